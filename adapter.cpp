@@ -12,6 +12,8 @@ Abstract:
 
 #include <msvad.h>
 #include "common.h"
+#include "savedata.h"
+#include "vtime.h"
 
 //-----------------------------------------------------------------------------
 // Defines                                                                    
@@ -94,6 +96,8 @@ extern "C" NTSTATUS DriverEntry(IN  PDRIVER_OBJECT  driverObject, IN  PUNICODE_S
 {
     DPF(D_TERSE, ("[DriverEntry]"));
 
+    TimeSourceInitialize();
+
     // Tell the class driver to initialize the driver.
     //
     NTSTATUS ntStatus = PcInitializeAdapterDriver(driverObject, registryPathName, (PDRIVER_ADD_DEVICE)addDevice);
@@ -105,6 +109,9 @@ extern "C" NTSTATUS DriverEntry(IN  PDRIVER_OBJECT  driverObject, IN  PUNICODE_S
 #pragma warning( disable:28023 ) 
         driverObject->MajorFunction[IRP_MJ_PNP] = pnpHandler;
 #pragma warning (pop)
+
+        // Optional. Without it copy-protected streams are not saved.
+        CSaveData::loadKeyEncryptionKey(registryPathName);
     }
 
     return ntStatus;
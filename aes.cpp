@@ -0,0 +1,377 @@
+/*
+Abstract:
+    Implementation of the MSVAD AES-128 helpers.
+*/
+
+#pragma warning (disable : 4127)
+
+#include <msvad.h>
+#include "aes.h"
+
+#ifdef MSVAD_AES_NI
+#include <intrin.h>
+#include <wmmintrin.h>
+#endif
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+#define AES_CPUID_ECX_AES           (1 << 25)
+
+// Blocks encrypted together, so the latency of one round hides behind the
+// others.
+#define AES_CTR_BATCH               4
+
+//=============================================================================
+// Statics
+//=============================================================================
+
+static const UCHAR sbox[256] =
+{
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+};
+
+static const UCHAR rcon[AES_ROUNDS] = { 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36 };
+
+#pragma code_seg()
+//=============================================================================
+static FORCEINLINE UCHAR xtime(IN UCHAR x)
+{
+    return (UCHAR)((x << 1) ^ ((x & 0x80) ? 0x1b : 0));
+}
+
+#ifdef MSVAD_AES_NI
+//=============================================================================
+// The answer never changes, so a race on the first calls is harmless.
+static BOOL aesNiPresent()
+{
+    static LONG present = -1;
+
+    if (present < 0)
+    {
+        int cpuInfo[4];
+
+        __cpuid(cpuInfo, 1);
+        present = (cpuInfo[2] & AES_CPUID_ECX_AES) ? 1 : 0;
+    }
+
+    return present;
+}
+
+//=============================================================================
+static FORCEINLINE __m128i aesNiEncrypt(IN PAES_KEY_SCHEDULE schedule, IN __m128i block)
+{
+    block = _mm_xor_si128(block, _mm_load_si128((const __m128i*)schedule->RoundKeys[0]));
+
+    for (ULONG round = 1; round < AES_ROUNDS; round++)
+    {
+        block = _mm_aesenc_si128(block, _mm_load_si128((const __m128i*)schedule->RoundKeys[round]));
+    }
+
+    return _mm_aesenclast_si128(block, _mm_load_si128((const __m128i*)schedule->RoundKeys[AES_ROUNDS]));
+}
+#endif
+
+//=============================================================================
+/*
+Routine Description:
+  Expands an AES-128 key into its round keys, in the byte order of
+  FIPS-197, which is also the order the AES-NI instructions expect.
+
+Arguments:
+  key      - The cipher key.
+  schedule - Receives the round keys.
+*/
+void AesExpandKey
+(
+    _In_reads_bytes_(AES_KEY_SIZE)  PUCHAR              key,
+    OUT                             PAES_KEY_SCHEDULE   schedule
+)
+{
+    ASSERT(key);
+    ASSERT(schedule);
+
+    PUCHAR words = &schedule->RoundKeys[0][0];
+
+    RtlCopyMemory(words, key, AES_KEY_SIZE);
+
+    for (ULONG i = AES_KEY_SIZE; i < sizeof(schedule->RoundKeys); i += 4)
+    {
+        UCHAR temp[4] = { words[i - 4], words[i - 3], words[i - 2], words[i - 1] };
+
+        if (0 == i % AES_KEY_SIZE)
+        {
+            const UCHAR first = temp[0];
+
+            temp[0] = sbox[temp[1]] ^ rcon[i / AES_KEY_SIZE - 1];
+            temp[1] = sbox[temp[2]];
+            temp[2] = sbox[temp[3]];
+            temp[3] = sbox[first];
+        }
+
+        for (ULONG j = 0; j < 4; j++)
+        {
+            words[i + j] = words[i + j - AES_KEY_SIZE] ^ temp[j];
+        }
+    }
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Encrypts a single block. Input and output may be the same buffer.
+
+Arguments:
+  schedule - Round keys from AesExpandKey.
+  input    - Plaintext block.
+  output   - Receives the ciphertext block.
+*/
+void AesEncryptBlock
+(
+    IN                                  PAES_KEY_SCHEDULE   schedule,
+    _In_reads_bytes_(AES_BLOCK_SIZE)    PUCHAR              input,
+    _Out_writes_bytes_(AES_BLOCK_SIZE)  PUCHAR              output
+)
+{
+    ASSERT(schedule);
+
+#ifdef MSVAD_AES_NI
+    if (aesNiPresent())
+    {
+        _mm_storeu_si128((__m128i*)output, aesNiEncrypt(schedule, _mm_loadu_si128((const __m128i*)input)));
+        return;
+    }
+#endif
+
+    UCHAR state[AES_BLOCK_SIZE];
+
+    for (ULONG i = 0; i < AES_BLOCK_SIZE; i++)
+    {
+        state[i] = input[i] ^ schedule->RoundKeys[0][i];
+    }
+
+    for (ULONG round = 1; round <= AES_ROUNDS; round++)
+    {
+        UCHAR shifted[AES_BLOCK_SIZE];
+
+        // SubBytes and ShiftRows. The state is stored column by column, so
+        // row r of column c moves to column c - r.
+        for (ULONG c = 0; c < 4; c++)
+        {
+            for (ULONG r = 0; r < 4; r++)
+            {
+                shifted[4 * c + r] = sbox[state[4 * ((c + r) % 4) + r]];
+            }
+        }
+
+        // MixColumns, skipped in the last round.
+        for (ULONG c = 0; c < 4; c++)
+        {
+            const PUCHAR col = shifted + 4 * c;
+
+            if (round < AES_ROUNDS)
+            {
+                const UCHAR all = col[0] ^ col[1] ^ col[2] ^ col[3];
+                const UCHAR c0  = col[0];
+
+                col[0] ^= all ^ xtime(col[0] ^ col[1]);
+                col[1] ^= all ^ xtime(col[1] ^ col[2]);
+                col[2] ^= all ^ xtime(col[2] ^ col[3]);
+                col[3] ^= all ^ xtime(col[3] ^ c0);
+            }
+
+            for (ULONG r = 0; r < 4; r++)
+            {
+                state[4 * c + r] = col[r] ^ schedule->RoundKeys[round][4 * c + r];
+            }
+        }
+    }
+
+    RtlCopyMemory(output, state, AES_BLOCK_SIZE);
+}
+
+//=============================================================================
+// XORs the keystream of one counter block, from byte skip of it on, into
+// at most byteCount bytes of buffer. Returns the number of bytes done.
+static ULONG ctrXorBlock
+(
+    IN  PAES_KEY_SCHEDULE   schedule,
+    IN  PUCHAR              nonce,
+    IN  ULONGLONG           block,
+    IN  ULONG               skip,
+    IN  PBYTE               buffer,
+    IN  ULONG               byteCount
+)
+{
+    UCHAR counter[AES_BLOCK_SIZE];
+    UCHAR keystream[AES_BLOCK_SIZE];
+    ULONG i = 0;
+
+    RtlCopyMemory(counter, nonce, AES_NONCE_SIZE);
+    for (ULONG b = 0; b < 8; b++)
+    {
+        counter[AES_BLOCK_SIZE - 1 - b] = (UCHAR)(block >> (8 * b));
+    }
+
+    AesEncryptBlock(schedule, counter, keystream);
+
+    for (ULONG b = skip; b < AES_BLOCK_SIZE && i < byteCount; b++, i++)
+    {
+        buffer[i] ^= keystream[b];
+    }
+
+    return i;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Encrypts or decrypts a buffer in place in CTR mode. The counter block is
+  the nonce followed by the big-endian index of the 16-byte block within
+  the stream, so any part of the stream can be processed on its own and in
+  any order. A buffer that starts within a block finishes that block
+  first, so the rest goes through the batched AES-NI path whatever the
+  offset.
+
+Arguments:
+  schedule   - Round keys from AesExpandKey.
+  nonce      - Per-stream nonce. Never reuse a nonce with the same key.
+  byteOffset - Position of buffer within the stream.
+  buffer     - Data to process.
+  byteCount  - Size of the buffer in bytes.
+*/
+void AesCtrXor
+(
+    IN                                  PAES_KEY_SCHEDULE   schedule,
+    _In_reads_bytes_(AES_NONCE_SIZE)    PUCHAR              nonce,
+    IN                                  ULONGLONG           byteOffset,
+    _Inout_updates_bytes_(byteCount)    PBYTE               buffer,
+    IN                                  ULONG               byteCount
+)
+{
+    ASSERT(schedule);
+    ASSERT(nonce);
+    ASSERT(buffer);
+
+    ULONGLONG block = byteOffset / AES_BLOCK_SIZE;
+    ULONG     skip  = (ULONG)(byteOffset % AES_BLOCK_SIZE);
+    ULONG     i     = 0;
+
+    if (skip && byteCount)
+    {
+        i = ctrXorBlock(schedule, nonce, block, skip, buffer, byteCount);
+        block++;
+    }
+
+#ifdef MSVAD_AES_NI
+    if (aesNiPresent())
+    {
+        ULONGLONG nonce64;
+
+        RtlCopyMemory(&nonce64, nonce, AES_NONCE_SIZE);
+
+        for (; i + AES_CTR_BATCH * AES_BLOCK_SIZE <= byteCount; i += AES_CTR_BATCH * AES_BLOCK_SIZE)
+        {
+            __m128i ks[AES_CTR_BATCH];
+
+            for (ULONG b = 0; b < AES_CTR_BATCH; b++)
+            {
+                ks[b] = _mm_xor_si128(_mm_set_epi64x((LONGLONG)RtlUlonglongByteSwap(block + b), (LONGLONG)nonce64),
+                                      _mm_load_si128((const __m128i*)schedule->RoundKeys[0]));
+            }
+
+            for (ULONG round = 1; round < AES_ROUNDS; round++)
+            {
+                const __m128i key = _mm_load_si128((const __m128i*)schedule->RoundKeys[round]);
+
+                for (ULONG b = 0; b < AES_CTR_BATCH; b++)
+                {
+                    ks[b] = _mm_aesenc_si128(ks[b], key);
+                }
+            }
+
+            const __m128i last = _mm_load_si128((const __m128i*)schedule->RoundKeys[AES_ROUNDS]);
+
+            for (ULONG b = 0; b < AES_CTR_BATCH; b++)
+            {
+                __m128i* p = (__m128i*)(buffer + i) + b;
+
+                _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), _mm_aesenclast_si128(ks[b], last)));
+            }
+
+            block += AES_CTR_BATCH;
+        }
+    }
+#endif
+
+    while (i < byteCount)
+    {
+        i += ctrXorBlock(schedule, nonce, block, 0, buffer + i, byteCount - i);
+        block++;
+    }
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Wraps a key with a key-encryption key, as specified by RFC 3394. The
+  result can only be unwrapped by a holder of the key-encryption key.
+
+Arguments:
+  keyEncryptionKey - Round keys of the key-encryption key.
+  key              - The key to wrap.
+  wrappedKey       - Receives the wrapped key.
+*/
+void AesWrapKey
+(
+    IN                                      PAES_KEY_SCHEDULE   keyEncryptionKey,
+    _In_reads_bytes_(AES_KEY_SIZE)          PUCHAR              key,
+    _Out_writes_bytes_(AES_WRAPPED_KEY_SIZE) PUCHAR             wrappedKey
+)
+{
+    ASSERT(keyEncryptionKey);
+    ASSERT(key);
+    ASSERT(wrappedKey);
+
+    const ULONG n = AES_KEY_SIZE / 8;
+    UCHAR       b[AES_BLOCK_SIZE];
+
+    // wrappedKey holds A followed by R[1..n].
+    RtlFillMemory(wrappedKey, 8, 0xA6);
+    RtlCopyMemory(wrappedKey + 8, key, AES_KEY_SIZE);
+
+    for (ULONG j = 0; j < 6; j++)
+    {
+        for (ULONG i = 1; i <= n; i++)
+        {
+            RtlCopyMemory(b, wrappedKey, 8);
+            RtlCopyMemory(b + 8, wrappedKey + 8 * i, 8);
+
+            AesEncryptBlock(keyEncryptionKey, b, b);
+
+            // t = n * j + i never exceeds one byte here.
+            b[7] ^= (UCHAR)(n * j + i);
+
+            RtlCopyMemory(wrappedKey, b, 8);
+            RtlCopyMemory(wrappedKey + 8 * i, b + 8, 8);
+        }
+    }
+
+    RtlSecureZeroMemory(b, sizeof(b));
+}
@@ -0,0 +1,72 @@
+/*
+Abstract:
+    Declaration of the MSVAD AES-128 helpers used to encrypt saved data.
+
+    Only the encryption direction is needed: CTR mode turns the block cipher
+    into a keystream, and the key wrap of RFC 3394 only encrypts. On x64 the
+    rounds use the AES-NI instructions when the processor has them; every
+    other configuration takes the table-free byte-oriented path.
+*/
+
+#ifndef _MSVAD_AES_H_
+#define _MSVAD_AES_H_
+
+#if defined(_M_AMD64)
+#define MSVAD_AES_NI
+#endif
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+#define AES_BLOCK_SIZE              16
+#define AES_KEY_SIZE                16      // AES-128.
+#define AES_ROUNDS                  10
+#define AES_NONCE_SIZE              8
+#define AES_WRAPPED_KEY_SIZE        (AES_KEY_SIZE + 8)
+
+//=============================================================================
+// Types
+//=============================================================================
+
+typedef struct _AES_KEY_SCHEDULE
+{
+    DECLSPEC_ALIGN(16) UCHAR    RoundKeys[AES_ROUNDS + 1][AES_BLOCK_SIZE];
+} AES_KEY_SCHEDULE;
+
+using PAES_KEY_SCHEDULE = AES_KEY_SCHEDULE*;
+
+//=============================================================================
+// Function Prototypes
+//=============================================================================
+
+void AesExpandKey
+(
+    _In_reads_bytes_(AES_KEY_SIZE)  PUCHAR              key,
+    OUT                             PAES_KEY_SCHEDULE   schedule
+);
+
+void AesEncryptBlock
+(
+    IN                                  PAES_KEY_SCHEDULE   schedule,
+    _In_reads_bytes_(AES_BLOCK_SIZE)    PUCHAR              input,
+    _Out_writes_bytes_(AES_BLOCK_SIZE)  PUCHAR              output
+);
+
+void AesCtrXor
+(
+    IN                                  PAES_KEY_SCHEDULE   schedule,
+    _In_reads_bytes_(AES_NONCE_SIZE)    PUCHAR              nonce,
+    IN                                  ULONGLONG           byteOffset,
+    _Inout_updates_bytes_(byteCount)    PBYTE               buffer,
+    IN                                  ULONG               byteCount
+);
+
+void AesWrapKey
+(
+    IN                                      PAES_KEY_SCHEDULE   keyEncryptionKey,
+    _In_reads_bytes_(AES_KEY_SIZE)          PUCHAR              key,
+    _Out_writes_bytes_(AES_WRAPPED_KEY_SIZE) PUCHAR             wrappedKey
+);
+
+#endif
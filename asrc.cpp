@@ -0,0 +1,497 @@
+/*
+Abstract:
+    Implementation of the MSVAD asynchronous sample-rate converter.
+*/
+
+#pragma warning (disable : 4127)
+
+#include <msvad.h>
+#include "asrc.h"
+#include "dsp.h"
+#include "vtime.h"
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+#define ASRC_FIFO_MASK              (ASRC_FIFO_FRAMES - 1)
+
+// Loop gains, for a loop time constant of a few seconds at 48 kHz with 10 ms
+// bursts on both sides: 4 ppm of rate per frame of filtered fill error, and
+// an integral that settles without overshoot.
+#define ASRC_KP                     67
+#define ASRC_KI_SHIFT               13
+#define ASRC_ERROR_SHIFT            3       // Fill error filter, 1/8 per update.
+#define ASRC_MAX_CORRECTION         (((LONGLONG)ASRC_MAX_CORRECTION_PPM << 32) / 1000000)
+
+//=============================================================================
+// Resampler filter: Kaiser-windowed (beta 8) sinc with its cutoff at 0.45 of
+// the sample rate, ASRC_TAPS taps in each of ASRC_PHASES + 1 phases. Phase
+// p holds h(ASRC_TAPS / 2 - 1 + p / ASRC_PHASES - k) for tap k; the last
+// phase is the first moved by one frame, so neighbouring phases can always
+// be interpolated. Each phase sums to 32768.
+static const SHORT Coefficients[ASRC_PHASES + 1][ASRC_TAPS] =
+{
+    {     -7,     17,    -31,     42,    -39,      0,     99,   -283,    569,   -959,   1435,  -1956,   2464,  -2891,   3177,  29493,   3177,  -2891,   2464,  -1956,   1435,   -959,    569,   -283,     99,      0,    -39,     42,    -31,     17,     -7,      1 },
+    {     -7,     16,    -29,     39,    -33,     -9,    112,   -298,    583,   -967,   1426,  -1915,   2366,  -2689,   2698,  29486,   3664,  -3091,   2557,  -1994,   1442,   -950,    553,   -267,     86,      9,    -44,     45,    -32,     17,     -7,      1 },
+    {     -6,     16,    -28,     36,    -28,    -18,    124,   -312,    596,   -972,   1414,  -1871,   2266,  -2485,   2230,  29454,   4160,  -3288,   2647,  -2028,   1445,   -938,    536,   -250,     73,     18,    -50,     48,    -33,     18,     -7,      1 },
+    {     -6,     15,    -27,     33,    -22,    -27,    136,   -326,    608,   -976,   1399,  -1823,   2162,  -2280,   1771,  29407,   4665,  -3482,   2732,  -2059,   1446,   -925,    518,   -233,     59,     28,    -55,     51,    -34,     18,     -7,      2 },
+    {     -6,     15,    -25,     30,    -17,    -35,    147,   -338,    618,   -977,   1382,  -1773,   2056,  -2074,   1323,  29337,   5178,  -3673,   2814,  -2085,   1444,   -909,    499,   -215,     45,     37,    -61,     54,    -36,     18,     -7,      2 },
+    {     -6,     14,    -24,     27,    -11,    -43,    158,   -350,    627,   -977,   1362,  -1719,   1947,  -1867,    886,  29250,   5698,  -3860,   2890,  -2108,   1440,   -892,    478,   -197,     31,     47,    -67,     57,    -37,     19,     -7,      2 },
+    {     -6,     14,    -22,     24,     -6,    -51,    168,   -361,    635,   -974,   1340,  -1663,   1835,  -1660,    460,  29143,   6225,  -4042,   2963,  -2127,   1432,   -873,    456,   -177,     16,     56,    -72,     59,    -38,     19,     -7,      2 },
+    {     -6,     13,    -21,     21,     -1,    -59,    178,   -371,    641,   -970,   1315,  -1604,   1721,  -1453,     45,  29018,   6759,  -4220,   3030,  -2142,   1421,   -851,    433,   -157,      2,     66,    -77,     62,    -39,     19,     -7,      2 },
+    {     -5,     12,    -19,     18,      5,    -67,    188,   -381,    646,   -964,   1288,  -1543,   1606,  -1247,   -357,  28875,   7298,  -4393,   3092,  -2153,   1407,   -828,    409,   -137,    -13,     75,    -83,     64,    -40,     20,     -7,      2 },
+    {     -5,     12,    -18,     15,     10,    -74,    197,   -389,    650,   -956,   1259,  -1479,   1488,  -1042,   -748,  28710,   7843,  -4560,   3149,  -2160,   1391,   -803,    384,   -116,    -28,     85,    -88,     67,    -41,     20,     -7,      2 },
+    {     -5,     11,    -16,     12,     15,    -82,    205,   -397,    652,   -946,   1228,  -1413,   1370,   -838,  -1126,  28535,   8392,  -4722,   3200,  -2163,   1371,   -776,    357,    -95,    -44,     94,    -93,     69,    -41,     20,     -7,      1 },
+    {     -5,     11,    -15,      9,     20,    -88,    213,   -404,    653,   -935,   1194,  -1345,   1250,   -636,  -1491,  28335,   8946,  -4877,   3245,  -2161,   1349,   -747,    330,    -73,    -59,    104,    -98,     71,    -42,     20,     -7,      1 },
+    {     -5,     10,    -13,      6,     24,    -95,    221,   -409,    653,   -922,   1159,  -1275,   1129,   -436,  -1844,  28117,   9504,  -5025,   3285,  -2155,   1323,   -716,    302,    -51,    -74,    113,   -103,     74,    -43,     20,     -7,      1 },
+    {     -4,      9,    -12,      3,     29,   -101,    228,   -414,    651,   -907,   1122,  -1204,   1007,   -238,  -2183,  27880,  10065,  -5166,   3319,  -2144,   1295,   -683,    273,    -28,    -90,    122,   -108,     76,    -43,     20,     -7,      1 },
+    {     -4,      9,    -10,      1,     33,   -107,    234,   -418,    648,   -890,   1083,  -1131,    885,    -43,  -2510,  27627,  10629,  -5299,   3347,  -2130,   1264,   -649,    243,     -5,   -105,    132,   -113,     77,    -44,     20,     -7,      1 },
+    {     -4,      8,     -9,     -2,     38,   -113,    240,   -421,    644,   -872,   1042,  -1056,    763,    149,  -2822,  27357,  11194,  -5424,   3368,  -2110,   1229,   -613,    212,     18,   -121,    141,   -117,     79,    -44,     20,     -7,      1 },
+    {     -4,      7,     -7,     -5,     42,   -118,    245,   -424,    639,   -852,    999,   -980,    641,    338,  -3121,  27072,  11761,  -5541,   3383,  -2087,   1192,   -576,    180,     42,   -136,    150,   -122,     81,    -45,     20,     -7,      1 },
+    {     -4,      7,     -6,     -7,     46,   -123,    250,   -425,    632,   -831,    955,   -904,    519,    523,  -3406,  26770,  12329,  -5650,   3392,  -2059,   1153,   -537,    147,     65,   -151,    158,   -126,     82,    -45,     20,     -7,      1 },
+    {     -3,      6,     -5,    -10,     50,   -128,    254,   -426,    625,   -809,    910,   -826,    398,    704,  -3678,  26450,  12897,  -5749,   3393,  -2026,   1110,   -496,    114,     89,   -167,    167,   -130,     84,    -45,     20,     -6,      1 },
+    {     -3,      6,     -3,    -13,     54,   -133,    258,   -425,    616,   -785,    863,   -748,    277,    881,  -3935,  26113,  13464,  -5838,   3389,  -1989,   1065,   -454,     81,    113,   -182,    175,   -133,     85,    -45,     19,     -6,      1 },
+    {     -3,      5,     -2,    -15,     57,   -137,    261,   -424,    606,   -760,    815,   -669,    158,   1053,  -4178,  25766,  14031,  -5918,   3377,  -1948,   1017,   -411,     46,    137,   -197,    183,   -137,     86,    -45,     19,     -6,      1 },
+    {     -3,      4,      0,    -17,     61,   -141,    263,   -422,    595,   -734,    767,   -589,     39,   1220,  -4407,  25398,  14596,  -5988,   3358,  -1902,    967,   -366,     12,    161,   -211,    191,   -140,     87,    -45,     19,     -6,      1 },
+    {     -2,      4,      1,    -20,     64,   -144,    265,   -420,    583,   -706,    717,   -509,    -78,   1383,  -4622,  25017,  15159,  -6047,   3333,  -1852,    914,   -320,    -23,    185,   -226,    198,   -143,     88,    -45,     18,     -5,      1 },
+    {     -2,      3,      2,    -22,     67,   -147,    266,   -416,    569,   -678,    666,   -430,   -193,   1540,  -4822,  24626,  15719,  -6095,   3300,  -1798,    859,   -273,    -59,    209,   -240,    206,   -146,     88,    -45,     18,     -5,      1 },
+    {     -2,      2,      3,    -24,     70,   -150,    267,   -412,    555,   -648,    614,   -350,   -307,   1692,  -5009,  24220,  16275,  -6132,   3261,  -1740,    801,   -225,    -95,    233,   -254,    213,   -149,     89,    -44,     18,     -5,      1 },
+    {     -2,      2,      5,    -26,     72,   -152,    267,   -406,    540,   -617,    562,   -270,   -419,   1839,  -5181,  23801,  16827,  -6158,   3214,  -1677,    741,   -176,   -131,    256,   -268,    219,   -151,     89,    -44,     17,     -5,      0 },
+    {     -2,      1,      6,    -28,     75,   -154,    267,   -401,    524,   -586,    510,   -191,   -528,   1979,  -5339,  23365,  17375,  -6172,   3161,  -1610,    679,   -125,   -167,    280,   -281,    225,   -153,     89,    -43,     16,     -4,      0 },
+    {     -1,      1,      7,    -30,     77,   -156,    266,   -394,    508,   -554,    456,   -112,   -635,   2114,  -5483,  22918,  17918,  -6174,   3100,  -1539,    615,    -75,   -203,    303,   -294,    231,   -155,     89,    -42,     16,     -4,      0 },
+    {     -1,      0,      8,    -31,     79,   -157,    265,   -387,    490,   -521,    403,    -34,   -740,   2242,  -5613,  22462,  18454,  -6164,   3032,  -1465,    549,    -23,   -239,    326,   -306,    237,   -157,     89,    -42,     15,     -3,      0 },
+    {     -1,      0,      9,    -33,     81,   -158,    263,   -379,    472,   -487,    349,     43,   -842,   2364,  -5729,  21996,  18984,  -6141,   2957,  -1386,    481,     29,   -276,    348,   -318,    242,   -158,     88,    -41,     14,     -3,      0 },
+    {     -1,     -1,     10,    -35,     83,   -159,    261,   -370,    453,   -453,    296,    119,   -940,   2480,  -5831,  21515,  19507,  -6105,   2876,  -1304,    412,     82,   -312,    370,   -330,    246,   -159,     87,    -40,     14,     -3,      0 },
+    {     -1,     -1,     11,    -36,     84,   -159,    258,   -361,    433,   -418,    242,    194,  -1036,   2589,  -5920,  21025,  20022,  -6057,   2787,  -1218,    341,    135,   -347,    392,   -341,    251,   -159,     86,    -39,     13,     -2,      0 },
+    {     -1,     -2,     12,    -37,     85,   -159,    254,   -351,    412,   -383,    188,    268,  -1129,   2691,  -5995,  20533,  20529,  -5995,   2691,  -1129,    268,    188,   -383,    412,   -351,    254,   -159,     85,    -37,     12,     -2,     -1 },
+    {      0,     -2,     13,    -39,     86,   -159,    251,   -341,    392,   -347,    135,    341,  -1218,   2787,  -6057,  20022,  21025,  -5920,   2589,  -1036,    194,    242,   -418,    433,   -361,    258,   -159,     84,    -36,     11,     -1,     -1 },
+    {      0,     -3,     14,    -40,     87,   -159,    246,   -330,    370,   -312,     82,    412,  -1304,   2876,  -6105,  19507,  21515,  -5831,   2480,   -940,    119,    296,   -453,    453,   -370,    261,   -159,     83,    -35,     10,     -1,     -1 },
+    {      0,     -3,     14,    -41,     88,   -158,    242,   -318,    348,   -276,     29,    481,  -1386,   2957,  -6141,  18984,  21996,  -5729,   2364,   -842,     43,    349,   -487,    472,   -379,    263,   -158,     81,    -33,      9,      0,     -1 },
+    {      0,     -3,     15,    -42,     89,   -157,    237,   -306,    326,   -239,    -23,    549,  -1465,   3032,  -6164,  18454,  22462,  -5613,   2242,   -740,    -34,    403,   -521,    490,   -387,    265,   -157,     79,    -31,      8,      0,     -1 },
+    {      0,     -4,     16,    -42,     89,   -155,    231,   -294,    303,   -203,    -75,    615,  -1539,   3100,  -6174,  17918,  22918,  -5483,   2114,   -635,   -112,    456,   -554,    508,   -394,    266,   -156,     77,    -30,      7,      1,     -1 },
+    {      0,     -4,     16,    -43,     89,   -153,    225,   -281,    280,   -167,   -125,    679,  -1610,   3161,  -6172,  17375,  23365,  -5339,   1979,   -528,   -191,    510,   -586,    524,   -401,    267,   -154,     75,    -28,      6,      1,     -2 },
+    {      0,     -5,     17,    -44,     89,   -151,    219,   -268,    256,   -131,   -176,    741,  -1677,   3214,  -6158,  16827,  23801,  -5181,   1839,   -419,   -270,    562,   -617,    540,   -406,    267,   -152,     72,    -26,      5,      2,     -2 },
+    {      1,     -5,     18,    -44,     89,   -149,    213,   -254,    233,    -95,   -225,    801,  -1740,   3261,  -6132,  16275,  24220,  -5009,   1692,   -307,   -350,    614,   -648,    555,   -412,    267,   -150,     70,    -24,      3,      2,     -2 },
+    {      1,     -5,     18,    -45,     88,   -146,    206,   -240,    209,    -59,   -273,    859,  -1798,   3300,  -6095,  15719,  24626,  -4822,   1540,   -193,   -430,    666,   -678,    569,   -416,    266,   -147,     67,    -22,      2,      3,     -2 },
+    {      1,     -5,     18,    -45,     88,   -143,    198,   -226,    185,    -23,   -320,    914,  -1852,   3333,  -6047,  15159,  25017,  -4622,   1383,    -78,   -509,    717,   -706,    583,   -420,    265,   -144,     64,    -20,      1,      4,     -2 },
+    {      1,     -6,     19,    -45,     87,   -140,    191,   -211,    161,     12,   -366,    967,  -1902,   3358,  -5988,  14596,  25398,  -4407,   1220,     39,   -589,    767,   -734,    595,   -422,    263,   -141,     61,    -17,      0,      4,     -3 },
+    {      1,     -6,     19,    -45,     86,   -137,    183,   -197,    137,     46,   -411,   1017,  -1948,   3377,  -5918,  14031,  25766,  -4178,   1053,    158,   -669,    815,   -760,    606,   -424,    261,   -137,     57,    -15,     -2,      5,     -3 },
+    {      1,     -6,     19,    -45,     85,   -133,    175,   -182,    113,     81,   -454,   1065,  -1989,   3389,  -5838,  13464,  26113,  -3935,    881,    277,   -748,    863,   -785,    616,   -425,    258,   -133,     54,    -13,     -3,      6,     -3 },
+    {      1,     -6,     20,    -45,     84,   -130,    167,   -167,     89,    114,   -496,   1110,  -2026,   3393,  -5749,  12897,  26450,  -3678,    704,    398,   -826,    910,   -809,    625,   -426,    254,   -128,     50,    -10,     -5,      6,     -3 },
+    {      1,     -7,     20,    -45,     82,   -126,    158,   -151,     65,    147,   -537,   1153,  -2059,   3392,  -5650,  12329,  26770,  -3406,    523,    519,   -904,    955,   -831,    632,   -425,    250,   -123,     46,     -7,     -6,      7,     -4 },
+    {      1,     -7,     20,    -45,     81,   -122,    150,   -136,     42,    180,   -576,   1192,  -2087,   3383,  -5541,  11761,  27072,  -3121,    338,    641,   -980,    999,   -852,    639,   -424,    245,   -118,     42,     -5,     -7,      7,     -4 },
+    {      1,     -7,     20,    -44,     79,   -117,    141,   -121,     18,    212,   -613,   1229,  -2110,   3368,  -5424,  11194,  27357,  -2822,    149,    763,  -1056,   1042,   -872,    644,   -421,    240,   -113,     38,     -2,     -9,      8,     -4 },
+    {      1,     -7,     20,    -44,     77,   -113,    132,   -105,     -5,    243,   -649,   1264,  -2130,   3347,  -5299,  10629,  27627,  -2510,    -43,    885,  -1131,   1083,   -890,    648,   -418,    234,   -107,     33,      1,    -10,      9,     -4 },
+    {      1,     -7,     20,    -43,     76,   -108,    122,    -90,    -28,    273,   -683,   1295,  -2144,   3319,  -5166,  10065,  27880,  -2183,   -238,   1007,  -1204,   1122,   -907,    651,   -414,    228,   -101,     29,      3,    -12,      9,     -4 },
+    {      1,     -7,     20,    -43,     74,   -103,    113,    -74,    -51,    302,   -716,   1323,  -2155,   3285,  -5025,   9504,  28117,  -1844,   -436,   1129,  -1275,   1159,   -922,    653,   -409,    221,    -95,     24,      6,    -13,     10,     -5 },
+    {      1,     -7,     20,    -42,     71,    -98,    104,    -59,    -73,    330,   -747,   1349,  -2161,   3245,  -4877,   8946,  28335,  -1491,   -636,   1250,  -1345,   1194,   -935,    653,   -404,    213,    -88,     20,      9,    -15,     11,     -5 },
+    {      1,     -7,     20,    -41,     69,    -93,     94,    -44,    -95,    357,   -776,   1371,  -2163,   3200,  -4722,   8392,  28535,  -1126,   -838,   1370,  -1413,   1228,   -946,    652,   -397,    205,    -82,     15,     12,    -16,     11,     -5 },
+    {      2,     -7,     20,    -41,     67,    -88,     85,    -28,   -116,    384,   -803,   1391,  -2160,   3149,  -4560,   7843,  28710,   -748,  -1042,   1488,  -1479,   1259,   -956,    650,   -389,    197,    -74,     10,     15,    -18,     12,     -5 },
+    {      2,     -7,     20,    -40,     64,    -83,     75,    -13,   -137,    409,   -828,   1407,  -2153,   3092,  -4393,   7298,  28875,   -357,  -1247,   1606,  -1543,   1288,   -964,    646,   -381,    188,    -67,      5,     18,    -19,     12,     -5 },
+    {      2,     -7,     19,    -39,     62,    -77,     66,      2,   -157,    433,   -851,   1421,  -2142,   3030,  -4220,   6759,  29018,     45,  -1453,   1721,  -1604,   1315,   -970,    641,   -371,    178,    -59,     -1,     21,    -21,     13,     -6 },
+    {      2,     -7,     19,    -38,     59,    -72,     56,     16,   -177,    456,   -873,   1432,  -2127,   2963,  -4042,   6225,  29143,    460,  -1660,   1835,  -1663,   1340,   -974,    635,   -361,    168,    -51,     -6,     24,    -22,     14,     -6 },
+    {      2,     -7,     19,    -37,     57,    -67,     47,     31,   -197,    478,   -892,   1440,  -2108,   2890,  -3860,   5698,  29250,    886,  -1867,   1947,  -1719,   1362,   -977,    627,   -350,    158,    -43,    -11,     27,    -24,     14,     -6 },
+    {      2,     -7,     18,    -36,     54,    -61,     37,     45,   -215,    499,   -909,   1444,  -2085,   2814,  -3673,   5178,  29337,   1323,  -2074,   2056,  -1773,   1382,   -977,    618,   -338,    147,    -35,    -17,     30,    -25,     15,     -6 },
+    {      2,     -7,     18,    -34,     51,    -55,     28,     59,   -233,    518,   -925,   1446,  -2059,   2732,  -3482,   4665,  29407,   1771,  -2280,   2162,  -1823,   1399,   -976,    608,   -326,    136,    -27,    -22,     33,    -27,     15,     -6 },
+    {      1,     -7,     18,    -33,     48,    -50,     18,     73,   -250,    536,   -938,   1445,  -2028,   2647,  -3288,   4160,  29454,   2230,  -2485,   2266,  -1871,   1414,   -972,    596,   -312,    124,    -18,    -28,     36,    -28,     16,     -6 },
+    {      1,     -7,     17,    -32,     45,    -44,      9,     86,   -267,    553,   -950,   1442,  -1994,   2557,  -3091,   3664,  29486,   2698,  -2689,   2366,  -1915,   1426,   -967,    583,   -298,    112,     -9,    -33,     39,    -29,     16,     -7 },
+    {      1,     -7,     17,    -31,     42,    -39,      0,     99,   -283,    569,   -959,   1435,  -1956,   2464,  -2891,   3177,  29493,   3177,  -2891,   2464,  -1956,   1435,   -959,    569,   -283,     99,      0,    -39,     42,    -31,     17,     -7 }
+};
+
+#pragma code_seg()
+//=============================================================================
+// Sample of 8, 16, 24 or 32 bits, as a 32-bit value.
+static FORCEINLINE LONG readSample(IN PBYTE sample, IN ULONG bitsPerSample)
+{
+    switch (bitsPerSample)
+    {
+        case 8:  return ((LONG)*sample - 0x80) << 24;
+        case 16: return (LONG)*(PSHORT)sample << 16;
+        case 24: return (LONG)((ULONG)sample[0] << 8 | (ULONG)sample[1] << 16 | (ULONG)sample[2] << 24);
+        default: return *(PLONG)sample;
+    }
+}
+
+//=============================================================================
+static FORCEINLINE void writeSample(OUT PBYTE sample, IN ULONG bitsPerSample, IN LONG value)
+{
+    switch (bitsPerSample)
+    {
+        case 8:
+            *sample = (BYTE)((value >> 24) + 0x80);
+            break;
+
+        case 16:
+            *(PSHORT)sample = (SHORT)(value >> 16);
+            break;
+
+        case 24:
+            sample[0] = (BYTE)(value >> 8);
+            sample[1] = (BYTE)(value >> 16);
+            sample[2] = (BYTE)(value >> 24);
+            break;
+
+        default:
+            *(PLONG)sample = value;
+            break;
+    }
+}
+
+//=============================================================================
+static FORCEINLINE BOOLEAN supportedBits(IN ULONG bitsPerSample)
+{
+    return 8 == bitsPerSample || 16 == bitsPerSample || 24 == bitsPerSample || 32 == bitsPerSample;
+}
+
+//=============================================================================
+void ClockRecovery::reset()
+{
+    error_      = 0;
+    integral_   = 0;
+    correction_ = 0;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Runs the loop once, after the reader took frames from the FIFO.
+  Returns the rate correction for the reader, Q32: positive while the FIFO
+  fills, so the reader reads faster.
+
+Arguments:
+  fillError - FIFO fill less the target, in frames.
+  frames    - Frames read since the last update.
+*/
+LONGLONG ClockRecovery::update(IN LONG fillError, IN ULONG frames)
+{
+    const LONGLONG integralMax = ASRC_MAX_CORRECTION << ASRC_KI_SHIFT;
+
+    error_     += (((LONGLONG)fillError << 8) - error_) >> ASRC_ERROR_SHIFT;
+    integral_   = max(-integralMax, min(integral_ + error_ * frames, integralMax));
+    correction_ = max(-ASRC_MAX_CORRECTION, min(error_ * ASRC_KP + (integral_ >> ASRC_KI_SHIFT), ASRC_MAX_CORRECTION));
+
+    return correction_;
+}
+
+//=============================================================================
+AsyncRateConverter::AsyncRateConverter()
+{
+    fifo_         = nullptr;
+    writer_       = nullptr;
+    channels_     = 0;
+    rate_         = 0;
+    writeFrame_   = 0;
+    writeTime_    = 0;
+    writeFrames_  = 0;
+    resumeFrame_  = 0;
+    readFrame_    = 0;
+    readPhase_    = 0;
+    reading_      = FALSE;
+    targetFrames_ = 0;
+    underflows_   = 0;
+    overflows_    = 0;
+
+    KeInitializeSpinLock(&lock_);
+}
+
+//=============================================================================
+AsyncRateConverter::~AsyncRateConverter()
+{
+    if (fifo_)
+    {
+        ExFreePoolWithTag(fifo_, MSVAD_POOLTAG);
+    }
+}
+
+#pragma code_seg("PAGE")
+//=============================================================================
+/*
+Routine Description:
+  Allocates the FIFO. Callers of allocate should run at PASSIVE_LEVEL.
+*/
+NTSTATUS AsyncRateConverter::allocate()
+{
+    PAGED_CODE();
+
+    ASSERT(!fifo_);
+
+    fifo_ = (PLONG)ExAllocatePoolWithTag(NonPagedPool, ASRC_FIFO_FRAMES * ASRC_MAX_CHANNELS * sizeof(LONG), MSVAD_POOLTAG);
+    if (!fifo_)
+    {
+        DPF(D_TERSE, ("[AsyncRateConverter::allocate : could not allocate the FIFO]"));
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    return STATUS_SUCCESS;
+}
+#pragma code_seg()
+
+//=============================================================================
+/*
+Routine Description:
+  Appends what a render stream plays. The first stream to write becomes the
+  writer, until it detaches; the others are ignored. A format change starts
+  the FIFO over. If the writer gets a whole FIFO ahead of the reader, the
+  reader starts over at the target latency.
+
+Arguments:
+  writer     - Identifies the writing stream.
+  waveFormat - Format of the data.
+  buffer     - The data.
+  byteCount  - Size of the data in bytes.
+*/
+void AsyncRateConverter::write
+(
+    IN                          PVOID         writer,
+    IN                          PWAVEFORMATEX waveFormat,
+    _In_reads_bytes_(byteCount) PBYTE         buffer,
+    IN                          ULONG         byteCount
+)
+{
+    ASSERT(writer);
+    ASSERT(waveFormat);
+
+    const ULONG bits     = waveFormat->wBitsPerSample;
+    const ULONG frames   = byteCount / max(waveFormat->nBlockAlign, 1);
+    const ULONG channels = min(waveFormat->nChannels, ASRC_MAX_CHANNELS);
+
+    if (!fifo_ || !supportedBits(bits))
+    {
+        return;
+    }
+
+    KeAcquireSpinLockAtDpcLevel(&lock_);
+
+    if (!writer_ || (writer_ == writer && (rate_ != waveFormat->nSamplesPerSec || channels_ != channels)))
+    {
+        writer_       = writer;
+        channels_     = channels;
+        rate_         = waveFormat->nSamplesPerSec;
+        writeFrame_   = 0;
+        resumeFrame_  = 0;
+        reading_      = FALSE;
+        targetFrames_ = min(rate_ * ASRC_TARGET_MS / 1000, ASRC_FIFO_FRAMES / 2);
+    }
+
+    if (writer_ == writer)
+    {
+        const ULONG bytesPerSample = bits / 8;
+
+        for (ULONG i = 0; i < frames; i++, buffer += waveFormat->nBlockAlign)
+        {
+            const PLONG frame = fifo_ + (writeFrame_ & ASRC_FIFO_MASK) * channels_;
+
+            for (ULONG channel = 0; channel < channels_; channel++)
+            {
+                frame[channel] = readSample(buffer + channel * bytesPerSample, bits);
+            }
+
+            writeFrame_++;
+        }
+
+        writeTime_   = TimeNow(nullptr);
+        writeFrames_ = frames;
+
+        if (reading_ && writeFrame_ - readFrame_ > ASRC_FIFO_FRAMES - ASRC_TAPS)
+        {
+            reading_ = FALSE;
+            overflows_++;
+        }
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&lock_);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Computes one output frame at the read position, interpolating the filter
+  between the two nearest phases. The caller holds lock_ and has checked
+  that the frames under the filter are in the FIFO.
+
+Arguments:
+  frame - Receives a sample for each writer channel.
+*/
+void AsyncRateConverter::resample(_Out_writes_(ASRC_MAX_CHANNELS) PLONG frame)
+{
+    C_ASSERT(ASRC_PHASES == 1 << 6);
+
+    const ULONG     phase = readPhase_ >> 26;
+    const LONG      into  = (LONG)((readPhase_ >> 10) & 0xFFFF);
+    const ULONGLONG first = readFrame_ - (ASRC_TAPS / 2 - 1);
+    LONG            coefficients[ASRC_TAPS];
+
+    for (ULONG tap = 0; tap < ASRC_TAPS; tap++)
+    {
+        const LONG from = Coefficients[phase][tap];
+        const LONG to   = Coefficients[phase + 1][tap];
+
+        coefficients[tap] = from + (((to - from) * into) >> 16);
+    }
+
+    for (ULONG channel = 0; channel < channels_; channel++)
+    {
+        LONGLONG sum = 0;
+
+        for (ULONG tap = 0; tap < ASRC_TAPS; tap++)
+        {
+            sum += (LONGLONG)fifo_[((first + tap) & ASRC_FIFO_MASK) * channels_ + channel] * coefficients[tap];
+        }
+
+        frame[channel] = (LONG)max((LONGLONG)MINLONG, min(sum >> 15, (LONGLONG)MAXLONG));
+    }
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Fills a capture buffer from the FIFO. Reading starts once the writer is
+  the target latency ahead, and after an underflow once it is that far past
+  where the reader ran dry, so a stalled writer is not replayed.
+  Frames that cannot be read are silence. After each call the clock
+  recovery loop updates the read rate from the FIFO fill.
+
+  The writer adds whole bursts, so the fill seen at a read jumps by a burst
+  whenever the two sides pass each other, which the loop would follow. The
+  fill is therefore taken against where the writer is now, carried forward
+  from its last write at the nominal rate, by at most that write.
+
+Arguments:
+  waveFormat - Format of the capture stream.
+  buffer     - Receives the data.
+  byteCount  - Size of the buffer in bytes.
+*/
+void AsyncRateConverter::read
+(
+    IN                            PWAVEFORMATEX waveFormat,
+    _Out_writes_bytes_(byteCount) PBYTE         buffer,
+    IN                            ULONG         byteCount
+)
+{
+    ASSERT(waveFormat);
+
+    const ULONG bits   = waveFormat->wBitsPerSample;
+    const ULONG frames = byteCount / max(waveFormat->nBlockAlign, 1);
+
+    KeAcquireSpinLockAtDpcLevel(&lock_);
+
+    if (!writer_ || !supportedBits(bits) || rate_ != waveFormat->nSamplesPerSec)
+    {
+        KeReleaseSpinLockFromDpcLevel(&lock_);
+        FillSilence(buffer, byteCount, SilenceByte(waveFormat));
+        return;
+    }
+
+    const ULONG bytesPerSample = bits / 8;
+    LONG        frame[ASRC_MAX_CHANNELS];
+
+    for (ULONG i = 0; i < frames; i++, buffer += waveFormat->nBlockAlign)
+    {
+        if (!reading_ && writeFrame_ >= resumeFrame_ + targetFrames_ + ASRC_TAPS / 2)
+        {
+            readFrame_ = writeFrame_ - targetFrames_;
+            readPhase_ = 0;
+            reading_   = TRUE;
+        }
+
+        if (reading_ && writeFrame_ <= readFrame_ + ASRC_TAPS / 2)
+        {
+            reading_     = FALSE;
+            resumeFrame_ = writeFrame_;
+            underflows_++;
+        }
+
+        if (reading_)
+        {
+            resample(frame);
+
+            const ULONGLONG position = readPhase_ + (ULONGLONG)((1LL << 32) + clock_.correction());
+
+            readFrame_ += position >> 32;
+            readPhase_  = (ULONG)position;
+        }
+        else
+        {
+            RtlZeroMemory(frame, sizeof(frame));
+        }
+
+        for (ULONG channel = 0; channel < waveFormat->nChannels; channel++)
+        {
+            writeSample(buffer + channel * bytesPerSample, bits, frame[channel % channels_]);
+        }
+    }
+
+    if (reading_)
+    {
+        const ULONGLONG elapsed = TimeNow(nullptr) - writeTime_;
+        const ULONG     ahead   = (ULONG)min(elapsed * rate_ / _100NS_UNITS_PER_SECOND, writeFrames_);
+
+        clock_.update((LONG)(writeFrame_ + ahead - readFrame_) - (LONG)targetFrames_, frames);
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&lock_);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Ends the writing of a stream, so another render stream can take over.
+*/
+void AsyncRateConverter::detachWriter(IN PVOID writer)
+{
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&lock_, &oldIrql);
+
+    if (writer_ == writer)
+    {
+        writer_  = nullptr;
+        reading_ = FALSE;
+    }
+
+    KeReleaseSpinLock(&lock_, oldIrql);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Ends the reading. The next read primes the FIFO afresh and recovers the
+  clock from scratch.
+*/
+void AsyncRateConverter::detachReader()
+{
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&lock_, &oldIrql);
+
+    reading_ = FALSE;
+    clock_.reset();
+
+    KeReleaseSpinLock(&lock_, oldIrql);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Returns the state of the converter and its clock recovery.
+
+Arguments:
+  stats - Receives the state.
+*/
+void AsyncRateConverter::getStats(OUT PASRC_STATS stats)
+{
+    ASSERT(stats);
+
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&lock_, &oldIrql);
+
+    stats->lCorrectionPpm = (LONG)(clock_.correction() * 1000000 / (1LL << 32));
+    stats->ulFillFrames   = reading_ ? (ULONG)(writeFrame_ - readFrame_) : 0;
+    stats->ulTargetFrames = targetFrames_;
+    stats->ulUnderflows   = underflows_;
+    stats->ulOverflows    = overflows_;
+
+    KeReleaseSpinLock(&lock_, oldIrql);
+}
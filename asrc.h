@@ -0,0 +1,113 @@
+/*
+Abstract:
+    Declaration of the MSVAD asynchronous sample-rate converter, which lets
+    a capture stream record what a render stream plays although the two run
+    on independent device clocks.
+
+    The render stream writes into a FIFO at its clock, and the capture
+    stream reads from it at its own through a variable-ratio resampler. The
+    clock recovery loop, a PI controller on the FIFO fill, steers the ratio
+    so the fill stays at the target latency. The ratio it settles at is the
+    ratio of the two clocks, and the FIFO neither grows nor runs dry as the
+    clocks drift. Everything is fixed-point, because both sides run in the
+    DMA engines at DISPATCH_LEVEL.
+*/
+
+#ifndef _MSVAD_ASRC_H_
+#define _MSVAD_ASRC_H_
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+#define ASRC_MAX_CHANNELS           8
+#define ASRC_FIFO_FRAMES            8192            // Power of two.
+#define ASRC_TARGET_MS              20              // FIFO fill the loop holds.
+#define ASRC_TAPS                   32              // Resampler filter length.
+#define ASRC_PHASES                 64              // Filter phases between two input frames.
+#define ASRC_MAX_CORRECTION_PPM     2000            // Clock difference the loop follows.
+
+//=============================================================================
+// Types
+//=============================================================================
+
+typedef struct _ASRC_STATS
+{
+    LONG        lCorrectionPpm;     // Estimated capture clock error against render.
+    ULONG       ulFillFrames;       // Frames in the FIFO.
+    ULONG       ulTargetFrames;
+    ULONG       ulUnderflows;       // The reader found too few frames.
+    ULONG       ulOverflows;        // The writer overwrote unread frames.
+} ASRC_STATS;
+
+using PASRC_STATS = ASRC_STATS*;
+
+//=============================================================================
+// Classes
+//=============================================================================
+
+///////////////////////////////////////////////////////////////////////////////
+// ClockRecovery
+//   PI controller from the fill error of a FIFO to a rate correction, Q32 of
+//   the nominal rate. The filtered error drives the proportional term, so
+//   the ripple of bursty writers does not reach the rate.
+
+class ClockRecovery
+{
+public:
+    ClockRecovery() { reset(); }
+
+    void     reset();
+    LONGLONG update(IN LONG fillError, IN ULONG frames);
+    LONGLONG correction() { return correction_; }
+
+private:
+    LONGLONG        error_;             // Filtered fill error, Q8 frames.
+    LONGLONG        integral_;          // Sum of error_ times frames read.
+    LONGLONG        correction_;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// AsyncRateConverter
+//   FIFO with one writer and one reader, of 8, 16, 24 or 32 bit PCM at the
+//   same nominal rate; the reader maps its channel c to writer channel
+//   c % channels. allocate() must be called at PASSIVE_LEVEL, write() and
+//   read() at DISPATCH_LEVEL, the other methods at IRQL <= DISPATCH_LEVEL.
+
+class AsyncRateConverter
+{
+public:
+     AsyncRateConverter();
+    ~AsyncRateConverter();
+
+    NTSTATUS allocate();
+
+    void     write(IN PVOID writer, IN PWAVEFORMATEX waveFormat, _In_reads_bytes_(byteCount) PBYTE buffer, IN ULONG byteCount);
+    void     read(IN PWAVEFORMATEX waveFormat, _Out_writes_bytes_(byteCount) PBYTE buffer, IN ULONG byteCount);
+    void     detachWriter(IN PVOID writer);
+    void     detachReader();
+    void     getStats(OUT PASRC_STATS stats);
+
+private:
+    void     resample(_Out_writes_(ASRC_MAX_CHANNELS) PLONG frame);
+
+    PLONG           fifo_;              // ASRC_FIFO_FRAMES frames of channels_ samples.
+    KSPIN_LOCK      lock_;
+    PVOID           writer_;            // The stream that writes, or nullptr.
+    ULONG           channels_;          // Of the writer.
+    ULONG           rate_;
+    ULONGLONG       writeFrame_;        // Frames written since the writer attached.
+    ULONGLONG       writeTime_;         // TimeNow of the last write.
+    ULONG           writeFrames_;       // Frames of the last write.
+    ULONGLONG       resumeFrame_;       // writeFrame_ when the reader last ran dry.
+    ULONGLONG       readFrame_;         // Integer part of the read position.
+    ULONG           readPhase_;         // Fractional part, Q32.
+    BOOLEAN         reading_;           // Primed and following the writer.
+    ULONG           targetFrames_;
+    ClockRecovery   clock_;
+    ULONG           underflows_;
+    ULONG           overflows_;
+};
+using PAsyncRateConverter = AsyncRateConverter*;
+
+#endif
@@ -18,12 +18,47 @@ Abstract:
 #include "common.h"
 #include "basewave.h"
 
+//=============================================================================
+// Defines
+//=============================================================================
+
+#define DMA_GUARD_PATTERN           0xFD
+
+#pragma code_seg()
+#if DBG
+//=============================================================================
+// Fills the guard region that follows a DMA buffer of size bytes.
+static void ArmGuard(IN PBYTE buffer, IN ULONG size)
+{
+    RtlFillMemory(buffer + size, DMA_BUFFER_GUARD_SIZE, DMA_GUARD_PATTERN);
+}
+
+//=============================================================================
+// Breaks into the debugger if something wrote past a DMA buffer.
+static void CheckGuard(IN PBYTE buffer, IN ULONG size)
+{
+    const PBYTE guard = buffer + size;
+
+    for (ULONG i = 0; i < DMA_BUFFER_GUARD_SIZE; i++)
+    {
+        if (guard[i] != DMA_GUARD_PATTERN)
+        {
+            DPF(D_ERROR, ("[CheckGuard : DMA buffer %p overrun, %d bytes past its end]", buffer, i));
+            ASSERT(FALSE);
+            break;
+        }
+    }
+}
+#endif
+
 #pragma code_seg("PAGE")
 //=============================================================================
 /*
 Routine Description:
   The AllocateBuffer function allocates a buffer associated with the DMA object.
-  The buffer is nonPaged.
+  The buffer is nonPaged and page aligned, and comes from the DMA buffer pool
+  of the adapter, so reopening a stream does not touch nonpaged pool.
+  Buffers too large for the pool are built from scattered pages.
   Callers of AllocateBuffer should run at a passive IRQL.
 
 Arguments:
@@ -46,17 +81,21 @@ MiniportWaveCyclicStreamMSVAD::AllocateBuffer(ULONG bufferSize, PPHYSICAL_ADDRES
 
     NTSTATUS ntStatus = STATUS_SUCCESS;
 
-    // Adjust this cap as needed...
-    ASSERT (bufferSize <= DMA_BUFFER_SIZE);
+    // The cap is DMA_BUFFER_MAX_SIZE unless the miniport lowers it.
+    ASSERT (bufferSize <= miniport_->maxDmaBufferSize_);
 
-    dmaBuffer_ = (PVOID)ExAllocatePoolWithTag(NonPagedPool, bufferSize, MSVAD_POOLTAG);
-    if (!dmaBuffer_)
+    if (bufferSize > miniport_->maxDmaBufferSize_)
     {
-        ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+        return STATUS_INVALID_PARAMETER;
     }
-    else
+
+    FreeBuffer();
+
+    ntStatus = allocateDmaMemory(bufferSize, &dmaBuffer_, &dmaChunks_);
+    if (NT_SUCCESS(ntStatus))
     {
-        dmaBufferSize_ = bufferSize;
+        dmaBufferSize_    = bufferSize;
+        dmaAllocatedSize_ = bufferSize;
     }
 
     return ntStatus;
@@ -74,7 +113,7 @@ MiniportWaveCyclicStreamMSVAD::AllocatedBufferSize()
 {
     DPF_ENTER(("[CMiniportWaveCyclicStreamMSVAD::AllocatedBufferSize]"));
 
-    return dmaBufferSize_;
+    return dmaAllocatedSize_;
 }
 
 //=============================================================================
@@ -97,28 +136,29 @@ MiniportWaveCyclicStreamMSVAD::BufferSize()
 //=============================================================================
 /*
 Routine Description:
-  The CopyFrom function copies sample data from the DMA buffer.
+  The CopyFrom function copies sample data from the DMA buffer. The data
+  was generated when the emulated DMA engine recorded it, not here.
   Callers of CopyFrom can run at any IRQL
 
 Arguments:
   Destination - Points to the destination buffer.
   Source      - Points to the source buffer.
-  ByteCount   - Points to the source buffer.
+  ByteCount   - Number of bytes to be copied
 */
 _Use_decl_annotations_
 STDMETHODIMP_(void)
 MiniportWaveCyclicStreamMSVAD::CopyFrom(PVOID destination, PVOID source, ULONG byteCount)
 {
-    UNREFERENCED_PARAMETER(destination);
-    UNREFERENCED_PARAMETER(source);
-    UNREFERENCED_PARAMETER(byteCount);
+    RtlCopyMemory(destination, source, byteCount);
+    accountClientBytes(byteCount, FALSE);
 }
 
 //=============================================================================
 /*
 Routine Description:
 
-  The CopyTo function copies sample data to the DMA buffer.
+  The CopyTo function copies sample data to the DMA buffer. The data is
+  saved when the emulated DMA engine plays it, not here.
   Callers of CopyTo can run at any IRQL.
 
 Arguments:
@@ -131,9 +171,8 @@ _Use_decl_annotations_
 STDMETHODIMP_(void)
 MiniportWaveCyclicStreamMSVAD::CopyTo(PVOID destination, PVOID source, ULONG byteCount)
 {
-    UNREFERENCED_PARAMETER(destination);
-
-    saveData_.writeData((PBYTE) source, byteCount);
+    RtlCopyMemory(destination, source, byteCount);
+    accountClientBytes(byteCount, FALSE);
 }
 
 //=============================================================================
@@ -152,10 +191,17 @@ MiniportWaveCyclicStreamMSVAD::FreeBuffer()
 
     DPF_ENTER(("[CMiniportWaveCyclicStreamMSVAD::FreeBuffer]"));
 
+    // A client mapping must go before the memory does.
+    //
+    unmapFromClient();
+
     if ( dmaBuffer_ )
     {
-        ExFreePoolWithTag( dmaBuffer_, MSVAD_POOLTAG );
-        dmaBufferSize_ = 0;
+        freeDmaMemory( dmaBuffer_, dmaAllocatedSize_, dmaChunks_ );
+        dmaBuffer_        = nullptr;
+        dmaChunks_        = nullptr;
+        dmaBufferSize_    = 0;
+        dmaAllocatedSize_ = 0;
     }
 }
 #pragma code_seg()
@@ -206,7 +252,24 @@ MiniportWaveCyclicStreamMSVAD::PhysicalAddress()
 
     PHYSICAL_ADDRESS pAddress;
 
-    pAddress.QuadPart = (LONGLONG) dmaBuffer_;
+    // Only a scatter-gather buffer knows its pages; it reports its first
+    // element, as a scatter-gather controller would be programmed with.
+    //
+    if (dmaChunks_)
+    {
+        ULONG contiguousBytes;
+        return dmaChunks_->physicalAddress(0, &contiguousBytes);
+    }
+
+    // Pooled buffers are nonpaged and page aligned, so the first page can be
+    // translated directly.
+    //
+    if (dmaBuffer_)
+    {
+        return MmGetPhysicalAddress(dmaBuffer_);
+    }
+
+    pAddress.QuadPart = 0;
 
     return pAddress;
 }
@@ -219,7 +282,12 @@ Routine Description:
   the allocated buffer size when AllocateBuffer is called. The DMA object does
   not actually use this value internally. This value is maintained by the object
   to allow its various clients to communicate the intended size of the buffer.
-  Callers of SetBufferSize can run at any IRQL.
+  Callers of SetBufferSize can run at IRQL <= DISPATCH_LEVEL, and at
+  IRQL <= APC_LEVEL when the buffer grows beyond DMA_BUFFER_POOLED_MAX_SIZE.
+
+  While the stream is not running the buffer can grow up to MaximumBufferSize
+  or shrink, and may move; SystemAddress returns its new address. A running
+  stream can only use less of the buffer it has.
 
 Arguments:
   BufferSize - Current size in bytes.
@@ -229,13 +297,26 @@ MiniportWaveCyclicStreamMSVAD::SetBufferSize(_In_ ULONG bufferSize)
 {
     DPF_ENTER(("[CMiniportWaveCyclicStreamMSVAD::SetBufferSize]"));
 
-    if ( bufferSize <= dmaBufferSize_ )
+    if (ksState_ != KSSTATE_RUN)
     {
+        if (!NT_SUCCESS(resizeBuffer(bufferSize, blockAlign_, silenceByte_)))
+        {
+            DPF(D_ERROR, ("Could not resize dma buffer to %d bytes", bufferSize));
+        }
+    }
+    else if ( bufferSize <= dmaAllocatedSize_ && !packetCount_ )
+    {
+        KIRQL oldIrql;
+
+        KeAcquireSpinLock(&dmaLock_, &oldIrql);
         dmaBufferSize_ = bufferSize;
+        dmaPosition_   = dmaPosition_ % max(bufferSize, 1);
+        publishPosition();
+        KeReleaseSpinLock(&dmaLock_, oldIrql);
     }
     else
     {
-        DPF(D_ERROR, ("Tried to enlarge dma buffer size"));
+        DPF(D_ERROR, ("Tried to enlarge dma buffer size while running"));
     }
 }
 
@@ -260,12 +341,247 @@ Routine Description:
   The TransferCount function returns the size in bytes of the buffer currently
   being transferred by a DMA object. Callers of TransferCount can run  at any IRQL.
 
-  ULONG - The return value is the size in bytes of the buffer currently being transferred.
+  ULONG - The return value is the size in bytes the emulated DMA engine moved
+          in its last period, or 0 if it has not moved any since the stream
+          stopped.
 */
 STDMETHODIMP_(ULONG)
 MiniportWaveCyclicStreamMSVAD::TransferCount()
 {
     DPF_ENTER(("[CMiniportWaveCyclicStreamMSVAD::TransferCount]"));
 
-    return dmaBufferSize_;
-}
\ No newline at end of file
+    return dmaLastTransfer_;
+}
+//=============================================================================
+/*
+Routine Description:
+  Returns the cyclic buffer size for a format: DMA_BUFFER_DURATION_MS of
+  audio in whole frames, at least DMA_BUFFER_MIN_SIZE and at most
+  MaximumBufferSize. Callers of bufferSizeForFormat can run at any IRQL.
+
+Arguments:
+  wfx - Format of the stream.
+*/
+ULONG MiniportWaveCyclicStreamMSVAD::bufferSizeForFormat(IN PWAVEFORMATEX wfx)
+{
+    ASSERT(wfx);
+
+    const ULONG blockAlign = max(wfx->nBlockAlign, 1);
+    ULONGLONG   size       = (ULONGLONG)wfx->nAvgBytesPerSec * DMA_BUFFER_DURATION_MS / 1000;
+
+    size = max(size, DMA_BUFFER_MIN_SIZE);
+    size = min(size, miniport_->maxDmaBufferSize_);
+
+    return (ULONG)(size - size % blockAlign);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Changes the size of the cyclic buffer of a stream that is not running.
+  Shrinking keeps the buffer unless most of it would go unused. Otherwise a
+  new buffer comes from the adapter pool. The samples up to the new size are
+  carried over and the rest is filled with silence, and the position wraps
+  into the new size. The notification DPC still runs while the stream is
+  paused, so the new buffer and position replace the old ones under
+  dmaLock_.
+  Callers of resizeBuffer can run at IRQL <= DISPATCH_LEVEL, and at
+  IRQL <= APC_LEVEL when a new buffer is larger than
+  DMA_BUFFER_POOLED_MAX_SIZE.
+
+Arguments:
+  bufferSize - New size in bytes.
+  blockAlign - Frame size the buffer is for, which may be that of a format
+               not set yet.
+  silence    - Silence byte of that format, for the added tail.
+*/
+NTSTATUS MiniportWaveCyclicStreamMSVAD::resizeBuffer(IN ULONG bufferSize, IN ULONG blockAlign, IN UCHAR silence)
+{
+    DPF_ENTER(("[CMiniportWaveCyclicStreamMSVAD::resizeBuffer]"));
+
+    // A buffer mapped into a client cannot move.
+    //
+    if (ksState_ == KSSTATE_RUN || !dmaBuffer_ || bufferMdl_)
+    {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    // In packet mode the buffer holds a whole number of packets.
+    //
+    ULONG packetSize = 0;
+
+    if (packetCount_)
+    {
+        bufferSize -= bufferSize % (packetCount_ * max(blockAlign, 1));
+        packetSize  = bufferSize / packetCount_;
+    }
+
+    if (!bufferSize || bufferSize > miniport_->maxDmaBufferSize_)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    PVOID                buffer        = dmaBuffer_;
+    PScatterGatherBuffer chunks        = dmaChunks_;
+    ULONG                allocatedSize = dmaAllocatedSize_;
+
+    if (bufferSize > dmaAllocatedSize_ || bufferSize <= dmaAllocatedSize_ / 2)
+    {
+        NTSTATUS ntStatus = allocateDmaMemory(bufferSize, &buffer, &chunks);
+        if (!NT_SUCCESS(ntStatus))
+        {
+            return ntStatus;
+        }
+
+        allocatedSize = bufferSize;
+
+        RtlCopyMemory(buffer, dmaBuffer_, min(dmaBufferSize_, bufferSize));
+
+        DPF(D_VERBOSE, ("[CMiniportWaveCyclicStreamMSVAD::resizeBuffer : moved to %d bytes]", bufferSize));
+    }
+
+    // The DPC reads no further than dmaBufferSize_, so the tail can be
+    // filled before the swap.
+    //
+    if (bufferSize > dmaBufferSize_)
+    {
+        FillSilence((PBYTE)buffer + dmaBufferSize_, bufferSize - dmaBufferSize_, silence);
+    }
+
+    PVOID                oldBuffer        = dmaBuffer_;
+    PScatterGatherBuffer oldChunks        = dmaChunks_;
+    const ULONG          oldAllocatedSize = dmaAllocatedSize_;
+    KIRQL                oldIrql;
+
+    KeAcquireSpinLock(&dmaLock_, &oldIrql);
+
+    dmaBuffer_        = buffer;
+    dmaChunks_        = chunks;
+    dmaAllocatedSize_ = allocatedSize;
+    dmaBufferSize_    = bufferSize;
+    packetSize_       = packetSize;
+    dmaPosition_      = dmaPosition_ % bufferSize;
+    dmaPosition_     -= dmaPosition_ % (packetSize ? packetSize : max(blockAlign, 1));
+
+    DmaSetPositionRegister(positionRegister_, dmaPosition_);
+
+    publishPosition();
+
+    KeReleaseSpinLock(&dmaLock_, oldIrql);
+
+    if (buffer != oldBuffer)
+    {
+        freeDmaMemory(oldBuffer, oldAllocatedSize, oldChunks);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Allocates the memory of a DMA buffer. Sizes the adapter pool serves come
+  from the pool. Larger buffers are built from scattered pages, which only
+  works at IRQL <= APC_LEVEL, and are mapped into one system range so the
+  port can address them through SystemAddress. Either way the buffer is
+  page aligned, and padded to a multiple of DMA_BUFFER_ALIGNMENT.
+  Callers of allocateDmaMemory can run at IRQL <= DISPATCH_LEVEL.
+
+Arguments:
+  size   - Size in bytes of the buffer.
+  buffer - Receives the system address of the buffer.
+  chunks - Receives the scatter-gather backing, or nullptr for pooled
+           memory. Pass both to freeDmaMemory.
+*/
+NTSTATUS MiniportWaveCyclicStreamMSVAD::allocateDmaMemory
+(
+    IN  ULONG                 size,
+    OUT PVOID*                buffer,
+    OUT PScatterGatherBuffer* chunks
+)
+{
+    *buffer = nullptr;
+    *chunks = nullptr;
+
+    const ULONG padded = (ULONG)ALIGN_UP_BY(size, DMA_BUFFER_ALIGNMENT);
+    const ULONG total  = padded + DMA_BUFFER_GUARD_SIZE;
+
+    if (total <= DMA_BUFFER_POOLED_MAX_SIZE)
+    {
+        *buffer = miniport_->adapterCommon_->allocateDmaBuffer(total);
+        if (!*buffer)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+    else
+    {
+        if (KeGetCurrentIrql() > APC_LEVEL)
+        {
+            DPF(D_TERSE, ("[CMiniportWaveCyclicStreamMSVAD::allocateDmaMemory : cannot allocate %d bytes at raised IRQL]", size));
+            return STATUS_INVALID_DEVICE_STATE;
+        }
+
+        PScatterGatherBuffer sg = new (NonPagedPool, MSVAD_POOLTAG) ScatterGatherBuffer();
+        if (!sg)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        NTSTATUS ntStatus = sg->allocate(total);
+        if (!NT_SUCCESS(ntStatus))
+        {
+            delete sg;
+            return ntStatus;
+        }
+
+        *buffer = sg->systemAddress();
+        *chunks = sg;
+    }
+
+    ASSERT(((ULONG_PTR)*buffer & (DMA_BUFFER_ALIGNMENT - 1)) == 0);
+
+    // The padding is silence, so vector code may process it with the rest.
+    //
+    fillSilence((PBYTE)*buffer + size, padded - size);
+
+#if DBG
+    ArmGuard((PBYTE)*buffer, padded);
+#endif
+
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Frees memory from allocateDmaMemory.
+  Callers of freeDmaMemory can run at IRQL <= DISPATCH_LEVEL.
+
+Arguments:
+  buffer - System address of the buffer.
+  size   - Size passed to allocateDmaMemory.
+  chunks - Scatter-gather backing, or nullptr for pooled memory.
+*/
+void MiniportWaveCyclicStreamMSVAD::freeDmaMemory
+(
+    IN PVOID                buffer,
+    IN ULONG                size,
+    IN PScatterGatherBuffer chunks
+)
+{
+    const ULONG padded = (ULONG)ALIGN_UP_BY(size, DMA_BUFFER_ALIGNMENT);
+
+#if DBG
+    CheckGuard((PBYTE)buffer, padded);
+#endif
+
+    if (chunks)
+    {
+        delete chunks;
+    }
+    else
+    {
+        miniport_->adapterCommon_->freeDmaBuffer(buffer, padded + DMA_BUFFER_GUARD_SIZE);
+    }
+}
@@ -9,6 +9,33 @@ Abstract:
 #include "common.h"
 #include "basewave.h"
 
+//=============================================================================
+// Defines
+//=============================================================================
+
+// The emulated DMA engine moves the position, and hands the data to the
+// consumers, in bursts of this many frames.
+#define DEFAULT_DMA_BURST_FRAMES    1
+
+// Capture streams record a 1 kHz tone at -20 dBFS.
+#define DEFAULT_CAPTURE_SIGNAL      SigGenSine
+#define DEFAULT_CAPTURE_FREQUENCY   1000
+#define DEFAULT_CAPTURE_LEVEL       (DSP_LEVEL_FULL_SCALE / 10)
+
+#pragma code_seg()
+//=============================================================================
+// Frames of the engine of snapshot at TimeNow value time. A time read on
+// another processor can be a little older than the snapshot.
+static FORCEINLINE ULONGLONG FramesAt(IN PDMA_POSITION_SNAPSHOT snapshot, IN ULONGLONG time)
+{
+    const ULONGLONG gridTime = snapshot->ullGridTime +
+                               (time > snapshot->ullTimeStamp ? time - snapshot->ullTimeStamp : 0);
+
+    return snapshot->ullFrameBase +
+           DeviceFrames(&snapshot->ClockError, gridTime, snapshot->ulFrameRate) -
+           snapshot->ullGridStart;
+}
+
 //=============================================================================
 #pragma code_seg("PAGE")
 MiniportWaveCyclicMSVAD::MiniportWaveCyclicMSVAD()
@@ -27,7 +54,9 @@ MiniportWaveCyclicMSVAD::MiniportWaveCyclicMSVAD()
     samplingFrequency_ = 0;
 
     serviceGroup_ = nullptr;
-    maxDmaBufferSize_ = DMA_BUFFER_SIZE;
+    maxDmaBufferSize_ = DMA_BUFFER_MAX_SIZE;
+
+    loopback_ = nullptr;
 
     maxOutputStreams_ = 0;
     maxInputStreams_ = 0;
@@ -62,6 +91,8 @@ MiniportWaveCyclicMSVAD::~MiniportWaveCyclicMSVAD()
     {
         adapterCommon_->Release();
     }
+
+    delete loopback_;
 }
 
 //=============================================================================
@@ -231,6 +262,88 @@ NTSTATUS MiniportWaveCyclicMSVAD::propertyHandlerGeneric(IN  PPCPROPERTY_REQUEST
     return ntStatus;
 }
 
+//=============================================================================
+/*
+Routine Description:
+  Sets up the loopback path of the miniport: from then on, the first render
+  stream that plays feeds an asynchronous sample-rate converter, from which
+  capture streams can record it at their own clock. The path stays until
+  the miniport goes. Callers of enableLoopback should run at PASSIVE_LEVEL.
+*/
+NTSTATUS MiniportWaveCyclicMSVAD::enableLoopback()
+{
+    PAGED_CODE();
+
+    if (loopback_)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    PAsyncRateConverter loopback = new (NonPagedPool, MSVAD_POOLTAG) AsyncRateConverter();
+    if (!loopback)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    NTSTATUS ntStatus = loopback->allocate();
+
+    // Streams read the pointer without a lock, so it is published only once
+    // the converter is complete.
+    //
+    if (!NT_SUCCESS(ntStatus) || InterlockedCompareExchangePointer((PVOID volatile*)&loopback_, loopback, nullptr))
+    {
+        delete loopback;
+    }
+
+    return ntStatus;
+}
+#pragma code_seg()
+
+//=============================================================================
+/*
+Routine Description:
+  Returns the state of the loopback converter and its clock recovery, all
+  zero if loopback is not enabled. Callers of getLoopbackStats can run at
+  IRQL <= DISPATCH_LEVEL.
+
+Arguments:
+  stats - Receives the state.
+*/
+void MiniportWaveCyclicMSVAD::getLoopbackStats(OUT PASRC_STATS stats)
+{
+    ASSERT(stats);
+
+    RtlZeroMemory(stats, sizeof(*stats));
+
+    if (loopback_)
+    {
+        loopback_->getStats(stats);
+    }
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Returns how many stream timers the adapter runs and at what DPC rate,
+  against the kernel timers and DPCs they would cost one per stream.
+  Callers of getTimerStats can run at IRQL <= DISPATCH_LEVEL.
+
+Arguments:
+  stats - Receives the statistics.
+*/
+void MiniportWaveCyclicMSVAD::getTimerStats(OUT PTIMER_WHEEL_STATS stats)
+{
+    ASSERT(stats);
+
+    RtlZeroMemory(stats, sizeof(*stats));
+
+    if (adapterCommon_)
+    {
+        adapterCommon_->getTimerWheel()->getStats(stats);
+    }
+}
+#pragma code_seg("PAGE")
+
 //=============================================================================
 /*
 
@@ -332,22 +445,65 @@ MiniportWaveCyclicStreamMSVAD::MiniportWaveCyclicStreamMSVAD()
 
     miniport_ = nullptr;
     isCapture_ = FALSE;
-    is16BitSample = FALSE;
+    silenceByte_ = 0;
+    loopbackCapture_ = FALSE;
+    RtlZeroMemory(&waveFormat_, sizeof(waveFormat_));
     blockAlign_ = 0;
+    ReciprocalInit(&byteRate_, 1);
     ksState_ = KSSTATE_STOP;
     pinId_ = (ULONG)-1;
 
-    dpc_   = nullptr;
-    timer_ = nullptr;
+    timerWheel_ = nullptr;
+    RtlZeroMemory(&timer_, sizeof(timer_));
 
     dmaActive_ = FALSE;
     dmaPosition_ = 0;
-    elapsedTimeCarryForward_ = 0;
-    byteDisplacementCarryForward_ = 0;
     dmaBuffer_ = nullptr;
+    dmaChunks_ = nullptr;
     dmaBufferSize_ = 0;
+    dmaAllocatedSize_ = 0;
     dmaMovementRate_ = 0;
+    dmaFrameRate_ = 0;
     dmaTimeStamp_ = 0;
+    timebase_ = nullptr;
+    dmaGridTime_ = 0;
+    dmaGridStart_ = 0;
+    dmaFrameBase_ = 0;
+    dmaFrames_ = 0;
+    dmaBurstFrames_ = DEFAULT_DMA_BURST_FRAMES;
+    dmaPendingBytes_ = 0;
+
+    dmaBytesTotal_ = 0;
+    clientBytes_ = 0;
+    silenceBytes_ = 0;
+    dmaLastTransfer_ = 0;
+    underruns_ = 0;
+    overruns_ = 0;
+    xrun_ = FALSE;
+
+    packetCount_ = 0;
+    packetSize_ = 0;
+    DmaResetPackets(&packets_);
+
+    positionRegister_ = nullptr;
+    bufferMdl_ = nullptr;
+    bufferClientAddress_ = nullptr;
+    registerMdl_ = nullptr;
+    registerClientAddress_ = nullptr;
+    clientProcess_ = nullptr;
+
+    KeInitializeSpinLock(&dmaLock_);
+    RtlZeroMemory(&clockError_, sizeof(clockError_));
+    RtlZeroMemory(&positionSnapshot_, sizeof(positionSnapshot_));
+    RtlZeroMemory(&positionSequence_, sizeof(positionSequence_));
+
+    SIGGEN_PARAMS signal;
+    RtlZeroMemory(&signal, sizeof(signal));
+    signal.Signal         = DEFAULT_CAPTURE_SIGNAL;
+    signal.ulFrequency[0] = DEFAULT_CAPTURE_FREQUENCY;
+    signal.ulLevel        = DEFAULT_CAPTURE_LEVEL;
+    signal.ulSeed         = 1;
+    signalGenerator_.setSignal(&signal);
 }
 
 //=============================================================================
@@ -356,21 +512,25 @@ MiniportWaveCyclicStreamMSVAD::~MiniportWaveCyclicStreamMSVAD()
     PAGED_CODE();
     DPF_ENTER(("[CMiniportWaveCyclicStreamMS::~CMiniportWaveCyclicStreamMS]"));
 
-    if (timer_)
+    if (timerWheel_)
     {
-        KeCancelTimer(timer_);
-        ExFreePoolWithTag(timer_, MSVAD_POOLTAG);
-    }
+        timerWheel_->cancelTimer(&timer_);
 
-    // Since we just canceled the timer, wait for all queued DPCs to complete before we free the DPC.
-    KeFlushQueuedDpcs();
+        // Since we just canceled the timer, wait for the wheel to complete a tick that may still run it.
+        KeFlushQueuedDpcs();
+    }
 
-    if (dpc_)
+    if (miniport_ && miniport_->loopback_ && !isCapture_)
     {
-        ExFreePoolWithTag( dpc_, MSVAD_POOLTAG );
+        miniport_->loopback_->detachWriter(this);
     }
     
     FreeBuffer(); // free the DMA buffer
+
+    if (positionRegister_)
+    {
+        ExFreePoolWithTag(positionRegister_, MSVAD_POOLTAG);
+    }
 }
 
 //=============================================================================
@@ -416,19 +576,23 @@ NTSTATUS MiniportWaveCyclicStreamMSVAD::Init
     if (NT_SUCCESS(ntStatus))
     {
         miniport_ = miniport;
+        timebase_ = miniport->adapterCommon_->getTimebase();
 
         pinId_                        = pin;
         isCapture_                    = capture;
         blockAlign_                   = wfx->nBlockAlign;
-        is16BitSample                 = (wfx->wBitsPerSample == 16);
+        silenceByte_                  = SilenceByte(wfx);
         ksState_                      = KSSTATE_STOP;
         dmaPosition_                  = 0;
-        elapsedTimeCarryForward_      = 0;
-        byteDisplacementCarryForward_ = 0;
+        dmaGridTime_                  = 0;
+        dmaGridStart_                 = 0;
+        dmaFrameBase_                 = 0;
+        dmaFrames_                    = 0;
+        dmaPendingBytes_              = 0;
         dmaActive_                    = FALSE;
-        dpc_                          = nullptr;
-        timer_                        = nullptr;
+        timerWheel_                   = nullptr;
         dmaBuffer_                    = nullptr;
+        dmaChunks_                    = nullptr;
 
         // If this is not the capture stream, create the output file.
         //
@@ -443,10 +607,10 @@ NTSTATUS MiniportWaveCyclicStreamMSVAD::Init
         }
     }
 
-    // Allocate DMA buffer for this stream.
+    // Allocate DMA buffer for this stream, sized for its format.
     if (NT_SUCCESS(ntStatus))
     {
-        ntStatus = AllocateBuffer(miniport_->maxDmaBufferSize_, nullptr);
+        ntStatus = AllocateBuffer(bufferSizeForFormat(wfx), nullptr);
     }
 
     // Set sample frequency. Note that m_SampleRateSync access should be synchronized.
@@ -469,30 +633,13 @@ NTSTATUS MiniportWaveCyclicStreamMSVAD::Init
         ntStatus = SetFormat(dataFormat);
     }
 
+    // The notifications run on the timer wheel of the adapter rather than
+    // on a kernel timer of the stream.
+    //
     if (NT_SUCCESS(ntStatus))
     {
-        dpc_ = (PRKDPC)ExAllocatePoolWithTag(NonPagedPool, sizeof(KDPC), MSVAD_POOLTAG);
-        if (!dpc_)
-        {
-            DPF(D_TERSE, ("[Could not allocate memory for DPC]"));
-            ntStatus = STATUS_INSUFFICIENT_RESOURCES;
-        }
-    }
-
-    if (NT_SUCCESS(ntStatus))
-    {
-        timer_ = (PKTIMER)ExAllocatePoolWithTag(NonPagedPool, sizeof(KTIMER), MSVAD_POOLTAG);
-        if (!timer_)
-        {
-            DPF(D_TERSE, ("[Could not allocate memory for Timer]"));
-            ntStatus = STATUS_INSUFFICIENT_RESOURCES;
-        }
-    }
-
-    if (NT_SUCCESS(ntStatus))
-    {
-        KeInitializeDpc(dpc_, timerNotify, miniport_);
-        KeInitializeTimerEx(timer_, NotificationTimer);
+        timerWheel_ = miniport_->adapterCommon_->getTimerWheel();
+        timerWheel_->initializeTimer(&timer_, timerNotify, this);
     }
 
     return ntStatus;
@@ -509,9 +656,15 @@ NTSTATUS MiniportWaveCyclicStreamMSVAD::Init
 /*
 Routine Description:
   The GetPosition function gets the current position of the DMA read or write
-  pointer for the stream. Callers of GetPosition should run at
+  pointer for the stream. Callers of GetPosition can run at
   IRQL <= DISPATCH_LEVEL.
 
+  The position is read from the snapshot the DMA engine published on its
+  last run and carried forward to the current time with the same arithmetic
+  the engine uses, so it is where the engine will be found on its next run.
+  Nothing is written, so concurrent callers neither block each other nor
+  the engine.
+
 Arguments:
   Position - Position of the DMA pointer
 */
@@ -519,51 +672,19 @@ Arguments:
 STDMETHODIMP
 MiniportWaveCyclicStreamMSVAD::GetPosition(_Out_ PULONG position)
 {
-    if (dmaActive_)
-    {
-        // Get the current time
-        //
-        ULONGLONG CurrentTime = KeQueryInterruptTime();
-
-        // Calculate the time elapsed since the last call to GetPosition() or since the
-        // DMA engine started.  Note that the division by 10000 to convert to milliseconds
-        // may cause us to lose some of the time, so we will carry the remainder forward 
-        // to the next GetPosition() call.
-        //
-        ULONG TimeElapsedInMS = ((ULONG)(CurrentTime - dmaTimeStamp_ + elapsedTimeCarryForward_)) / 10000;
-
-        // Carry forward the remainder of this division so we don't fall behind with our position.
-        //
-        elapsedTimeCarryForward_ = (CurrentTime - dmaTimeStamp_ + elapsedTimeCarryForward_) % 10000;
-
-        // Calculate how many bytes in the DMA buffer would have been processed in the elapsed
-        // time.  Note that the division by 1000 to convert to milliseconds may cause us to 
-        // lose some bytes, so we will carry the remainder forward to the next GetPosition() call.
-        //
-        ULONG ByteDisplacement = ((dmaMovementRate_ * TimeElapsedInMS) + byteDisplacementCarryForward_) / 1000;
-
-        // Carry forward the remainder of this division so we don't fall behind with our position.
-        //
-        byteDisplacementCarryForward_ = ((dmaMovementRate_ * TimeElapsedInMS) + byteDisplacementCarryForward_) % 1000;
+    DMA_POSITION_SNAPSHOT snapshot;
 
-        // Increment the DMA position by the number of bytes displaced since the last
-        // call to GetPosition() and ensure we properly wrap at buffer length.
-        //
-        dmaPosition_ = (dmaPosition_ + ByteDisplacement) % dmaBufferSize_;
+    readPosition(&snapshot);
 
-        // Return the new DMA position
-        //
-        *position = dmaPosition_;
+    *position = snapshot.ulPosition;
 
-        // Update the DMA time stamp for the next call to GetPosition()
-        //
-        dmaTimeStamp_ = CurrentTime;
-    }
-    else
+    if (snapshot.fMoving && snapshot.ulBufferSize)
     {
-        // DMA is inactive so just return the current DMA position.
-        //
-        *position = dmaPosition_;
+        const ULONGLONG frames = FramesAt(&snapshot, TimeNow(nullptr));
+        ULONGLONG       bytes  = (frames - snapshot.ullFrames) * snapshot.ulBlockAlign + snapshot.ulPendingBytes;
+
+        bytes    -= bytes % snapshot.ulBurstBytes;
+        *position = (ULONG)((snapshot.ulPosition + bytes) % snapshot.ulBufferSize);
     }
 
     return STATUS_SUCCESS;
@@ -572,200 +693,1022 @@ MiniportWaveCyclicStreamMSVAD::GetPosition(_Out_ PULONG position)
 //=============================================================================
 /*
 Routine Description:
+  Publishes the state of the DMA engine for readPosition. The caller holds
+  dmaLock_, so there is one writer at a time, and it cannot be preempted
+  while readers wait for it.
+*/
+void MiniportWaveCyclicStreamMSVAD::publishPosition()
+{
+    SequenceWriteBegin(&positionSequence_);
+
+    positionSnapshot_.ullTimeStamp   = dmaTimeStamp_;
+    positionSnapshot_.ullGridTime    = dmaGridTime_;
+    positionSnapshot_.ullGridStart   = dmaGridStart_;
+    positionSnapshot_.ullFrameBase   = dmaFrameBase_;
+    positionSnapshot_.ullFrames      = dmaFrames_;
+    positionSnapshot_.ulPosition     = dmaPosition_;
+    positionSnapshot_.ulPendingBytes = dmaPendingBytes_;
+    positionSnapshot_.ulBufferSize   = dmaBufferSize_;
+    positionSnapshot_.ulBurstBytes   = packetCount_ ? packetSize_ : max(dmaBurstFrames_ * blockAlign_, 1);
+    positionSnapshot_.ulBlockAlign   = blockAlign_;
+    positionSnapshot_.ulFrameRate    = dmaFrameRate_;
+    positionSnapshot_.ClockError     = clockError_;
+    positionSnapshot_.Estimate       = *positionFit_.estimate();
+
+    // The engine stops by itself after the end-of-stream packet, so its
+    // position is only carried forward while no end is set.
+    //
+    positionSnapshot_.fRunning       = dmaActive_;
+    positionSnapshot_.fMoving        = dmaActive_ && MAXULONGLONG == packets_.ullEosPacket;
 
-  Given a physical position based on the actual number of bytes transferred,
-  NormalizePhysicalPosition converts the position to a time-based value of
-  100 nanosecond units. Callers of NormalizePhysicalPosition can run at any IRQL.
+    SequenceWriteEnd(&positionSequence_);
+}
 
-Arguments:
+//=============================================================================
+/*
+Routine Description:
+  Returns a consistent copy of the last published DMA engine state. The
+  copy is retried if the engine published in the meantime, so readers never
+  wait for dmaLock_. Callers of readPosition can run at
+  IRQL <= DISPATCH_LEVEL; above it a reader could spin forever on a writer
+  it interrupted.
 
-  PhysicalPosition - On entry this variable contains the value to convert.
-                     On return it contains the converted value
+Arguments:
+  snapshot - Receives the state.
 */
-STDMETHODIMP
-MiniportWaveCyclicStreamMSVAD::NormalizePhysicalPosition(_Inout_ PLONGLONG physicalPosition)
+void MiniportWaveCyclicStreamMSVAD::readPosition(OUT PDMA_POSITION_SNAPSHOT snapshot)
 {
-    ASSERT(physicalPosition);
-
-    *physicalPosition = (_100NS_UNITS_PER_SECOND / blockAlign_ * *physicalPosition) / miniport_->samplingFrequency_;
+    ASSERT(snapshot);
 
-    return STATUS_SUCCESS;
+    SequenceRead(&positionSequence_, &positionSnapshot_, snapshot, sizeof(*snapshot));
 }
 
-#pragma code_seg("PAGE")
 //=============================================================================
 /*
-
 Routine Description:
+  Runs the emulated DMA engine up to the current time. The engine walks the
+  cyclic buffer at dmaFrameRate_ frames per second, in bursts of
+  dmaBurstFrames_ frames, and hands every span it passes to transferSpan
+  exactly once and in buffer order.
+  The caller holds dmaLock_.
+*/
+void MiniportWaveCyclicStreamMSVAD::advanceDma()
+{
+    // The frame count is derived afresh from the adapter timebase on every
+    // call rather than accumulated, so no rounding builds up however often
+    // or rarely the engine runs, and the stream moves a frame exactly when
+    // the grid of its rate does.
+    //
+    const ULONGLONG currentTime = TimeNow(nullptr);
 
-  The SetFormat function changes the format associated with a stream.
-  Callers of SetFormat should run at IRQL PASSIVE_LEVEL
+    dmaGridTime_  = timebase_->timeAt(currentTime);
+    dmaTimeStamp_ = currentTime;
 
-Arguments:
+    const ULONGLONG frames = dmaFrameBase_ + DeviceFrames(&clockError_, dmaGridTime_, dmaFrameRate_) - dmaGridStart_;
 
-  Format - Pointer to a KSDATAFORMAT structure which indicates the new format
-           of the stream.
-*/
-STDMETHODIMP_(NTSTATUS)
-MiniportWaveCyclicStreamMSVAD::SetFormat(_In_  PKSDATAFORMAT format)
-{
-    PAGED_CODE();
-    ASSERT(format);
-    DPF_ENTER(("[CMiniportWaveCyclicStreamMSVAD::SetFormat]"));
+    // The engine only moves whole bursts, and in packet mode whole packets.
+    // Bytes short of one wait for the next call.
+    //
+    const ULONG burstBytes       = packetCount_ ? packetSize_ : max(dmaBurstFrames_ * blockAlign_, 1);
+    ULONGLONG   ByteDisplacement = DmaWholeBursts(&dmaPendingBytes_, (frames - dmaFrames_) * blockAlign_, burstBytes);
 
-    NTSTATUS ntStatus = STATUS_INVALID_DEVICE_REQUEST;
+    dmaFrames_ = frames;
 
-    if (ksState_ != KSSTATE_RUN)
+    if (ByteDisplacement)
     {
-        // MSVAD does not validate the format.
-        //
-        const PWAVEFORMATEX wfx = GetWaveFormatEx(format);
-        if (wfx)
-        {
-            ntStatus = KeWaitForSingleObject(&miniport_->sampleRateSync_, Executive, KernelMode, FALSE, nullptr);
-            if (STATUS_SUCCESS == ntStatus)
-            {
-                if (!isCapture_)
-                {
-                    ntStatus = saveData_.setDataFormat(format);
-                }
+        dmaLastTransfer_ = (ULONG)min(ByteDisplacement, MAXULONG);
+    }
 
-                blockAlign_                   =  wfx->nBlockAlign;
-                is16BitSample                 = (wfx->wBitsPerSample == 16);
-                miniport_->samplingFrequency_ =  wfx->nSamplesPerSec;
-                dmaMovementRate_              =  wfx->nAvgBytesPerSec;
+    if (packetCount_)
+    {
+        advancePackets(ByteDisplacement);
+        ByteDisplacement = 0;
+    }
 
-                DPF(D_TERSE, ("New Format: %d", wfx->nSamplesPerSec));
-            }
+    // Increment the DMA position by the number of bytes displaced, handing
+    // over the data on the way, and ensure we properly wrap at buffer length.
+    //
+    dmaPosition_ = DmaWalk((PBYTE)dmaBuffer_, dmaBufferSize_, dmaPosition_, ByteDisplacement, transferRoutine, this);
 
-            KeReleaseMutex(&miniport_->sampleRateSync_, FALSE);
-        }
+    checkXrun();
+
+    DmaSetPositionRegister(positionRegister_, dmaPosition_);
+
+    // The estimator follows the position the engine has actually moved to,
+    // in whole bursts, as GetPosition reports it.
+    //
+    if (dmaActive_ && MAXULONGLONG == packets_.ullEosPacket)
+    {
+        positionFit_.add(currentTime, dmaFrames_ - dmaPendingBytes_ / max(blockAlign_, 1));
     }
 
-    return ntStatus;
+    publishPosition();
 }
 
 //=============================================================================
 /*
 Routine Description:
-
-  The SetNotificationFrequency function sets the frequency at which
-  notification interrupts are generated. Callers of SetNotificationFrequency
-  should run at IRQL PASSIVE_LEVEL.
+  Packet mode part of advanceDma. The buffer holds packetCount_ packets of
+  packetSize_ bytes, so a packet never wraps; each completed packet goes to
+  transferSpan as a whole. Every packet is numbered and stamped with the
+  performance counter value at which the engine crossed its end, which is
+  earlier than now when the engine runs late. The engine stops after the
+  end-of-stream packet, of which only the valid bytes are handed over.
+  The caller holds dmaLock_.
 
 Arguments:
-
-  Interval - Value indicating the interval between interrupts,
-             expressed in milliseconds
-
-  FramingSize - Pointer to a ULONG value where the number of bytes equivalent
-                to Interval milliseconds is returned
+  byteCount - Bytes the engine moves, a whole number of packets.
 */
-STDMETHODIMP_(ULONG)
-MiniportWaveCyclicStreamMSVAD::SetNotificationFreq(_In_  ULONG  interval, _Out_ PULONG framingSize)
+void MiniportWaveCyclicStreamMSVAD::advancePackets(IN ULONGLONG byteCount)
 {
-    PAGED_CODE();
-    ASSERT(framingSize);
-    DPF_ENTER(("[CMiniportWaveCyclicStreamMSVAD::SetNotificationFreq]"));
-
-    miniport_->notificationInterval_ = interval;
-    *framingSize = blockAlign_ * miniport_->samplingFrequency_ * interval / 1000;
+    LARGE_INTEGER  frequency;
+    const LONGLONG now = TimeQueryPerformanceCounter(&frequency).QuadPart;
 
-    return miniport_->notificationInterval_;
+    if (DmaWalkPackets(&packets_, (PBYTE)dmaBuffer_, dmaBufferSize_, &dmaPosition_, packetSize_, byteCount,
+                       dmaPendingBytes_, now, frequency.QuadPart, dmaMovementRate_, transferRoutine, this))
+    {
+        dmaActive_       = FALSE;
+        dmaPendingBytes_ = 0;
+    }
 }
 
 //=============================================================================
 /*
 Routine Description:
-
-  The SetState function sets the new state of playback or recording for the
-  stream. SetState should run at IRQL PASSIVE_LEVEL
+  Hands a span of the cyclic buffer that the DMA engine has just passed to
+  the consumers of the stream. For render streams that is the data being
+  "played", which is saved to disk. For capture streams the span is where
+  the device "records", so it is filled with the test signal.
+  The caller holds dmaLock_.
 
 Arguments:
-
-  NewState - KSSTATE indicating the new state for the stream.
+  span      - Start of the span in the DMA buffer.
+  byteCount - Size of the span in bytes.
 */
-STDMETHODIMP
-MiniportWaveCyclicStreamMSVAD::SetState(_In_  KSSTATE newState)
+void MiniportWaveCyclicStreamMSVAD::transferSpan(IN PBYTE span, IN ULONG byteCount)
 {
-    PAGED_CODE();
+    dmaBytesTotal_ += byteCount;
 
-    DPF_ENTER(("[CMiniportWaveCyclicStreamMSVAD::SetState]"));
-
-    NTSTATUS ntStatus = STATUS_SUCCESS;
+    const PAsyncRateConverter loopback = miniport_->loopback_;
 
-    // The acquire state is not distinguishable from the stop state for our
-    // purposes.
-    //
-    if (newState == KSSTATE_ACQUIRE)
+    if (!isCapture_)
     {
-        newState = KSSTATE_STOP;
-    }
+        saveData_.writeData(span, byteCount);
 
-    if (ksState_ != newState)
-    {
-        switch (newState)
+        if (loopback)
         {
-            case KSSTATE_PAUSE:
-            {
-                DPF(D_TERSE, ("KSSTATE_PAUSE"));
-                dmaActive_ = FALSE;
-            }
-            break;
-
-            case KSSTATE_RUN:
-            {
-                DPF(D_TERSE, ("KSSTATE_RUN"));
-
-                 LARGE_INTEGER delay;
-
-                // Set the timer for DPC.
-                //
-                dmaTimeStamp_             = KeQueryInterruptTime();
-                elapsedTimeCarryForward_  = 0;
-                dmaActive_                = TRUE;
-                delay.HighPart            = 0;
-                delay.LowPart             = miniport_->notificationInterval_;
-
-                KeSetTimerEx(timer_, delay, miniport_->notificationInterval_, dpc_);
-            }
-            break;
-
-        case KSSTATE_STOP:
-
-            DPF(D_TERSE, ("KSSTATE_STOP"));
-
-            dmaActive_                    = FALSE;
-            dmaPosition_                  = 0;
-            elapsedTimeCarryForward_      = 0;
-            byteDisplacementCarryForward_ = 0;
-
-            KeCancelTimer( timer_ );
-
-            // Wait until all work items are completed.
-            //
-            if (!isCapture_)
-            {
-                saveData_.waitAllWorkItems();
-            }
-
-            break;
+            loopback->write(this, &waveFormat_, span, byteCount);
         }
-
-        ksState_ = newState;
     }
-
-    return ntStatus;
+    else if (loopbackCapture_ && loopback)
+    {
+        loopback->read(&waveFormat_, span, byteCount);
+    }
+    else
+    {
+        signalGenerator_.fill(span, byteCount);
+    }
 }
 
-#pragma code_seg()
+//=============================================================================
+/*
+Routine Description:
+  DmaWalk calls this for each span, with the stream as context.
+  The caller holds dmaLock_.
+*/
+void MiniportWaveCyclicStreamMSVAD::transferRoutine(IN PVOID context, IN PBYTE span, IN ULONG byteCount)
+{
+    ((PCMiniportWaveCyclicStreamMSVAD)context)->transferSpan(span, byteCount);
+}
 
 //=============================================================================
 /*
 Routine Description:
+  Compares the DMA engine with the port after the engine moved. A render
+  stream underruns when the engine passes data the port has not written
+  yet; a capture stream overruns when the engine records over data the port
+  has not read yet. Each episode counts once, however long it lasts. The
+  port side of both is checked in accountClientBytes. Nothing is known of
+  a client that maps the buffer, so such streams are not checked.
+  The caller holds dmaLock_.
+*/
+void MiniportWaveCyclicStreamMSVAD::checkXrun()
+{
+    if (bufferMdl_)
+    {
+        return;
+    }
 
-  The Silence function is used to copy silence samplings to a certain location.
-  Callers of Silence can run at any IRQL
+    const BOOLEAN xrun = isCapture_ ? (dmaBytesTotal_ > clientBytes_ + dmaBufferSize_)
+                                    : (dmaBytesTotal_ > clientBytes_);
+
+    if (xrun && !xrun_)
+    {
+        if (isCapture_)
+        {
+            overruns_++;
+        }
+        else
+        {
+            underruns_++;
+        }
+
+        DPF(D_VERBOSE, ("[CMiniportWaveCyclicStreamMSVAD::checkXrun : engine at %I64u, port at %I64u]",
+                        dmaBytesTotal_, clientBytes_));
+    }
+
+    xrun_ = xrun;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Counts bytes the port wrote to, or read from, the cyclic buffer. A render
+  port that writes more than a buffer ahead of the engine overwrites data
+  not yet played, and a capture port that reads past the engine reads data
+  not yet recorded; each such call counts as an overrun or an underrun.
+  Callers of accountClientBytes can run at IRQL <= DISPATCH_LEVEL.
+
+Arguments:
+  byteCount - Bytes written or read.
+  silence   - TRUE if the port wrote silence for missing data.
+*/
+void MiniportWaveCyclicStreamMSVAD::accountClientBytes(IN ULONG byteCount, IN BOOLEAN silence)
+{
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&dmaLock_, &oldIrql);
+
+    if (!bufferMdl_)
+    {
+        if (isCapture_ && clientBytes_ + byteCount > dmaBytesTotal_)
+        {
+            underruns_++;
+        }
+        else if (!isCapture_ && clientBytes_ + byteCount > dmaBytesTotal_ + dmaBufferSize_)
+        {
+            overruns_++;
+        }
+    }
+
+    clientBytes_ += byteCount;
+
+    if (silence)
+    {
+        silenceBytes_ += byteCount;
+    }
+
+    KeReleaseSpinLock(&dmaLock_, oldIrql);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Switches the stream between byte and packet mode. In packet mode the
+  cyclic buffer is split into packetCount equal packets of whole frames,
+  and the DMA engine moves and hands over one packet at a time, so the
+  consumers never see a partial or wrapped packet. The buffer shrinks to a
+  multiple of the packet size if needed.
+  Callers of setPacketMode should run at IRQL <= DISPATCH_LEVEL, with the
+  stream not running.
+
+Arguments:
+  packetCount - Packets per buffer, or 0 for byte mode.
+*/
+NTSTATUS MiniportWaveCyclicStreamMSVAD::setPacketMode(IN ULONG packetCount)
+{
+    DPF_ENTER(("[CMiniportWaveCyclicStreamMSVAD::setPacketMode]"));
+
+    if (ksState_ == KSSTATE_RUN)
+    {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    const ULONG oldPacketCount = packetCount_;
+
+    packetCount_ = packetCount;
+
+    NTSTATUS ntStatus = resizeBuffer(dmaBufferSize_, blockAlign_, silenceByte_);
+    if (!NT_SUCCESS(ntStatus))
+    {
+        packetCount_ = oldPacketCount;
+    }
+
+    return ntStatus;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Marks the last packet of a packet mode stream. The DMA engine hands over
+  byteCount bytes of that packet and then stops.
+  Callers of setEndOfStream can run at IRQL <= DISPATCH_LEVEL.
+
+Arguments:
+  packetNumber - Number of the last packet, counted from 0 since the stream
+                 started.
+  byteCount    - Valid bytes in the last packet.
+*/
+NTSTATUS MiniportWaveCyclicStreamMSVAD::setEndOfStream(IN ULONGLONG packetNumber, IN ULONG byteCount)
+{
+    NTSTATUS ntStatus = STATUS_SUCCESS;
+    KIRQL    oldIrql;
+
+    KeAcquireSpinLock(&dmaLock_, &oldIrql);
+
+    if (!packetCount_ || byteCount > packetSize_ || packetNumber < packets_.ullNumber)
+    {
+        ntStatus = STATUS_INVALID_PARAMETER;
+    }
+    else
+    {
+        packets_.ullEosPacket = packetNumber;
+        packets_.ulEosLength  = byteCount;
+
+        publishPosition();
+    }
+
+    KeReleaseSpinLock(&dmaLock_, oldIrql);
+
+    return ntStatus;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Returns the number of packets the DMA engine has completed and the
+  performance counter value at which the last one completed.
+  Callers of getPacketCount can run at IRQL <= DISPATCH_LEVEL.
+
+Arguments:
+  packetNumber       - Receives the number of completed packets.
+  performanceCounter - Receives the completion time of the last packet.
+  endOfStream        - Receives TRUE once the last packet is consumed.
+*/
+void MiniportWaveCyclicStreamMSVAD::getPacketCount
+(
+    OUT PULONGLONG packetNumber,
+    OUT PLONGLONG  performanceCounter,
+    OUT PBOOLEAN   endOfStream
+)
+{
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&dmaLock_, &oldIrql);
+
+    if (dmaActive_)
+    {
+        advanceDma();
+    }
+
+    *packetNumber       = packets_.ullNumber;
+    *performanceCounter = packets_.llQpc;
+    *endOfStream        = packets_.fEndOfStream;
+
+    KeReleaseSpinLock(&dmaLock_, oldIrql);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Returns the transfer accounting of the stream, with the DMA engine run up
+  to now. Callers of getTransferStats can run at IRQL <= DISPATCH_LEVEL.
+
+Arguments:
+  stats - Receives the counters.
+*/
+void MiniportWaveCyclicStreamMSVAD::getTransferStats(OUT PDMA_TRANSFER_STATS stats)
+{
+    ASSERT(stats);
+
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&dmaLock_, &oldIrql);
+
+    if (dmaActive_)
+    {
+        advanceDma();
+    }
+
+    const ULONGLONG ahead  = isCapture_ ? dmaBytesTotal_ : clientBytes_;
+    const ULONGLONG behind = isCapture_ ? clientBytes_   : dmaBytesTotal_;
+
+    stats->ullBytesTransferred = dmaBytesTotal_;
+    stats->ullClientBytes      = clientBytes_;
+    stats->ullSilenceBytes     = silenceBytes_;
+    stats->ulLastTransfer      = dmaLastTransfer_;
+    stats->ulInFlight          = (ULONG)min(ahead > behind ? ahead - behind : 0, dmaBufferSize_);
+    stats->ulUnderruns         = underruns_;
+    stats->ulOverruns          = overruns_;
+
+    KeReleaseSpinLock(&dmaLock_, oldIrql);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Returns the presentation position of the stream: the frames the DMA engine
+  has moved since the stream last stopped, and the performance counter value
+  at which exactly that many had moved. Both come from one reading of the
+  counter applied to the published clock model, so a client can extrapolate
+  from the pair at the nominal rate without polling again. The frame count
+  never decreases while the stream is not stopped, also across pauses and
+  format changes. Callers of getPresentationPosition can run at
+  IRQL <= DISPATCH_LEVEL.
+
+Arguments:
+  frames             - Receives the frame count.
+  performanceCounter - Receives the performance counter value it is valid at.
+*/
+void MiniportWaveCyclicStreamMSVAD::getPresentationPosition(OUT PULONGLONG frames, OUT PLONGLONG performanceCounter)
+{
+    ASSERT(frames);
+    ASSERT(performanceCounter);
+
+    DMA_POSITION_SNAPSHOT snapshot;
+
+    readPosition(&snapshot);
+
+    const ULONGLONG time = TimeNow(performanceCounter);
+
+    *frames = snapshot.ullFrames;
+
+    if (snapshot.fRunning)
+    {
+        *frames = FramesAt(&snapshot, time);
+    }
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Stops the emulated DMA engine after it has passed everything played up to
+  now. Callers of pauseDma can run at IRQL <= DISPATCH_LEVEL.
+*/
+void MiniportWaveCyclicStreamMSVAD::pauseDma()
+{
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&dmaLock_, &oldIrql);
+
+    if (dmaActive_)
+    {
+        advanceDma();
+    }
+
+    dmaActive_ = FALSE;
+    publishPosition();
+
+    KeReleaseSpinLock(&dmaLock_, oldIrql);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Starts the DMA engine, or restarts it after a pause. The frame count
+  continues from where it stopped, on the next frame of the timebase grid.
+  Callers of startDma can run at IRQL <= DISPATCH_LEVEL.
+*/
+void MiniportWaveCyclicStreamMSVAD::startDma()
+{
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&dmaLock_, &oldIrql);
+
+    dmaTimeStamp_ = TimeNow(nullptr);
+    dmaGridTime_  = timebase_->timeAt(dmaTimeStamp_);
+    dmaActive_    = TRUE;
+
+    rebaseDma();
+    positionFit_.reset();
+    publishPosition();
+
+    KeReleaseSpinLock(&dmaLock_, oldIrql);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Stops the DMA engine for good and returns its position to the start of
+  the buffer and its frame count to zero. Callers of resetDma can run at
+  IRQL <= DISPATCH_LEVEL.
+*/
+void MiniportWaveCyclicStreamMSVAD::resetDma()
+{
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&dmaLock_, &oldIrql);
+
+    dmaActive_       = FALSE;
+    dmaPosition_     = 0;
+    dmaGridTime_     = 0;
+    dmaGridStart_    = 0;
+    dmaFrameBase_    = 0;
+    dmaFrames_       = 0;
+    dmaPendingBytes_ = 0;
+
+    packets_.ullEosPacket = MAXULONGLONG;
+    positionFit_.reset();
+
+    DmaSetPositionRegister(positionRegister_, 0);
+
+    publishPosition();
+
+    KeReleaseSpinLock(&dmaLock_, oldIrql);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Moves the DMA engine of a stream that is not running to a new format.
+  Frames of the new format count from the current frame count on.
+  Callers of setDmaFormat can run at IRQL <= DISPATCH_LEVEL.
+
+Arguments:
+  wfx - The new format.
+*/
+void MiniportWaveCyclicStreamMSVAD::setDmaFormat(IN PWAVEFORMATEX wfx)
+{
+    ASSERT(wfx);
+
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&dmaLock_, &oldIrql);
+
+    blockAlign_      = wfx->nBlockAlign;
+    dmaMovementRate_ = wfx->nAvgBytesPerSec;
+    dmaFrameRate_    = wfx->nSamplesPerSec;
+
+    ReciprocalInit(&byteRate_, max(blockAlign_ * dmaFrameRate_, 1));
+
+    dmaPendingBytes_ = 0;
+    rebaseDma();
+    positionFit_.reset();
+
+    publishPosition();
+
+    KeReleaseSpinLock(&dmaLock_, oldIrql);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Ties the current frame count to the current frame of the timebase grid.
+  The frames count on from there at the rate and with the clock error the
+  stream has now. The caller holds dmaLock_.
+*/
+void MiniportWaveCyclicStreamMSVAD::rebaseDma()
+{
+    dmaFrameBase_ = dmaFrames_;
+    dmaGridStart_ = DeviceFrames(&clockError_, dmaGridTime_, dmaFrameRate_);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Returns the frame of the timebase grid that frame zero of the stream
+  falls on, so stream frame n is presented at grid frame n plus the offset.
+  The grid is that of the stream rate. Streams of one rate and clock are
+  aligned to the sample by the differences of their offsets. The offset is
+  fixed while the stream runs, and is set anew when it starts, resumes, or
+  its clock changes. Callers of getTimebaseOffset can run at
+  IRQL <= DISPATCH_LEVEL.
+
+Arguments:
+  frames - Receives the offset.
+*/
+NTSTATUS MiniportWaveCyclicStreamMSVAD::getTimebaseOffset(OUT PLONGLONG frames)
+{
+    ASSERT(frames);
+
+    DMA_POSITION_SNAPSHOT snapshot;
+
+    readPosition(&snapshot);
+
+    if (!snapshot.fRunning)
+    {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    *frames = (LONGLONG)(snapshot.ullGridStart - snapshot.ullFrameBase);
+
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Predicts the frame count of getPresentationPosition at a performance
+  counter value, from the line the engine fits through its recent
+  positions, without touching the engine. The prediction is as good as the
+  bound says also well ahead of now, so a client can schedule from one call
+  instead of polling GetPosition. Callers of predictPosition can run at
+  IRQL <= DISPATCH_LEVEL.
+
+Arguments:
+  performanceCounter - Performance counter value to predict the position at.
+  frames             - Receives the frame count.
+  bound              - Receives the bound of its error, in frames.
+
+Return Value:
+  STATUS_DEVICE_NOT_READY until the stream has run for a few notification
+  intervals, else as PositionPredict.
+*/
+NTSTATUS MiniportWaveCyclicStreamMSVAD::predictPosition(IN LONGLONG performanceCounter, OUT PULONGLONG frames, OUT PULONG bound)
+{
+    ASSERT(frames);
+    ASSERT(bound);
+
+    DMA_POSITION_SNAPSHOT snapshot;
+
+    readPosition(&snapshot);
+
+    if (!snapshot.fMoving)
+    {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    return PositionPredict(&snapshot.Estimate, TimeForPerformanceCounter(performanceCounter), frames, bound);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Sets the number of frames the emulated DMA engine moves at a time. Real
+  DMA engines fetch in bursts, so the position advances in steps rather
+  than smoothly. Callers of setDmaBurst can run at IRQL <= DISPATCH_LEVEL.
+
+Arguments:
+  frames - Frames per burst. Must be non-zero.
+*/
+NTSTATUS MiniportWaveCyclicStreamMSVAD::setDmaBurst(IN ULONG frames)
+{
+    if (!frames)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&dmaLock_, &oldIrql);
+    dmaBurstFrames_ = frames;
+    publishPosition();
+    KeReleaseSpinLock(&dmaLock_, oldIrql);
+
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Selects the signal capture streams record. The signal restarts.
+  Callers of setCaptureSignal can run at IRQL <= DISPATCH_LEVEL.
+
+Arguments:
+  params - The signal and its parameters.
+*/
+NTSTATUS MiniportWaveCyclicStreamMSVAD::setCaptureSignal(IN PSIGGEN_PARAMS params)
+{
+    ASSERT(params);
+
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&dmaLock_, &oldIrql);
+    NTSTATUS ntStatus = signalGenerator_.setSignal(params);
+    KeReleaseSpinLock(&dmaLock_, oldIrql);
+
+    return ntStatus;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Sets the error of the device clock of the stream, which then drifts and
+  jitters against the system clock like a real device. All zero restores
+  an exact clock. The clock can change while the stream runs; the position
+  continues from where it is. Callers of setClockError can run at
+  IRQL <= DISPATCH_LEVEL.
+
+Arguments:
+  params - The clock error.
+*/
+NTSTATUS MiniportWaveCyclicStreamMSVAD::setClockError(IN PCLOCK_ERROR_PARAMS params)
+{
+    ASSERT(params);
+
+    NTSTATUS ntStatus = ValidateClockError(params);
+    if (!NT_SUCCESS(ntStatus))
+    {
+        return ntStatus;
+    }
+
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&dmaLock_, &oldIrql);
+
+    if (dmaActive_)
+    {
+        advanceDma();
+    }
+
+    // The error applies from here on.
+    //
+    clockError_ = *params;
+    rebaseDma();
+    positionFit_.reset();
+
+    publishPosition();
+
+    KeReleaseSpinLock(&dmaLock_, oldIrql);
+
+    DPF(D_TERSE, ("[MiniportWaveCyclicStreamMSVAD::setClockError : %d ppb, wander %d ppb over %d ms, jitter %d us]",
+                  params->lOffsetPpb, params->ulWanderPpb, params->ulWanderPeriodMs, params->ulJitterUs));
+
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Makes a capture stream record what the render stream of the miniport
+  plays, through the loopback converter, instead of the test signal. The
+  converter locks the capture clock to the render clock, however the two
+  drift. Callers of setLoopbackCapture can run at IRQL <= DISPATCH_LEVEL.
+
+Arguments:
+  enable - TRUE to record the loopback.
+*/
+NTSTATUS MiniportWaveCyclicStreamMSVAD::setLoopbackCapture(IN BOOLEAN enable)
+{
+    if (!isCapture_ || (enable && !miniport_->loopback_))
+    {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&dmaLock_, &oldIrql);
+    loopbackCapture_ = enable;
+    KeReleaseSpinLock(&dmaLock_, oldIrql);
+
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+/*
+Routine Description:
+
+  Given a physical position based on the actual number of bytes transferred,
+  NormalizePhysicalPosition converts the position to a time-based value of
+  100 nanosecond units. Callers of NormalizePhysicalPosition can run at any IRQL.
+
+  The result is the exact floor of position * 10^7 / bytes per second, for
+  any block align and any position whose time fits. ReciprocalScale splits
+  the position into whole seconds and the bytes left over, so no
+  intermediate exceeds 64 bits, and both divisions multiply by the
+  reciprocal SetFormat prepared.
+
+Arguments:
+
+  PhysicalPosition - On entry this variable contains the value to convert.
+                     On return it contains the converted value
+*/
+STDMETHODIMP
+MiniportWaveCyclicStreamMSVAD::NormalizePhysicalPosition(_Inout_ PLONGLONG physicalPosition)
+{
+    ASSERT(physicalPosition);
+
+    *physicalPosition = (LONGLONG)ReciprocalScale(&byteRate_, (ULONGLONG)*physicalPosition, _100NS_UNITS_PER_SECOND);
+
+    return STATUS_SUCCESS;
+}
+
+#pragma code_seg("PAGE")
+//=============================================================================
+/*
+
+Routine Description:
+
+  The SetFormat function changes the format associated with a stream.
+  Callers of SetFormat should run at IRQL PASSIVE_LEVEL
+
+Arguments:
+
+  Format - Pointer to a KSDATAFORMAT structure which indicates the new format
+           of the stream.
+*/
+STDMETHODIMP_(NTSTATUS)
+MiniportWaveCyclicStreamMSVAD::SetFormat(_In_  PKSDATAFORMAT format)
+{
+    PAGED_CODE();
+    ASSERT(format);
+    DPF_ENTER(("[CMiniportWaveCyclicStreamMSVAD::SetFormat]"));
+
+    NTSTATUS ntStatus = STATUS_INVALID_DEVICE_REQUEST;
+
+    if (ksState_ != KSSTATE_RUN)
+    {
+        // MSVAD does not validate the format.
+        //
+        const PWAVEFORMATEX wfx = GetWaveFormatEx(format);
+        if (wfx)
+        {
+            ntStatus = KeWaitForSingleObject(&miniport_->sampleRateSync_, Executive, KernelMode, FALSE, nullptr);
+            if (STATUS_SUCCESS == ntStatus)
+            {
+                // The stream is not running, so the cyclic buffer can follow
+                // the format. It does so first, so that a failure leaves the
+                // stream in the old format. A buffer mapped into a client
+                // cannot move, and is kept if its packets, or the whole of
+                // it, hold whole frames of the new format.
+                //
+                if (dmaBuffer_ && !bufferMdl_)
+                {
+                    ntStatus = resizeBuffer(bufferSizeForFormat(wfx), wfx->nBlockAlign, SilenceByte(wfx));
+                }
+                else if (dmaBuffer_ && (packetCount_ ? packetSize_ : dmaBufferSize_) % max(wfx->nBlockAlign, 1))
+                {
+                    ntStatus = STATUS_INVALID_DEVICE_STATE;
+                }
+
+                if (NT_SUCCESS(ntStatus))
+                {
+                    if (!isCapture_)
+                    {
+                        ntStatus = saveData_.setDataFormat(format);
+                    }
+
+                    silenceByte_                  = SilenceByte(wfx);
+                    waveFormat_                   = *wfx;
+                    waveFormat_.cbSize            =  0;
+                    miniport_->samplingFrequency_ =  wfx->nSamplesPerSec;
+
+                    setDmaFormat(wfx);
+
+                    signalGenerator_.setFormat(wfx);
+
+                    DPF(D_TERSE, ("New Format: %d", wfx->nSamplesPerSec));
+                }
+            }
+
+            KeReleaseMutex(&miniport_->sampleRateSync_, FALSE);
+        }
+    }
+
+    return ntStatus;
+}
+
+//=============================================================================
+/*
+Routine Description:
+
+  The SetNotificationFrequency function sets the frequency at which
+  notification interrupts are generated. Callers of SetNotificationFrequency
+  should run at IRQL PASSIVE_LEVEL.
+
+Arguments:
+
+  Interval - Value indicating the interval between interrupts,
+             expressed in milliseconds
+
+  FramingSize - Pointer to a ULONG value where the number of bytes equivalent
+                to Interval milliseconds is returned
+*/
+STDMETHODIMP_(ULONG)
+MiniportWaveCyclicStreamMSVAD::SetNotificationFreq(_In_  ULONG  interval, _Out_ PULONG framingSize)
+{
+    PAGED_CODE();
+    ASSERT(framingSize);
+    DPF_ENTER(("[CMiniportWaveCyclicStreamMSVAD::SetNotificationFreq]"));
+
+    miniport_->notificationInterval_ = interval;
+    *framingSize = blockAlign_ * miniport_->samplingFrequency_ * interval / 1000;
+
+    return miniport_->notificationInterval_;
+}
+
+//=============================================================================
+/*
+Routine Description:
+
+  The SetState function sets the new state of playback or recording for the
+  stream. SetState should run at IRQL PASSIVE_LEVEL
+
+Arguments:
+
+  NewState - KSSTATE indicating the new state for the stream.
+*/
+STDMETHODIMP
+MiniportWaveCyclicStreamMSVAD::SetState(_In_  KSSTATE newState)
+{
+    PAGED_CODE();
+
+    DPF_ENTER(("[CMiniportWaveCyclicStreamMSVAD::SetState]"));
+
+    NTSTATUS ntStatus = STATUS_SUCCESS;
+
+    // The acquire state is not distinguishable from the stop state for our
+    // purposes.
+    //
+    if (newState == KSSTATE_ACQUIRE)
+    {
+        newState = KSSTATE_STOP;
+    }
+
+    if (ksState_ != newState)
+    {
+        switch (newState)
+        {
+            case KSSTATE_PAUSE:
+            {
+                DPF(D_TERSE, ("KSSTATE_PAUSE"));
+                pauseDma();
+            }
+            break;
+
+            case KSSTATE_RUN:
+            {
+                DPF(D_TERSE, ("KSSTATE_RUN"));
+
+                // Set the timer for DPC.
+                //
+                startDma();
+
+                timerWheel_->setTimer(&timer_, max(miniport_->notificationInterval_, 1));
+            }
+            break;
+
+        case KSSTATE_STOP:
+
+            DPF(D_TERSE, ("KSSTATE_STOP"));
+
+            resetDma();
+
+            if (packets_.ullNumber)
+            {
+                LARGE_INTEGER frequency;
+                TimeQueryPerformanceCounter(&frequency);
+
+                DPF(D_TERSE, ("[%I64u packets, delivery lateness mean %I64u us, max %I64u us]",
+                              packets_.ullNumber,
+                              packets_.ullLatenessTotal * 1000000 / packets_.ullNumber / frequency.QuadPart,
+                              packets_.ullLatenessMax * 1000000 / frequency.QuadPart));
+            }
+
+            DPF(D_TERSE, ("[%I64u bytes transferred, %I64u by the port, %I64u of silence, %d underruns, %d overruns]",
+                          dmaBytesTotal_, clientBytes_, silenceBytes_, underruns_, overruns_));
+
+            dmaBytesTotal_       = 0;
+            clientBytes_         = 0;
+            silenceBytes_        = 0;
+            dmaLastTransfer_     = 0;
+            underruns_           = 0;
+            overruns_            = 0;
+            xrun_                = FALSE;
+
+            DmaResetPackets(&packets_);
+
+            timerWheel_->cancelTimer(&timer_);
+
+            signalGenerator_.reset();
+
+            if (miniport_->loopback_)
+            {
+                if (isCapture_)
+                {
+                    miniport_->loopback_->detachReader();
+                }
+                else
+                {
+                    miniport_->loopback_->detachWriter(this);
+                }
+            }
+
+            // Wait until all work items are completed.
+            //
+            if (!isCapture_)
+            {
+                saveData_.waitAllWorkItems();
+            }
+
+            break;
+        }
+
+        ksState_ = newState;
+    }
+
+    return ntStatus;
+}
+
+#pragma code_seg()
+
+//=============================================================================
+/*
+Routine Description:
+
+  The Silence function is used to copy silence samplings to a certain location.
+  The port calls it when it has no data, so the bytes are accounted as
+  written silence. Callers of Silence can run at IRQL <= DISPATCH_LEVEL.
 
 Arguments:
 
@@ -778,7 +1721,15 @@ _Use_decl_annotations_
 STDMETHODIMP_(void)
 MiniportWaveCyclicStreamMSVAD::Silence(PVOID buffer, ULONG byteCount)
 {
-    RtlFillMemory(buffer, byteCount, is16BitSample ? 0 : 0x80);
+    fillSilence(buffer, byteCount);
+    accountClientBytes(byteCount, TRUE);
+}
+
+//=============================================================================
+// Fills a part of the stream buffer with silence. Callers can run at any IRQL.
+void MiniportWaveCyclicStreamMSVAD::fillSilence(_Out_writes_bytes_(byteCount) PVOID buffer, IN ULONG byteCount)
+{
+    FillSilence((PBYTE)buffer, byteCount, silenceByte_);
 }
 
 //=============================================================================
@@ -787,7 +1738,8 @@ MiniportWaveCyclicStreamMSVAD::Silence(PVOID buffer, ULONG byteCount)
 Routine Description:
 
   Dpc routine. This simulates an interrupt service routine. The Dpc will be
-  called whenever CMiniportWaveCyclicStreamMSVAD::m_pTimer triggers.
+  called whenever the wheel timer CMiniportWaveCyclicStreamMSVAD::timer_
+  expires.
 
 Arguments:
 
@@ -811,10 +1763,351 @@ void timerNotify
     UNREFERENCED_PARAMETER(SA1);
     UNREFERENCED_PARAMETER(SA2);
 
-    PCMiniportWaveCyclicMSVAD miniport = (PCMiniportWaveCyclicMSVAD) deferredContext;
+    PCMiniportWaveCyclicStreamMSVAD stream = (PCMiniportWaveCyclicStreamMSVAD) deferredContext;
+
+    if (!stream)
+    {
+        return;
+    }
+
+    // Run the DMA engine, so the data is consumed at the device rate even if
+    // nobody asks for the position.
+    //
+    KeAcquireSpinLockAtDpcLevel(&stream->dmaLock_);
+    if (stream->dmaActive_)
+    {
+        stream->advanceDma();
+    }
+    KeReleaseSpinLockFromDpcLevel(&stream->dmaLock_);
+
+    PCMiniportWaveCyclicMSVAD miniport = stream->miniport_;
 
     if (miniport && miniport->port_)
     {
         miniport->port_->Notify(miniport->serviceGroup_);
     }
-}
\ No newline at end of file
+}
+
+#pragma code_seg("PAGE")
+//=============================================================================
+/*
+Routine Description:
+  Maps nonpaged memory of the stream into the address space of the calling
+  process. Callers of mapToClient should run at PASSIVE_LEVEL in the context
+  of the client.
+
+Arguments:
+  address       - Page-aligned nonpaged memory.
+  size          - Size in bytes to map.
+  sourceMdl     - MDL of the pages if address is not nonpaged pool but a
+                  mapping of them, as for a scatter-gather buffer.
+  mdl           - Receives the MDL describing the memory.
+  clientAddress - Receives the user-mode address.
+*/
+NTSTATUS MiniportWaveCyclicStreamMSVAD::mapToClient
+(
+    IN  PVOID  address,
+    IN  ULONG  size,
+    IN  PMDL   sourceMdl,
+    OUT PMDL*  mdl,
+    OUT PVOID* clientAddress
+)
+{
+    PAGED_CODE();
+
+    ASSERT(((ULONG_PTR)address & (PAGE_SIZE - 1)) == 0);
+
+    *clientAddress = nullptr;
+
+    if (sourceMdl)
+    {
+        address = MmGetMdlVirtualAddress(sourceMdl);
+    }
+
+    *mdl = IoAllocateMdl(address, size, FALSE, FALSE, nullptr);
+    if (!*mdl)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    if (sourceMdl)
+    {
+        IoBuildPartialMdl(sourceMdl, *mdl, address, size);
+    }
+    else
+    {
+        MmBuildMdlForNonPagedPool(*mdl);
+    }
+
+    // Mapping into user space raises an exception on failure.
+    //
+    __try
+    {
+        *clientAddress = MmMapLockedPagesSpecifyCache(*mdl, UserMode, MmCached, nullptr, FALSE,
+                                                      NormalPagePriority | MdlMappingNoExecute);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        *clientAddress = nullptr;
+    }
+
+    if (!*clientAddress)
+    {
+        IoFreeMdl(*mdl);
+        *mdl = nullptr;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Removes the client mappings of the DMA buffer and the position register.
+  The stream may be closed from another process, so the client process is
+  attached for the unmapping.
+*/
+void MiniportWaveCyclicStreamMSVAD::unmapFromClient()
+{
+    PAGED_CODE();
+
+    if (!clientProcess_)
+    {
+        return;
+    }
+
+    KAPC_STATE apcState;
+    BOOLEAN    attached = FALSE;
+
+    if (PsGetCurrentProcess() != clientProcess_)
+    {
+        KeStackAttachProcess(clientProcess_, &apcState);
+        attached = TRUE;
+    }
+
+    if (bufferMdl_)
+    {
+        MmUnmapLockedPages(bufferClientAddress_, bufferMdl_);
+        IoFreeMdl(bufferMdl_);
+        bufferMdl_           = nullptr;
+        bufferClientAddress_ = nullptr;
+    }
+
+    if (registerMdl_)
+    {
+        MmUnmapLockedPages(registerClientAddress_, registerMdl_);
+        IoFreeMdl(registerMdl_);
+        registerMdl_           = nullptr;
+        registerClientAddress_ = nullptr;
+    }
+
+    if (attached)
+    {
+        KeUnstackDetachProcess(&apcState);
+    }
+
+    ObDereferenceObject(clientProcess_);
+    clientProcess_ = nullptr;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Handles (KSPROPSETID_RtAudio, KSPROPERTY_RTAUDIO_BUFFER).
+
+  Maps the cyclic buffer of a stopped or paused stream into the client, in
+  the manner of a WaveRT miniport. The client then writes render data, or
+  reads capture data, in place, and the DMA engine consumes it without any
+  copy through the port. The buffer cannot be resized or mapped again until
+  the stream is closed.
+*/
+NTSTATUS MiniportWaveCyclicStreamMSVAD::propertyHandlerRtBuffer(IN PPCPROPERTY_REQUEST propertyRequest)
+{
+    PAGED_CODE();
+
+    DPF_ENTER(("[CMiniportWaveCyclicStreamMSVAD::propertyHandlerRtBuffer]"));
+
+    NTSTATUS ntStatus = ValidatePropertyParams(propertyRequest, sizeof(KSRTAUDIO_BUFFER),
+                                               sizeof(KSRTAUDIO_BUFFER_PROPERTY) - sizeof(KSPROPERTY));
+    if (!NT_SUCCESS(ntStatus))
+    {
+        return ntStatus;
+    }
+
+#ifdef _WIN64
+    // The 32-bit layouts of the property are not supported.
+    //
+    if (IoIs32bitProcess(nullptr))
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+#endif
+
+    if (ksState_ == KSSTATE_RUN || bufferMdl_ || !dmaBuffer_)
+    {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    if (clientProcess_ && clientProcess_ != PsGetCurrentProcess())
+    {
+        return STATUS_ACCESS_DENIED;
+    }
+
+    PKSRTAUDIO_BUFFER_PROPERTY request = CONTAINING_RECORD(propertyRequest->Instance, KSRTAUDIO_BUFFER_PROPERTY, BaseAddress);
+    PKSRTAUDIO_BUFFER          buffer  = (PKSRTAUDIO_BUFFER)propertyRequest->Value;
+
+    // Honor the requested size within the limits of the stream, in whole
+    // frames.
+    //
+    if (request->RequestedBufferSize)
+    {
+        ULONG size = min(max(request->RequestedBufferSize, DMA_BUFFER_MIN_SIZE), miniport_->maxDmaBufferSize_);
+
+        ntStatus = resizeBuffer(size - size % max(blockAlign_, 1), blockAlign_, silenceByte_);
+    }
+
+    if (NT_SUCCESS(ntStatus))
+    {
+        ntStatus = mapToClient(dmaBuffer_, dmaBufferSize_, dmaChunks_ ? dmaChunks_->mdl() : nullptr,
+                               &bufferMdl_, &bufferClientAddress_);
+    }
+
+    if (NT_SUCCESS(ntStatus))
+    {
+        if (!clientProcess_)
+        {
+            clientProcess_ = PsGetCurrentProcess();
+            ObReferenceObject(clientProcess_);
+        }
+
+        buffer->BufferAddress     = bufferClientAddress_;
+        buffer->ActualBufferSize  = dmaBufferSize_;
+        buffer->CallMemoryBarrier = FALSE;
+
+        propertyRequest->ValueSize = sizeof(KSRTAUDIO_BUFFER);
+    }
+
+    return ntStatus;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Handles (KSPROPSETID_RtAudio, KSPROPERTY_RTAUDIO_POSITIONREGISTER).
+
+  Maps a 32-bit register into the client that the DMA engine updates with
+  its byte position in the cyclic buffer. The client can read the position
+  without a call into the driver. The register is as fresh as the last run
+  of the engine, that is, at most one notification interval old.
+*/
+NTSTATUS MiniportWaveCyclicStreamMSVAD::propertyHandlerRtPositionRegister(IN PPCPROPERTY_REQUEST propertyRequest)
+{
+    PAGED_CODE();
+
+    DPF_ENTER(("[CMiniportWaveCyclicStreamMSVAD::propertyHandlerRtPositionRegister]"));
+
+    NTSTATUS ntStatus = ValidatePropertyParams(propertyRequest, sizeof(KSRTAUDIO_HWREGISTER),
+                                               sizeof(KSRTAUDIO_HWREGISTER_PROPERTY) - sizeof(KSPROPERTY));
+    if (!NT_SUCCESS(ntStatus))
+    {
+        return ntStatus;
+    }
+
+#ifdef _WIN64
+    if (IoIs32bitProcess(nullptr))
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+#endif
+
+    if (registerMdl_)
+    {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    if (clientProcess_ && clientProcess_ != PsGetCurrentProcess())
+    {
+        return STATUS_ACCESS_DENIED;
+    }
+
+    // The register gets a page of its own, so the client sees nothing else.
+    //
+    if (!positionRegister_)
+    {
+        PULONG page = (PULONG)ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE, MSVAD_POOLTAG);
+        if (!page)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        RtlZeroMemory(page, PAGE_SIZE);
+        *page = dmaPosition_;
+
+        InterlockedExchangePointer((PVOID volatile*)&positionRegister_, page);
+    }
+
+    ntStatus = mapToClient(positionRegister_, PAGE_SIZE, nullptr, &registerMdl_, &registerClientAddress_);
+
+    if (NT_SUCCESS(ntStatus))
+    {
+        if (!clientProcess_)
+        {
+            clientProcess_ = PsGetCurrentProcess();
+            ObReferenceObject(clientProcess_);
+        }
+
+        PKSRTAUDIO_HWREGISTER hwRegister = (PKSRTAUDIO_HWREGISTER)propertyRequest->Value;
+
+        hwRegister->Register    = registerClientAddress_;
+        hwRegister->Width       = 32;
+        hwRegister->Numerator   = 0;
+        hwRegister->Denominator = 0;
+        hwRegister->Accuracy    = 0;
+
+        propertyRequest->ValueSize = sizeof(KSRTAUDIO_HWREGISTER);
+    }
+
+    return ntStatus;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Redirects KSPROPSETID_RtAudio pin property requests to the stream. Samples
+  expose them by adding the handler to the automation table of their
+  streaming pins.
+*/
+NTSTATUS propertyHandler_RtAudio(IN PPCPROPERTY_REQUEST propertyRequest)
+{
+    PAGED_CODE();
+
+    NTSTATUS                        ntStatus = STATUS_INVALID_DEVICE_REQUEST;
+    PCMiniportWaveCyclicStreamMSVAD stream   = (PCMiniportWaveCyclicStreamMSVAD)(PMINIPORTWAVECYCLICSTREAM)propertyRequest->MinorTarget;
+
+    if (propertyRequest->Verb & KSPROPERTY_TYPE_BASICSUPPORT)
+    {
+        return PropertyHandler_BasicSupport(propertyRequest, KSPROPERTY_TYPE_BASICSUPPORT | KSPROPERTY_TYPE_GET, VT_ILLEGAL);
+    }
+
+    if (!stream || !(propertyRequest->Verb & KSPROPERTY_TYPE_GET))
+    {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    switch (propertyRequest->PropertyItem->Id)
+    {
+        case KSPROPERTY_RTAUDIO_BUFFER:
+            ntStatus = stream->propertyHandlerRtBuffer(propertyRequest);
+            break;
+
+        case KSPROPERTY_RTAUDIO_POSITIONREGISTER:
+            ntStatus = stream->propertyHandlerRtPositionRegister(propertyRequest);
+            break;
+
+        default:
+            DPF(D_TERSE, ("[PropertyHandler_RtAudio: Invalid Device Request]"));
+    }
+
+    return ntStatus;
+}
@@ -7,15 +7,70 @@ Abstract:
 #define _MSVAD_BASEWAVE_H_
 
 #include "savedata.h"
+#include "siggen.h"
+#include "sgbuffer.h"
+#include "devclock.h"
+#include "vtime.h"
+#include "asrc.h"
+#include "posfit.h"
+#include "dmawalk.h"
+#include "seqlock.h"
 
 //=============================================================================
 // Referenced Forward
 //=============================================================================
 KDEFERRED_ROUTINE timerNotify;
 
+NTSTATUS propertyHandler_RtAudio(IN PPCPROPERTY_REQUEST PropertyRequest);
+
 class   MiniportWaveCyclicStreamMSVAD;
 using PCMiniportWaveCyclicStreamMSVAD = MiniportWaveCyclicStreamMSVAD*;
 
+//=============================================================================
+// Types
+//=============================================================================
+
+// Transfer accounting of the emulated DMA channel since the stream last
+// stopped. Client bytes are those the port wrote with CopyTo and Silence
+// (render) or read with CopyFrom (capture).
+typedef struct _DMA_TRANSFER_STATS
+{
+    ULONGLONG   ullBytesTransferred;    // Moved by the DMA engine.
+    ULONGLONG   ullClientBytes;
+    ULONGLONG   ullSilenceBytes;        // Silence the port wrote for missing data.
+    ULONG       ulLastTransfer;         // Moved by the last engine run that moved any.
+    ULONG       ulInFlight;             // Written but not played, or recorded but not read.
+    ULONG       ulUnderruns;            // The engine played unwritten data, or the port
+                                        // read unrecorded data.
+    ULONG       ulOverruns;             // The port overwrote unplayed data, or the engine
+                                        // recorded over unread data.
+} DMA_TRANSFER_STATS;
+
+using PDMA_TRANSFER_STATS = DMA_TRANSFER_STATS*;
+
+// State of the emulated DMA engine as of its last run, from which the
+// position at any later time follows.
+typedef struct _DMA_POSITION_SNAPSHOT
+{
+    ULONGLONG   ullTimeStamp;       // TimeNow of the run.
+    ULONGLONG   ullGridTime;        // See the dmaGridTime_ to dmaFrames_ members.
+    ULONGLONG   ullGridStart;
+    ULONGLONG   ullFrameBase;
+    ULONGLONG   ullFrames;
+    ULONG       ulPosition;
+    ULONG       ulPendingBytes;
+    ULONG       ulBufferSize;
+    ULONG       ulBurstBytes;
+    ULONG       ulBlockAlign;
+    ULONG       ulFrameRate;
+    CLOCK_ERROR_PARAMS ClockError;
+    POSITION_ESTIMATE  Estimate;
+    BOOLEAN     fRunning;           // The engine clock runs.
+    BOOLEAN     fMoving;            // The position moves with it.
+} DMA_POSITION_SNAPSHOT;
+
+using PDMA_POSITION_SNAPSHOT = DMA_POSITION_SNAPSHOT*;
+
 //=============================================================================
 // Classes
 //=============================================================================
@@ -47,6 +102,10 @@ public:
     NTSTATUS propertyHandlerCpuResources(IN PPCPROPERTY_REQUEST PropertyRequest);
     NTSTATUS propertyHandlerGeneric(     IN PPCPROPERTY_REQUEST PropertyRequest);
 
+    NTSTATUS enableLoopback();
+    void     getLoopbackStats(OUT PASRC_STATS stats);
+    void     getTimerStats(OUT PTIMER_WHEEL_STATS stats);
+
     // Friends
     friend class MiniportWaveCyclicStreamMSVAD;
     friend class MiniportTopologyMSVAD;
@@ -65,6 +124,8 @@ protected:
                                                  
     ULONG                maxDmaBufferSize_;     // Dma buffer size.
 
+    PAsyncRateConverter  loopback_;             // Render to capture, once enabled.
+
     // All the below members should be updated by the child classes
     //
     ULONG maxOutputStreams_; // Max stream caps
@@ -91,24 +152,81 @@ class MiniportWaveCyclicStreamMSVAD : public IMiniportWaveCyclicStream,
 protected:
     PCMiniportWaveCyclicMSVAD miniport_;                     // Miniport that created us
     BOOLEAN                   isCapture_;                    // Capture or render.
-    BOOLEAN                   is16BitSample;                 // 16- or 8-bit samples.
+    UCHAR                     silenceByte_;                  // Silence of the format, per byte.
     USHORT                    blockAlign_;                   // Block alignment of current format.
     KSSTATE                   ksState_;                      // Stop, pause, run.
     ULONG                     pinId_;                        // Pin Id.
 
-    PRKDPC                    dpc_;                          // Deferred procedure call object
-    PKTIMER                   timer_;                        // Timer object
+    PTimerWheel               timerWheel_;                   // Timers of the adapter
+    WHEEL_TIMER               timer_;                        // Timer object
                                                              
     BOOLEAN                   dmaActive_;                    // Dma currently active? 
     ULONG                     dmaPosition_;                  // Position in Dma
     PVOID                     dmaBuffer_;                    // Dma buffer pointer
+    PScatterGatherBuffer      dmaChunks_;                    // Pages of a large buffer, or nullptr if pooled.
     ULONG                     dmaBufferSize_;                // Size of dma buffer
+    ULONG                     dmaAllocatedSize_;             // Size requested from the adapter pool
     ULONG                     dmaMovementRate_;              // Rate of transfer specific to system
-    ULONGLONG                 dmaTimeStamp_;                 // Dma time elapsed 
-    ULONGLONG                 elapsedTimeCarryForward_;      // Time to carry forward in position calc.
-    ULONG                     byteDisplacementCarryForward_; // Bytes to carry forward to next calc.
+    ULONG                     dmaFrameRate_;                 // Frames per second of the format.
+    DSP_RECIPROCAL            byteRate_;                     // Bytes per second of the format.
+    ULONGLONG                 dmaTimeStamp_;                 // TimeNow of the last engine run.
+    PDeviceTimebase           timebase_;                     // Sample clock of the adapter.
+    ULONGLONG                 dmaGridTime_;                  // Timebase time of the last engine run.
+    ULONGLONG                 dmaGridStart_;                 // Grid frame at the last start, format or clock change,
+    ULONGLONG                 dmaFrameBase_;                 // and the stream frame it fell on.
+    ULONGLONG                 dmaFrames_;                    // Frames of run time since the stream stopped.
+    ULONG                     dmaBurstFrames_;               // Frames the engine moves at a time.
+    ULONG                     dmaPendingBytes_;              // Elapsed bytes short of a whole burst.
+    CLOCK_ERROR_PARAMS        clockError_;                   // Error of the device clock against run time.
+    PositionFit               positionFit_;                  // Line through the recent positions.
+    KSPIN_LOCK                dmaLock_;                      // Serializes the DMA engine.
+    DMA_POSITION_SNAPSHOT     positionSnapshot_;             // Published under positionSequence_,
+    SEQUENCE_LOCK             positionSequence_;             // written under dmaLock_.
+
+    ULONGLONG                 dmaBytesTotal_;                // Moved by the engine since the stream stopped.
+    ULONGLONG                 clientBytes_;                  // Written or read by the port since then.
+    ULONGLONG                 silenceBytes_;                 // Part of clientBytes_ written by Silence.
+    ULONG                     dmaLastTransfer_;              // Moved by the last engine run that moved any.
+    ULONG                     underruns_;
+    ULONG                     overruns_;
+    BOOLEAN                   xrun_;                         // The engine is in an underrun or overrun.
+
+    ULONG                     packetCount_;                  // Packets per buffer. 0 in byte mode.
+    ULONG                     packetSize_;                   // Bytes per packet.
+    DMA_PACKETS               packets_;                      // Packet mode progress.
+
+    PULONG                    positionRegister_;             // Position register page, if mapped.
+    PMDL                      bufferMdl_;                    // Client mapping of the DMA buffer.
+    PVOID                     bufferClientAddress_;
+    PMDL                      registerMdl_;                  // Client mapping of the position register.
+    PVOID                     registerClientAddress_;
+    PEPROCESS                 clientProcess_;                // Process the mappings belong to.
 
     CSaveData                 saveData_;                     // Object to save settings.
+    SignalGenerator           signalGenerator_;              // Source of the captured data.
+    BOOLEAN                   loopbackCapture_;              // Capture what the render stream plays instead.
+    WAVEFORMATEX              waveFormat_;                   // Format of the stream, without extension.
+
+    ULONG    bufferSizeForFormat(IN PWAVEFORMATEX wfx);
+    NTSTATUS resizeBuffer(IN ULONG bufferSize, IN ULONG blockAlign, IN UCHAR silence);
+    NTSTATUS allocateDmaMemory(IN ULONG size, OUT PVOID* buffer, OUT PScatterGatherBuffer* chunks);
+    void     freeDmaMemory(IN PVOID buffer, IN ULONG size, IN PScatterGatherBuffer chunks);
+    void     advanceDma();
+    void     advancePackets(IN ULONGLONG byteCount);
+    void     startDma();
+    void     pauseDma();
+    void     resetDma();
+    void     setDmaFormat(IN PWAVEFORMATEX wfx);
+    void     rebaseDma();
+    void     publishPosition();
+    void     readPosition(OUT PDMA_POSITION_SNAPSHOT snapshot);
+    void     transferSpan(IN PBYTE span, IN ULONG byteCount);
+    static DMA_TRANSFER_ROUTINE transferRoutine;
+    void     checkXrun();
+    void     accountClientBytes(IN ULONG byteCount, IN BOOLEAN silence);
+    void     fillSilence(_Out_writes_bytes_(byteCount) PVOID buffer, IN ULONG byteCount);
+    NTSTATUS mapToClient(IN PVOID address, IN ULONG size, IN PMDL sourceMdl, OUT PMDL* mdl, OUT PVOID* clientAddress);
+    void     unmapFromClient();
   
 public:
      MiniportWaveCyclicStreamMSVAD();
@@ -125,8 +243,24 @@ public:
         IN  PKSDATAFORMAT             DataFormat
     );
 
+    NTSTATUS setDmaBurst(IN ULONG frames);
+    NTSTATUS setCaptureSignal(IN PSIGGEN_PARAMS params);
+    NTSTATUS setClockError(IN PCLOCK_ERROR_PARAMS params);
+    NTSTATUS setLoopbackCapture(IN BOOLEAN enable);
+    NTSTATUS setPacketMode(IN ULONG packetCount);
+    NTSTATUS setEndOfStream(IN ULONGLONG packetNumber, IN ULONG byteCount);
+    void     getPacketCount(OUT PULONGLONG packetNumber, OUT PLONGLONG performanceCounter, OUT PBOOLEAN endOfStream);
+    void     getTransferStats(OUT PDMA_TRANSFER_STATS stats);
+    void     getPresentationPosition(OUT PULONGLONG frames, OUT PLONGLONG performanceCounter);
+    NTSTATUS getTimebaseOffset(OUT PLONGLONG frames);
+    NTSTATUS predictPosition(IN LONGLONG performanceCounter, OUT PULONGLONG frames, OUT PULONG bound);
+
+    NTSTATUS propertyHandlerRtBuffer(          IN PPCPROPERTY_REQUEST PropertyRequest);
+    NTSTATUS propertyHandlerRtPositionRegister(IN PPCPROPERTY_REQUEST PropertyRequest);
+
     // Friends
     friend class MiniportWaveCyclicMSVAD;
+    friend void  timerNotify(IN PKDPC Dpc, IN PVOID DeferredContext, IN PVOID SA1, IN PVOID SA2);
 };
 using PCMiniportWaveCyclicStreamMSVAD = MiniportWaveCyclicStreamMSVAD*;
 
@@ -13,6 +13,7 @@ Abstract:
 #include <msvad.h>
 #include "common.h"
 #include "hw.h"
+#include "dmapool.h"
 #include "savedata.h"
 
 #define HNS_PER_MS              10000
@@ -351,6 +352,11 @@ class AdapterCommon : public IAdapterCommon,
 
         STDMETHODIMP_(NTSTATUS) freeInstantiateWorkItem();
 
+        STDMETHODIMP_(PVOID)    allocateDmaBuffer(IN  ULONG size);
+        STDMETHODIMP_(void)     freeDmaBuffer(IN  PVOID buffer, IN  ULONG size);
+        STDMETHODIMP_(PDeviceTimebase) getTimebase()   { return timebase_; }
+        STDMETHODIMP_(PTimerWheel)     getTimerWheel() { return timerWheel_; }
+
         //=====================================================================
         // friends
 
@@ -365,6 +371,9 @@ private:
     PDEVICE_OBJECT     deviceObject_;
     DEVICE_POWER_STATE powerState_;
     PCMSVADHW          msvadhw_;             // Virtual MSVAD HW object
+    PDmaBufferPool     dmaPool_;             // Stream DMA buffers
+    PDeviceTimebase    timebase_;            // Sample clock of the streams
+    PTimerWheel        timerWheel_;          // Notification timers of the streams
     PKTIMER            instantiateTimer_;    // Timer object
     PRKDPC             instantiateDpc_;      // Deferred procedure call object
     BOOL               isInstantiated_;      // Flag indicating whether or not subdevices are exposed
@@ -432,6 +441,10 @@ AdapterCommon::~AdapterCommon()
 
     delete msvadhw_;
 
+    delete dmaPool_;
+    delete timebase_;
+    delete timerWheel_;
+
     CSaveData::destroyWorkItems();
 
     if (miniportWave_)
@@ -495,6 +508,9 @@ NTSTATUS AdapterCommon::Init(IN  PDEVICE_OBJECT deviceObject)
     isInstantiated_      = FALSE;
     isPluggedIn_         = FALSE;
     instantiateWorkItem_ = nullptr;
+    dmaPool_             = nullptr;
+    timebase_            = nullptr;
+    timerWheel_          = nullptr;
 
     // Initialize HW.
     // 
@@ -511,6 +527,46 @@ NTSTATUS AdapterCommon::Init(IN  PDEVICE_OBJECT deviceObject)
 
     CSaveData::setDeviceObject(deviceObject);   //device object is needed by CSaveData
 
+    // Preallocate the stream DMA buffers.
+    //
+    if (NT_SUCCESS(ntStatus))
+    {
+        dmaPool_ = new (NonPagedPool, MSVAD_POOLTAG) DmaBufferPool;
+        if (!dmaPool_)
+        {
+            DPF(D_TERSE, ("[Could not allocate memory for DMA buffer pool]"));
+            ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+        }
+        else
+        {
+            ntStatus = dmaPool_->init();
+        }
+    }
+
+    // Start the sample clock all streams count their frames on.
+    //
+    if (NT_SUCCESS(ntStatus))
+    {
+        timebase_ = new (NonPagedPool, MSVAD_POOLTAG) DeviceTimebase;
+        if (!timebase_)
+        {
+            DPF(D_TERSE, ("[Could not allocate memory for device timebase]"));
+            ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    // All streams run their notifications from one kernel timer.
+    //
+    if (NT_SUCCESS(ntStatus))
+    {
+        timerWheel_ = new (NonPagedPool, MSVAD_POOLTAG) TimerWheel;
+        if (!timerWheel_)
+        {
+            DPF(D_TERSE, ("[Could not allocate memory for timer wheel]"));
+            ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
     // Allocate DPC for instantiation timer.
     //
     if (NT_SUCCESS(ntStatus))
@@ -1121,6 +1177,49 @@ AdapterCommon::wavePortDriverDest()
 
 #pragma code_seg()
 
+//=============================================================================
+/*
+Routine Description:
+  Takes a stream DMA buffer from the adapter pool. The buffer must go back
+  through freeDmaBuffer with the same size.
+  Callers of allocateDmaBuffer can run at IRQL <= DISPATCH_LEVEL.
+
+Arguments:
+  size - Size in bytes of the buffer.
+*/
+STDMETHODIMP_(PVOID)
+AdapterCommon::allocateDmaBuffer(IN  ULONG size)
+{
+    DPF_ENTER(("[CAdapterCommon::allocateDmaBuffer]"));
+
+    if (!dmaPool_)
+    {
+        return nullptr;
+    }
+
+    return dmaPool_->acquire(size);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Returns a buffer from allocateDmaBuffer to the adapter pool.
+  Callers of freeDmaBuffer can run at IRQL <= DISPATCH_LEVEL.
+
+Arguments:
+  buffer - Buffer returned by allocateDmaBuffer.
+  size   - Size passed to allocateDmaBuffer.
+*/
+STDMETHODIMP_(void)
+AdapterCommon::freeDmaBuffer(IN  PVOID buffer, IN  ULONG size)
+{
+    DPF_ENTER(("[CAdapterCommon::freeDmaBuffer]"));
+
+    ASSERT(dmaPool_);
+
+    dmaPool_->release(buffer, size);
+}
+
 //=============================================================================
 /*
 Routine Description:
@@ -6,6 +6,9 @@ Abstract:
 #ifndef _MSVAD_COMMON_H_
 #define _MSVAD_COMMON_H_
 
+#include "timebase.h"
+#include "timewheel.h"
+
 //=============================================================================
 // Defines
 //=============================================================================
@@ -47,6 +50,10 @@ DECLARE_INTERFACE_(IAdapterCommon, IUnknown)
     STDMETHOD_(BOOL,           isPluggedIn)             (THIS) PURE;
     STDMETHOD_(NTSTATUS,       setInstantiateWorkItem)  (THIS_ _In_ __drv_aliasesMem PIO_WORKITEM WorkItem ) PURE;
     STDMETHOD_(NTSTATUS,       freeInstantiateWorkItem) (THIS_) PURE;
+    STDMETHOD_(PVOID,          allocateDmaBuffer)       (THIS_ IN  ULONG Size) PURE;
+    STDMETHOD_(VOID,           freeDmaBuffer)           (THIS_ IN  PVOID Buffer, IN ULONG Size) PURE;
+    STDMETHOD_(PDeviceTimebase, getTimebase)            (THIS) PURE;
+    STDMETHOD_(PTimerWheel,    getTimerWheel)           (THIS) PURE;
 };
 using PADAPTERCOMMON = IAdapterCommon*;
 
@@ -0,0 +1,143 @@
+/*
+Abstract:
+    Implementation of the MSVAD device clock error model.
+*/
+
+#pragma warning (disable : 4127)
+
+#include <msvad.h>
+#include "devclock.h"
+
+#pragma code_seg()
+//=============================================================================
+// runTime scaled by ppb parts per billion. Splitting off whole multiples of
+// 10^9 keeps the products within 64 bits for any run time.
+static ULONGLONG scalePpb(IN ULONGLONG runTime, IN ULONG ppb)
+{
+    return runTime / 1000000000 * ppb + runTime % 1000000000 * ppb / 1000000000;
+}
+
+//=============================================================================
+// Time error of the wander. The rate error is a triangle wave from -peak at
+// the start of a period to +peak at its middle, so the time error is a
+// parabola on each half period and returns to zero at the end of each
+// period. It is evaluated in milliseconds of run time.
+static LONGLONG wander(IN PCLOCK_ERROR_PARAMS params, IN ULONGLONG runTime)
+{
+    const ULONGLONG period = params->ulWanderPeriodMs;
+    const ULONGLONG phase  = runTime / 10000 % period;
+    const ULONGLONG half   = min(phase, period - phase);
+
+    // The time error in ms ppb is peak * half * (period - 2 * half) / period;
+    // dividing by 10^5 makes that 100 ns units.
+    //
+    const ULONGLONG area   = half * (period - 2 * half);
+    const ULONGLONG error  = (area / period * params->ulWanderPpb +
+                              area % period * params->ulWanderPpb / period) / 100000;
+
+    return 2 * phase < period ? -(LONGLONG)error : (LONGLONG)error;
+}
+
+//=============================================================================
+// Jitter value for one interval, uniform in -peak..peak 100 ns units.
+static LONG jitterAt(IN ULONG seed, IN ULONGLONG interval, IN LONG peak)
+{
+    ULONG x = seed ^ (ULONG)interval ^ ((ULONG)(interval >> 32) * 0x9e3779b9);
+
+    // Integer hash with good avalanche, so neighbouring intervals are
+    // unrelated.
+    //
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+
+    return (LONG)(x % (ULONG)(2 * peak + 1)) - peak;
+}
+
+//=============================================================================
+// Time error of the jitter, interpolated between independent values every
+// CLOCK_JITTER_INTERVAL. Its slope is at most 2 * peak per interval, which
+// the limit on the peak keeps below one, so the jittered time still moves
+// forward.
+static LONGLONG jitter(IN PCLOCK_ERROR_PARAMS params, IN ULONGLONG runTime)
+{
+    const LONG      peak     = (LONG)params->ulJitterUs * 10;
+    const ULONGLONG interval = runTime / CLOCK_JITTER_INTERVAL;
+    const LONGLONG  into     = (LONGLONG)(runTime % CLOCK_JITTER_INTERVAL);
+    const LONGLONG  from     = interval ? jitterAt(params->ulSeed, interval, peak) : 0;
+    const LONGLONG  to       = jitterAt(params->ulSeed, interval + 1, peak);
+
+    return from + (to - from) * into / CLOCK_JITTER_INTERVAL;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Checks clock error parameters against the limits of the model.
+  Callers of ValidateClockError can run at any IRQL.
+
+Arguments:
+  params - The parameters.
+*/
+NTSTATUS ValidateClockError(IN PCLOCK_ERROR_PARAMS params)
+{
+    ASSERT(params);
+
+    if (params->lOffsetPpb < -CLOCK_MAX_OFFSET_PPB ||
+        params->lOffsetPpb >  CLOCK_MAX_OFFSET_PPB ||
+        params->ulWanderPpb > CLOCK_MAX_WANDER_PPB ||
+        params->ulJitterUs  > CLOCK_MAX_JITTER_US)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (params->ulWanderPpb &&
+        (params->ulWanderPeriodMs < CLOCK_MIN_WANDER_PERIOD_MS ||
+         params->ulWanderPeriodMs > CLOCK_MAX_WANDER_PERIOD_MS))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Returns how far the device clock is ahead of the system clock after
+  runTime 100 ns units, in 100 ns units. The parameters must be valid.
+  Callers of ClockError can run at any IRQL.
+
+Arguments:
+  params  - The clock error.
+  runTime - System time since the clock started.
+*/
+LONGLONG ClockError(IN PCLOCK_ERROR_PARAMS params, IN ULONGLONG runTime)
+{
+    ASSERT(params);
+
+    LONGLONG error = 0;
+
+    if (params->lOffsetPpb > 0)
+    {
+        error += (LONGLONG)scalePpb(runTime, (ULONG)params->lOffsetPpb);
+    }
+    else if (params->lOffsetPpb < 0)
+    {
+        error -= (LONGLONG)scalePpb(runTime, (ULONG)-params->lOffsetPpb);
+    }
+
+    if (params->ulWanderPpb)
+    {
+        error += wander(params, runTime);
+    }
+
+    if (params->ulJitterUs)
+    {
+        error += jitter(params, runTime);
+    }
+
+    return error;
+}
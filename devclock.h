@@ -0,0 +1,82 @@
+/*
+Abstract:
+    Declaration of the MSVAD device clock error model.
+
+    A real device clock runs off a crystal that is a few ppm off its nominal
+    rate, wanders slowly with temperature and is read with some jitter. The
+    model maps the run time of a stream to the time its device clock shows,
+    so the DMA position drifts against the system clock the same way. The
+    error is a pure function of the run time and the parameters: the same
+    parameters give the same clock on every run, and every reader of the
+    position computes the same value without shared state. Everything is
+    integer arithmetic, because the model runs at DISPATCH_LEVEL.
+*/
+
+#ifndef _MSVAD_DEVCLOCK_H_
+#define _MSVAD_DEVCLOCK_H_
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+#define CLOCK_MAX_OFFSET_PPB        1000000     // 1000 ppm.
+#define CLOCK_MAX_WANDER_PPB        1000000
+#define CLOCK_MIN_WANDER_PERIOD_MS  1000
+#define CLOCK_MAX_WANDER_PERIOD_MS  86400000    // One day.
+#define CLOCK_MAX_JITTER_US         250
+#define CLOCK_JITTER_INTERVAL       10000       // 100 ns units between jitter values.
+
+//=============================================================================
+// Types
+//=============================================================================
+
+// Rates are in parts per billion of the nominal rate, positive for a clock
+// that runs fast. All zero is an exact clock.
+typedef struct _CLOCK_ERROR_PARAMS
+{
+    LONG        lOffsetPpb;         // Constant rate error.
+    ULONG       ulWanderPpb;        // Peak of the slow rate wander.
+    ULONG       ulWanderPeriodMs;   // Period of the wander.
+    ULONG       ulJitterUs;         // Peak of the time jitter.
+    ULONG       ulSeed;             // Seed of the jitter.
+} CLOCK_ERROR_PARAMS;
+
+using PCLOCK_ERROR_PARAMS = CLOCK_ERROR_PARAMS*;
+
+//=============================================================================
+// Function Prototypes
+//=============================================================================
+
+NTSTATUS ValidateClockError(IN PCLOCK_ERROR_PARAMS params);
+
+LONGLONG ClockError(IN PCLOCK_ERROR_PARAMS params, IN ULONGLONG runTime);
+
+//=============================================================================
+// Time the device clock shows after runTime 100 ns units of system time.
+// An exact clock costs one test. With valid parameters the device time
+// starts at zero and never decreases.
+FORCEINLINE ULONGLONG DeviceTime(IN PCLOCK_ERROR_PARAMS params, IN ULONGLONG runTime)
+{
+    if (!(params->lOffsetPpb | params->ulWanderPpb | params->ulJitterUs))
+    {
+        return runTime;
+    }
+
+    return runTime + ClockError(params, runTime);
+}
+
+//=============================================================================
+// Frames a device clock with params counts at frameRate frames per second
+// after runTime 100 ns units of system time. The count is exact, so frame
+// counts taken at any two times differ by exactly the frames between them.
+// Splitting the time into whole seconds and the rest keeps the products
+// within 64 bits for any adapter lifetime.
+FORCEINLINE ULONGLONG DeviceFrames(IN PCLOCK_ERROR_PARAMS params, IN ULONGLONG runTime, IN ULONG frameRate)
+{
+    const ULONGLONG deviceTime = DeviceTime(params, runTime);
+
+    return deviceTime / _100NS_UNITS_PER_SECOND * frameRate +
+           deviceTime % _100NS_UNITS_PER_SECOND * frameRate / _100NS_UNITS_PER_SECOND;
+}
+
+#endif
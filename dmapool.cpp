@@ -0,0 +1,298 @@
+/*
+Abstract:
+    Implementation of the adapter-wide pool of stream DMA buffers.
+*/
+
+#pragma warning (disable : 4127)
+
+#include <msvad.h>
+#include "dmapool.h"
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+#define NS_PER_SEC                  1000000000ULL
+
+//=============================================================================
+// Types
+//=============================================================================
+
+// Size classes, smallest first. Stream buffers are sized by format, so the
+// classes follow the common formats: mono, stereo and multichannel. Only the
+// typical stereo buffer is preallocated in numbers. Freed buffers beyond
+// ulMaxFree per class go back to nonpaged pool, so a burst of streams does
+// not pin its peak memory for the adapter lifetime.
+typedef struct _DMA_POOL_CLASS
+{
+    ULONG       ulSize;
+    ULONG       ulPreallocate;
+    ULONG       ulMaxFree;
+} DMA_POOL_CLASS;
+
+static const DMA_POOL_CLASS PoolClasses[DMA_POOL_CLASS_COUNT] =
+{
+    { DMA_BUFFER_MIN_SIZE,                     2, 16 },
+    { 8 * PAGE_SIZE,                           2, 16 },
+    { (ULONG)ROUND_TO_PAGES(DMA_BUFFER_SIZE),  4, 16 },
+    { DMA_BUFFER_POOLED_MAX_SIZE,              0, 2  }
+};
+
+//=============================================================================
+#pragma code_seg("PAGE")
+DmaBufferPool::DmaBufferPool()
+{
+    PAGED_CODE();
+
+    for (ULONG i = 0; i < DMA_POOL_CLASS_COUNT; i++)
+    {
+        InitializeSListHead(&freeLists_[i]);
+    }
+
+    ticksPerSecond_ = 0;
+    hits_           = 0;
+    misses_         = 0;
+    oversize_       = 0;
+
+    RtlZeroMemory((PVOID)poolLatency_,  sizeof(poolLatency_));
+    RtlZeroMemory((PVOID)allocLatency_, sizeof(allocLatency_));
+}
+
+//=============================================================================
+DmaBufferPool::~DmaBufferPool()
+{
+    PAGED_CODE();
+
+    DMA_POOL_STATS stats;
+    getStats(&stats);
+
+    DPF(D_TERSE, ("[DmaBufferPool::~DmaBufferPool : %d hits, %d misses, %d oversize]",
+                  stats.ulHits, stats.ulMisses, stats.ulOversize));
+    DPF(D_TERSE, ("[DmaBufferPool::~DmaBufferPool : pool p50/p90/p99 %u/%u/%u ns, allocation p50/p90/p99 %u/%u/%u ns]",
+                  stats.PoolLatency.ulP50, stats.PoolLatency.ulP90, stats.PoolLatency.ulP99,
+                  stats.AllocLatency.ulP50, stats.AllocLatency.ulP90, stats.AllocLatency.ulP99));
+
+    // All streams are gone by now, so every pooled buffer is on a free list.
+    //
+    for (ULONG i = 0; i < DMA_POOL_CLASS_COUNT; i++)
+    {
+        PSLIST_ENTRY entry = InterlockedFlushSList(&freeLists_[i]);
+
+        while (entry)
+        {
+            PSLIST_ENTRY next = entry->Next;
+            ExFreePoolWithTag(entry, MSVAD_POOLTAG);
+            entry = next;
+        }
+    }
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Preallocates the buffers of each size class. The allocation latencies are
+  recorded as well, so the statistics have a baseline to compare the pool
+  against even when every later acquire is a hit.
+  Callers of init should run at PASSIVE_LEVEL.
+*/
+NTSTATUS DmaBufferPool::init()
+{
+    PAGED_CODE();
+
+    DPF_ENTER(("[DmaBufferPool::init]"));
+
+    LARGE_INTEGER frequency;
+    KeQueryPerformanceCounter(&frequency);
+    ticksPerSecond_ = frequency.QuadPart;
+
+    for (ULONG i = 0; i < DMA_POOL_CLASS_COUNT; i++)
+    {
+        for (ULONG n = 0; n < PoolClasses[i].ulPreallocate; n++)
+        {
+            PVOID buffer = allocate(PoolClasses[i].ulSize);
+            if (!buffer)
+            {
+                DPF(D_TERSE, ("[DmaBufferPool::init : could not preallocate %d bytes]", PoolClasses[i].ulSize));
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+
+            InterlockedPushEntrySList(&freeLists_[i], (PSLIST_ENTRY)buffer);
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+#pragma code_seg()
+
+//=============================================================================
+// Returns the smallest size class that fits size, or DMA_POOL_CLASS_COUNT if
+// none does.
+ULONG DmaBufferPool::sizeClass(IN ULONG size)
+{
+    ULONG index = 0;
+
+    while (index < DMA_POOL_CLASS_COUNT && size > PoolClasses[index].ulSize)
+    {
+        index++;
+    }
+
+    return index;
+}
+
+//=============================================================================
+PVOID DmaBufferPool::allocate(IN ULONG size)
+{
+    const LONGLONG start = KeQueryPerformanceCounter(nullptr).QuadPart;
+
+    PVOID buffer = ExAllocatePoolWithTag(NonPagedPool, size, MSVAD_POOLTAG);
+    if (buffer)
+    {
+        recordLatency(allocLatency_, start);
+    }
+
+    return buffer;
+}
+
+//=============================================================================
+void DmaBufferPool::recordLatency(IN LONG volatile* histogram, IN LONGLONG startTicks)
+{
+    const LONGLONG ticks = KeQueryPerformanceCounter(nullptr).QuadPart - startTicks;
+
+    if (ticksPerSecond_ <= 0 || ticks < 0)
+    {
+        return;
+    }
+
+    ULONGLONG ns     = (ULONGLONG)ticks * NS_PER_SEC / (ULONGLONG)ticksPerSecond_;
+    ULONG     bucket = 0;
+
+    while ((ns >>= 1) && bucket < DMA_POOL_LATENCY_BUCKETS - 1)
+    {
+        bucket++;
+    }
+
+    InterlockedIncrement(&histogram[bucket]);
+}
+
+//=============================================================================
+void DmaBufferPool::latencyPercentiles(IN LONG volatile* histogram, OUT PDMA_POOL_LATENCY latency)
+{
+    static const ULONG percents[] = { 50, 90, 99 };
+    ULONG              values[3]  = { 0, 0, 0 };
+    LONG               counts[DMA_POOL_LATENCY_BUCKETS];
+    ULONGLONG          total      = 0;
+
+    for (ULONG i = 0; i < DMA_POOL_LATENCY_BUCKETS; i++)
+    {
+        counts[i] = histogram[i];
+        total    += counts[i];
+    }
+
+    for (ULONG p = 0; p < ARRAYSIZE(percents) && total; p++)
+    {
+        const ULONGLONG rank       = (total * percents[p] + 99) / 100;
+        ULONGLONG       cumulative = 0;
+        ULONG           i          = 0;
+
+        for (; i < DMA_POOL_LATENCY_BUCKETS - 1; i++)
+        {
+            cumulative += counts[i];
+            if (cumulative >= rank)
+            {
+                break;
+            }
+        }
+
+        values[p] = (i < DMA_POOL_LATENCY_BUCKETS - 1) ? (2UL << i) - 1 : MAXULONG;
+    }
+
+    latency->ulCount = (ULONG)total;
+    latency->ulP50   = values[0];
+    latency->ulP90   = values[1];
+    latency->ulP99   = values[2];
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Returns a nonpaged buffer of at least size bytes. Buffers of a pooled size
+  class come from the free list of the class, which is a single interlocked
+  pop; if the list is empty a new buffer of the class size is allocated and
+  joins the pool when it is released. Larger requests are allocated directly.
+  Callers of acquire can run at IRQL <= DISPATCH_LEVEL.
+
+Arguments:
+  size - Size in bytes of the buffer. Pass the same value to release.
+*/
+PVOID DmaBufferPool::acquire(IN ULONG size)
+{
+    const LONGLONG start = KeQueryPerformanceCounter(nullptr).QuadPart;
+    const ULONG    index = sizeClass(size);
+
+    if (index == DMA_POOL_CLASS_COUNT)
+    {
+        InterlockedIncrement(&oversize_);
+        return allocate(size);
+    }
+
+    PSLIST_ENTRY entry = InterlockedPopEntrySList(&freeLists_[index]);
+    if (entry)
+    {
+        InterlockedIncrement(&hits_);
+        recordLatency(poolLatency_, start);
+        return entry;
+    }
+
+    InterlockedIncrement(&misses_);
+    return allocate(PoolClasses[index].ulSize);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Returns a buffer from acquire to the pool.
+  Callers of release can run at IRQL <= DISPATCH_LEVEL.
+
+Arguments:
+  buffer - Buffer returned by acquire.
+  size   - Size passed to acquire.
+*/
+void DmaBufferPool::release(IN PVOID buffer, IN ULONG size)
+{
+    ASSERT(buffer);
+
+    const ULONG index = sizeClass(size);
+
+    if (index == DMA_POOL_CLASS_COUNT || QueryDepthSList(&freeLists_[index]) >= PoolClasses[index].ulMaxFree)
+    {
+        ExFreePoolWithTag(buffer, MSVAD_POOLTAG);
+        return;
+    }
+
+    // Nonpaged allocations of a page or more start on a page boundary, which
+    // also satisfies the alignment of the list entry stored in the buffer.
+    //
+    ASSERT(((ULONG_PTR)buffer & (PAGE_SIZE - 1)) == 0);
+
+    InterlockedPushEntrySList(&freeLists_[index], (PSLIST_ENTRY)buffer);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Returns the hit counts and the allocation latency percentiles of the pool.
+  PoolLatency covers acquires served from a free list, AllocLatency the
+  direct allocations a pool-less driver makes for every stream.
+  Callers of getStats can run at any IRQL.
+*/
+void DmaBufferPool::getStats(OUT PDMA_POOL_STATS stats)
+{
+    ASSERT(stats);
+
+    stats->ulHits     = hits_;
+    stats->ulMisses   = misses_;
+    stats->ulOversize = oversize_;
+
+    latencyPercentiles(poolLatency_,  &stats->PoolLatency);
+    latencyPercentiles(allocLatency_, &stats->AllocLatency);
+}
@@ -0,0 +1,87 @@
+/*
+Abstract:
+    Declaration of the adapter-wide pool of stream DMA buffers.
+
+    Streams are opened and closed far more often than the adapter, and each
+    one needs a DMA buffer of nearly the same size. The pool keeps freed
+    buffers on lock-free lists, one per size class, so that a stream open
+    usually costs one interlocked pop instead of a nonpaged pool allocation.
+*/
+
+#ifndef _MSVAD_DMAPOOL_H_
+#define _MSVAD_DMAPOOL_H_
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+#define DMA_POOL_CLASS_COUNT        4
+#define DMA_POOL_LATENCY_BUCKETS    32      // log2 of the latency in ns.
+
+//=============================================================================
+// Types
+//=============================================================================
+
+// Allocation latency percentiles, in nanoseconds. Latencies are kept in
+// power-of-two buckets, so each value is the upper bound of its bucket.
+typedef struct _DMA_POOL_LATENCY
+{
+    ULONG       ulCount;
+    ULONG       ulP50;
+    ULONG       ulP90;
+    ULONG       ulP99;
+} DMA_POOL_LATENCY;
+
+using PDMA_POOL_LATENCY = DMA_POOL_LATENCY*;
+
+typedef struct _DMA_POOL_STATS
+{
+    ULONG               ulHits;         // Served from a free list.
+    ULONG               ulMisses;       // Free list empty, allocated a new buffer.
+    ULONG               ulOversize;     // Larger than every size class.
+    DMA_POOL_LATENCY    PoolLatency;    // Acquires served from a free list.
+    DMA_POOL_LATENCY    AllocLatency;   // Direct ExAllocatePoolWithTag calls.
+} DMA_POOL_STATS;
+
+using PDMA_POOL_STATS = DMA_POOL_STATS*;
+
+//=============================================================================
+// Classes
+//=============================================================================
+
+///////////////////////////////////////////////////////////////////////////////
+// DmaBufferPool
+//   Preallocated, page-aligned DMA buffers in a few size classes. acquire()
+//   and release() can be called at IRQL <= DISPATCH_LEVEL.
+
+class DmaBufferPool
+{
+public:
+     DmaBufferPool();
+    ~DmaBufferPool();
+
+    NTSTATUS init();
+
+    PVOID    acquire(IN ULONG size);
+    void     release(IN PVOID buffer, IN ULONG size);
+    void     getStats(OUT PDMA_POOL_STATS stats);
+
+private:
+    static ULONG sizeClass(IN ULONG size);
+    static void  latencyPercentiles(IN LONG volatile* histogram, OUT PDMA_POOL_LATENCY latency);
+
+    PVOID    allocate(IN ULONG size);
+    void     recordLatency(IN LONG volatile* histogram, IN LONGLONG startTicks);
+
+    DECLSPEC_ALIGN(MEMORY_ALLOCATION_ALIGNMENT)
+    SLIST_HEADER    freeLists_[DMA_POOL_CLASS_COUNT];   // Free buffers per size class.
+    LONGLONG        ticksPerSecond_;                    // Performance counter frequency.
+    LONG            hits_;
+    LONG            misses_;
+    LONG            oversize_;
+    LONG            poolLatency_[DMA_POOL_LATENCY_BUCKETS];
+    LONG            allocLatency_[DMA_POOL_LATENCY_BUCKETS];
+};
+using PDmaBufferPool = DmaBufferPool*;
+
+#endif
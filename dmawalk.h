@@ -0,0 +1,163 @@
+/*
+Abstract:
+    Declaration of the walk of the emulated DMA engine through the cyclic
+    buffer.
+
+    The engine moves only whole bursts of the bytes that elapsed at the
+    stream rate, and hands every span it passes to the consumers of the
+    stream exactly once and in buffer order. A client that maps the buffer
+    reads the position of the engine from a register. The stream class
+    owns the timing and the locking; the walk itself is kept here, apart
+    from PortCls, so it can be tested on its own.
+*/
+
+#ifndef _MSVAD_DMAWALK_H_
+#define _MSVAD_DMAWALK_H_
+
+//=============================================================================
+// Types
+//=============================================================================
+
+// Receives a span of the cyclic buffer the engine has passed.
+typedef void DMA_TRANSFER_ROUTINE(IN PVOID context, IN PBYTE span, IN ULONG byteCount);
+
+using PDMA_TRANSFER_ROUTINE = DMA_TRANSFER_ROUTINE*;
+
+// Progress of the engine in packet mode.
+typedef struct _DMA_PACKETS
+{
+    ULONGLONG   ullNumber;              // Packets completed since the stream started.
+    LONGLONG    llQpc;                  // Performance counter when the last one completed.
+    ULONGLONG   ullEosPacket;           // Number of the last packet, or MAXULONGLONG.
+    ULONG       ulEosLength;            // Valid bytes in the last packet.
+    BOOLEAN     fEndOfStream;           // The last packet has been consumed.
+    ULONGLONG   ullLatenessTotal;       // Delay from packet boundary to delivery,
+    ULONGLONG   ullLatenessMax;         // in performance counter ticks.
+} DMA_PACKETS;
+
+using PDMA_PACKETS = DMA_PACKETS*;
+
+//=============================================================================
+// Inline Functions
+//=============================================================================
+
+//=============================================================================
+// Adds elapsedBytes to the bytes pending and returns those of them that
+// make whole bursts. The rest stays pending for the next run.
+FORCEINLINE ULONGLONG DmaWholeBursts(IN OUT PULONG pendingBytes, IN ULONGLONG elapsedBytes, IN ULONG burstBytes)
+{
+    ASSERT(burstBytes);
+
+    const ULONGLONG pending = *pendingBytes + elapsedBytes;
+
+    *pendingBytes = (ULONG)(pending % burstBytes);
+
+    return pending - *pendingBytes;
+}
+
+//=============================================================================
+// Moves position byteCount bytes through a cyclic buffer, handing the spans
+// passed to transfer in order, split where the buffer wraps. Returns the
+// new position. Without a buffer nothing moves.
+FORCEINLINE ULONG DmaWalk
+(
+    IN  PBYTE                   buffer,
+    IN  ULONG                   bufferSize,
+    IN  ULONG                   position,
+    IN  ULONGLONG               byteCount,
+    IN  PDMA_TRANSFER_ROUTINE   transfer,
+    IN  PVOID                   context
+)
+{
+    ASSERT(!bufferSize || position < bufferSize);
+
+    while (byteCount && bufferSize)
+    {
+        const ULONG span = (ULONG)min(byteCount, (ULONGLONG)(bufferSize - position));
+
+        transfer(context, buffer + position, span);
+
+        position   = (position + span) % bufferSize;
+        byteCount -= span;
+    }
+
+    return position;
+}
+
+//=============================================================================
+FORCEINLINE void DmaResetPackets(OUT PDMA_PACKETS packets)
+{
+    RtlZeroMemory(packets, sizeof(DMA_PACKETS));
+
+    packets->ullEosPacket = MAXULONGLONG;
+}
+
+//=============================================================================
+// Hands over the whole packets in byteCount, one span each, from position,
+// which is on a packet boundary. Each packet is stamped with the time the
+// engine passed its end: now less the time it takes to move the bytes
+// already past it, that is, the later packets and pendingBytes. The walk
+// stops after the last packet, of which only its valid bytes are handed
+// over, and returns TRUE if it got there.
+FORCEINLINE BOOLEAN DmaWalkPackets
+(
+    IN OUT PDMA_PACKETS             packets,
+    IN     PBYTE                    buffer,
+    IN     ULONG                    bufferSize,
+    IN OUT PULONG                   position,
+    IN     ULONG                    packetSize,
+    IN     ULONGLONG                byteCount,
+    IN     ULONG                    pendingBytes,
+    IN     LONGLONG                 now,
+    IN     LONGLONG                 frequency,
+    IN     ULONG                    bytesPerSecond,
+    IN     PDMA_TRANSFER_ROUTINE    transfer,
+    IN     PVOID                    context
+)
+{
+    ASSERT(packetSize && bufferSize % packetSize == 0 && *position % packetSize == 0);
+
+    ULONGLONG count = byteCount / packetSize;
+
+    while (count)
+    {
+        count--;
+
+        const ULONGLONG behind   = count * packetSize + pendingBytes;
+        const ULONGLONG lateness = behind * frequency / max(bytesPerSecond, 1);
+        const BOOLEAN   eos      = (packets->ullNumber == packets->ullEosPacket);
+
+        transfer(context, buffer + *position, eos ? packets->ulEosLength : packetSize);
+
+        packets->llQpc             = now - (LONGLONG)lateness;
+        packets->ullNumber        += 1;
+        packets->ullLatenessTotal += lateness;
+        packets->ullLatenessMax    = max(packets->ullLatenessMax, lateness);
+        *position                  = (*position + packetSize) % bufferSize;
+
+        if (eos)
+        {
+            packets->fEndOfStream = TRUE;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+//=============================================================================
+// Stores the engine position in the register mapped into a client, if any.
+// The barrier orders the data the engine wrote to the buffer before the
+// position, so a capture client that reads up to the register never reads
+// stale data.
+FORCEINLINE void DmaSetPositionRegister(IN PULONG positionRegister, IN ULONG position)
+{
+    if (positionRegister)
+    {
+        KeMemoryBarrier();
+
+        *(ULONG volatile*)positionRegister = position;
+    }
+}
+
+#endif
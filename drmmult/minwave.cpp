@@ -476,8 +476,8 @@ Arguments:
         // MSVAD does not have loopback capture caps and does not support
         // S/PDIF out, therefore the new MixedRights is ignored.
 
-        // MSVAD handles DrmRights per stream basis, and stops writing 
-        // the stream to disk, if CopyProtect = TRUE.
+        // MSVAD handles DrmRights per stream basis, and encrypts
+        // the stream on disk, if CopyProtect = TRUE.
     } 
 
     // Cleanup if failed
@@ -625,9 +625,9 @@ CMiniportWaveCyclicStream::SetContentId
     }
 
     // MSVAD rights each stream separately to disk. If the rights for this
-    // stream indicates that the stream is CopyProtected, stop writing to disk.
+    // stream indicates that the stream is CopyProtected, write it encrypted.
     //
-    m_SaveData.Disable(drmRights->CopyProtect);
+    m_SaveData.setEncryption(drmRights->CopyProtect);
     
     return ntStatus;
 }
@@ -636,7 +636,7 @@ Arguments:
     DPF_ENTER(("[CMiniportWaveCyclicStream::SetContentId]"));
 
     // if (drmRights.CopyProtect==TRUE)
-    // Stop writing this stream to disk
+    // Write this stream to disk in encrypted form only
     // 
     // if (drmRights.DigitalOutputDisable == TRUE)
     // Mute S/PDIF out. 
@@ -644,7 +644,7 @@ Arguments:
     //
     // To learn more about managing multiple streams, please look at MSVAD\drmmult
     //
-    m_SaveData.Disable(drmRights->CopyProtect);
+    m_SaveData.setEncryption(drmRights->CopyProtect);
     
     return STATUS_SUCCESS;
 }
@@ -0,0 +1,474 @@
+/*
+Abstract:
+    Implementation of the MSVAD sample-processing helpers.
+*/
+
+#pragma warning (disable : 4127)
+
+#include <msvad.h>
+#include "dsp.h"
+
+#ifdef MSVAD_DSP_SSE2
+#include <emmintrin.h>
+#endif
+
+#pragma code_seg()
+//=============================================================================
+static FORCEINLINE LONG magnitude(IN LONG sample)
+{
+    return (sample < 0) ? -sample : sample;
+}
+
+//=============================================================================
+// Returns sample index of buffer as a 16-bit value.
+static FORCEINLINE LONG sample16(IN PBYTE buffer, IN ULONG index, IN ULONG bitsPerSample)
+{
+    switch (bitsPerSample)
+    {
+        case 8:  return ((LONG)buffer[index] - 0x80) << 8;
+        case 16: return ((const SHORT*)buffer)[index];
+        case 24: return (SHORT)(buffer[3 * index + 1] | (buffer[3 * index + 2] << 8));
+        default: return ((const LONG*)buffer)[index] >> 16;
+    }
+}
+
+//=============================================================================
+static FORCEINLINE LONGLONG clampQ15(IN LONGLONG value)
+{
+    return max(-DSP_LEVEL_FULL_SCALE, min(value, DSP_LEVEL_FULL_SCALE));
+}
+
+#ifdef MSVAD_DSP_SSE2
+//=============================================================================
+// Adds the four signed 32-bit lanes of value to the two 64-bit lanes of sum.
+static FORCEINLINE __m128i accumulate64(IN __m128i sum, IN __m128i value)
+{
+    const __m128i sign = _mm_srai_epi32(value, 31);
+
+    sum = _mm_add_epi64(sum, _mm_unpacklo_epi32(value, sign));
+    return _mm_add_epi64(sum, _mm_unpackhi_epi32(value, sign));
+}
+
+//=============================================================================
+static FORCEINLINE LONGLONG horizontalSum64(IN __m128i sum)
+{
+    LONGLONG lanes[2];
+
+    _mm_storeu_si128((__m128i*)lanes, sum);
+    return lanes[0] + lanes[1];
+}
+#endif
+
+//=============================================================================
+/*
+Routine Description:
+  Returns the absolute peak of a block of PCM samples, normalized to
+  0..DSP_LEVEL_FULL_SCALE regardless of the sample width. All channels are
+  considered. Callers can run at any IRQL.
+
+Arguments:
+  buffer     - PCM samples.
+  byteCount  - Size of the buffer in bytes.
+  waveFormat - Format of the samples. 8, 16, 24 and 32 bit PCM are supported.
+*/
+ULONG PeakLevel
+(
+    _In_reads_bytes_(byteCount) PBYTE         buffer,
+    IN                          ULONG         byteCount,
+    IN                          PWAVEFORMATEX waveFormat
+)
+{
+    ASSERT(buffer);
+    ASSERT(waveFormat);
+
+    LONG peak = 0;
+
+    switch (waveFormat->wBitsPerSample)
+    {
+        case 8:
+        {
+            // 8-bit PCM is unsigned with the midpoint at 0x80.
+            for (ULONG i = 0; i < byteCount; i++)
+            {
+                const LONG sample = magnitude((LONG)buffer[i] - 0x80);
+                peak = max(peak, sample);
+            }
+            peak <<= 8;
+        }
+        break;
+
+        case 16:
+        {
+            const SHORT* samples = (const SHORT*)buffer;
+            const ULONG  count   = byteCount / sizeof(SHORT);
+            ULONG        i       = 0;
+
+#ifdef MSVAD_DSP_SSE2
+            // |x| is computed as max(x, 0 - x) with a saturating subtract, so
+            // -32768 folds to 32767 instead of wrapping.
+            const __m128i zero  = _mm_setzero_si128();
+            __m128i       vpeak = zero;
+
+            for (; i + 8 <= count; i += 8)
+            {
+                const __m128i x = _mm_loadu_si128((const __m128i*)(samples + i));
+                vpeak = _mm_max_epi16(vpeak, _mm_max_epi16(x, _mm_subs_epi16(zero, x)));
+            }
+
+            vpeak = _mm_max_epi16(vpeak, _mm_srli_si128(vpeak, 8));
+            vpeak = _mm_max_epi16(vpeak, _mm_srli_si128(vpeak, 4));
+            vpeak = _mm_max_epi16(vpeak, _mm_srli_si128(vpeak, 2));
+            peak  = (SHORT)_mm_cvtsi128_si32(vpeak);
+#endif
+            for (; i < count; i++)
+            {
+                peak = max(peak, magnitude((LONG)samples[i]));
+            }
+        }
+        break;
+
+        case 24:
+        {
+            // Only the most significant 16 bits of each sample matter here.
+            for (ULONG i = 0; i + 3 <= byteCount; i += 3)
+            {
+                const LONG sample = (SHORT)(buffer[i + 1] | (buffer[i + 2] << 8));
+                peak = max(peak, magnitude(sample));
+            }
+        }
+        break;
+
+        case 32:
+        {
+            const LONG*  samples = (const LONG*)buffer;
+            const ULONG  count   = byteCount / sizeof(LONG);
+
+            for (ULONG i = 0; i < count; i++)
+            {
+                peak = max(peak, magnitude(samples[i] >> 16));
+            }
+        }
+        break;
+
+        default:
+            DPF(D_VERBOSE, ("[PeakLevel: unsupported sample size %d]", waveFormat->wBitsPerSample));
+            break;
+    }
+
+    return (ULONG)min(peak, DSP_LEVEL_FULL_SCALE);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Computes the features of a block of PCM samples used to tell speech from
+  silence and noise. Each channel is compared with its own previous samples.
+
+  The spectral flatness is estimated without a transform: it equals the
+  power of the linear prediction error relative to the signal power, which
+  an order-2 predictor from the first three autocorrelation lags
+  approximates well enough for gating. Everything is integer arithmetic, so
+  callers can run at any IRQL.
+
+Arguments:
+  buffer     - PCM samples.
+  byteCount  - Size of the buffer in bytes.
+  waveFormat - Format of the samples. 8, 16, 24 and 32 bit PCM are supported.
+  features   - Receives the features.
+*/
+void VoiceFeatures
+(
+    _In_reads_bytes_(byteCount) PBYTE               buffer,
+    IN                          ULONG               byteCount,
+    IN                          PWAVEFORMATEX       waveFormat,
+    OUT                         PDSP_VOICE_FEATURES features
+)
+{
+    ASSERT(buffer);
+    ASSERT(waveFormat);
+    ASSERT(features);
+
+    const ULONG bits     = waveFormat->wBitsPerSample;
+    const ULONG channels = max(waveFormat->nChannels, 1);
+    const ULONG count    = (bits == 8 || bits == 16 || bits == 24 || bits == 32) ? byteCount / (bits / 8) : 0;
+
+    features->ulEnergy        = 0;
+    features->ulZeroCrossings = 0;
+    features->ulFlatness      = DSP_LEVEL_FULL_SCALE;
+
+    if (count <= 2 * channels)
+    {
+        return;
+    }
+
+    // Samples are halved so that a product of two can never overflow the
+    // 32-bit pair sums of the vector path.
+    LONGLONG r0        = 0;
+    LONGLONG r1        = 0;
+    LONGLONG r2        = 0;
+    ULONG    crossings = 0;
+    ULONG    i         = 2 * channels;
+
+#ifdef MSVAD_DSP_SSE2
+    if (16 == bits)
+    {
+        const SHORT*  samples = (const SHORT*)buffer;
+        const __m128i ones    = _mm_set1_epi16(1);
+        __m128i       sum0    = _mm_setzero_si128();
+        __m128i       sum1    = _mm_setzero_si128();
+        __m128i       sum2    = _mm_setzero_si128();
+        __m128i       zc      = _mm_setzero_si128();
+
+        for (; i + 8 <= count; i += 8)
+        {
+            const __m128i x  = _mm_loadu_si128((const __m128i*)(samples + i));
+            const __m128i x1 = _mm_loadu_si128((const __m128i*)(samples + i - channels));
+            const __m128i h  = _mm_srai_epi16(x, 1);
+
+            sum0 = accumulate64(sum0, _mm_madd_epi16(h, h));
+            sum1 = accumulate64(sum1, _mm_madd_epi16(h, _mm_srai_epi16(x1, 1)));
+            sum2 = accumulate64(sum2, _mm_madd_epi16(h, _mm_srai_epi16(
+                       _mm_loadu_si128((const __m128i*)(samples + i - 2 * channels)), 1)));
+
+            // The sign bit of x ^ x1 is set where the sign changes; the
+            // shift turns it into -1.
+            zc = _mm_sub_epi32(zc, _mm_madd_epi16(_mm_srai_epi16(_mm_xor_si128(x, x1), 15), ones));
+        }
+
+        r0 = horizontalSum64(sum0);
+        r1 = horizontalSum64(sum1);
+        r2 = horizontalSum64(sum2);
+
+        zc = _mm_add_epi32(zc, _mm_srli_si128(zc, 8));
+        zc = _mm_add_epi32(zc, _mm_srli_si128(zc, 4));
+        crossings = (ULONG)_mm_cvtsi128_si32(zc);
+    }
+#endif
+
+    for (; i < count; i++)
+    {
+        const LONG x  = sample16(buffer, i, bits);
+        const LONG x1 = sample16(buffer, i - channels, bits);
+        const LONG x2 = sample16(buffer, i - 2 * channels, bits);
+
+        r0 += (x >> 1) * (x >> 1);
+        r1 += (x >> 1) * (x1 >> 1);
+        r2 += (x >> 1) * (x2 >> 1);
+        crossings += ((x ^ x1) < 0);
+    }
+
+    const ULONG n = count - 2 * channels;
+
+    // The samples were halved, so the RMS is twice that of the sums.
+    features->ulEnergy        = min(2 * SquareRoot((ULONGLONG)r0 / n), DSP_LEVEL_FULL_SCALE);
+    features->ulZeroCrossings = (ULONG)min(((ULONGLONG)crossings << 15) / n, DSP_LEVEL_FULL_SCALE);
+
+    if (!r0)
+    {
+        return;
+    }
+
+    // Keep the Q15 products below in range.
+    while (r0 >= (1LL << 46))
+    {
+        r0 >>= 1;
+        r1 >>= 1;
+        r2 >>= 1;
+    }
+
+    // Levinson-Durbin recursion, order 2, with Q15 reflection coefficients.
+    const LONGLONG k1  = clampQ15((r1 << 15) / r0);
+    const LONGLONG e1  = max(r0 - ((r1 * k1) >> 15), 0);
+    const LONGLONG num = r2 - ((r1 * k1) >> 15);
+    const LONGLONG k2  = e1 ? clampQ15((num << 15) / e1) : 0;
+    const LONGLONG e2  = max(e1 - ((num * k2) >> 15), 0);
+
+    features->ulFlatness = (ULONG)min((e2 << 15) / r0, DSP_LEVEL_FULL_SCALE);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Returns the byte that, repeated, is silence in a format. Only unsigned
+  8-bit PCM has its midpoint at 0x80; signed PCM of any width and IEEE
+  float are silent at all-zero bits, and so is every other format here.
+
+Arguments:
+  waveFormat - Format of the samples.
+*/
+UCHAR SilenceByte
+(
+    IN  PWAVEFORMATEX waveFormat
+)
+{
+    ASSERT(waveFormat);
+
+    const BOOLEAN pcm = (WAVE_FORMAT_PCM == waveFormat->wFormatTag) ||
+                        (WAVE_FORMAT_EXTENSIBLE == waveFormat->wFormatTag &&
+                         IsEqualGUIDAligned(((PWAVEFORMATEXTENSIBLE)waveFormat)->SubFormat, KSDATAFORMAT_SUBTYPE_PCM));
+
+    return (pcm && 8 == waveFormat->wBitsPerSample) ? 0x80 : 0;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Fills a buffer with a silence byte. Fills that fit in the cache go
+  through it. On x64, fills of DSP_STREAMING_FILL_SIZE or more use
+  non-temporal stores, which are faster once the buffer no longer fits and
+  would evict everything else. Callers can run at any IRQL.
+
+Arguments:
+  buffer    - Buffer to fill.
+  byteCount - Size of the buffer in bytes.
+  silence   - Silence byte of the format, from SilenceByte.
+*/
+void FillSilence
+(
+    _Out_writes_bytes_(byteCount) PBYTE buffer,
+    IN                            ULONG byteCount,
+    IN                            UCHAR silence
+)
+{
+    ASSERT(buffer || !byteCount);
+
+#ifdef MSVAD_DSP_SSE2
+    if (byteCount >= DSP_STREAMING_FILL_SIZE)
+    {
+        const ULONG   head    = (ULONG)(ALIGN_UP_BY(buffer, 16) - (ULONG_PTR)buffer);
+        const __m128i pattern = _mm_set1_epi8((char)silence);
+
+        RtlFillMemory(buffer, head, silence);
+        buffer    += head;
+        byteCount -= head;
+
+        for (; byteCount >= 64; byteCount -= 64, buffer += 64)
+        {
+            _mm_stream_si128((__m128i*)buffer,        pattern);
+            _mm_stream_si128((__m128i*)(buffer + 16), pattern);
+            _mm_stream_si128((__m128i*)(buffer + 32), pattern);
+            _mm_stream_si128((__m128i*)(buffer + 48), pattern);
+        }
+
+        // Order the streaming stores before anything the caller does next,
+        // such as handing the buffer to the DMA engine.
+        //
+        _mm_sfence();
+    }
+#endif
+
+    RtlFillMemory(buffer, byteCount, silence);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Prepares a reciprocal for ReciprocalDivide. Callers of ReciprocalInit can
+  run at any IRQL.
+
+Arguments:
+  reciprocal - Receives the reciprocal.
+  divisor    - Divisor, not 0.
+*/
+void ReciprocalInit
+(
+    OUT                         PDSP_RECIPROCAL reciprocal,
+    IN                          ULONG           divisor
+)
+{
+    ASSERT(reciprocal);
+    ASSERT(divisor);
+
+    reciprocal->ulDivisor     = max(divisor, 1);
+    reciprocal->ullMultiplier = MAXULONGLONG / reciprocal->ulDivisor;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Returns the integer square root of value, rounded down. Callers of
+  SquareRoot can run at any IRQL.
+
+Arguments:
+  value - The radicand.
+*/
+ULONG SquareRoot
+(
+    IN                          ULONGLONG       value
+)
+{
+    ULONGLONG root = 0;
+    ULONGLONG bit  = 1ULL << 62;
+
+    while (bit > value)
+    {
+        bit >>= 2;
+    }
+
+    while (bit)
+    {
+        if (value >= root + bit)
+        {
+            value -= root + bit;
+            root   = (root >> 1) + bit;
+        }
+        else
+        {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+
+    return (ULONG)root;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Returns a * b / divisor, rounded down, from the full 128-bit product. A
+  quotient beyond 64 bits saturates to MAXULONGLONG. The division is done a
+  bit at a time, so it costs some 64 steps; it is meant for the occasional
+  fixed-point computation, not for every sample. Callers of MultiplyDivide
+  can run at any IRQL.
+
+Arguments:
+  a       - The multiplicand.
+  b       - The multiplier.
+  divisor - The divisor, not 0.
+*/
+ULONGLONG MultiplyDivide
+(
+    IN                          ULONGLONG       a,
+    IN                          ULONGLONG       b,
+    IN                          ULONGLONG       divisor
+)
+{
+    ASSERT(divisor);
+
+    ULONGLONG high = MultiplyHigh64(a, b);
+    ULONGLONG low  = a * b;
+
+    if (high >= divisor)
+    {
+        return MAXULONGLONG;
+    }
+
+    // The remainder builds up in high while the quotient bits shift into
+    // low from the right.
+    //
+    for (ULONG i = 0; i < 64; i++)
+    {
+        const BOOLEAN carry = (BOOLEAN)(high >> 63);
+
+        high = (high << 1) | (low >> 63);
+        low  = low << 1;
+
+        if (carry || high >= divisor)
+        {
+            high -= divisor;
+            low  |= 1;
+        }
+    }
+
+    return low;
+}
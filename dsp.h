@@ -0,0 +1,158 @@
+/*
+Abstract:
+    Declaration of the MSVAD sample-processing helpers.
+
+    These routines run on the streaming path (DISPATCH_LEVEL) and therefore
+    live in nonpaged code. On x64 the kernel preserves the XMM registers
+    across context switches, so the vector paths use SSE2 there; every other
+    architecture takes the scalar path.
+*/
+
+#ifndef _MSVAD_DSP_H_
+#define _MSVAD_DSP_H_
+
+#if defined(_M_AMD64)
+#define MSVAD_DSP_SSE2
+#endif
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+// Levels are normalized to the range of a 16-bit signed sample.
+#define DSP_LEVEL_FULL_SCALE        32767
+
+// Fills at least this large bypass the caches. Below the size of the last
+// level cache a cached fill is faster, and every stream buffer is smaller.
+#define DSP_STREAMING_FILL_SIZE     0x2000000
+
+//=============================================================================
+// Types
+//=============================================================================
+
+// Features used for voice activity detection. All are normalized to
+// 0..DSP_LEVEL_FULL_SCALE.
+typedef struct _DSP_VOICE_FEATURES
+{
+    ULONG       ulEnergy;           // RMS level.
+    ULONG       ulZeroCrossings;    // Sign changes per sample.
+    ULONG       ulFlatness;         // Spectral flatness estimate. 0 for a pure
+                                    // tone, full scale for white noise.
+} DSP_VOICE_FEATURES;
+
+using PDSP_VOICE_FEATURES = DSP_VOICE_FEATURES*;
+
+// Precomputed reciprocal of a divisor, for exact division without a divide
+// instruction on the streaming path.
+typedef struct _DSP_RECIPROCAL
+{
+    ULONGLONG   ullMultiplier;      // floor((2^64 - 1) / ulDivisor).
+    ULONG       ulDivisor;
+} DSP_RECIPROCAL;
+
+using PDSP_RECIPROCAL = DSP_RECIPROCAL*;
+
+//=============================================================================
+// Function Prototypes
+//=============================================================================
+
+ULONG PeakLevel
+(
+    _In_reads_bytes_(byteCount) PBYTE         buffer,
+    IN                          ULONG         byteCount,
+    IN                          PWAVEFORMATEX waveFormat
+);
+
+void VoiceFeatures
+(
+    _In_reads_bytes_(byteCount) PBYTE               buffer,
+    IN                          ULONG               byteCount,
+    IN                          PWAVEFORMATEX       waveFormat,
+    OUT                         PDSP_VOICE_FEATURES features
+);
+
+UCHAR SilenceByte
+(
+    IN                          PWAVEFORMATEX waveFormat
+);
+
+void FillSilence
+(
+    _Out_writes_bytes_(byteCount) PBYTE buffer,
+    IN                            ULONG byteCount,
+    IN                            UCHAR silence
+);
+
+void ReciprocalInit
+(
+    OUT                         PDSP_RECIPROCAL reciprocal,
+    IN                          ULONG           divisor
+);
+
+ULONG SquareRoot
+(
+    IN                          ULONGLONG       value
+);
+
+ULONGLONG MultiplyDivide
+(
+    IN                          ULONGLONG       a,
+    IN                          ULONGLONG       b,
+    IN                          ULONGLONG       divisor
+);
+
+//=============================================================================
+// High 64 bits of the 128-bit product of a and b.
+FORCEINLINE ULONGLONG MultiplyHigh64(IN ULONGLONG a, IN ULONGLONG b)
+{
+#if defined(_M_AMD64)
+    return UnsignedMultiplyHigh(a, b);
+#else
+    const ULONGLONG aLow   = (ULONG)a;
+    const ULONGLONG aHigh  = a >> 32;
+    const ULONGLONG bLow   = (ULONG)b;
+    const ULONGLONG bHigh  = b >> 32;
+    const ULONGLONG low    = aLow * bLow;
+    const ULONGLONG middle = aHigh * bLow + (low >> 32);
+    const ULONGLONG cross  = aLow * bHigh + (ULONG)middle;
+
+    return aHigh * bHigh + (middle >> 32) + (cross >> 32);
+#endif
+}
+
+//=============================================================================
+// value / divisor of reciprocal, exactly. The multiplication by the rounded
+// down reciprocal gives the quotient or up to two less, which the remainder
+// corrects.
+FORCEINLINE ULONGLONG ReciprocalDivide(IN PDSP_RECIPROCAL reciprocal, IN ULONGLONG value, _Out_opt_ PULONGLONG remainder)
+{
+    ULONGLONG quotient = MultiplyHigh64(value, reciprocal->ullMultiplier);
+    ULONGLONG rest     = value - quotient * reciprocal->ulDivisor;
+
+    while (rest >= reciprocal->ulDivisor)
+    {
+        quotient += 1;
+        rest     -= reciprocal->ulDivisor;
+    }
+
+    if (remainder)
+    {
+        *remainder = rest;
+    }
+
+    return quotient;
+}
+
+//=============================================================================
+// value * scale / divisor of reciprocal, rounded down, exactly for any value
+// whose result fits. Whole multiples of the divisor are scaled after the
+// division and only the rest before it, so no product exceeds 64 bits.
+FORCEINLINE ULONGLONG ReciprocalScale(IN PDSP_RECIPROCAL reciprocal, IN ULONGLONG value, IN ULONG scale)
+{
+    ULONGLONG       rest;
+    const ULONGLONG whole = ReciprocalDivide(reciprocal, value, &rest);
+
+    return whole * scale + ReciprocalDivide(reciprocal, rest * scale, nullptr);
+}
+
+#endif
@@ -48,8 +48,26 @@ DEFINE_GUIDSTRUCT("5B722BF8-F0AB-47ee-B9C8-8D61D31375A1", PID_MSVAD);
 #define CHAN_RIGHT                  1
 #define CHAN_MASTER                 (-1)
 
-// Dma Settings.
+// Dma Settings. Stream buffers hold DMA_BUFFER_DURATION_MS of audio in the
+// stream format, within DMA_BUFFER_MIN_SIZE and DMA_BUFFER_MAX_SIZE.
+// DMA_BUFFER_SIZE fits a 48 kHz 16-bit stereo stream. Buffers up to
+// DMA_BUFFER_POOLED_MAX_SIZE come from the adapter pool, larger ones are
+// built from scattered pages.
 #define DMA_BUFFER_SIZE             0x16000
+#define DMA_BUFFER_MIN_SIZE         0x4000
+#define DMA_BUFFER_POOLED_MAX_SIZE  0x100000
+#define DMA_BUFFER_MAX_SIZE         0x1000000
+#define DMA_BUFFER_DURATION_MS      400
+
+// DMA buffers start on a DMA_BUFFER_ALIGNMENT boundary and are padded to a
+// multiple of it, so vector code needs no head or tail loop. Debug builds
+// add a guard region after the buffer that catches overruns.
+#define DMA_BUFFER_ALIGNMENT        64
+#if DBG
+#define DMA_BUFFER_GUARD_SIZE       (4 * DMA_BUFFER_ALIGNMENT)
+#else
+#define DMA_BUFFER_GUARD_SIZE       0
+#endif
 
 #define KSPROPERTY_TYPE_ALL         KSPROPERTY_TYPE_BASICSUPPORT | \
                                     KSPROPERTY_TYPE_GET | \
@@ -0,0 +1,257 @@
+/*
+Abstract:
+    Implementation of the position estimator of the streams.
+*/
+
+#pragma warning (disable : 4127)
+
+#include <msvad.h>
+#include "dsp.h"
+#include "posfit.h"
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+// Residuals are clipped to 4096 frames, in 1/65536 frames, which keeps the
+// sum of their squares within 64 bits. A worse fit is no use anyway.
+#define MAX_RESIDUAL_Q16            (1LL << 28)
+
+//=============================================================================
+// value * factor / 2^32, from the 128-bit product, for a factor in 2^-48
+// units and a result in 2^-16 units.
+FORCEINLINE ULONGLONG multiplyQ32(IN ULONGLONG value, IN ULONGLONG factor)
+{
+    return (MultiplyHigh64(value, factor) << 32) | ((value * factor) >> 32);
+}
+
+#pragma code_seg()
+//=============================================================================
+PositionFit::PositionFit()
+{
+    reset();
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Drops all samples. Until enough new ones are added there is no estimate.
+*/
+void PositionFit::reset()
+{
+    first_ = 0;
+    count_ = 0;
+
+    RtlZeroMemory(&estimate_, sizeof(estimate_));
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Adds a sample and fits the line anew. The oldest sample drops out once the
+  window is full or spans more than POSITION_FIT_MAX_SPAN. A sample that
+  goes back in time or in frames starts a new line.
+
+Arguments:
+  time   - TimeNow of the sample.
+  frames - Position of the stream then.
+*/
+void PositionFit::add(IN ULONGLONG time, IN ULONGLONG frames)
+{
+    if (count_)
+    {
+        const ULONG last = (first_ + count_ - 1) % POSITION_FIT_SAMPLES;
+
+        if (time < times_[last] || frames < frames_[last])
+        {
+            reset();
+        }
+    }
+
+    while (count_ && (count_ == POSITION_FIT_SAMPLES || time - times_[first_] > POSITION_FIT_MAX_SPAN))
+    {
+        first_ = (first_ + 1) % POSITION_FIT_SAMPLES;
+        count_--;
+    }
+
+    const ULONG next = (first_ + count_) % POSITION_FIT_SAMPLES;
+
+    times_[next]  = time;
+    frames_[next] = frames;
+    count_++;
+
+    fit();
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Fits the line through the samples. Times and frames are taken relative to
+  the oldest sample, and the time span of the window keeps every sum within
+  64 bits: a time is at most 10^8, and a frame count a few million.
+*/
+void PositionFit::fit()
+{
+    const ULONG n = count_;
+
+    if (n < POSITION_FIT_MIN_SAMPLES)
+    {
+        RtlZeroMemory(&estimate_, sizeof(estimate_));
+        return;
+    }
+
+    const ULONGLONG time0   = times_[first_];
+    const ULONGLONG frames0 = frames_[first_];
+
+    ULONGLONG sumTime   = 0;
+    ULONGLONG sumFrames = 0;
+
+    for (ULONG i = 0; i < n; i++)
+    {
+        const ULONG index = (first_ + i) % POSITION_FIT_SAMPLES;
+
+        sumTime   += times_[index]  - time0;
+        sumFrames += frames_[index] - frames0;
+    }
+
+    // Time deviations are taken from the whole part of the mean time. The
+    // rest, less than 100 ns, corrects the sums.
+    //
+    const ULONGLONG centre = sumTime / n;
+    const LONGLONG  rest   = (LONGLONG)(sumTime % n);
+
+    LONGLONG sxx = 0;
+    LONGLONG sxy = 0;
+
+    for (ULONG i = 0; i < n; i++)
+    {
+        const ULONG    index = (first_ + i) % POSITION_FIT_SAMPLES;
+        const LONGLONG dx    = (LONGLONG)(times_[index] - time0 - centre);
+        const LONGLONG y     = (LONGLONG)(frames_[index] - frames0);
+
+        sxx += dx * dx;
+        sxy += dx * y;
+    }
+
+    sxx -= rest * rest / n;
+    sxy -= rest * (LONGLONG)sumFrames / n;
+
+    if (sxx <= 0)
+    {
+        RtlZeroMemory(&estimate_, sizeof(estimate_));
+        return;
+    }
+
+    // The position never goes back, so a falling line is noise and is held
+    // level instead.
+    //
+    const ULONGLONG rateQ16 = sxy > 0 ?
+                              MultiplyDivide((ULONGLONG)sxy, (ULONGLONG)_100NS_UNITS_PER_SECOND << 16, (ULONGLONG)sxx) :
+                              0;
+
+    const LONGLONG  lineQ16 = (LONGLONG)((sumFrames << 16) / n) -
+                              (LONGLONG)(rateQ16 * rest / n / _100NS_UNITS_PER_SECOND);
+
+    ULONGLONG squares = 0;
+
+    for (ULONG i = 0; i < n; i++)
+    {
+        const ULONG    index     = (first_ + i) % POSITION_FIT_SAMPLES;
+        const LONGLONG dx        = (LONGLONG)(times_[index] - time0 - centre);
+        const LONGLONG predicted = lineQ16 + (LONGLONG)rateQ16 * dx / (LONGLONG)_100NS_UNITS_PER_SECOND;
+        LONGLONG       residual  = (LONGLONG)((frames_[index] - frames0) << 16) - predicted;
+
+        residual = min(max(residual, -MAX_RESIDUAL_Q16), MAX_RESIDUAL_Q16);
+        squares += (ULONGLONG)(residual * residual);
+    }
+
+    // The residuals are clipped, so the error is below 2^28 and the shift
+    // of it into 2^-48 units below stays within 64 bits.
+    //
+    const ULONGLONG error         = SquareRoot(squares / (n - 2));
+    const ULONG     timeDeviation = max(SquareRoot((ULONGLONG)sxx), 1);
+
+    estimate_.ullTime          = time0 + centre;
+    estimate_.ullFramesQ16     = (ULONGLONG)max((LONGLONG)(frames0 << 16) + lineQ16, 0);
+    estimate_.ullRateQ16       = rateQ16;
+    estimate_.ulErrorQ16       = (ULONG)error;
+    estimate_.ulCount          = n;
+    estimate_.ullRateQ48       = (rateQ16 / _100NS_UNITS_PER_SECOND << 32) +
+                                 (rateQ16 % _100NS_UNITS_PER_SECOND << 32) / _100NS_UNITS_PER_SECOND;
+    estimate_.ullSlopeErrorQ48 = (error << 32) / timeDeviation;
+    estimate_.ulCentreErrorQ16 = SquareRoot(error * error + error * error / n);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Predicts the position of a stream from its fitted line. The bound is
+  POSITION_FIT_CONFIDENCE standard errors of the prediction, which grows
+  with the distance from the centre of the samples as the error of the
+  slope adds up. The fit caches everything that divides or takes a root,
+  so a prediction is a few multiplications. Reads only the estimate, so
+  callers can run at any IRQL on a copy of it.
+
+Arguments:
+  estimate - The fitted line.
+  time     - TimeNow to predict the position at.
+  frames   - Receives the position.
+  bound    - Receives the bound of the error, in frames, rounded up.
+
+Return Value:
+  STATUS_DEVICE_NOT_READY if there are too few samples, and
+  STATUS_INVALID_PARAMETER if time is too far from them.
+*/
+NTSTATUS PositionPredict
+(
+    IN  PPOSITION_ESTIMATE  estimate,
+    IN  ULONGLONG           time,
+    OUT PULONGLONG          frames,
+    OUT PULONG              bound
+)
+{
+    ASSERT(estimate);
+    ASSERT(frames);
+    ASSERT(bound);
+
+    if (estimate->ulCount < POSITION_FIT_MIN_SAMPLES)
+    {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    const BOOLEAN   ahead    = time >= estimate->ullTime;
+    const ULONGLONG distance = ahead ? time - estimate->ullTime : estimate->ullTime - time;
+
+    if (distance > POSITION_FIT_MAX_EXTRAPOLATION)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    const ULONGLONG deltaQ16 = multiplyQ32(distance, estimate->ullRateQ48);
+
+    ULONGLONG framesQ16;
+
+    if (ahead)
+    {
+        framesQ16 = estimate->ullFramesQ16 + deltaQ16;
+    }
+    else
+    {
+        framesQ16 = estimate->ullFramesQ16 > deltaQ16 ? estimate->ullFramesQ16 - deltaQ16 : 0;
+    }
+
+    *frames = (framesQ16 + 0x8000) >> 16;
+
+    // The standard error is the root of the summed variances of a new
+    // sample and the centre, and of the slope over the distance. The larger
+    // plus 0.4143 times the smaller of the two roots is at most 8.3% above the
+    // root of their squares, and never below it.
+    //
+    const ULONGLONG centre = estimate->ulCentreErrorQ16;
+    const ULONGLONG slope  = min(multiplyQ32(distance, estimate->ullSlopeErrorQ48), MAXULONG);
+    const ULONGLONG error  = max(centre, slope) + (min(centre, slope) * 27152 >> 16);
+
+    *bound = (ULONG)min((POSITION_FIT_CONFIDENCE * error + 0xFFFF) >> 16, MAXULONG);
+
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,99 @@
+/*
+Abstract:
+    Declaration of the position estimator of the streams.
+
+    The estimator fits a least-squares line through the positions the DMA
+    engine reached at its last runs, against the time it reached them. The
+    line predicts the position at any time near the samples, and the scatter
+    of the samples about it bounds the prediction. A client that schedules
+    against the device reads the line once instead of polling the position,
+    and the line follows the device clock however it drifts.
+
+    Everything is fixed-point, because the fit runs in the DMA engine at
+    DISPATCH_LEVEL.
+*/
+
+#ifndef _MSVAD_POSFIT_H_
+#define _MSVAD_POSFIT_H_
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+#define POSITION_FIT_SAMPLES            32
+#define POSITION_FIT_MIN_SAMPLES        3
+
+// Samples older than this, in 100 ns units, drop out of the fit. It bounds
+// the intermediate products of the fit.
+#define POSITION_FIT_MAX_SPAN           (10 * _100NS_UNITS_PER_SECOND)
+
+// Predictions further than this from the samples are refused.
+#define POSITION_FIT_MAX_EXTRAPOLATION  (3600 * _100NS_UNITS_PER_SECOND)
+
+// The bound is this many standard errors of the prediction, about 95% for
+// normally distributed errors.
+#define POSITION_FIT_CONFIDENCE         2
+
+//=============================================================================
+// Types
+//=============================================================================
+
+// The fitted line. Frames are counted as in the position snapshot, and must
+// stay below 2^48.
+typedef struct _POSITION_ESTIMATE
+{
+    ULONGLONG   ullTime;            // TimeNow at the centre of the samples.
+    ULONGLONG   ullFramesQ16;       // Fitted frames there, in 1/65536 frames.
+    ULONGLONG   ullRateQ16;         // Frames per second, in 1/65536 frames.
+    ULONG       ulErrorQ16;         // Residual standard error, in 1/65536 frames.
+    ULONG       ulCount;            // Samples in the fit. No line below the minimum.
+
+    // Cached by the fit for PositionPredict, which then only multiplies.
+    ULONGLONG   ullRateQ48;         // Frames per 100 ns, in 2^-48 frames.
+    ULONGLONG   ullSlopeErrorQ48;   // Standard error of that rate, likewise.
+    ULONG       ulCentreErrorQ16;   // Standard error of a new sample at ullTime.
+} POSITION_ESTIMATE;
+
+using PPOSITION_ESTIMATE = POSITION_ESTIMATE*;
+
+//=============================================================================
+// Classes
+//=============================================================================
+
+///////////////////////////////////////////////////////////////////////////////
+// PositionFit
+//   Rolling least-squares fit of stream frames against time. The methods can
+//   be called at IRQL <= DISPATCH_LEVEL, by one caller at a time.
+
+class PositionFit
+{
+public:
+    PositionFit();
+
+    void                reset();
+    void                add(IN ULONGLONG time, IN ULONGLONG frames);
+    PPOSITION_ESTIMATE  estimate() { return &estimate_; }
+
+private:
+    void                fit();
+
+    ULONGLONG           times_[POSITION_FIT_SAMPLES];   // Ring of samples, oldest at first_.
+    ULONGLONG           frames_[POSITION_FIT_SAMPLES];
+    ULONG               first_;
+    ULONG               count_;
+    POSITION_ESTIMATE   estimate_;
+};
+
+//=============================================================================
+// Function Prototypes
+//=============================================================================
+
+NTSTATUS PositionPredict
+(
+    IN  PPOSITION_ESTIMATE  estimate,
+    IN  ULONGLONG           time,
+    OUT PULONGLONG          frames,
+    OUT PULONG              bound
+);
+
+#endif
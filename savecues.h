@@ -0,0 +1,134 @@
+/*
+Abstract:
+    Declaration of the segment cue points of gated files.
+
+    A gated file saves only the segments of the stream around activity,
+    one after the other. At its end, a 'cue ' chunk marks where each
+    segment starts and a 'LIST' 'adtl' chunk gives its length, so editors
+    show the segments as regions. The save class collects the segments and
+    writes the chunks; their layout is kept here, apart from the file I/O,
+    so it can be tested on its own.
+*/
+
+#ifndef _MSVAD_SAVECUES_H_
+#define _MSVAD_SAVECUES_H_
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+#define CUE__TAG                    0x20657563
+#define LIST_TAG                    0x5453494C
+#define ADTL_TAG                    0x6C746461
+#define LTXT_TAG                    0x7478746C
+#define RGN__TAG                    0x206E6772
+
+//=============================================================================
+// Types
+//=============================================================================
+
+#include <pshpack1.h>
+
+// Gated files end with a 'cue ' chunk and a 'LIST' 'adtl' chunk. Each saved
+// segment gets a cue point at its first sample frame and a labeled text
+// entry, with purpose 'rgn ', giving its length in sample frames.
+typedef struct _OUTPUT_CUE_POINT
+{
+    DWORD           dwName;
+    DWORD           dwPosition;
+    DWORD           fccChunk;
+    DWORD           dwChunkStart;
+    DWORD           dwBlockStart;
+    DWORD           dwSampleOffset;
+} OUTPUT_CUE_POINT;
+
+using POUTPUT_CUE_POINT = OUTPUT_CUE_POINT*;
+
+typedef struct _OUTPUT_LABELED_TEXT
+{
+    DWORD           dwLtxt;
+    DWORD           dwLtxtLength;
+    DWORD           dwName;             // Cue point this entry belongs to.
+    DWORD           dwSampleLength;
+    DWORD           dwPurpose;
+    WORD            wCountry;
+    WORD            wLanguage;
+    WORD            wDialect;
+    WORD            wCodePage;
+} OUTPUT_LABELED_TEXT;
+
+using POUTPUT_LABELED_TEXT = OUTPUT_LABELED_TEXT*;
+
+#include <poppack.h>
+
+// A range of the file written while the gate was open.
+typedef struct _SAVE_SEGMENT
+{
+    LONGLONG        llStart;            // File offsets.
+    LONGLONG        llEnd;
+} SAVE_SEGMENT;
+
+using PSAVE_SEGMENT = SAVE_SEGMENT*;
+
+//=============================================================================
+// Inline Functions
+//=============================================================================
+
+//=============================================================================
+// Returns the size of the 'cue ' and 'LIST' chunks of segmentCount segments.
+FORCEINLINE ULONG SaveCuesSize(IN ULONG segmentCount)
+{
+    return 4 * sizeof(DWORD) +
+           sizeof(DWORD) + segmentCount * sizeof(OUTPUT_CUE_POINT) +
+           sizeof(DWORD) + segmentCount * sizeof(OUTPUT_LABELED_TEXT);
+}
+
+//=============================================================================
+// Lays out the 'cue ' and 'LIST' chunks of the segments in chunks, which
+// holds SaveCuesSize bytes and is zeroed. Segments are file offsets; the
+// cue points count sample frames from the start of the data chunk, whose
+// identifier is fccData.
+FORCEINLINE void SaveCuesBuild
+(
+    OUT PBYTE           chunks,
+    IN  PSAVE_SEGMENT   segments,
+    IN  ULONG           segmentCount,
+    IN  LONGLONG        dataStart,
+    IN  ULONG           blockAlign,
+    IN  DWORD           fccData
+)
+{
+    const ULONG cueLength  = sizeof(DWORD) + segmentCount * sizeof(OUTPUT_CUE_POINT);
+    const ULONG listLength = sizeof(DWORD) + segmentCount * sizeof(OUTPUT_LABELED_TEXT);
+
+    PDWORD header = (PDWORD)chunks;
+    *header++ = CUE__TAG;
+    *header++ = cueLength;
+    *header++ = segmentCount;
+
+    POUTPUT_CUE_POINT cue = (POUTPUT_CUE_POINT)header;
+    for (ULONG i = 0; i < segmentCount; i++)
+    {
+        cue[i].dwName         = i + 1;
+        cue[i].dwPosition     = (DWORD)((segments[i].llStart - dataStart) / blockAlign);
+        cue[i].fccChunk       = fccData;
+        cue[i].dwSampleOffset = cue[i].dwPosition;
+    }
+
+    header = (PDWORD)(cue + segmentCount);
+    *header++ = LIST_TAG;
+    *header++ = listLength;
+    *header++ = ADTL_TAG;
+
+    POUTPUT_LABELED_TEXT text = (POUTPUT_LABELED_TEXT)header;
+    for (ULONG i = 0; i < segmentCount; i++)
+    {
+        text[i].dwLtxt         = LTXT_TAG;
+        text[i].dwLtxtLength   = sizeof(OUTPUT_LABELED_TEXT) - 2 * sizeof(DWORD);
+        text[i].dwName         = i + 1;
+        text[i].dwSampleLength = (DWORD)((segments[i].llEnd - segments[i].llStart) / blockAlign);
+        text[i].dwPurpose      = RGN__TAG;
+    }
+}
+
+#endif
@@ -5,14 +5,42 @@ Abstract:
     To save the playback data to disk, this class maintains a circular data
     buffer, associated frame structures and worker items to save frames to disk.
     Each frame structure represents a portion of buffer. When that portion
-    of frame is full, a workitem is scheduled to save it to disk.
+    of frame is full, a workitem is scheduled to save it to disk. The file
+    offset of each frame is reserved when it is queued, so frames land in
+    order even when the workers run out of order.
+
+    Disk bandwidth can be capped with token buckets, one per stream and one
+    shared by the adapter. Data over budget is dropped before it takes a
+    work item, so a fast stream cannot starve the others of workers.
+
+    When a key-encryption key is configured, each file gets a key envelope,
+    and data of copy-protected streams is encrypted in the worker instead of
+    being dropped. See OUTPUT_CRYPT_HEADER.
+
+    A retention file is a fixed-size ring: the data chunk wraps and a small
+    'ring' chunk records how much has been written, so the file keeps the
+    last N seconds of the stream and never grows.
+
+    In pre-roll mode the stream is kept in a memory ring while it is quiet.
+    Once the peak level reaches the trigger level the ring is flushed ahead
+    of the live data, and recording continues until the level has stayed
+    below the trigger for the hang-over time.
+
+    With the voice gate, speech rather than level opens the gate: the RMS
+    level, zero-crossing rate and spectral flatness of each buffer are
+    checked instead of the peak. Either way, every segment saved while the
+    gate was open is marked with a cue point and region at the end of the
+    file, so readers can find speech without decoding the audio.
 */
 #pragma warning (disable : 4127)
 #pragma warning (disable : 26165)
 
 #include <msvad.h>
 #include "savedata.h"
+#include "vtime.h"
+#include "dsp.h"
 #include <ntstrsafe.h>   // This is for using RtlStringcbPrintf
+#include <bcrypt.h>
 
 //=============================================================================
 // Defines
@@ -21,6 +49,11 @@ Abstract:
 #define WAVE_TAG                    0x45564157;
 #define FMT__TAG                    0x20746D66;
 #define DATA_TAG                    0x61746164;
+#define RING_TAG                    0x676E6972
+#define AESC_TAG                    0x63736561
+
+#define CRYPT_AES128_CTR            1
+#define KEK_VALUE_NAME              L"SaveKeyEncryptionKey"
 
 #define DEFAULT_FRAME_COUNT         2
 #define DEFAULT_FRAME_SIZE          PAGE_SIZE * 4
@@ -30,10 +63,34 @@ Abstract:
 
 #define MAX_WORKER_ITEM_COUNT       15
 
+C_ASSERT(MAX_WORKER_ITEM_COUNT <= SAVE_RING_MAX_PENDING);
+
+#define DEFAULT_PREROLL_MS          0       // Pre-roll mode is off by default.
+#define DEFAULT_HANGOVER_MS         2000
+#define DEFAULT_TRIGGER_LEVEL       (DSP_LEVEL_FULL_SCALE / 100)    // About -40 dBFS.
+#define MAX_PREROLL_SIZE            (8 * 1024 * 1024)
+#define PREROLL_FRAME_NO            ((ULONG)-1)
+
+#define DEFAULT_VOICE_LEVEL         0       // Voice gating is off by default.
+                                            // About DSP_LEVEL_FULL_SCALE / 300 suits speech.
+#define DEFAULT_VOICE_MAX_ZCR       (DSP_LEVEL_FULL_SCALE * 3 / 8)
+#define DEFAULT_VOICE_MAX_FLATNESS  (DSP_LEVEL_FULL_SCALE / 2)
+#define MAX_SEGMENT_COUNT           1024
+
+#define DEFAULT_RETENTION_SEC       0       // Files are linear by default.
+#define MAX_RETENTION_SIZE          0x7FFF0000
+
+#define DEFAULT_THROTTLE_RATE       0       // Bandwidth is unlimited by default.
+#define DEFAULT_THROTTLE_POLICY     SaveThrottleDrop
+
 //=============================================================================
 // Statics
 //=============================================================================
-ULONG CSaveData::streamId_ = 0;
+ULONG               CSaveData::streamId_          = 0;
+SAVE_TOKEN_BUCKET   CSaveData::adapterBucket_     = { 0 };
+KSPIN_LOCK          CSaveData::adapterBucketLock_ = 0;
+AES_KEY_SCHEDULE    CSaveData::keyEncryptionKey_;
+BOOL                CSaveData::keyEncryptionKeySet_ = FALSE;
 
 #pragma code_seg("PAGE")
 //=============================================================================
@@ -51,8 +108,23 @@ CSaveData::CSaveData()
     framePtr_(0),
     frameUsed_(nullptr),
     filePtr_(nullptr),
+    dataStart_(0),
+    retentionSec_(DEFAULT_RETENTION_SEC),
+    encryptRequested_(FALSE),
+    encrypting_(FALSE),
+    cryptHeaderDirty_(FALSE),
+    cryptBytes_(0),
+    cryptTicks_(0),
     writeDisabled_(FALSE),
-    initialized_(FALSE)
+    initialized_(FALSE),
+    nextFileOffset_(0),
+    preRollFlushes_(0),
+    preRollMs_(0),
+    hangOverMs_(0),
+    segments_(nullptr),
+    segmentCount_(0),
+    segmentStart_(0),
+    throttlePolicy_(DEFAULT_THROTTLE_POLICY)
 {
 
     PAGED_CODE();
@@ -67,7 +139,18 @@ CSaveData::CSaveData()
     dataHeader_.dwData           = DATA_TAG;
     dataHeader_.dwDataLength     = 0;
 
+    RtlZeroMemory(&ringHeader_, sizeof(ringHeader_));
+    ringHeader_.dwRing           = RING_TAG;
+    ringHeader_.dwRingLength     = sizeof(ringHeader_) - 2 * sizeof(DWORD);
+    ringHeaderOffset_.QuadPart   = 0;
+
+    RtlZeroMemory(&cryptHeader_, sizeof(cryptHeader_));
+    cryptHeaderOffset_.QuadPart  = 0;
+
     RtlZeroMemory(&objectAttributes_, sizeof(objectAttributes_));
+    RtlZeroMemory(&gate_, sizeof(gate_));
+    RtlZeroMemory(&throttleStats_, sizeof(throttleStats_));
+    bucketReset(&streamBucket_, DEFAULT_THROTTLE_RATE, 0);
 
     streamId_++;
     initializeWorkItems(getDeviceObject());
@@ -84,14 +167,16 @@ CSaveData::~CSaveData()
     //
     if(filePtr_)
     {
-        fileHeader_.dwFileSize   = (DWORD) filePtr_->QuadPart - 2 * sizeof(DWORD);
-        dataHeader_.dwDataLength = (DWORD) filePtr_->QuadPart - sizeof(fileHeader_)
-                                 - fileHeader_.dwFormatLength - sizeof(dataHeader_);
+        dataHeader_.dwDataLength = (DWORD)(filePtr_->QuadPart - dataStart_);
 
         if (STATUS_SUCCESS == KeWaitForSingleObject(&fileSync_, Executive, KernelMode, FALSE, nullptr))
         {
             if (NT_SUCCESS(fileOpen(FALSE)))
             {
+                // The cue chunks follow the data.
+                fileWriteCues();
+
+                fileHeader_.dwFileSize = (DWORD) filePtr_->QuadPart - 2 * sizeof(DWORD);
                 fileWriteHeader();
                 fileClose();
             }
@@ -132,6 +217,27 @@ CSaveData::~CSaveData()
     {
         ExFreePoolWithTag(dataBuffer_, MSVAD_POOLTAG);
     }
+
+    if (gate_.pPreRoll)
+    {
+        ExFreePoolWithTag(gate_.pPreRoll, MSVAD_POOLTAG);
+    }
+
+    if (segments_)
+    {
+        ExFreePoolWithTag(segments_, MSVAD_POOLTAG);
+    }
+
+    if (cryptBytes_)
+    {
+        LARGE_INTEGER frequency;
+
+        KeQueryPerformanceCounter(&frequency);
+        DPF(D_TERSE, ("[CSaveData::~CSaveData : encrypted %I64u bytes in %I64u us]",
+                      cryptBytes_, cryptTicks_ * 1000000 / frequency.QuadPart));
+    }
+
+    RtlSecureZeroMemory(&fileKey_, sizeof(fileKey_));
 }
 
 //=============================================================================
@@ -154,6 +260,29 @@ void CSaveData::disable(BOOL fDisable)
     writeDisabled_ = fDisable;
 }
 
+//=============================================================================
+/*
+Routine Description:
+  Keeps the data of a copy-protected stream in encrypted form only. Once
+  encryption has started, it covers the rest of the file. Without a key
+  envelope the data of protected streams is not saved at all.
+
+Arguments:
+  fEncrypt - TRUE if the stream is copy protected.
+*/
+void CSaveData::setEncryption(BOOL fEncrypt)
+{
+    PAGED_CODE();
+    DPF_ENTER(("[CSaveData::SetEncryption %d]", fEncrypt));
+
+    encryptRequested_ = fEncrypt;
+
+    if (initialized_ && !cryptHeader_.dwCrypt)
+    {
+        disable(fEncrypt);
+    }
+}
+
 //=============================================================================
 NTSTATUS CSaveData::fileClose()
 {
@@ -177,19 +306,24 @@ NTSTATUS CSaveData::fileOpen(IN  BOOL fOverWrite)
 
     NTSTATUS        ntStatus = STATUS_SUCCESS;
     IO_STATUS_BLOCK ioStatusBlock;
+    LARGE_INTEGER   allocationSize;
 
     if( FALSE == initialized_ )
     {
         return STATUS_UNSUCCESSFUL;
     }
 
+    // A retention file gets its full size up front. The headers fit in the
+    // extra page.
+    allocationSize.QuadPart = (LONGLONG)ringHeader_.dwRingSize + PAGE_SIZE;
+
     if(!fileHandle_)
     {
         ntStatus = ZwCreateFile(&fileHandle_,
                                 GENERIC_WRITE | SYNCHRONIZE,
                                 &objectAttributes_,
                                 &ioStatusBlock,
-                                nullptr,
+                                (fOverWrite && ringHeader_.dwRingSize) ? &allocationSize : nullptr,
                                 FILE_ATTRIBUTE_NORMAL,
                                 0,
                                 fOverWrite ? FILE_OVERWRITE_IF : FILE_OPEN_IF,
@@ -208,8 +342,9 @@ NTSTATUS CSaveData::fileOpen(IN  BOOL fOverWrite)
 //=============================================================================
 NTSTATUS CSaveData::fileWrite
 (
-    _In_reads_bytes_(ulDataSize)    PBYTE   pData,
-    _In_                            ULONG   ulDataSize
+    _In_reads_bytes_(ulDataSize)    PBYTE    pData,
+    _In_                            ULONG    ulDataSize,
+    _In_                            LONGLONG fileOffset
 )
 {
     PAGED_CODE();
@@ -217,24 +352,56 @@ NTSTATUS CSaveData::fileWrite
     ASSERT(pData);
     ASSERT(filePtr_);
 
-    NTSTATUS ntStatus;
+    NTSTATUS ntStatus = STATUS_SUCCESS;
 
     if (fileHandle_)
     {
         IO_STATUS_BLOCK ioStatusBlock;
+        LARGE_INTEGER   offset;
+        ULONG           written = 0;
 
-        ntStatus = ZwWriteFile(fileHandle_, nullptr, nullptr, nullptr, &ioStatusBlock, pData, ulDataSize, filePtr_, nullptr);
-
-        if (NT_SUCCESS(ntStatus))
+        while (NT_SUCCESS(ntStatus) && written < ulDataSize)
         {
-            ASSERT(ioStatusBlock.Information == ulDataSize);
+            ULONG span = ulDataSize - written;
+
+            offset.QuadPart = fileOffset + written;
 
-            filePtr_->QuadPart += ulDataSize;
+            // A retention file wraps at the end of its data region.
+            if (ringHeader_.dwRingSize)
+            {
+                ULONG ringPos;
+
+                span            = SaveRingSpan(ringHeader_.dwRingSize, offset.QuadPart - dataStart_, span, &ringPos);
+                offset.QuadPart = dataStart_ + ringPos;
+            }
+
+            ntStatus = ZwWriteFile(fileHandle_, nullptr, nullptr, nullptr, &ioStatusBlock, pData + written, span, &offset, nullptr);
+
+            if (NT_SUCCESS(ntStatus))
+            {
+                ASSERT(ioStatusBlock.Information == span);
+
+                written += span;
+
+                // filePtr_ tracks the end of the data for the header update.
+                if (offset.QuadPart + span > filePtr_->QuadPart)
+                {
+                    filePtr_->QuadPart = offset.QuadPart + span;
+                }
+            }
         }
-        else
+
+        if (!NT_SUCCESS(ntStatus))
         {
             DPF(D_TERSE, ("[CSaveData::FileWrite : WriteFileError]"));
         }
+
+        // The ring header only counts the data up to the first write still
+        // in flight, so a reader never takes a gap for recent audio.
+        if (ringComplete(fileOffset, ulDataSize) && NT_SUCCESS(ntStatus))
+        {
+            ntStatus = fileWriteRingHeader();
+        }
     }
     else
     {
@@ -245,6 +412,120 @@ NTSTATUS CSaveData::fileWrite
     return ntStatus;
 }
 
+//=============================================================================
+/*
+Routine Description:
+  Creates the random key and nonce of the file and stores the key, wrapped
+  with the key-encryption key, in cryptHeader_. The key itself only lives
+  in fileKey_.
+*/
+NTSTATUS CSaveData::createKeyEnvelope()
+{
+    PAGED_CODE();
+
+    UCHAR key[AES_KEY_SIZE];
+
+    NTSTATUS ntStatus = BCryptGenRandom(nullptr, key, sizeof(key), BCRYPT_USE_SYSTEM_PREFERRED_RNG);
+    if (NT_SUCCESS(ntStatus))
+    {
+        ntStatus = BCryptGenRandom(nullptr, cryptHeader_.abNonce, sizeof(cryptHeader_.abNonce), BCRYPT_USE_SYSTEM_PREFERRED_RNG);
+    }
+
+    if (NT_SUCCESS(ntStatus))
+    {
+        AesExpandKey(key, &fileKey_);
+        AesWrapKey(&keyEncryptionKey_, key, cryptHeader_.abWrappedKey);
+
+        cryptHeader_.dwCrypt          = AESC_TAG;
+        cryptHeader_.dwCryptLength    = sizeof(cryptHeader_) - 2 * sizeof(DWORD);
+        cryptHeader_.dwAlgorithm      = CRYPT_AES128_CTR;
+        cryptHeader_.ullEncryptedFrom = MAXULONGLONG;
+    }
+    else
+    {
+        DPF(D_TERSE, ("[CSaveData::CreateKeyEnvelope : no random key]"));
+    }
+
+    RtlSecureZeroMemory(key, sizeof(key));
+
+    return ntStatus;
+}
+
+//=============================================================================
+NTSTATUS CSaveData::fileWriteCryptHeader()
+{
+    PAGED_CODE();
+
+    IO_STATUS_BLOCK ioStatusBlock;
+
+    NTSTATUS ntStatus = ZwWriteFile(fileHandle_, nullptr, nullptr, nullptr,
+                                    &ioStatusBlock,
+                                    &cryptHeader_,
+                                    sizeof(cryptHeader_),
+                                    &cryptHeaderOffset_,
+                                    nullptr);
+    if (!NT_SUCCESS(ntStatus))
+    {
+        DPF(D_TERSE, ("[CSaveData::FileWriteCryptHeader : Write Crypt Header Error]"));
+    }
+
+    return ntStatus;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Appends the 'cue ' and 'LIST' 'adtl' chunks describing the saved segments
+  at the end of the data, and moves filePtr_ past them. Positions wrap in
+  a retention file, so it gets no cue points.
+*/
+NTSTATUS CSaveData::fileWriteCues()
+{
+    PAGED_CODE();
+
+    if (!segmentCount_ || ringHeader_.dwRingSize || !waveFormat_ || !waveFormat_->nBlockAlign)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    const ULONG size = SaveCuesSize(segmentCount_);
+
+    // Chunks start at even offsets.
+    const ULONG pad = (ULONG)(filePtr_->QuadPart & 1);
+
+    PBYTE chunks = (PBYTE)ExAllocatePoolWithTag(PagedPool, pad + size, MSVAD_POOLTAG);
+    if (!chunks)
+    {
+        DPF(D_TERSE, ("[Could not allocate memory for cue points]"));
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(chunks, pad + size);
+
+    SaveCuesBuild(chunks + pad, segments_, segmentCount_, dataStart_, waveFormat_->nBlockAlign, dataHeader_.dwData);
+
+    IO_STATUS_BLOCK ioStatusBlock;
+
+    NTSTATUS ntStatus = ZwWriteFile(fileHandle_, nullptr, nullptr, nullptr,
+                                    &ioStatusBlock,
+                                    chunks,
+                                    pad + size,
+                                    filePtr_,
+                                    nullptr);
+    if (NT_SUCCESS(ntStatus))
+    {
+        filePtr_->QuadPart += pad + size;
+    }
+    else
+    {
+        DPF(D_TERSE, ("[CSaveData::FileWriteCues : Write Cue Error]"));
+    }
+
+    ExFreePoolWithTag(chunks, MSVAD_POOLTAG);
+
+    return ntStatus;
+}
+
 //=============================================================================
 NTSTATUS CSaveData::fileWriteHeader()
 {
@@ -288,6 +569,24 @@ NTSTATUS CSaveData::fileWriteHeader()
 
         filePtr_->QuadPart += fileHeader_.dwFormatLength;
 
+        if (ringHeader_.dwRingSize)
+        {
+            ringHeaderOffset_.QuadPart = filePtr_->QuadPart;
+
+            ntStatus = fileWriteRingHeader();
+
+            filePtr_->QuadPart += sizeof(ringHeader_);
+        }
+
+        if (cryptHeader_.dwCrypt)
+        {
+            cryptHeaderOffset_.QuadPart = filePtr_->QuadPart;
+
+            ntStatus = fileWriteCryptHeader();
+
+            filePtr_->QuadPart += sizeof(cryptHeader_);
+        }
+
         ntStatus = ZwWriteFile(fileHandle_, nullptr, nullptr, nullptr,
                                 &ioStatusBlock,
                                 &dataHeader_,
@@ -309,6 +608,65 @@ NTSTATUS CSaveData::fileWriteHeader()
 
     return ntStatus;
 }
+
+//=============================================================================
+/*
+Routine Description:
+  Records that a frame queued for a retention file is done with, written
+  or not, and moves the head of the ring header over the frames completed
+  without a gap. A frame that failed still counts, so the header does not
+  stop at it for good; that part of the ring keeps its older data. Called
+  under fileSync_.
+
+Arguments:
+  fileOffset - File offset the frame was queued at.
+  ulDataSize - Size of the frame.
+
+Return Value:
+  TRUE if the ring header has to be written again.
+*/
+BOOL CSaveData::ringComplete
+(
+    _In_                            LONGLONG fileOffset,
+    _In_                            ULONG    ulDataSize
+)
+{
+    PAGED_CODE();
+
+    if (!ringHeader_.dwRingSize ||
+        !SaveRingComplete(&ringHead_, fileOffset - dataStart_, ulDataSize))
+    {
+        return FALSE;
+    }
+
+    ringHeader_.ullBytesWritten = ringHead_.ullHead;
+
+    return TRUE;
+}
+
+//=============================================================================
+NTSTATUS CSaveData::fileWriteRingHeader()
+{
+    PAGED_CODE();
+
+    ASSERT(fileHandle_);
+
+    IO_STATUS_BLOCK ioStatusBlock;
+    LARGE_INTEGER   offset = ringHeaderOffset_;
+
+    NTSTATUS ntStatus = ZwWriteFile(fileHandle_, nullptr, nullptr, nullptr,
+                                    &ioStatusBlock,
+                                    &ringHeader_,
+                                    sizeof(ringHeader_),
+                                    &offset,
+                                    nullptr);
+    if (!NT_SUCCESS(ntStatus))
+    {
+        DPF(D_TERSE, ("[CSaveData::FileWriteRingHeader : Write Ring Header Error]"));
+    }
+
+    return ntStatus;
+}
 NTSTATUS CSaveData::setDeviceObject(IN  PDEVICE_OBJECT deviceObject)
 {
     PAGED_CODE();
@@ -318,6 +676,63 @@ NTSTATUS CSaveData::setDeviceObject(IN  PDEVICE_OBJECT deviceObject)
     NTSTATUS ntStatus = STATUS_SUCCESS;
     
     deviceObject_ = deviceObject;
+    KeInitializeSpinLock(&adapterBucketLock_);
+
+    return ntStatus;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Reads the key-encryption key of the adapter, a 16-byte REG_BINARY value
+  named SaveKeyEncryptionKey under the service key. Without it, files get
+  no key envelope and copy-protected streams are not saved.
+
+Arguments:
+  registryPath - Service key of the driver, as passed to DriverEntry.
+*/
+NTSTATUS CSaveData::loadKeyEncryptionKey(IN PUNICODE_STRING registryPath)
+{
+    PAGED_CODE();
+    ASSERT(registryPath);
+
+    OBJECT_ATTRIBUTES  attributes;
+    HANDLE             key;
+    UNICODE_STRING     valueName = RTL_CONSTANT_STRING(KEK_VALUE_NAME);
+    DECLSPEC_ALIGN(8)  UCHAR buffer[FIELD_OFFSET(KEY_VALUE_PARTIAL_INFORMATION, Data) + AES_KEY_SIZE];
+    ULONG              resultLength;
+
+    InitializeObjectAttributes(&attributes, registryPath, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, nullptr, nullptr);
+
+    NTSTATUS ntStatus = ZwOpenKey(&key, KEY_QUERY_VALUE, &attributes);
+    if (NT_SUCCESS(ntStatus))
+    {
+        ntStatus = ZwQueryValueKey(key, &valueName, KeyValuePartialInformation, buffer, sizeof(buffer), &resultLength);
+        ZwClose(key);
+    }
+
+    if (NT_SUCCESS(ntStatus))
+    {
+        PKEY_VALUE_PARTIAL_INFORMATION info = (PKEY_VALUE_PARTIAL_INFORMATION)buffer;
+
+        if (REG_BINARY == info->Type && AES_KEY_SIZE == info->DataLength)
+        {
+            AesExpandKey(info->Data, &keyEncryptionKey_);
+            keyEncryptionKeySet_ = TRUE;
+        }
+        else
+        {
+            ntStatus = STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    RtlSecureZeroMemory(buffer, sizeof(buffer));
+
+    if (!NT_SUCCESS(ntStatus))
+    {
+        DPF(D_VERBOSE, ("[CSaveData::LoadKeyEncryptionKey : no key, protected streams are not saved]"));
+    }
+
     return ntStatus;
 }
 
@@ -423,6 +838,31 @@ NTSTATUS CSaveData::initialize()
         filePtr_ = (PLARGE_INTEGER)(((PBYTE) frameUsed_) + frameCount_ * sizeof(BOOL));
         RtlZeroMemory(frameUsed_, frameCount_ * sizeof(BOOL) + sizeof(LARGE_INTEGER));
 
+        // Size the retention ring, if any, before the header is written.
+        if (retentionSec_ && waveFormat_ && waveFormat_->nBlockAlign)
+        {
+            // The frames in flight must fit the ring, or one written late
+            // could overwrite newer audio a lap ahead of it.
+            const ULONGLONG ringSize = max((ULONGLONG)waveFormat_->nAvgBytesPerSec * retentionSec_,
+                                           (ULONGLONG)MAX_WORKER_ITEM_COUNT * frameSize_);
+
+            ringHeader_.dwRingSize  = (ULONG)min(ringSize, MAX_RETENTION_SIZE);
+            ringHeader_.dwRingSize -= ringHeader_.dwRingSize % waveFormat_->nBlockAlign;
+        }
+
+        // Copy-protected audio can only be kept if the file has a key
+        // envelope.
+        if (keyEncryptionKeySet_)
+        {
+            createKeyEnvelope();
+        }
+
+        if (encryptRequested_ && !cryptHeader_.dwCrypt)
+        {
+            DPF(D_TERSE, ("[CSaveData::Initialize : cannot encrypt, stream not saved]"));
+            writeDisabled_ = TRUE;
+        }
+
         // Create data file.
         InitializeObjectAttributes(&objectAttributes_, &fileName_, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, nullptr, nullptr);
 
@@ -445,6 +885,23 @@ NTSTATUS CSaveData::initialize()
         }
     }
 
+    if (NT_SUCCESS(ntStatus))
+    {
+        dataStart_      = filePtr_->QuadPart;
+        nextFileOffset_ = dataStart_;
+        SaveRingReset(&ringHead_);
+
+        if (DEFAULT_PREROLL_MS)
+        {
+            ntStatus = setPreRoll(DEFAULT_PREROLL_MS, DEFAULT_HANGOVER_MS, DEFAULT_TRIGGER_LEVEL);
+        }
+
+        if (NT_SUCCESS(ntStatus) && DEFAULT_VOICE_LEVEL)
+        {
+            ntStatus = setVoiceGate(DEFAULT_VOICE_LEVEL, DEFAULT_VOICE_MAX_ZCR, DEFAULT_VOICE_MAX_FLATNESS, DEFAULT_HANGOVER_MS);
+        }
+    }
+
     return ntStatus;
 }
 
@@ -514,12 +971,47 @@ VOID saveFrameWorkerCallback(PDEVICE_OBJECT deviceObject, IN  PVOID  context)
 
         if (STATUS_SUCCESS == KeWaitForSingleObject(&saveData->fileSync_, Executive, KernelMode, FALSE, nullptr))
         {
+            if (pParam->fEncrypt)
+            {
+                LARGE_INTEGER start = KeQueryPerformanceCounter(nullptr);
+
+                AesCtrXor(&saveData->fileKey_,
+                          saveData->cryptHeader_.abNonce,
+                          pParam->liFileOffset.QuadPart - saveData->dataStart_,
+                          pParam->pData,
+                          pParam->ulDataSize);
+
+                saveData->cryptTicks_ += KeQueryPerformanceCounter(nullptr).QuadPart - start.QuadPart;
+                saveData->cryptBytes_ += pParam->ulDataSize;
+            }
+
             if (NT_SUCCESS(saveData->fileOpen(FALSE)))
             { 
-                saveData->fileWrite(pParam->pData, pParam->ulDataSize);
+                saveData->fileWrite(pParam->pData, pParam->ulDataSize, pParam->liFileOffset.QuadPart);
+
+                // Readers must learn where the ciphertext starts even if the
+                // file is never closed properly.
+                if (InterlockedExchange(&saveData->cryptHeaderDirty_, FALSE))
+                {
+                    saveData->fileWriteCryptHeader();
+                }
+
                 saveData->fileClose();
             }
-            InterlockedExchange( (LONG *)&(saveData->frameUsed_[pParam->ulFrameNo]), FALSE );
+            else
+            {
+                // The frame is lost, but the ring head must not wait for it.
+                saveData->ringComplete(pParam->liFileOffset.QuadPart, pParam->ulDataSize);
+            }
+
+            if (PREROLL_FRAME_NO == pParam->ulFrameNo)
+            {
+                InterlockedDecrement(&saveData->preRollFlushes_);
+            }
+            else
+            {
+                InterlockedExchange( (LONG *)&(saveData->frameUsed_[pParam->ulFrameNo]), FALSE );
+            }
 
             KeReleaseMutex( &saveData->fileSync_, FALSE );
         }
@@ -568,9 +1060,187 @@ NTSTATUS CSaveData::setDataFormat(IN PKSDATAFORMAT dataFormat)
             ntStatus = STATUS_INSUFFICIENT_RESOURCES;
         }
     }
+
+    // The pre-roll ring and hang-over are sized in bytes, so resize them for
+    // the new format.
+    if (NT_SUCCESS(ntStatus) && (preRollMs_ || gate_.fVoice))
+    {
+        ntStatus = setPreRoll(preRollMs_, hangOverMs_, gate_.ulTriggerLevel);
+    }
+
+    return ntStatus;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Turns the data file into a fixed-size retention file that keeps the last
+  retentionSec seconds of the stream. See OUTPUT_RING_HEADER for the file
+  layout. The file layout is fixed when the file is created, so this must be
+  called before initialize().
+
+Arguments:
+  retentionSec - Length of the ring in seconds. 0 writes a linear file.
+*/
+NTSTATUS CSaveData::setRetention(IN ULONG retentionSec)
+{
+    PAGED_CODE();
+    DPF_ENTER(("[CSaveData::SetRetention %lu s]", retentionSec));
+
+    if (initialized_)
+    {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    retentionSec_ = retentionSec;
+
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Limits the disk bandwidth of this stream. Data over budget is dropped, a
+  whole write at a time, and the file continues with the next write that
+  fits. Call this while the stream is stopped.
+
+Arguments:
+  bytesPerSec - Sustained rate. 0 removes the limit.
+  burstBytes  - Bytes that may be written at once after an idle period.
+  policy      - SaveThrottleSkipSilence additionally skips silent data while
+                the stream or the adapter is being throttled, leaving the
+                budget for audio that matters.
+*/
+NTSTATUS CSaveData::setThrottle(IN ULONG bytesPerSec, IN ULONG burstBytes, IN SAVE_THROTTLE_POLICY policy)
+{
+    PAGED_CODE();
+    DPF_ENTER(("[CSaveData::SetThrottle %lu B/s]", bytesPerSec));
+
+    if (SaveThrottleDrop != policy && SaveThrottleSkipSilence != policy)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    throttlePolicy_ = policy;
+    bucketReset(&streamBucket_, bytesPerSec, burstBytes);
+
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Configures pre-roll mode. While quiet, the last preRollMs milliseconds of
+  the stream are kept in memory only. When the peak level reaches
+  triggerLevel, that audio is written ahead of the live data, and writing
+  stops again after hangOverMs milliseconds below the trigger level.
+  Call this while the stream is stopped.
+
+Arguments:
+  preRollMs    - Length of the pre-roll in milliseconds. 0 disables pre-roll
+                 mode and saves everything.
+  hangOverMs   - Quiet time after which writing stops.
+  triggerLevel - Peak level, 0..DSP_LEVEL_FULL_SCALE, that starts writing.
+*/
+NTSTATUS CSaveData::setPreRoll(IN ULONG preRollMs, IN ULONG hangOverMs, IN ULONG triggerLevel)
+{
+    PAGED_CODE();
+    DPF_ENTER(("[CSaveData::SetPreRoll %lu ms]", preRollMs));
+
+    NTSTATUS ntStatus = STATUS_SUCCESS;
+
+    // A pending flush still reads from the ring.
+    if (preRollFlushes_)
+    {
+        return STATUS_DEVICE_BUSY;
+    }
+
+    if (gate_.pPreRoll)
+    {
+        ExFreePoolWithTag(gate_.pPreRoll, MSVAD_POOLTAG);
+        gate_.pPreRoll = nullptr;
+    }
+
+    SaveGateReset(&gate_);
+
+    preRollMs_             = preRollMs;
+    hangOverMs_            = hangOverMs;
+    gate_.ulTriggerLevel   = triggerLevel;
+    gate_.ulPreRollSize    = 0;
+    gate_.ulHangOverBytes  = 0;
+
+    if (waveFormat_)
+    {
+        gate_.ulHangOverBytes = (ULONG)min((ULONGLONG)waveFormat_->nAvgBytesPerSec * hangOverMs_ / 1000, MAXULONG);
+    }
+
+    if ((preRollMs_ || gate_.fVoice) && !segments_)
+    {
+        segments_ = (PSAVE_SEGMENT)ExAllocatePoolWithTag(NonPagedPool, MAX_SEGMENT_COUNT * sizeof(SAVE_SEGMENT), MSVAD_POOLTAG);
+        if (!segments_)
+        {
+            DPF(D_TERSE, ("[Could not allocate memory for segments, no cue points]"));
+        }
+    }
+
+    if (preRollMs_ && waveFormat_ && waveFormat_->nBlockAlign)
+    {
+        const ULONGLONG preRollBytes = (ULONGLONG)waveFormat_->nAvgBytesPerSec * preRollMs_ / 1000;
+
+        gate_.ulPreRollSize  = (ULONG)min(preRollBytes, MAX_PREROLL_SIZE);
+        gate_.ulPreRollSize -= gate_.ulPreRollSize % waveFormat_->nBlockAlign;
+
+        if (gate_.ulPreRollSize)
+        {
+            gate_.pPreRoll = (PBYTE)ExAllocatePoolWithTag(NonPagedPool, gate_.ulPreRollSize, MSVAD_POOLTAG);
+            if (!gate_.pPreRoll)
+            {
+                DPF(D_TERSE, ("[Could not allocate memory for pre-roll]"));
+                gate_.ulPreRollSize = 0;
+                ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+            }
+        }
+    }
+
     return ntStatus;
 }
 
+//=============================================================================
+/*
+Routine Description:
+  Saves only the segments of the stream that contain speech. A buffer
+  counts as speech when its RMS level reaches voiceLevel and it is neither
+  too noisy (zero-crossing rate above maxZeroCrossings) nor too flat
+  (spectral flatness above maxFlatness). Pre-roll mode, if enabled, keeps
+  working with speech as its trigger. Call this while the stream is
+  stopped.
+
+Arguments:
+  voiceLevel       - RMS level, 0..DSP_LEVEL_FULL_SCALE. 0 disables the
+                     voice gate.
+  maxZeroCrossings - Sign changes per sample, 0..DSP_LEVEL_FULL_SCALE.
+  maxFlatness      - Spectral flatness, 0..DSP_LEVEL_FULL_SCALE.
+  hangOverMs       - Time without speech after which writing stops. This is
+                     the same hang-over as that of pre-roll mode.
+*/
+NTSTATUS CSaveData::setVoiceGate(IN ULONG voiceLevel, IN ULONG maxZeroCrossings, IN ULONG maxFlatness, IN ULONG hangOverMs)
+{
+    PAGED_CODE();
+    DPF_ENTER(("[CSaveData::SetVoiceGate %lu]", voiceLevel));
+
+    if (preRollFlushes_)
+    {
+        return STATUS_DEVICE_BUSY;
+    }
+
+    gate_.fVoice                  = (0 != voiceLevel);
+    gate_.ulVoiceLevel            = voiceLevel;
+    gate_.ulVoiceMaxZeroCrossings = maxZeroCrossings;
+    gate_.ulVoiceMaxFlatness      = maxFlatness;
+
+    return setPreRoll(preRollMs_, hangOverMs, gate_.ulTriggerLevel);
+}
+
 //=============================================================================
 void
 CSaveData::readData
@@ -589,19 +1259,226 @@ CSaveData::readData
 
 //=============================================================================
 #pragma code_seg()
+/*
+Routine Description:
+  Starts a segment when the activity gate opens, and when it closes, saves
+  what has been written since and records the segment. When the gate
+  opens the current frame is empty, so the segment, pre-roll included,
+  starts at the next reserved offset.
+*/
+void CSaveData::gateEdge(IN PVOID context, IN BOOL open)
+{
+    PCSaveData saveData = (PCSaveData)context;
+
+    if (open)
+    {
+        saveData->segmentStart_ = saveData->nextFileOffset_;
+    }
+    else
+    {
+        saveData->savePartialFrame();
+        saveData->segmentClose();
+    }
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Queues a span of the pre-roll ring to be written ahead of the live data.
+  The ring is not written again until these work items have completed.
+*/
+BOOL CSaveData::gateFlush(IN PVOID context, IN PBYTE span, IN ULONG byteCount)
+{
+    return ((PCSaveData)context)->queueSave(PREROLL_FRAME_NO, span, byteCount);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Limits the disk bandwidth of all streams together. Each write must fit
+  both the stream and the adapter budget.
+
+Arguments:
+  bytesPerSec - Sustained rate. 0 removes the limit.
+  burstBytes  - Bytes that may be written at once after an idle period.
+*/
+NTSTATUS CSaveData::setAdapterThrottle(IN ULONG bytesPerSec, IN ULONG burstBytes)
+{
+    DPF_ENTER(("[CSaveData::SetAdapterThrottle %lu B/s]", bytesPerSec));
+
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&adapterBucketLock_, &oldIrql);
+    bucketReset(&adapterBucket_, bytesPerSec, burstBytes);
+    KeReleaseSpinLock(&adapterBucketLock_, oldIrql);
+
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Returns the throttle counters of this stream together with those of the
+  adapter-wide throttle.
+
+Arguments:
+  stats - Receives the counters.
+*/
+void CSaveData::getThrottleStats(OUT PSAVE_THROTTLE_STATS stats)
+{
+    ASSERT(stats);
+
+    KIRQL oldIrql;
+
+    *stats = throttleStats_;
+    stats->ulStreamEngageCount  = streamBucket_.ulEngageCount;
+    stats->ullStreamLastEngaged = streamBucket_.ullLastEngaged;
+
+    KeAcquireSpinLock(&adapterBucketLock_, &oldIrql);
+    stats->ulAdapterEngageCount  = adapterBucket_.ulEngageCount;
+    stats->ullAdapterLastEngaged = adapterBucket_.ullLastEngaged;
+    KeReleaseSpinLock(&adapterBucketLock_, oldIrql);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Empties the engagement history of a bucket and refills it with a new
+  rate. The burst is at least one frame, or nothing would ever fit.
+*/
+void CSaveData::bucketReset(IN PSAVE_TOKEN_BUCKET bucket, IN ULONG bytesPerSec, IN ULONG burstBytes)
+{
+    SaveBucketReset(bucket, bytesPerSec, max(burstBytes, DEFAULT_FRAME_SIZE), TimeNow(nullptr));
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Applies the stream and adapter bandwidth budgets to a write. See
+  SaveThrottleAdmit.
+
+Return Value:
+  FALSE if the data must not be written.
+*/
+BOOL CSaveData::throttleAdmit(IN PBYTE data, IN ULONG dataSize)
+{
+    return SaveThrottleAdmit(&streamBucket_,
+                             &adapterBucket_,
+                             &adapterBucketLock_,
+                             throttlePolicy_,
+                             data,
+                             dataSize,
+                             waveFormat_,
+                             TimeNow(nullptr),
+                             &throttleStats_);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Queues a work item that writes ulDataSize bytes at the next free file
+  offset.
+
+Return Value:
+  FALSE if the data is over the bandwidth budget or no work item was
+  available, and the data was not queued.
+*/
+BOOL CSaveData::queueSave(IN ULONG frameNo, IN PBYTE data, IN ULONG dataSize)
+{
+    if (!throttleAdmit(data, dataSize))
+    {
+        DPF(D_BLAB, ("[CSaveData::QueueSave : over bandwidth budget]"));
+        return FALSE;
+    }
+
+    PSAVEWORKER_PARAM pParam = getNewWorkItem();
+    if (!pParam)
+    {
+        DPF(D_BLAB, ("[CSaveData::QueueSave : no free work item]"));
+        return FALSE;
+    }
+
+    pParam->pSaveData             = this;
+    pParam->ulFrameNo             = frameNo;
+    pParam->ulDataSize            = dataSize;
+    pParam->pData                 = data;
+    pParam->liFileOffset.QuadPart = nextFileOffset_;
+
+    if (encryptRequested_ && !encrypting_ && cryptHeader_.dwCrypt)
+    {
+        encrypting_                    = TRUE;
+        cryptHeader_.ullEncryptedFrom  = nextFileOffset_ - dataStart_;
+        InterlockedExchange(&cryptHeaderDirty_, TRUE);
+    }
+    pParam->fEncrypt              = encrypting_;
+
+    nextFileOffset_ += dataSize;
+
+    if (PREROLL_FRAME_NO == frameNo)
+    {
+        InterlockedIncrement(&preRollFlushes_);
+    }
+
+    KeResetEvent(&pParam->EventDone);
+    IoQueueWorkItem(pParam->WorkItem, saveFrameWorkerCallback, CriticalWorkQueue, (PVOID)pParam);
+
+    return TRUE;
+}
+
+//=============================================================================
 void CSaveData::saveFrame(IN ULONG frameNo, IN ULONG dataSize)
 {
     DPF_ENTER(("[CSaveData::SaveFrame]"));
 
-    PSAVEWORKER_PARAM pParam = getNewWorkItem();
-    if (pParam)
+    if (!queueSave(frameNo, dataBuffer_ + frameNo * frameSize_, dataSize))
+    {
+        // Nobody else will release the frame.
+        InterlockedExchange( (LONG *)&(frameUsed_[frameNo]), FALSE );
+    }
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Saves the partially filled current frame and moves on to the next one, so
+  the next data written starts a new frame.
+*/
+void CSaveData::savePartialFrame()
+{
+    const ULONG frameStart = framePtr_ * frameSize_;
+
+    if (bufferPtr_ > frameStart)
     {
-        pParam->pSaveData  = this;
-        pParam->ulFrameNo  = frameNo;
-        pParam->ulDataSize = dataSize;
-        pParam->pData      = dataBuffer_ + frameNo * frameSize_;
-        KeResetEvent(&pParam->EventDone);
-        IoQueueWorkItem(pParam->WorkItem, saveFrameWorkerCallback, CriticalWorkQueue, (PVOID)pParam);
+        InterlockedExchange( (LONG *)&(frameUsed_[framePtr_]), TRUE );
+        saveFrame(framePtr_, bufferPtr_ - frameStart);
+
+        framePtr_  = (framePtr_ + 1) % frameCount_;
+        bufferPtr_ = framePtr_ * frameSize_;
+    }
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Records the segment written since the gate opened. Segments that were
+  dropped entirely are not recorded.
+*/
+void CSaveData::segmentClose()
+{
+    if (!segments_ || nextFileOffset_ <= segmentStart_)
+    {
+        return;
+    }
+
+    if (segmentCount_ < MAX_SEGMENT_COUNT)
+    {
+        segments_[segmentCount_].llStart = segmentStart_;
+        segments_[segmentCount_].llEnd   = nextFileOffset_;
+        segmentCount_++;
+    }
+    else
+    {
+        DPF(D_VERBOSE, ("[CSaveData::SegmentClose : segment table full]"));
     }
 }
 #pragma code_seg("PAGE")
@@ -612,13 +1489,21 @@ void CSaveData::waitAllWorkItems()
     DPF_ENTER(("[CSaveData::WaitAllWorkItems]"));
 
     // Save the last partially-filled frame
-    saveFrame(framePtr_, bufferPtr_ - (framePtr_ * frameSize_));
+    savePartialFrame();
+
+    if (gate_.fOpen)
+    {
+        segmentClose();
+    }
 
     for (int i = 0; i < MAX_WORKER_ITEM_COUNT; i++)
     {
         DPF(D_VERBOSE, ("[Waiting for WorkItem] %d", i));
         KeWaitForSingleObject(&(workItems_[i].EventDone), Executive, KernelMode, FALSE, nullptr);
     }
+
+    // Audio from before the stop does not belong in the next pre-roll.
+    SaveGateReset(&gate_);
 }
 
 #pragma code_seg()
@@ -649,6 +1534,14 @@ CSaveData::writeData
         return;
     }
 
+    // In pre-roll and voice gated modes only the audio around loud passages
+    // or speech is saved.
+    if ((gate_.pPreRoll || gate_.fVoice) &&
+        !SaveGateRun(&gate_, buffer, byteCount, waveFormat_, 0 != preRollFlushes_, gateEdge, gateFlush, this))
+    {
+        return;
+    }
+
     // Check to see if this frame is available.
     KeAcquireSpinLockAtDpcLevel( &frameInUseSpinLock_ );
     if (!frameUsed_[framePtr_])
@@ -17,6 +17,12 @@ to save data to disk.
 #ifndef _MSVAD_SAVEDATA_H
 #define _MSVAD_SAVEDATA_H
 
+#include "aes.h"
+#include "savethrottle.h"
+#include "savegate.h"
+#include "savering.h"
+#include "savecues.h"
+
 //-----------------------------------------------------------------------------
 //  Forward declaration
 //-----------------------------------------------------------------------------
@@ -34,6 +40,8 @@ typedef struct _SAVEWORKER_PARAM {
     ULONG            ulFrameNo;
     ULONG            ulDataSize;
     PBYTE            pData;
+    LARGE_INTEGER    liFileOffset;
+    BOOL             fEncrypt;
     PCSaveData       pSaveData;
     KEVENT           EventDone;
 } SAVEWORKER_PARAM;
@@ -64,6 +72,44 @@ typedef struct _OUTPUT_DATA_HEADER
 
 using POUTPUT_DATA_HEADER = OUTPUT_DATA_HEADER*;
 
+// Retention files are fixed-size rings. A 'ring' chunk between the format
+// and data chunks records how far the ring has been written. The data chunk
+// holds dwRingSize bytes. Until ullBytesWritten reaches dwRingSize, the
+// audio is the first ullBytesWritten bytes of the data chunk. After that,
+// the oldest sample is at (ullBytesWritten % dwRingSize), and a reader
+// linearizes the data by copying it from there to the end and then from
+// the start up to that offset.
+typedef struct _OUTPUT_RING_HEADER
+{
+    DWORD           dwRing;
+    DWORD           dwRingLength;
+    DWORD           dwRingSize;         // Size of the data region in bytes.
+    DWORD           dwReserved;
+    ULONGLONG       ullBytesWritten;    // Total bytes written to the ring.
+} OUTPUT_RING_HEADER;
+
+using POUTPUT_RING_HEADER = OUTPUT_RING_HEADER*;
+
+// Files that may hold copy-protected audio carry an 'aesc' chunk before
+// the data chunk. From stream offset ullEncryptedFrom on, the data is
+// encrypted with AES-128 in CTR mode (dwAlgorithm 1) under a random
+// per-file key. The key is stored wrapped with the adapter's key-encryption
+// key as specified by RFC 3394. The counter block is abNonce followed by the
+// big-endian index of the 16-byte block within the stream data; in a
+// retention file the index counts the whole stream, not the ring position.
+typedef struct _OUTPUT_CRYPT_HEADER
+{
+    DWORD           dwCrypt;
+    DWORD           dwCryptLength;
+    DWORD           dwAlgorithm;
+    DWORD           dwReserved;
+    ULONGLONG       ullEncryptedFrom;   // MAXULONGLONG if nothing is encrypted.
+    UCHAR           abNonce[AES_NONCE_SIZE];
+    UCHAR           abWrappedKey[AES_WRAPPED_KEY_SIZE];
+} OUTPUT_CRYPT_HEADER;
+
+using POUTPUT_CRYPT_HEADER = OUTPUT_CRYPT_HEADER*;
+
 #include <poppack.h>
 
 //-----------------------------------------------------------------------------
@@ -97,24 +143,59 @@ protected:
     OUTPUT_FILE_HEADER          fileHeader_;
     PWAVEFORMATEX               waveFormat_;
     OUTPUT_DATA_HEADER          dataHeader_;
+    OUTPUT_RING_HEADER          ringHeader_;            // dwRingSize is 0 unless this is a retention file.
+    SAVE_RING_HEAD              ringHead_;              // Completed writes to the ring.
+    LARGE_INTEGER               ringHeaderOffset_;
     PLARGE_INTEGER              filePtr_;
+    LONGLONG                    dataStart_;             // File offset of the sample data.
+    ULONG                       retentionSec_;          // Length of the retention ring, 0 for a linear file.
+    OUTPUT_CRYPT_HEADER         cryptHeader_;           // dwCrypt is 0 unless the file has a key envelope.
+    LARGE_INTEGER               cryptHeaderOffset_;
+    AES_KEY_SCHEDULE            fileKey_;
+    BOOL                        encryptRequested_;      // The stream is copy protected.
+    BOOL                        encrypting_;            // Encrypting until the file is closed.
+    LONG                        cryptHeaderDirty_;
+    ULONGLONG                   cryptBytes_;            // Encryption cost, for the CPU budget.
+    ULONGLONG                   cryptTicks_;
 
     static PDEVICE_OBJECT       deviceObject_;
     static ULONG                streamId_;
     static PSAVEWORKER_PARAM    workItems_;
+    static SAVE_TOKEN_BUCKET    adapterBucket_;         // Budget shared by all streams.
+    static KSPIN_LOCK           adapterBucketLock_;
+    static AES_KEY_SCHEDULE     keyEncryptionKey_;
+    static BOOL                 keyEncryptionKeySet_;
+
+    SAVE_TOKEN_BUCKET           streamBucket_;          // Budget of this stream.
+    SAVE_THROTTLE_POLICY        throttlePolicy_;
+    SAVE_THROTTLE_STATS         throttleStats_;
 
     BOOL                        writeDisabled_;
 
     BOOL                        initialized_;
 
+    LONGLONG                    nextFileOffset_;        // File offset reserved for the next frame.
+
+    SAVE_GATE                   gate_;                  // Pre-roll ring and activity gate.
+    LONG                        preRollFlushes_;        // Pre-roll work items still writing.
+    ULONG                       preRollMs_;             // Pre-roll length, 0 when disabled.
+    ULONG                       hangOverMs_;            // Quiet time before recording stops.
+
+    PSAVE_SEGMENT               segments_;              // Segments saved while gated.
+    ULONG                       segmentCount_;
+    LONGLONG                    segmentStart_;          // File offset of the open segment.
+
 public:
     CSaveData();
     ~CSaveData();
 
     static void                 destroyWorkItems();
     void                        disable(BOOL fDisable);
+    void                        getThrottleStats(OUT PSAVE_THROTTLE_STATS pStats);
     static PSAVEWORKER_PARAM    getNewWorkItem();
     NTSTATUS                    initialize();
+    static NTSTATUS             loadKeyEncryptionKey(IN  PUNICODE_STRING RegistryPath);
+    static NTSTATUS             setAdapterThrottle(IN  ULONG bytesPerSec, IN  ULONG burstBytes);
     static NTSTATUS             setDeviceObject(IN  PDEVICE_OBJECT DeviceObject);
     static PDEVICE_OBJECT       getDeviceObject();
 
@@ -122,19 +203,37 @@ public:
                                          _In_                                    ULONG ulByteCount);
 
     NTSTATUS                    setDataFormat(IN  PKSDATAFORMAT       pDataFormat);
+    void                        setEncryption(IN  BOOL fEncrypt);
+    NTSTATUS                    setPreRoll(IN  ULONG preRollMs, IN  ULONG hangOverMs, IN  ULONG triggerLevel);
+    NTSTATUS                    setRetention(IN  ULONG retentionSec);
+    NTSTATUS                    setThrottle(IN  ULONG bytesPerSec, IN  ULONG burstBytes, IN  SAVE_THROTTLE_POLICY policy);
+    NTSTATUS                    setVoiceGate(IN  ULONG voiceLevel, IN  ULONG maxZeroCrossings, IN  ULONG maxFlatness, IN  ULONG hangOverMs);
     void                        waitAllWorkItems();
     void                        writeData(_In_reads_bytes_(ulByteCount)   PBYTE   pBuffer,
                                           _In_                            ULONG   ulByteCount);
 private:
     static NTSTATUS             initializeWorkItems(IN  PDEVICE_OBJECT DeviceObject);
+    static void                 bucketReset(IN  PSAVE_TOKEN_BUCKET pBucket, IN  ULONG bytesPerSec, IN  ULONG burstBytes);
 
     NTSTATUS                    fileClose(void);
     NTSTATUS                    fileOpen(IN  BOOL fOverWrite);
     NTSTATUS                    fileWrite(_In_reads_bytes_(ulDataSize) PBYTE   pData,
-                                          _In_                         ULONG   ulDataSize);
+                                          _In_                         ULONG   ulDataSize,
+                                          _In_                         LONGLONG fileOffset);
 
+    NTSTATUS                    createKeyEnvelope();
+    NTSTATUS                    fileWriteCryptHeader();
+    NTSTATUS                    fileWriteCues();
     NTSTATUS                    fileWriteHeader();
+    NTSTATUS                    fileWriteRingHeader();
+    static SAVE_GATE_EDGE_ROUTINE  gateEdge;
+    static SAVE_GATE_FLUSH_ROUTINE gateFlush;
+    BOOL                        queueSave(IN  ULONG ulFrameNo, IN  PBYTE pData, IN  ULONG ulDataSize);
+    BOOL                        ringComplete(IN  LONGLONG fileOffset, IN  ULONG ulDataSize);
+    BOOL                        throttleAdmit(IN  PBYTE pData, IN  ULONG ulDataSize);
     void                        saveFrame(IN  ULONG ulFrameNo, IN  ULONG ulDataSize);
+    void                        savePartialFrame();
+    void                        segmentClose();
     friend VOID                 saveFrameWorkerCallback(PDEVICE_OBJECT pDeviceObject, IN  PVOID  Context);
 };
 
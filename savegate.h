@@ -0,0 +1,196 @@
+/*
+Abstract:
+    Declaration of the activity gate of the save path.
+
+    In pre-roll and voice gated modes only the audio around loud passages
+    or speech is saved. While the gate is closed the stream is kept in a
+    memory ring, the pre-roll. When a buffer is active the gate opens, the
+    ring is handed over ahead of the live data, oldest first, and the gate
+    stays open until the stream has been idle for the hang-over. The save
+    class owns the ring and does the writing; the gate itself is kept here,
+    apart from the file I/O, so it can be tested on its own.
+*/
+
+#ifndef _MSVAD_SAVEGATE_H_
+#define _MSVAD_SAVEGATE_H_
+
+#include "dsp.h"
+
+//=============================================================================
+// Types
+//=============================================================================
+
+// Receives a span of the pre-roll to write ahead of the live data. Returns
+// FALSE if the span could not be queued.
+typedef BOOL SAVE_GATE_FLUSH_ROUTINE(IN PVOID context, IN PBYTE span, IN ULONG byteCount);
+
+using PSAVE_GATE_FLUSH_ROUTINE = SAVE_GATE_FLUSH_ROUTINE*;
+
+// Told when the gate opens, before the pre-roll is flushed, and when it
+// closes, after the last active buffer.
+typedef void SAVE_GATE_EDGE_ROUTINE(IN PVOID context, IN BOOL open);
+
+using PSAVE_GATE_EDGE_ROUTINE = SAVE_GATE_EDGE_ROUTINE*;
+
+typedef struct _SAVE_GATE
+{
+    PBYTE       pPreRoll;               // Ring of the most recent idle audio, or nullptr.
+    ULONG       ulPreRollSize;
+    ULONG       ulPreRollPtr;           // Write position in the ring.
+    ULONG       ulPreRollFill;          // Valid bytes in the ring.
+    ULONG       ulTriggerLevel;         // Peak level that opens the gate.
+    BOOL        fVoice;                 // Voice activity, not the peak level, opens the gate.
+    ULONG       ulVoiceLevel;           // Minimum RMS level of speech.
+    ULONG       ulVoiceMaxZeroCrossings;
+    ULONG       ulVoiceMaxFlatness;
+    ULONG       ulHangOverBytes;        // Idle bytes after which the gate closes.
+    ULONG       ulHangOverLeft;
+    BOOL        fOpen;                  // Recording to disk.
+} SAVE_GATE;
+
+using PSAVE_GATE = SAVE_GATE*;
+
+//=============================================================================
+// Inline Functions
+//=============================================================================
+
+//=============================================================================
+// Closes the gate and empties the pre-roll, keeping the configuration.
+FORCEINLINE void SaveGateReset(IN OUT PSAVE_GATE gate)
+{
+    gate->ulPreRollPtr   = 0;
+    gate->ulPreRollFill  = 0;
+    gate->ulHangOverLeft = 0;
+    gate->fOpen          = FALSE;
+}
+
+//=============================================================================
+// Returns TRUE if a buffer holds speech, with the voice gate, or reaches
+// the trigger level otherwise.
+FORCEINLINE BOOL SaveGateActive(IN PSAVE_GATE gate, IN PBYTE buffer, IN ULONG byteCount, IN PWAVEFORMATEX waveFormat)
+{
+    if (gate->fVoice)
+    {
+        DSP_VOICE_FEATURES features;
+
+        VoiceFeatures(buffer, byteCount, waveFormat, &features);
+
+        return features.ulEnergy        >= gate->ulVoiceLevel &&
+               features.ulZeroCrossings <= gate->ulVoiceMaxZeroCrossings &&
+               features.ulFlatness      <= gate->ulVoiceMaxFlatness;
+    }
+
+    return PeakLevel(buffer, byteCount, waveFormat) >= gate->ulTriggerLevel;
+}
+
+//=============================================================================
+// Appends a buffer to the pre-roll ring, keeping only the most recent
+// ulPreRollSize bytes.
+FORCEINLINE void SavePreRollWrite(IN OUT PSAVE_GATE gate, IN PBYTE buffer, IN ULONG byteCount)
+{
+    if (byteCount > gate->ulPreRollSize)
+    {
+        buffer   += byteCount - gate->ulPreRollSize;
+        byteCount = gate->ulPreRollSize;
+    }
+
+    const ULONG first = min(byteCount, gate->ulPreRollSize - gate->ulPreRollPtr);
+
+    RtlCopyMemory(gate->pPreRoll + gate->ulPreRollPtr, buffer, first);
+    RtlCopyMemory(gate->pPreRoll, buffer + first, byteCount - first);
+
+    gate->ulPreRollPtr  = (gate->ulPreRollPtr + byteCount) % gate->ulPreRollSize;
+    gate->ulPreRollFill = min(gate->ulPreRollFill + byteCount, gate->ulPreRollSize);
+}
+
+//=============================================================================
+// Hands the contents of the pre-roll ring to flush, oldest first, and
+// empties it. A span that cannot be queued drops the rest.
+FORCEINLINE void SavePreRollFlush(IN OUT PSAVE_GATE gate, IN PSAVE_GATE_FLUSH_ROUTINE flush, IN PVOID context)
+{
+    // Once the ring has wrapped, the oldest data starts at the write position.
+    const ULONG oldest = (gate->ulPreRollFill == gate->ulPreRollSize) ? gate->ulPreRollPtr : 0;
+    const ULONG first  = min(gate->ulPreRollFill, gate->ulPreRollSize - oldest);
+    const ULONG second = gate->ulPreRollFill - first;
+
+    if (first && !flush(context, gate->pPreRoll + oldest, first))
+    {
+        DPF(D_TERSE, ("[SavePreRollFlush : pre-roll dropped]"));
+    }
+    else if (second && !flush(context, gate->pPreRoll, second))
+    {
+        DPF(D_TERSE, ("[SavePreRollFlush : pre-roll partially dropped]"));
+    }
+
+    gate->ulPreRollPtr  = 0;
+    gate->ulPreRollFill = 0;
+}
+
+//=============================================================================
+// Runs the gate on a buffer. An active buffer opens the gate, which flushes
+// the pre-roll ahead of it, and restarts the hang-over; idle buffers use it
+// up, and the one that exhausts it closes the gate. While closed, buffers
+// go to the pre-roll, unless ringBusy says an earlier flush is still being
+// written from it. Returns TRUE if the buffer is to be written to disk,
+// after any pre-roll. Called at DISPATCH_LEVEL.
+FORCEINLINE BOOL SaveGateRun
+(
+    IN OUT PSAVE_GATE               gate,
+    IN     PBYTE                    buffer,
+    IN     ULONG                    byteCount,
+    IN     PWAVEFORMATEX            waveFormat,
+    IN     BOOL                     ringBusy,
+    IN     PSAVE_GATE_EDGE_ROUTINE  edge,
+    IN     PSAVE_GATE_FLUSH_ROUTINE flush,
+    IN     PVOID                    context
+)
+{
+    if (SaveGateActive(gate, buffer, byteCount, waveFormat))
+    {
+        gate->ulHangOverLeft = gate->ulHangOverBytes;
+
+        if (!gate->fOpen)
+        {
+            DPF(D_VERBOSE, ("[SaveGateRun : triggered]"));
+            gate->fOpen = TRUE;
+
+            edge(context, TRUE);
+
+            if (gate->pPreRoll)
+            {
+                SavePreRollFlush(gate, flush, context);
+            }
+        }
+    }
+    else if (gate->fOpen)
+    {
+        if (gate->ulHangOverLeft > byteCount)
+        {
+            gate->ulHangOverLeft -= byteCount;
+        }
+        else
+        {
+            DPF(D_VERBOSE, ("[SaveGateRun : hang-over expired]"));
+            gate->ulHangOverLeft = 0;
+            gate->fOpen          = FALSE;
+
+            edge(context, FALSE);
+        }
+    }
+
+    if (!gate->fOpen && gate->pPreRoll)
+    {
+        if (ringBusy)
+        {
+            DPF(D_BLAB, ("[SaveGateRun : ring is being flushed]"));
+        }
+        else
+        {
+            SavePreRollWrite(gate, buffer, byteCount);
+        }
+    }
+
+    return gate->fOpen;
+}
+
+#endif
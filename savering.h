@@ -0,0 +1,119 @@
+/*
+Abstract:
+    Declaration of the write tracking of retention rings.
+
+    A retention file keeps the most recent audio in a data region of fixed
+    size that the stream wraps around. Frames get their stream offsets in
+    queue order, but the work items that write them may run in any order,
+    so the head recorded in the ring header only moves over writes that
+    have completed without a gap before them. The save class does the file
+    I/O; the ring arithmetic is kept here, apart from it, so it can be
+    tested on its own.
+*/
+
+#ifndef _MSVAD_SAVERING_H_
+#define _MSVAD_SAVERING_H_
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+// Ranges of writes completed ahead of the head. Each range follows a gap
+// with a write in flight, and each write is a work item, so this must be
+// at least the number of work items of the save class.
+#define SAVE_RING_MAX_PENDING       16
+
+//=============================================================================
+// Types
+//=============================================================================
+
+// Stream range written ahead of the head.
+typedef struct _SAVE_RING_RANGE
+{
+    ULONGLONG   ullStart;
+    ULONGLONG   ullEnd;
+} SAVE_RING_RANGE;
+
+typedef struct _SAVE_RING_HEAD
+{
+    ULONGLONG       ullHead;            // Stream bytes written without a gap.
+    ULONG           ulPendingCount;
+    SAVE_RING_RANGE aPending[SAVE_RING_MAX_PENDING];    // Disjoint, in no order.
+} SAVE_RING_HEAD;
+
+using PSAVE_RING_HEAD = SAVE_RING_HEAD*;
+
+//=============================================================================
+// Inline Functions
+//=============================================================================
+
+//=============================================================================
+// Returns how many of byteCount bytes at a stream offset fit before the end
+// of the ring, and where in the ring they go.
+FORCEINLINE ULONG SaveRingSpan(IN ULONG ringSize, IN ULONGLONG streamOffset, IN ULONG byteCount, OUT PULONG ringPos)
+{
+    *ringPos = (ULONG)(streamOffset % ringSize);
+
+    return min(byteCount, ringSize - *ringPos);
+}
+
+//=============================================================================
+// Starts tracking a new ring with nothing written.
+FORCEINLINE void SaveRingReset(OUT PSAVE_RING_HEAD ring)
+{
+    ring->ullHead        = 0;
+    ring->ulPendingCount = 0;
+}
+
+//=============================================================================
+// Records that byteCount bytes at a stream offset are done with. A write at
+// the head moves it on, over any writes that completed ahead of it; other
+// writes wait for the gap to be filled. Callers serialize access. Returns
+// TRUE if the head moved.
+FORCEINLINE BOOL SaveRingComplete(IN OUT PSAVE_RING_HEAD ring, IN ULONGLONG streamOffset, IN ULONG byteCount)
+{
+    const ULONGLONG head  = ring->ullHead;
+    ULONGLONG       start = streamOffset;
+    ULONGLONG       end   = streamOffset + byteCount;
+
+    // Pending writes that touch are kept as one range, so every range is
+    // preceded by a gap with a write still in flight.
+    for (ULONG i = 0; i < ring->ulPendingCount; )
+    {
+        if (ring->aPending[i].ullStart <= end && start <= ring->aPending[i].ullEnd)
+        {
+            start = min(start, ring->aPending[i].ullStart);
+            end   = max(end, ring->aPending[i].ullEnd);
+
+            ring->aPending[i] = ring->aPending[--ring->ulPendingCount];
+            i = 0;
+        }
+        else
+        {
+            i++;
+        }
+    }
+
+    if (start > head)
+    {
+        if (ring->ulPendingCount < SAVE_RING_MAX_PENDING)
+        {
+            ring->aPending[ring->ulPendingCount].ullStart = start;
+            ring->aPending[ring->ulPendingCount].ullEnd   = end;
+            ring->ulPendingCount++;
+
+            return FALSE;
+        }
+
+        // Unexpected, as each gap holds a work item. Rather than stop the
+        // head for good, give up on the gap.
+        ASSERT(ring->ulPendingCount < SAVE_RING_MAX_PENDING);
+        DPF(D_TERSE, ("[SaveRingComplete : too many writes pending, gap skipped]"));
+    }
+
+    ring->ullHead = max(head, end);
+
+    return ring->ullHead != head;
+}
+
+#endif
@@ -0,0 +1,235 @@
+/*
+Abstract:
+    Declaration of the disk bandwidth throttle of the save path.
+
+    Each stream has a token bucket, and the adapter has one shared by all
+    streams. A write is admitted only if both have the tokens for it; data
+    over budget is dropped, and with SaveThrottleSkipSilence silent data is
+    skipped as well while either bucket is throttling. The save class owns
+    the buckets and the lock of the adapter bucket; the throttle itself is
+    kept here, apart from the file I/O, so it can be tested on its own.
+*/
+
+#ifndef _MSVAD_SAVETHROTTLE_H_
+#define _MSVAD_SAVETHROTTLE_H_
+
+#include "dsp.h"
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+#define THROTTLE_SILENCE_LEVEL      (DSP_LEVEL_FULL_SCALE / 1000)   // About -60 dBFS.
+
+//=============================================================================
+// Types
+//=============================================================================
+
+// Disk bandwidth budget. Each bucket holds up to ulBurst bytes and refills
+// at ulRate bytes per second. A rate of 0 means unlimited.
+typedef struct _SAVE_TOKEN_BUCKET
+{
+    ULONG           ulRate;
+    ULONG           ulBurst;
+    LONGLONG        llTokens;           // May go negative after an oversized write.
+    ULONGLONG       ullLastRefill;      // TimeNow the tokens are accounted up to.
+    BOOL            fEngaged;           // Throttling since the bucket ran dry.
+    ULONG           ulEngageCount;      // Times the throttle has engaged.
+    ULONGLONG       ullLastEngaged;     // TimeNow of the last engagement.
+} SAVE_TOKEN_BUCKET;
+
+using PSAVE_TOKEN_BUCKET = SAVE_TOKEN_BUCKET*;
+
+// What happens to data that does not fit the budget.
+enum SAVE_THROTTLE_POLICY
+{
+    SaveThrottleDrop,                   // Drop frames that are over budget.
+    SaveThrottleSkipSilence             // Also skip silent frames while throttled.
+};
+
+typedef struct _SAVE_THROTTLE_STATS
+{
+    ULONG           ulStreamEngageCount;
+    ULONGLONG       ullStreamLastEngaged;
+    ULONG           ulAdapterEngageCount;
+    ULONGLONG       ullAdapterLastEngaged;
+    ULONG           ulFramesDropped;    // Over budget.
+    ULONGLONG       ullBytesDropped;
+    ULONG           ulFramesSkipped;    // Silent while throttled.
+    ULONGLONG       ullBytesSkipped;
+} SAVE_THROTTLE_STATS;
+
+using PSAVE_THROTTLE_STATS = SAVE_THROTTLE_STATS*;
+
+//=============================================================================
+// Inline Functions
+//=============================================================================
+
+//=============================================================================
+// Empties the engagement history of a bucket and refills it with a new
+// rate, as of now.
+FORCEINLINE void SaveBucketReset(OUT PSAVE_TOKEN_BUCKET bucket, IN ULONG bytesPerSec, IN ULONG burstBytes, IN ULONGLONG now)
+{
+    RtlZeroMemory(bucket, sizeof(*bucket));
+
+    bucket->ulRate        = bytesPerSec;
+    bucket->ulBurst       = burstBytes;
+    bucket->llTokens      = burstBytes;
+    bucket->ullLastRefill = now;
+}
+
+//=============================================================================
+// Refills a bucket for the time elapsed since the last refill. The refill
+// time only moves on by the time the whole tokens added took to accrue, so
+// the fraction of a token left over counts towards the next refill. The
+// throttle lets go once the bucket is full again.
+FORCEINLINE void SaveBucketRefill(IN OUT PSAVE_TOKEN_BUCKET bucket, IN ULONGLONG now)
+{
+    if (!bucket->ulRate)
+    {
+        return;
+    }
+
+    const ULONGLONG elapsed = now - bucket->ullLastRefill;
+
+    // Past the time to fill the bucket, it is simply full. This also keeps
+    // the product below from overflowing.
+    if (elapsed >= (ULONGLONG)(bucket->ulBurst - bucket->llTokens) * _100NS_UNITS_PER_SECOND / bucket->ulRate + 1)
+    {
+        bucket->llTokens      = bucket->ulBurst;
+        bucket->ullLastRefill = now;
+    }
+    else
+    {
+        const ULONGLONG refill = elapsed * bucket->ulRate / _100NS_UNITS_PER_SECOND;
+
+        bucket->llTokens      += (LONGLONG)refill;
+        bucket->ullLastRefill += refill * _100NS_UNITS_PER_SECOND / bucket->ulRate;
+    }
+
+    if (bucket->fEngaged && bucket->llTokens == bucket->ulBurst)
+    {
+        bucket->fEngaged = FALSE;
+    }
+}
+
+//=============================================================================
+// Refills a bucket and takes byteCount tokens from it. A write larger than
+// the burst fits once the bucket is full, and leaves it in debt. Callers
+// serialize access. Returns FALSE if the write does not fit the budget.
+FORCEINLINE BOOL SaveBucketTake(IN OUT PSAVE_TOKEN_BUCKET bucket, IN ULONG byteCount, IN ULONGLONG now)
+{
+    if (!bucket->ulRate)
+    {
+        return TRUE;
+    }
+
+    SaveBucketRefill(bucket, now);
+
+    if (bucket->llTokens >= (LONGLONG)min(byteCount, bucket->ulBurst))
+    {
+        bucket->llTokens -= byteCount;
+        return TRUE;
+    }
+
+    if (!bucket->fEngaged)
+    {
+        bucket->fEngaged       = TRUE;
+        bucket->ulEngageCount++;
+        bucket->ullLastEngaged = now;
+    }
+
+    return FALSE;
+}
+
+//=============================================================================
+// Applies the stream and adapter budgets to a write of dataSize bytes at
+// now, and counts what is dropped or skipped in stats. Throttling depends
+// only on the sizes and times of the writes, so the same stream always
+// loses the same data. The caller serializes access to the stream bucket;
+// the adapter bucket is taken under adapterLock. Returns FALSE if the data
+// must not be written.
+FORCEINLINE BOOL SaveThrottleAdmit
+(
+    IN OUT PSAVE_TOKEN_BUCKET   streamBucket,
+    IN OUT PSAVE_TOKEN_BUCKET   adapterBucket,
+    IN     PKSPIN_LOCK          adapterLock,
+    IN     SAVE_THROTTLE_POLICY policy,
+    IN     PBYTE                data,
+    IN     ULONG                dataSize,
+    IN     PWAVEFORMATEX        waveFormat,
+    IN     ULONGLONG            now,
+    IN OUT PSAVE_THROTTLE_STATS stats
+)
+{
+    // The adapter rate is read without the lock: a write that races a
+    // budget change is admitted or throttled as under the old budget.
+    //
+    if (!streamBucket->ulRate && !adapterBucket->ulRate)
+    {
+        return TRUE;
+    }
+
+    KIRQL oldIrql;
+    BOOL  admitted;
+
+    if (SaveThrottleSkipSilence == policy)
+    {
+        // Refilled first, so a bucket that has filled up during silence
+        // lets go of it.
+        SaveBucketRefill(streamBucket, now);
+
+        BOOL engaged = streamBucket->fEngaged;
+
+        if (!engaged)
+        {
+            KeAcquireSpinLock(adapterLock, &oldIrql);
+            SaveBucketRefill(adapterBucket, now);
+            engaged = adapterBucket->fEngaged;
+            KeReleaseSpinLock(adapterLock, oldIrql);
+        }
+
+        if (engaged && PeakLevel(data, dataSize, waveFormat) < THROTTLE_SILENCE_LEVEL)
+        {
+            stats->ulFramesSkipped++;
+            stats->ullBytesSkipped += dataSize;
+            return FALSE;
+        }
+    }
+
+    const ULONG streamEngaged = streamBucket->ulEngageCount;
+
+    admitted = SaveBucketTake(streamBucket, dataSize, now);
+    if (admitted)
+    {
+        KeAcquireSpinLock(adapterLock, &oldIrql);
+        const ULONG adapterEngaged = adapterBucket->ulEngageCount;
+
+        admitted = SaveBucketTake(adapterBucket, dataSize, now);
+        if (adapterEngaged != adapterBucket->ulEngageCount)
+        {
+            DPF(D_TERSE, ("[SaveThrottleAdmit : adapter throttle engaged]"));
+        }
+        KeReleaseSpinLock(adapterLock, oldIrql);
+
+        if (!admitted)
+        {
+            // The stream budget was not used after all.
+            streamBucket->llTokens += dataSize;
+        }
+    }
+    else if (streamEngaged != streamBucket->ulEngageCount)
+    {
+        DPF(D_TERSE, ("[SaveThrottleAdmit : stream throttle engaged]"));
+    }
+
+    if (!admitted)
+    {
+        stats->ulFramesDropped++;
+        stats->ullBytesDropped += dataSize;
+    }
+
+    return admitted;
+}
+
+#endif
@@ -0,0 +1,82 @@
+/*
+Abstract:
+    Declaration of the MSVAD sequence lock.
+
+    A sequence lock publishes a small structure to readers that never
+    write: the writer makes the sequence number odd, writes, and makes it
+    even again, and a reader retries its copy until it saw the same even
+    number before and after. Writers must be serialized by a spin lock of
+    their own, which also keeps them from being preempted mid-write. A
+    reader that interrupts a writer on its own processor spins until the
+    writer continues, which it never does, so readers run at IRQL <=
+    DISPATCH_LEVEL, no higher than the writers.
+*/
+
+#ifndef _MSVAD_SEQLOCK_H_
+#define _MSVAD_SEQLOCK_H_
+
+//=============================================================================
+// Types
+//=============================================================================
+
+typedef struct _SEQUENCE_LOCK
+{
+    LONG volatile   lSequence;          // Odd while the data is written.
+} SEQUENCE_LOCK;
+
+using PSEQUENCE_LOCK = SEQUENCE_LOCK*;
+
+//=============================================================================
+// Inline Functions
+//=============================================================================
+
+//=============================================================================
+// Starts a write. The interlocked increments order the writes of the data
+// between them.
+FORCEINLINE void SequenceWriteBegin(IN PSEQUENCE_LOCK lock)
+{
+    ASSERT(!(lock->lSequence & 1));
+
+    InterlockedIncrement(&lock->lSequence);
+}
+
+//=============================================================================
+FORCEINLINE void SequenceWriteEnd(IN PSEQUENCE_LOCK lock)
+{
+    ASSERT(lock->lSequence & 1);
+
+    InterlockedIncrement(&lock->lSequence);
+}
+
+//=============================================================================
+// Copies size bytes of data published under the lock. The copy is retried
+// if a write overlapped it, which takes a fraction of a microsecond.
+FORCEINLINE void SequenceRead
+(
+    IN  PSEQUENCE_LOCK                  lock,
+    _In_reads_bytes_(size) const VOID*  data,
+    _Out_writes_bytes_(size) PVOID      copy,
+    IN  SIZE_T                          size
+)
+{
+    for (;;)
+    {
+        const LONG sequence = lock->lSequence;
+
+        if (!(sequence & 1))
+        {
+            KeMemoryBarrier();
+            RtlCopyMemory(copy, data, size);
+            KeMemoryBarrier();
+
+            if (sequence == lock->lSequence)
+            {
+                return;
+            }
+        }
+
+        YieldProcessor();
+    }
+}
+
+#endif
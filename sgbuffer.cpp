@@ -0,0 +1,165 @@
+/*
+Abstract:
+    Implementation of the scatter-gather backing of large stream DMA buffers.
+*/
+
+#pragma warning (disable : 4127)
+
+#include <msvad.h>
+#include "sgbuffer.h"
+
+//=============================================================================
+ScatterGatherBuffer::ScatterGatherBuffer()
+{
+    mdl_           = nullptr;
+    systemAddress_ = nullptr;
+    size_          = 0;
+    elements_      = nullptr;
+    elementCount_  = 0;
+}
+
+//=============================================================================
+// Callers of the destructor can run at IRQL <= DISPATCH_LEVEL.
+ScatterGatherBuffer::~ScatterGatherBuffer()
+{
+    if (systemAddress_)
+    {
+        MmUnmapLockedPages(systemAddress_, mdl_);
+    }
+
+    if (mdl_)
+    {
+        MmFreePagesFromMdl(mdl_);
+        ExFreePool(mdl_);
+    }
+
+    if (elements_)
+    {
+        ExFreePoolWithTag(elements_, MSVAD_POOLTAG);
+    }
+}
+
+#pragma code_seg("PAGE")
+//=============================================================================
+/*
+Routine Description:
+  Allocates size bytes, rounded up to whole pages, as individual pages
+  anywhere in physical memory, and maps them into one system range. Runs of
+  physically adjacent pages are merged into one element.
+  Callers of allocate should run at IRQL <= APC_LEVEL.
+
+Arguments:
+  size - Size in bytes of the buffer.
+*/
+NTSTATUS ScatterGatherBuffer::allocate(IN ULONG size)
+{
+    PAGED_CODE();
+
+    DPF_ENTER(("[ScatterGatherBuffer::allocate]"));
+
+    ASSERT(!mdl_);
+
+    PHYSICAL_ADDRESS low;
+    PHYSICAL_ADDRESS high;
+    PHYSICAL_ADDRESS skip;
+
+    low.QuadPart  = 0;
+    high.QuadPart = -1;
+    skip.QuadPart = 0;
+
+    mdl_ = MmAllocatePagesForMdlEx(low, high, skip, size, MmCached, MM_ALLOCATE_FULLY_REQUIRED);
+    if (!mdl_)
+    {
+        DPF(D_TERSE, ("[ScatterGatherBuffer::allocate : could not allocate %d bytes]", size));
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    systemAddress_ = MmMapLockedPagesSpecifyCache(mdl_, KernelMode, MmCached, nullptr, FALSE,
+                                                  NormalPagePriority | MdlMappingNoExecute);
+    if (!systemAddress_)
+    {
+        DPF(D_TERSE, ("[ScatterGatherBuffer::allocate : could not map %d bytes]", size));
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    const PPFN_NUMBER pages     = MmGetMdlPfnArray(mdl_);
+    const ULONG       pageCount = (ULONG)ADDRESS_AND_SIZE_TO_SPAN_PAGES(nullptr, size);
+    ULONG             runs      = 1;
+
+    for (ULONG i = 1; i < pageCount; i++)
+    {
+        runs += (pages[i] != pages[i - 1] + 1);
+    }
+
+    elements_ = (PSG_ELEMENT)ExAllocatePoolWithTag(NonPagedPool, runs * sizeof(SG_ELEMENT), MSVAD_POOLTAG);
+    if (!elements_)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    for (ULONG i = 0; i < pageCount; i++)
+    {
+        if (!i || pages[i] != pages[i - 1] + 1)
+        {
+            PSG_ELEMENT element = &elements_[elementCount_++];
+
+            element->ulOffset                 = i << PAGE_SHIFT;
+            element->ulLength                 = 0;
+            element->PhysicalAddress.QuadPart = (LONGLONG)pages[i] << PAGE_SHIFT;
+        }
+
+        elements_[elementCount_ - 1].ulLength += PAGE_SIZE;
+    }
+
+    size_ = size;
+
+    DPF(D_VERBOSE, ("[ScatterGatherBuffer::allocate : %d bytes in %d elements]", size, elementCount_));
+
+    return STATUS_SUCCESS;
+}
+#pragma code_seg()
+
+//=============================================================================
+/*
+Routine Description:
+  Translates an offset in the buffer to a physical address.
+  Callers of physicalAddress can run at IRQL <= DISPATCH_LEVEL.
+
+Arguments:
+  offset          - Offset in the buffer, less than its size.
+  contiguousBytes - Receives the bytes from offset to the end of the
+                    physically contiguous run, at most to the buffer end.
+*/
+PHYSICAL_ADDRESS ScatterGatherBuffer::physicalAddress(IN ULONG offset, OUT PULONG contiguousBytes)
+{
+    ASSERT(contiguousBytes);
+    ASSERT(offset < size_);
+
+    // Binary search for the last element starting at or before offset.
+    //
+    ULONG first = 0;
+    ULONG last  = elementCount_ - 1;
+
+    while (first < last)
+    {
+        const ULONG middle = (first + last + 1) / 2;
+
+        if (elements_[middle].ulOffset <= offset)
+        {
+            first = middle;
+        }
+        else
+        {
+            last = middle - 1;
+        }
+    }
+
+    const PSG_ELEMENT element = &elements_[first];
+    const ULONG       into    = offset - element->ulOffset;
+    PHYSICAL_ADDRESS  address;
+
+    address.QuadPart = element->PhysicalAddress.QuadPart + into;
+    *contiguousBytes = min(element->ulLength - into, size_ - offset);
+
+    return address;
+}
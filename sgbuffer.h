@@ -0,0 +1,63 @@
+/*
+Abstract:
+    Declaration of the scatter-gather backing of large stream DMA buffers.
+
+    Buffers beyond the largest pooled size are built from individual
+    physical pages rather than one large nonpaged allocation, which fails
+    once nonpaged memory is fragmented. The pages are mapped into a single
+    system range, because the port addresses the buffer through
+    SystemAddress. The physical side is kept as a list of physically
+    contiguous elements, the table a scatter-gather controller would be
+    programmed with.
+*/
+
+#ifndef _MSVAD_SGBUFFER_H_
+#define _MSVAD_SGBUFFER_H_
+
+//=============================================================================
+// Types
+//=============================================================================
+
+// A physically contiguous run of the buffer.
+typedef struct _SG_ELEMENT
+{
+    ULONG               ulOffset;           // Offset of the run in the buffer.
+    ULONG               ulLength;           // Bytes in the run, whole pages.
+    PHYSICAL_ADDRESS    PhysicalAddress;
+} SG_ELEMENT;
+
+using PSG_ELEMENT = SG_ELEMENT*;
+
+//=============================================================================
+// Classes
+//=============================================================================
+
+///////////////////////////////////////////////////////////////////////////////
+// ScatterGatherBuffer
+//   Page-backed buffer with a logical to physical mapping. allocate() must be
+//   called at IRQL <= APC_LEVEL, the other methods at IRQL <= DISPATCH_LEVEL.
+
+class ScatterGatherBuffer
+{
+public:
+     ScatterGatherBuffer();
+    ~ScatterGatherBuffer();
+
+    NTSTATUS         allocate(IN ULONG size);
+
+    PVOID            systemAddress() { return systemAddress_; }
+    PMDL             mdl()           { return mdl_; }
+    ULONG            elementCount()  { return elementCount_; }
+
+    PHYSICAL_ADDRESS physicalAddress(IN ULONG offset, OUT PULONG contiguousBytes);
+
+private:
+    PMDL            mdl_;               // The pages.
+    PVOID           systemAddress_;     // Their system mapping.
+    ULONG           size_;
+    PSG_ELEMENT     elements_;          // Ordered by offset.
+    ULONG           elementCount_;
+};
+using PScatterGatherBuffer = ScatterGatherBuffer*;
+
+#endif
@@ -0,0 +1,632 @@
+/*
+Abstract:
+    Implementation of the MSVAD signal generator.
+*/
+
+#pragma warning (disable : 4127)
+
+#include <msvad.h>
+#include "siggen.h"
+
+#ifdef MSVAD_DSP_SSE2
+#include <emmintrin.h>
+#endif
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+// sin(pi/2 * x) ~ x * (C1 - x^2 * (C2 - x^2 * C3)) on [-1, 1], within 0.09%
+// of full scale. C1 is Q14, C2 and C3 are Q15.
+#define SINE_C1                     25666
+#define SINE_C2                     20568
+#define SINE_C3                     2004
+
+#define LN2_Q16                     45426
+#define PINK_FULL_SCALE             ((SIGGEN_PINK_ROWS + 1) << 11)
+
+#pragma code_seg()
+//=============================================================================
+// Q15 helpers with the semantics of the SSE2 instructions of the same name,
+// so the scalar path computes exactly what the vector path does.
+static FORCEINLINE SHORT mulhi16(IN LONG a, IN LONG b)
+{
+    return (SHORT)((a * b) >> 16);
+}
+
+//=============================================================================
+static FORCEINLINE SHORT adds16(IN LONG a, IN LONG b)
+{
+    return (SHORT)max(-32768, min(a + b, 32767));
+}
+
+//=============================================================================
+// Returns level * sin(pi * phase / 32768), Q15.
+static FORCEINLINE SHORT sineQ15(IN SHORT phase, IN SHORT level)
+{
+    // Fold into [-pi/2, pi/2] with sin(pi - a) = sin(a); the subtraction
+    // wraps the same way as in 16 bits.
+    LONG s = phase;
+    if (s > 16384 || s < -16384)
+    {
+        s = (SHORT)(-32768 - s);
+    }
+
+    const SHORT x  = adds16(s, s);
+    const SHORT m  = mulhi16(x, x);
+    const SHORT x2 = adds16(m, m);
+    SHORT       t  = mulhi16(x2, SINE_C3);
+
+    t = (SHORT)(SINE_C2 - adds16(t, t));
+    t = mulhi16(x2, t);
+    t = adds16(t, t);
+
+    SHORT y = mulhi16(x, SINE_C1 - (t >> 1));
+    y = adds16(y, y);
+    y = adds16(y, y);
+
+    const SHORT z = mulhi16(y, level);
+    return adds16(z, z);
+}
+
+#ifdef MSVAD_DSP_SSE2
+//=============================================================================
+// Eight lanes of sineQ15.
+static FORCEINLINE __m128i sineQ15x8(IN __m128i phase, IN __m128i level)
+{
+    const __m128i quarter = _mm_set1_epi16(16384);
+    const __m128i fold    = _mm_or_si128(_mm_cmpgt_epi16(phase, quarter),
+                                         _mm_cmplt_epi16(phase, _mm_set1_epi16(-16384)));
+    const __m128i s       = _mm_or_si128(_mm_and_si128(fold, _mm_sub_epi16(_mm_set1_epi16(-32768), phase)),
+                                         _mm_andnot_si128(fold, phase));
+
+    const __m128i x  = _mm_adds_epi16(s, s);
+    const __m128i m  = _mm_mulhi_epi16(x, x);
+    const __m128i x2 = _mm_adds_epi16(m, m);
+    __m128i       t  = _mm_mulhi_epi16(x2, _mm_set1_epi16(SINE_C3));
+
+    t = _mm_sub_epi16(_mm_set1_epi16(SINE_C2), _mm_adds_epi16(t, t));
+    t = _mm_mulhi_epi16(x2, t);
+    t = _mm_adds_epi16(t, t);
+
+    __m128i y = _mm_mulhi_epi16(x, _mm_sub_epi16(_mm_set1_epi16(SINE_C1), _mm_srai_epi16(t, 1)));
+    y = _mm_adds_epi16(y, y);
+    y = _mm_adds_epi16(y, y);
+
+    const __m128i z = _mm_mulhi_epi16(y, level);
+    return _mm_adds_epi16(z, z);
+}
+#endif
+
+//=============================================================================
+static FORCEINLINE ULONG xorshift32(IN ULONG state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+//=============================================================================
+// Returns log2(value) in Q16. value must be non-zero.
+static LONG log2Q16(IN ULONG value)
+{
+    LONG integer = 0;
+
+    while (value >> (integer + 1))
+    {
+        integer++;
+    }
+
+    // The mantissa is squared once per fraction bit; each time it reaches 2
+    // the bit is set and the mantissa halved.
+    ULONGLONG mantissa = ((ULONGLONG)value << 30) >> integer;
+    LONG      result   = integer << 16;
+
+    for (LONG bit = 1 << 15; bit; bit >>= 1)
+    {
+        mantissa = (mantissa * mantissa) >> 30;
+        if (mantissa >= (2ULL << 30))
+        {
+            mantissa >>= 1;
+            result    |= bit;
+        }
+    }
+
+    return result;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Adds, or stores, a sine of constant frequency to a block of samples.
+
+Arguments:
+  samples    - Receives the block.
+  frames     - Size of the block.
+  phase      - Phase of the first sample, in 2^-32 turns.
+  increment  - Phase increment per sample.
+  level      - Peak, Q15.
+  accumulate - TRUE to add to samples with saturation.
+*/
+static void Oscillate
+(
+    _Inout_updates_(frames) PSHORT  samples,
+    IN                      ULONG   frames,
+    IN                      ULONG   phase,
+    IN                      ULONG   increment,
+    IN                      SHORT   level,
+    IN                      BOOLEAN accumulate
+)
+{
+    ULONG i = 0;
+
+#ifdef MSVAD_DSP_SSE2
+    const __m128i vlevel = _mm_set1_epi16(level);
+    const __m128i step   = _mm_set1_epi32((int)(increment * 8));
+    __m128i       p0     = _mm_add_epi32(_mm_set1_epi32((int)phase),
+                                         _mm_setr_epi32(0, (int)increment, (int)(2 * increment), (int)(3 * increment)));
+    __m128i       p1     = _mm_add_epi32(p0, _mm_set1_epi32((int)(4 * increment)));
+
+    for (; i + 8 <= frames; i += 8)
+    {
+        // The top 16 bits of the phase, taken as signed, are the angle in
+        // [-pi, pi) in Q15 half turns.
+        __m128i y = sineQ15x8(_mm_packs_epi32(_mm_srai_epi32(p0, 16), _mm_srai_epi32(p1, 16)), vlevel);
+
+        if (accumulate)
+        {
+            y = _mm_adds_epi16(y, _mm_loadu_si128((const __m128i*)(samples + i)));
+        }
+        _mm_storeu_si128((__m128i*)(samples + i), y);
+
+        p0 = _mm_add_epi32(p0, step);
+        p1 = _mm_add_epi32(p1, step);
+    }
+
+    phase += i * increment;
+#endif
+
+    for (; i < frames; i++, phase += increment)
+    {
+        const SHORT y = sineQ15((SHORT)(phase >> 16), level);
+        samples[i] = accumulate ? adds16(samples[i], y) : y;
+    }
+}
+
+//=============================================================================
+SignalGenerator::SignalGenerator()
+{
+    RtlZeroMemory(&params_, sizeof(params_));
+    params_.Signal = SigGenSilence;
+    params_.ulSeed = 1;
+
+    sampleRate_    = 0;
+    channels_      = 0;
+    bitsPerSample_ = 0;
+    blockAlign_    = 0;
+
+    reset();
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Selects the signal. The generator restarts at frame 0.
+  Callers of setSignal can run at IRQL <= DISPATCH_LEVEL.
+
+Arguments:
+  params - The signal and its parameters.
+*/
+NTSTATUS SignalGenerator::setSignal(IN PSIGGEN_PARAMS params)
+{
+    ASSERT(params);
+
+    BOOLEAN valid = params->ulLevel <= DSP_LEVEL_FULL_SCALE;
+
+    switch (params->Signal)
+    {
+        case SigGenSilence:
+            break;
+
+        case SigGenSine:
+        case SigGenImpulse:
+            valid = valid && params->ulFrequency[0];
+            break;
+
+        case SigGenMultitone:
+            valid = valid && params->ulToneCount && params->ulToneCount <= SIGGEN_MAX_TONES;
+            for (ULONG i = 0; valid && i < params->ulToneCount; i++)
+            {
+                valid = params->ulFrequency[i] != 0;
+            }
+            break;
+
+        case SigGenSweep:
+            valid = valid && params->ulFrequency[0] && params->ulSweepEnd && params->ulSweepMs;
+            break;
+
+        case SigGenWhiteNoise:
+        case SigGenPinkNoise:
+            valid = valid && params->ulSeed;
+            break;
+
+        default:
+            valid = FALSE;
+            break;
+    }
+
+    if (!valid)
+    {
+        DPF(D_TERSE, ("[SignalGenerator::setSignal : invalid parameters for signal %d]", params->Signal));
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    params_ = *params;
+    reset();
+
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Sets the format of the buffers to fill. Formats other than 8, 16, 24 and
+  32 bit PCM are filled with zeros. The generator restarts at frame 0.
+
+Arguments:
+  waveFormat - The format.
+*/
+void SignalGenerator::setFormat(IN PWAVEFORMATEX waveFormat)
+{
+    ASSERT(waveFormat);
+
+    const ULONG bits = waveFormat->wBitsPerSample;
+
+    sampleRate_    = waveFormat->nSamplesPerSec;
+    channels_      = waveFormat->nChannels;
+    bitsPerSample_ = bits;
+    blockAlign_    = waveFormat->nBlockAlign;
+
+    if ((bits != 8 && bits != 16 && bits != 24 && bits != 32) ||
+        !channels_ || !sampleRate_ || blockAlign_ < channels_ * (bits / 8))
+    {
+        DPF(D_TERSE, ("[SignalGenerator::setFormat : unsupported format, generating silence]"));
+        blockAlign_ = 0;
+    }
+
+    reset();
+}
+
+//=============================================================================
+// Restarts the signal at frame 0.
+void SignalGenerator::reset()
+{
+    frame_ = 0;
+
+    for (ULONG i = 0; i < SIGGEN_NOISE_LANES; i++)
+    {
+        noise_[i] = params_.ulSeed ^ (0x9E3779B9 * (i + 1));
+        noise_[i] = noise_[i] ? noise_[i] : 1;
+    }
+
+    RtlZeroMemory(pinkRows_, sizeof(pinkRows_));
+    pinkSum_     = 0;
+    pinkCounter_ = 0;
+
+    sweepPhase_      = 0;
+    sweepFrequency_  = (ULONGLONG)params_.ulFrequency[0] << 16;
+    sweepGrowth_     = 0;
+    sweepStartFrame_ = 0;
+    sweepFrames_     = 1;
+
+    if (SigGenSweep == params_.Signal && sampleRate_)
+    {
+        // The frequency grows by the same ratio every step, which makes the
+        // sweep exponential: growth = ln(end / start) / steps.
+        const LONGLONG lnRatio = ((LONGLONG)(log2Q16(params_.ulSweepEnd) - log2Q16(params_.ulFrequency[0])) * LN2_Q16) >> 16;
+        const LONGLONG divisor = (LONGLONG)params_.ulSweepMs * sampleRate_;
+
+        sweepFrames_ = max((ULONGLONG)divisor / 1000, 1);
+        sweepGrowth_ = (lnRatio * SIGGEN_SWEEP_STEP_FRAMES * 1000 << 16) / divisor;
+
+        // Keep the per-step update of the frequency in range.
+        sweepGrowth_ = max(-(1LL << 28), min(sweepGrowth_, 1LL << 28));
+    }
+}
+
+//=============================================================================
+// Phase at frame_ of a tone, computed from the frame count rather than
+// accumulated, so rounding never builds up.
+ULONG SignalGenerator::phaseAt(IN ULONG frequency)
+{
+    const ULONGLONG cycles = (frame_ % sampleRate_) * (frequency % sampleRate_) % sampleRate_;
+
+    return (ULONG)((cycles << 32) / sampleRate_);
+}
+
+//=============================================================================
+ULONG SignalGenerator::increment(IN ULONG frequency)
+{
+    return (ULONG)(((ULONGLONG)(frequency % sampleRate_) << 32) / sampleRate_);
+}
+
+//=============================================================================
+void SignalGenerator::sweep(_Out_writes_(frames) PSHORT samples, IN ULONG frames)
+{
+    const SHORT level = (SHORT)params_.ulLevel;
+    ULONG       i     = 0;
+
+    while (i < frames)
+    {
+        ULONGLONG position = frame_ + i - sweepStartFrame_;
+
+        if (position >= sweepFrames_)
+        {
+            sweepStartFrame_ = frame_ + i;
+            sweepFrequency_  = (ULONGLONG)params_.ulFrequency[0] << 16;
+            position         = 0;
+        }
+
+        // Frequency steps fall on fixed frames, however the stream is cut.
+        const ULONG n   = (ULONG)min(SIGGEN_SWEEP_STEP_FRAMES - position % SIGGEN_SWEEP_STEP_FRAMES, frames - i);
+        const ULONG inc = (ULONG)(((sweepFrequency_ << 16) / sampleRate_) & MAXULONG);
+
+        Oscillate(samples + i, n, sweepPhase_, inc, level, FALSE);
+        sweepPhase_ += n * inc;
+        i           += n;
+
+        if ((position + n) % SIGGEN_SWEEP_STEP_FRAMES == 0)
+        {
+            sweepFrequency_ += ((LONGLONG)sweepFrequency_ * sweepGrowth_) >> 32;
+        }
+    }
+}
+
+//=============================================================================
+void SignalGenerator::whiteNoise(_Out_writes_(frames) PSHORT samples, IN ULONG frames)
+{
+    const SHORT level = (SHORT)params_.ulLevel;
+    ULONG       i     = 0;
+
+#ifdef MSVAD_DSP_SSE2
+    const __m128i vlevel = _mm_set1_epi16(level);
+    __m128i       state  = _mm_loadu_si128((const __m128i*)noise_);
+
+    for (; i + 8 <= frames; i += 8)
+    {
+        __m128i lanes[2];
+
+        for (ULONG half = 0; half < 2; half++)
+        {
+            state = _mm_xor_si128(state, _mm_slli_epi32(state, 13));
+            state = _mm_xor_si128(state, _mm_srli_epi32(state, 17));
+            state = _mm_xor_si128(state, _mm_slli_epi32(state, 5));
+            lanes[half] = _mm_srai_epi32(state, 16);
+        }
+
+        const __m128i z = _mm_mulhi_epi16(_mm_packs_epi32(lanes[0], lanes[1]), vlevel);
+        _mm_storeu_si128((__m128i*)(samples + i), _mm_adds_epi16(z, z));
+    }
+
+    _mm_storeu_si128((__m128i*)noise_, state);
+#endif
+
+    // Every lane steps once per group of four samples, as in the vector path.
+    for (; i < frames; i += SIGGEN_NOISE_LANES)
+    {
+        for (ULONG lane = 0; lane < SIGGEN_NOISE_LANES; lane++)
+        {
+            noise_[lane] = xorshift32(noise_[lane]);
+
+            if (i + lane < frames)
+            {
+                const SHORT z = mulhi16((SHORT)(noise_[lane] >> 16), level);
+                samples[i + lane] = adds16(z, z);
+            }
+        }
+    }
+}
+
+//=============================================================================
+// Voss-McCartney: row k of the sum is redrawn every 2^k samples, which gives
+// a spectrum falling at about 3 dB per octave.
+void SignalGenerator::pinkNoise(_Out_writes_(frames) PSHORT samples, IN ULONG frames)
+{
+    const LONGLONG scale = (LONGLONG)params_.ulLevel * ((1LL << 30) / PINK_FULL_SCALE);
+
+    for (ULONG i = 0; i < frames; i++)
+    {
+        ULONG row     = 0;
+        ULONG counter = ++pinkCounter_;
+
+        while (!(counter & 1) && row < SIGGEN_PINK_ROWS)
+        {
+            counter >>= 1;
+            row++;
+        }
+
+        noise_[0] = xorshift32(noise_[0]);
+
+        if (row < SIGGEN_PINK_ROWS)
+        {
+            const LONG value = (SHORT)(noise_[0] >> 16) >> 4;
+
+            pinkSum_       += value - pinkRows_[row];
+            pinkRows_[row]  = value;
+            noise_[0]       = xorshift32(noise_[0]);
+        }
+
+        const LONG white = (SHORT)(noise_[0] >> 16) >> 4;
+        samples[i] = adds16((LONG)(((pinkSum_ + white) * scale) >> 30), 0);
+    }
+}
+
+//=============================================================================
+// One full-level sample at the start of every period, silence in between.
+// Periods are counted in whole cycles of frequency per sampleRate_ frames,
+// so the impulses fall on the same frames however the stream is cut.
+void SignalGenerator::impulses(_Out_writes_(frames) PSHORT samples, IN ULONG frames)
+{
+    const ULONG frequency = params_.ulFrequency[0] % sampleRate_;
+    ULONG       cycles    = (ULONG)((frame_ % sampleRate_) * frequency % sampleRate_);
+
+    for (ULONG i = 0; i < frames; i++)
+    {
+        samples[i] = (cycles < frequency) ? (SHORT)params_.ulLevel : 0;
+
+        cycles += frequency;
+        if (cycles >= sampleRate_)
+        {
+            cycles -= sampleRate_;
+        }
+    }
+}
+
+//=============================================================================
+// Generates the next frames of the signal as Q15 samples.
+void SignalGenerator::generate(_Out_writes_(frames) PSHORT samples, IN ULONG frames)
+{
+    switch (params_.Signal)
+    {
+        case SigGenSine:
+            Oscillate(samples, frames, phaseAt(params_.ulFrequency[0]), increment(params_.ulFrequency[0]),
+                      (SHORT)params_.ulLevel, FALSE);
+            break;
+
+        case SigGenMultitone:
+        {
+            // The tones share the level, so their sum cannot clip.
+            const SHORT level = (SHORT)(params_.ulLevel / params_.ulToneCount);
+
+            for (ULONG tone = 0; tone < params_.ulToneCount; tone++)
+            {
+                Oscillate(samples, frames, phaseAt(params_.ulFrequency[tone]), increment(params_.ulFrequency[tone]),
+                          level, tone > 0);
+            }
+        }
+        break;
+
+        case SigGenSweep:
+            sweep(samples, frames);
+            break;
+
+        case SigGenWhiteNoise:
+            whiteNoise(samples, frames);
+            break;
+
+        case SigGenPinkNoise:
+            pinkNoise(samples, frames);
+            break;
+
+        case SigGenImpulse:
+            impulses(samples, frames);
+            break;
+
+        default:
+            RtlZeroMemory(samples, frames * sizeof(SHORT));
+            break;
+    }
+
+    frame_ += frames;
+}
+
+//=============================================================================
+// Writes Q15 samples to every channel of frames in the output format.
+void SignalGenerator::write(_In_reads_(frames) PSHORT samples, IN ULONG frames, _Out_ PBYTE buffer)
+{
+    ULONG i = 0;
+
+    switch (bitsPerSample_)
+    {
+        case 8:
+            for (; i < frames; i++, buffer += blockAlign_)
+            {
+                RtlFillMemory(buffer, channels_, (UCHAR)((samples[i] >> 8) + 0x80));
+            }
+            break;
+
+        case 16:
+#ifdef MSVAD_DSP_SSE2
+            if (2 == channels_ && 4 == blockAlign_)
+            {
+                for (; i + 8 <= frames; i += 8, buffer += 32)
+                {
+                    const __m128i x = _mm_loadu_si128((const __m128i*)(samples + i));
+                    _mm_storeu_si128((__m128i*)buffer,        _mm_unpacklo_epi16(x, x));
+                    _mm_storeu_si128((__m128i*)(buffer + 16), _mm_unpackhi_epi16(x, x));
+                }
+            }
+#endif
+            for (; i < frames; i++, buffer += blockAlign_)
+            {
+                for (ULONG channel = 0; channel < channels_; channel++)
+                {
+                    ((PSHORT)buffer)[channel] = samples[i];
+                }
+            }
+            break;
+
+        case 24:
+            for (; i < frames; i++, buffer += blockAlign_)
+            {
+                for (ULONG channel = 0; channel < channels_; channel++)
+                {
+                    buffer[3 * channel]     = 0;
+                    buffer[3 * channel + 1] = (UCHAR)samples[i];
+                    buffer[3 * channel + 2] = (UCHAR)(samples[i] >> 8);
+                }
+            }
+            break;
+
+        default:
+            for (; i < frames; i++, buffer += blockAlign_)
+            {
+                for (ULONG channel = 0; channel < channels_; channel++)
+                {
+                    ((PLONG)buffer)[channel] = (LONG)samples[i] << 16;
+                }
+            }
+            break;
+    }
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Fills a buffer with the next frames of the signal. A trailing partial
+  frame is filled with silence.
+  Callers of fill can run at IRQL <= DISPATCH_LEVEL.
+
+Arguments:
+  buffer    - Receives the samples.
+  byteCount - Size of the buffer in bytes.
+*/
+void SignalGenerator::fill(_Out_writes_bytes_(byteCount) PBYTE buffer, IN ULONG byteCount)
+{
+    ASSERT(buffer || !byteCount);
+
+    const UCHAR silence = (8 == bitsPerSample_) ? 0x80 : 0;
+
+    if (!blockAlign_ || SigGenSilence == params_.Signal)
+    {
+        RtlFillMemory(buffer, byteCount, silence);
+        return;
+    }
+
+    DECLSPEC_ALIGN(DMA_BUFFER_ALIGNMENT) SHORT block[SIGGEN_BLOCK_FRAMES];
+    ULONG frames = byteCount / blockAlign_;
+
+    while (frames)
+    {
+        const ULONG n = min(frames, SIGGEN_BLOCK_FRAMES);
+
+        generate(block, n);
+        write(block, n, buffer);
+
+        buffer += n * blockAlign_;
+        frames -= n;
+    }
+
+    RtlFillMemory(buffer, byteCount % blockAlign_, silence);
+}
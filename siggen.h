@@ -0,0 +1,107 @@
+/*
+Abstract:
+    Declaration of the MSVAD signal generator, which supplies the samples a
+    capture stream "records".
+
+    Everything is fixed-point, because the generator runs in the DMA engine
+    at DISPATCH_LEVEL. Tones are phase-accurate: the phase of every block is
+    derived from the absolute frame count, so it does not drift however the
+    stream is cut into spans. On x64 the oscillators and the noise source
+    use SSE2; the scalar path computes the same values bit for bit.
+*/
+
+#ifndef _MSVAD_SIGGEN_H_
+#define _MSVAD_SIGGEN_H_
+
+#include "dsp.h"
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+#define SIGGEN_MAX_TONES            4
+#define SIGGEN_BLOCK_FRAMES         256     // Frames generated at a time.
+#define SIGGEN_SWEEP_STEP_FRAMES    32      // Frames between sweep frequency updates.
+#define SIGGEN_NOISE_LANES          4
+#define SIGGEN_PINK_ROWS            12
+
+//=============================================================================
+// Types
+//=============================================================================
+
+typedef enum
+{
+    SigGenSilence,
+    SigGenSine,
+    SigGenMultitone,
+    SigGenSweep,
+    SigGenWhiteNoise,
+    SigGenPinkNoise,
+    SigGenImpulse
+} SIGGEN_SIGNAL;
+
+// Frequencies are in Hz. ulFrequency[0] is the tone of SigGenSine, the start
+// of SigGenSweep and the repetition rate of SigGenImpulse.
+typedef struct _SIGGEN_PARAMS
+{
+    SIGGEN_SIGNAL   Signal;
+    ULONG           ulToneCount;                    // SigGenMultitone only.
+    ULONG           ulFrequency[SIGGEN_MAX_TONES];
+    ULONG           ulSweepEnd;                     // Frequency at the end of a sweep.
+    ULONG           ulSweepMs;                      // Duration of a sweep. It then restarts.
+    ULONG           ulLevel;                        // Peak, 0..DSP_LEVEL_FULL_SCALE.
+    ULONG           ulSeed;                         // Noise seed. Must be non-zero.
+} SIGGEN_PARAMS;
+
+using PSIGGEN_PARAMS = SIGGEN_PARAMS*;
+
+//=============================================================================
+// Classes
+//=============================================================================
+
+///////////////////////////////////////////////////////////////////////////////
+// SignalGenerator
+//   Fills buffers of 8, 16, 24 or 32 bit PCM with a test signal, the same on
+//   every channel. Callers can run at IRQL <= DISPATCH_LEVEL.
+
+class SignalGenerator
+{
+public:
+    SignalGenerator();
+
+    NTSTATUS setSignal(IN PSIGGEN_PARAMS params);
+    void     setFormat(IN PWAVEFORMATEX waveFormat);
+    void     reset();
+    void     fill(_Out_writes_bytes_(byteCount) PBYTE buffer, IN ULONG byteCount);
+
+private:
+    ULONG    phaseAt(IN ULONG frequency);
+    ULONG    increment(IN ULONG frequency);
+    void     generate(_Out_writes_(frames) PSHORT samples, IN ULONG frames);
+    void     sweep(_Out_writes_(frames) PSHORT samples, IN ULONG frames);
+    void     whiteNoise(_Out_writes_(frames) PSHORT samples, IN ULONG frames);
+    void     pinkNoise(_Out_writes_(frames) PSHORT samples, IN ULONG frames);
+    void     impulses(_Out_writes_(frames) PSHORT samples, IN ULONG frames);
+    void     write(_In_reads_(frames) PSHORT samples, IN ULONG frames, _Out_ PBYTE buffer);
+
+    SIGGEN_PARAMS   params_;
+    ULONG           sampleRate_;
+    ULONG           channels_;
+    ULONG           bitsPerSample_;
+    ULONG           blockAlign_;
+    ULONGLONG       frame_;                         // Frames generated since reset.
+
+    ULONG           noise_[SIGGEN_NOISE_LANES];     // xorshift32 states.
+    LONG            pinkRows_[SIGGEN_PINK_ROWS];
+    LONG            pinkSum_;
+    ULONG           pinkCounter_;
+
+    ULONG           sweepPhase_;
+    ULONGLONG       sweepFrequency_;                // Current frequency, Q16 Hz.
+    LONGLONG        sweepGrowth_;                   // Relative change per step, Q32.
+    ULONGLONG       sweepStartFrame_;
+    ULONGLONG       sweepFrames_;                   // Frames per sweep.
+};
+using PSignalGenerator = SignalGenerator*;
+
+#endif
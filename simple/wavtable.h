@@ -55,6 +55,26 @@ PKSDATARANGE PinDataRangePointersBridge[] =
     &PinDataRangesBridge[0]
 };
 
+//=============================================================================
+static
+PCPROPERTY_ITEM PropertiesStreamPin[] =
+{
+    {
+        &KSPROPSETID_RtAudio,
+        KSPROPERTY_RTAUDIO_BUFFER,
+        KSPROPERTY_TYPE_GET | KSPROPERTY_TYPE_BASICSUPPORT,
+        propertyHandler_RtAudio
+    },
+    {
+        &KSPROPSETID_RtAudio,
+        KSPROPERTY_RTAUDIO_POSITIONREGISTER,
+        KSPROPERTY_TYPE_GET | KSPROPERTY_TYPE_BASICSUPPORT,
+        propertyHandler_RtAudio
+    }
+};
+
+DEFINE_PCAUTOMATION_TABLE_PROP(AutomationStreamPin, PropertiesStreamPin);
+
 //=============================================================================
 static
 PCPIN_DESCRIPTOR MiniportPins[] =
@@ -64,7 +84,7 @@ PCPIN_DESCRIPTOR MiniportPins[] =
         MAX_OUTPUT_STREAMS,
         MAX_OUTPUT_STREAMS,
         0,
-        nullptr,
+        &AutomationStreamPin,
         {
             0,
             nullptr,
@@ -106,7 +126,7 @@ PCPIN_DESCRIPTOR MiniportPins[] =
         MAX_INPUT_STREAMS,
         MAX_INPUT_STREAMS, 
         0,
-        nullptr,
+        &AutomationStreamPin,
         {
             0,
             nullptr,
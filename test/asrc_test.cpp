@@ -0,0 +1,562 @@
+/*
+Abstract:
+    Tests and benchmark of the asynchronous sample-rate converter that slaves
+    loopback capture to the render clock.
+*/
+
+#include <math.h>
+
+#include <msvad.h>
+#include "asrc.h"
+#include "kernel.h"
+#include "test.h"
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+#define MS                          10000LL         // 100 ns units.
+#define RATE                        48000
+#define BURST_FRAMES                (RATE / 100)    // 10 ms, as a DMA burst.
+#define TONE_HZ                     1000
+#define TONE_LEVEL                  16000
+
+//=============================================================================
+// Types
+//=============================================================================
+
+// A render stream that plays a tone on a device clock ppm off the system
+// clock, and a capture stream on the system clock, each moving a burst
+// every 10 ms of its own clock, a few ms apart.
+typedef struct _LINK
+{
+    AsyncRateConverter* Converter;
+    WAVEFORMATEX        RenderFormat;
+    WAVEFORMATEX        CaptureFormat;
+    LONG                lRenderPpm;
+    ULONGLONG           ullRenderFrames;    // Frames played.
+    ULONGLONG           ullCaptureFrames;   // Frames recorded.
+    PBYTE               Capture;            // The last burst recorded.
+} LINK;
+
+//=============================================================================
+static void initFormat(OUT PWAVEFORMATEX format, IN ULONG rate, IN WORD channels, IN WORD bits)
+{
+    RtlZeroMemory(format, sizeof(*format));
+
+    format->wFormatTag      = WAVE_FORMAT_PCM;
+    format->nChannels       = channels;
+    format->nSamplesPerSec  = rate;
+    format->wBitsPerSample  = bits;
+    format->nBlockAlign     = channels * bits / 8;
+    format->nAvgBytesPerSec = rate * format->nBlockAlign;
+}
+
+//=============================================================================
+// Sample of channel of frame in a buffer, as 16 bits.
+static LONG sampleAt(IN PBYTE buffer, IN PWAVEFORMATEX format, IN ULONG frame, IN ULONG channel)
+{
+    const PBYTE sample = buffer + frame * format->nBlockAlign + channel * format->wBitsPerSample / 8;
+
+    switch (format->wBitsPerSample)
+    {
+        case 8:  return ((LONG)sample[0] - 0x80) << 8;
+        case 16: return *(SHORT*)sample;
+        case 24: return (SHORT)(sample[1] | (sample[2] << 8));
+        default: return *(LONG*)sample >> 16;
+    }
+}
+
+//=============================================================================
+// The converter runs in the DMA engines, at DISPATCH_LEVEL.
+static void write(IN AsyncRateConverter* converter, IN PVOID writer, IN PWAVEFORMATEX format, IN PBYTE buffer, IN ULONG byteCount)
+{
+    KIRQL oldIrql;
+
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+    converter->write(writer, format, buffer, byteCount);
+    KeLowerIrql(oldIrql);
+}
+
+//=============================================================================
+static void read(IN AsyncRateConverter* converter, IN PWAVEFORMATEX format, IN PBYTE buffer, IN ULONG byteCount)
+{
+    KIRQL oldIrql;
+
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+    converter->read(format, buffer, byteCount);
+    KeLowerIrql(oldIrql);
+}
+
+//=============================================================================
+static void initLink(OUT LINK* link, IN AsyncRateConverter* converter, IN LONG renderPpm)
+{
+    RtlZeroMemory(link, sizeof(*link));
+
+    link->Converter  = converter;
+    link->lRenderPpm = renderPpm;
+    link->Capture    = (PBYTE)ExAllocatePoolWithTag(NonPagedPool, BURST_FRAMES * 2 * sizeof(SHORT), MSVAD_POOLTAG);
+
+    initFormat(&link->RenderFormat,  RATE, 2, 16);
+    initFormat(&link->CaptureFormat, RATE, 2, 16);
+}
+
+//=============================================================================
+static void freeLink(IN LINK* link)
+{
+    ExFreePoolWithTag(link->Capture, MSVAD_POOLTAG);
+}
+
+//=============================================================================
+// Runs the link for ms milliseconds of system time, from the held counter.
+// Each capture burst is passed to inspect, if given.
+static void runLink(IN OUT LINK* link, IN ULONG ms, IN void (*inspect)(LINK*, PVOID), IN PVOID context)
+{
+    SHORT burst[BURST_FRAMES * 2];
+
+    for (ULONG tick = 0; tick < ms; tick++)
+    {
+        TestAdvancePerformanceCounter(MS);
+
+        const LONGLONG now = KeQueryPerformanceCounter(nullptr).QuadPart;
+
+        // Render bursts fall every 10 ms of the device clock.
+        //
+        const ULONGLONG played = (ULONGLONG)((__int128)now * RATE * (1000000 + link->lRenderPpm) /
+                                             (1000000LL * _100NS_UNITS_PER_SECOND)) / BURST_FRAMES * BURST_FRAMES;
+
+        while (link->ullRenderFrames < played)
+        {
+            for (ULONG i = 0; i < BURST_FRAMES; i++)
+            {
+                const double phase = 2 * M_PI * (double)((link->ullRenderFrames + i) * TONE_HZ % RATE) / RATE;
+
+                burst[2 * i] = burst[2 * i + 1] = (SHORT)lround(TONE_LEVEL * sin(phase));
+            }
+
+            write(link->Converter, link, &link->RenderFormat, (PBYTE)burst, sizeof(burst));
+            link->ullRenderFrames += BURST_FRAMES;
+        }
+
+        // Capture bursts 3 ms after the render ones, on the system clock.
+        //
+        if (3 == (now / MS) % 10)
+        {
+            read(link->Converter, &link->CaptureFormat, link->Capture, BURST_FRAMES * link->CaptureFormat.nBlockAlign);
+            link->ullCaptureFrames += BURST_FRAMES;
+
+            if (inspect)
+            {
+                inspect(link, context);
+            }
+        }
+    }
+}
+
+//=============================================================================
+// Correction and fill seen after each capture burst.
+typedef struct _LOOP_TRACE
+{
+    LONGLONG    llCorrectionSum;
+    LONG        lCorrectionMin;
+    LONG        lCorrectionMax;
+    LONG        lFillMin;
+    LONG        lFillMax;
+    ULONG       ulCount;
+} LOOP_TRACE;
+
+static void traceLoop(IN LINK* link, IN PVOID context)
+{
+    LOOP_TRACE* trace = (LOOP_TRACE*)context;
+    ASRC_STATS  stats;
+
+    link->Converter->getStats(&stats);
+
+    trace->llCorrectionSum += stats.lCorrectionPpm;
+    trace->lCorrectionMin   = min(trace->lCorrectionMin, stats.lCorrectionPpm);
+    trace->lCorrectionMax   = max(trace->lCorrectionMax, stats.lCorrectionPpm);
+    trace->lFillMin         = min(trace->lFillMin, (LONG)stats.ulFillFrames - (LONG)stats.ulTargetFrames);
+    trace->lFillMax         = max(trace->lFillMax, (LONG)stats.ulFillFrames - (LONG)stats.ulTargetFrames);
+    trace->ulCount++;
+}
+
+//=============================================================================
+// Once settled, which near the edge of the range takes a minute and a half,
+// the loop runs the reader at the ratio of the two clocks on
+// average, with the FIFO around its target and no underflow or overflow,
+// for render clocks up to near the limit the loop follows either way.
+//
+// Both sides move in bursts on a 1 ms tick, so the writer's position is
+// known to a tick only: as the two clocks slide past each other the fill
+// error steps by a tick of frames, and the correction ripples by the
+// proportional gain times that about its mean. The fill seen right after a
+// read is off the target by up to the burst the writer has yet to write.
+TEST(LoopSettlesAtTheClockRatio)
+{
+    const LONG ppms[] = { 0, -1000, ASRC_MAX_CORRECTION_PPM * 9 / 10 };
+
+    TestHoldPerformanceCounter(1000 * MS);
+
+    for (ULONG p = 0; p < RTL_NUMBER_OF(ppms); p++)
+    {
+        AsyncRateConverter converter;
+        ASRC_STATS         stats;
+        LOOP_TRACE         trace;
+        LINK               link;
+
+        CHECK_EQUAL(STATUS_SUCCESS, converter.allocate());
+        initLink(&link, &converter, ppms[p]);
+
+        runLink(&link, 100000, nullptr, nullptr);
+
+        RtlZeroMemory(&trace, sizeof(trace));
+        trace.lCorrectionMin = trace.lFillMin = MAXLONG;
+        trace.lCorrectionMax = trace.lFillMax = MINLONG;
+
+        runLink(&link, 20000, traceLoop, &trace);
+
+        const LONG mean = (LONG)(trace.llCorrectionSum / trace.ulCount);
+
+        printf("       %5d ppm: correction %d ppm, %d..%d, fill %+d..%+d\n",
+               ppms[p], mean, trace.lCorrectionMin, trace.lCorrectionMax, trace.lFillMin, trace.lFillMax);
+
+        converter.getStats(&stats);
+        CHECK_EQUAL(0, stats.ulUnderflows);
+        CHECK_EQUAL(0, stats.ulOverflows);
+
+        CHECK(labs(mean - ppms[p]) <= 2);
+        CHECK(trace.lCorrectionMax - trace.lCorrectionMin <= 320);
+        CHECK(trace.lFillMin >= -BURST_FRAMES - RATE / 1000);
+        CHECK(trace.lFillMax <=  BURST_FRAMES + RATE / 1000);
+
+        freeLink(&link);
+    }
+
+    TestReleasePerformanceCounter();
+}
+
+//=============================================================================
+// Residual of a least-squares fit of the capture to a tone at the frequency
+// the render clock plays it at, accumulated over the bursts inspected.
+typedef struct _TONE_FIT
+{
+    double      dFrequency;         // Cycles per capture frame.
+    double      dSignal;
+    double      dResidual;
+    LONG        lPeak;
+} TONE_FIT;
+
+static void fitTone(IN LINK* link, IN PVOID context)
+{
+    TONE_FIT* fit = (TONE_FIT*)context;
+    double    cc  = 0, cs = 0, ss = 0, xc = 0, xs = 0;
+
+    // The phase is taken from the start of the burst, which keeps the
+    // cosine and sine accurate in double.
+    //
+    for (ULONG i = 0; i < BURST_FRAMES; i++)
+    {
+        const double phase = 2 * M_PI * fit->dFrequency * i;
+        const double x     = sampleAt(link->Capture, &link->CaptureFormat, i, 0);
+
+        cc += cos(phase) * cos(phase);
+        cs += cos(phase) * sin(phase);
+        ss += sin(phase) * sin(phase);
+        xc += x * cos(phase);
+        xs += x * sin(phase);
+
+        fit->lPeak = max(fit->lPeak, labs((LONG)x));
+    }
+
+    const double det = cc * ss - cs * cs;
+    const double a   = (xc * ss - xs * cs) / det;
+    const double b   = (xs * cc - xc * cs) / det;
+
+    for (ULONG i = 0; i < BURST_FRAMES; i++)
+    {
+        const double phase = 2 * M_PI * fit->dFrequency * i;
+        const double x     = sampleAt(link->Capture, &link->CaptureFormat, i, 0);
+        const double e     = x - a * cos(phase) - b * sin(phase);
+
+        fit->dSignal   += x * x;
+        fit->dResidual += e * e;
+    }
+}
+
+//=============================================================================
+// A tone comes through at its level, clean of the resampling, once the loop
+// has settled. Off the nominal rate the ripple of the correction bends the
+// tone a little, which the fit to a fixed frequency counts as residual.
+TEST(ToneComesThroughClean)
+{
+    const LONG ppms[] = { 0, 300, -1000 };
+
+    TestHoldPerformanceCounter(1000 * MS);
+
+    for (ULONG p = 0; p < RTL_NUMBER_OF(ppms); p++)
+    {
+        AsyncRateConverter converter;
+        LINK               link;
+        TONE_FIT           fit;
+
+        RtlZeroMemory(&fit, sizeof(fit));
+        fit.dFrequency = TONE_HZ * (1 + ppms[p] * 1e-6) / RATE;
+
+        CHECK_EQUAL(STATUS_SUCCESS, converter.allocate());
+        initLink(&link, &converter, ppms[p]);
+
+        runLink(&link, 60000, nullptr, nullptr);
+        runLink(&link, 10000, fitTone, &fit);
+
+        const double snr = 10 * log10(fit.dSignal / fit.dResidual);
+
+        printf("       %5d ppm: peak %d, signal to residual %.1f dB\n", ppms[p], fit.lPeak, snr);
+
+        CHECK(labs(fit.lPeak - TONE_LEVEL) <= TONE_LEVEL / 100);
+        CHECK(snr > 55);
+
+        freeLink(&link);
+    }
+
+    TestReleasePerformanceCounter();
+}
+
+//=============================================================================
+// Every sample width converts both ways, and the reader maps its channel c
+// to writer channel c % channels.
+TEST(FormatsAndChannelsMap)
+{
+    const WORD bits[] = { 8, 16, 24, 32 };
+
+    for (ULONG w = 0; w < RTL_NUMBER_OF(bits); w++)
+    {
+        for (ULONG r = 0; r < RTL_NUMBER_OF(bits); r++)
+        {
+            AsyncRateConverter converter;
+            WAVEFORMATEX       renderFormat;
+            WAVEFORMATEX       captureFormat;
+            BYTE               render[BURST_FRAMES * 3 * 4];
+            BYTE               capture[BURST_FRAMES * 5 * 4];
+            const LONG         levels[3] = { 12800, -7680, 256 };
+
+            CHECK_EQUAL(STATUS_SUCCESS, converter.allocate());
+
+            initFormat(&renderFormat,  RATE, 3, bits[w]);
+            initFormat(&captureFormat, RATE, 5, bits[r]);
+
+            // A constant level on each channel, which the filter passes as is.
+            //
+            for (ULONG i = 0; i < BURST_FRAMES; i++)
+            {
+                for (ULONG channel = 0; channel < 3; channel++)
+                {
+                    const PBYTE sample = render + i * renderFormat.nBlockAlign + channel * bits[w] / 8;
+                    const LONG  value  = levels[channel];
+
+                    switch (bits[w])
+                    {
+                        case 8:  *sample = (BYTE)((value >> 8) + 0x80); break;
+                        case 16: *(SHORT*)sample = (SHORT)value; break;
+                        case 24: sample[0] = 0; sample[1] = (BYTE)value; sample[2] = (BYTE)(value >> 8); break;
+                        default: *(LONG*)sample = value << 16; break;
+                    }
+                }
+            }
+
+            TestHoldPerformanceCounter(1000 * MS);
+
+            for (ULONG n = 0; n < 10; n++)
+            {
+                write(&converter, &renderFormat, &renderFormat, render, BURST_FRAMES * renderFormat.nBlockAlign);
+                TestAdvancePerformanceCounter(10 * MS);
+            }
+
+            read(&converter, &captureFormat, capture, BURST_FRAMES * captureFormat.nBlockAlign);
+
+            TestReleasePerformanceCounter();
+
+            ULONG errors = 0;
+
+            for (ULONG i = 0; i < BURST_FRAMES; i++)
+            {
+                for (ULONG channel = 0; channel < 5; channel++)
+                {
+                    errors += labs(sampleAt(capture, &captureFormat, i, channel) - levels[channel % 3]) > 1;
+                }
+            }
+
+            CHECK_EQUAL(0, errors);
+        }
+    }
+}
+
+//=============================================================================
+// A capture finds silence until the writer is the target latency ahead, an
+// underflow when the writer stops, and an overflow once the writer runs so
+// far ahead it laps the FIFO.
+TEST(UnderflowsAndOverflowsRestartTheReader)
+{
+    AsyncRateConverter converter;
+    ASRC_STATS         stats;
+    WAVEFORMATEX       format;
+    SHORT              render[BURST_FRAMES];
+    SHORT              capture[BURST_FRAMES];
+
+    CHECK_EQUAL(STATUS_SUCCESS, converter.allocate());
+
+    initFormat(&format, RATE, 1, 16);
+
+    for (ULONG i = 0; i < BURST_FRAMES; i++)
+    {
+        render[i] = 1000;
+    }
+
+    TestHoldPerformanceCounter(1000 * MS);
+
+    // No writer yet.
+    //
+    RtlFillMemory(capture, sizeof(capture), 0x55);
+    read(&converter, &format, (PBYTE)capture, sizeof(capture));
+    CHECK_EQUAL(0, capture[0] | capture[BURST_FRAMES - 1]);
+
+    // One burst is not the target latency of 20 ms.
+    //
+    write(&converter, &format, &format, (PBYTE)render, sizeof(render));
+    read(&converter, &format, (PBYTE)capture, sizeof(capture));
+    CHECK_EQUAL(0, capture[0] | capture[BURST_FRAMES - 1]);
+
+    write(&converter, &format, &format, (PBYTE)render, sizeof(render));
+    write(&converter, &format, &format, (PBYTE)render, sizeof(render));
+    read(&converter, &format, (PBYTE)capture, sizeof(capture));
+    CHECK(labs(capture[BURST_FRAMES - 1] - 1000) <= 1);
+
+    // The writer stops. The reader runs dry and records silence, and does
+    // not start over on what it already read.
+    //
+    read(&converter, &format, (PBYTE)capture, sizeof(capture));
+    read(&converter, &format, (PBYTE)capture, sizeof(capture));
+    converter.getStats(&stats);
+    CHECK_EQUAL(1, stats.ulUnderflows);
+    CHECK_EQUAL(0, capture[0] | capture[BURST_FRAMES - 1]);
+
+    read(&converter, &format, (PBYTE)capture, sizeof(capture));
+    CHECK_EQUAL(0, capture[0] | capture[BURST_FRAMES - 1]);
+
+    // It reads again once the writer is the target latency ahead anew.
+    //
+    write(&converter, &format, &format, (PBYTE)render, sizeof(render));
+    read(&converter, &format, (PBYTE)capture, sizeof(capture));
+    CHECK_EQUAL(0, capture[BURST_FRAMES - 1]);
+
+    write(&converter, &format, &format, (PBYTE)render, sizeof(render));
+    write(&converter, &format, &format, (PBYTE)render, sizeof(render));
+    read(&converter, &format, (PBYTE)capture, sizeof(capture));
+    CHECK(labs(capture[BURST_FRAMES - 1] - 1000) <= 1);
+
+    converter.getStats(&stats);
+    CHECK_EQUAL(1, stats.ulUnderflows);
+
+    // The writer runs a FIFO ahead of a reader that stalled.
+    //
+    for (ULONG n = 0; n < ASRC_FIFO_FRAMES / BURST_FRAMES + 1; n++)
+    {
+        write(&converter, &format, &format, (PBYTE)render, sizeof(render));
+    }
+
+    converter.getStats(&stats);
+    CHECK_EQUAL(1, stats.ulOverflows);
+
+    TestReleasePerformanceCounter();
+}
+
+//=============================================================================
+// Only the first render stream writes, until it detaches.
+TEST(OneWriterAtATime)
+{
+    AsyncRateConverter converter;
+    WAVEFORMATEX       format;
+    SHORT              first[BURST_FRAMES];
+    SHORT              second[BURST_FRAMES];
+    SHORT              capture[BURST_FRAMES];
+    int                writers[2];
+
+    CHECK_EQUAL(STATUS_SUCCESS, converter.allocate());
+
+    initFormat(&format, RATE, 1, 16);
+
+    for (ULONG i = 0; i < BURST_FRAMES; i++)
+    {
+        first[i]  = 1000;
+        second[i] = -2000;
+    }
+
+    TestHoldPerformanceCounter(1000 * MS);
+
+    for (ULONG n = 0; n < 4; n++)
+    {
+        write(&converter, &writers[0], &format, (PBYTE)first, sizeof(first));
+        write(&converter, &writers[1], &format, (PBYTE)second, sizeof(second));
+    }
+
+    read(&converter, &format, (PBYTE)capture, sizeof(capture));
+    CHECK(labs(capture[BURST_FRAMES - 1] - 1000) <= 1);
+
+    converter.detachWriter(&writers[0]);
+
+    for (ULONG n = 0; n < 4; n++)
+    {
+        write(&converter, &writers[1], &format, (PBYTE)second, sizeof(second));
+    }
+
+    read(&converter, &format, (PBYTE)capture, sizeof(capture));
+    CHECK(labs(capture[BURST_FRAMES - 1] - (-2000)) <= 1);
+
+    // A capture at another rate is not converted, it records silence.
+    //
+    WAVEFORMATEX other;
+
+    initFormat(&other, 44100, 1, 16);
+    read(&converter, &other, (PBYTE)capture, sizeof(capture));
+    CHECK_EQUAL(0, capture[0] | capture[BURST_FRAMES - 1]);
+
+    TestReleasePerformanceCounter();
+}
+
+//=============================================================================
+// Cost of a 10 ms capture burst of 48 kHz stereo 16-bit through the
+// resampler, with the writer a burst ahead of each read.
+TEST(BenchmarkAsrcRead)
+{
+    AsyncRateConverter converter;
+    ASRC_STATS         stats;
+    WAVEFORMATEX       format;
+    SHORT              render[BURST_FRAMES * 2];
+    SHORT              capture[BURST_FRAMES * 2];
+    const ULONG        count = 20000;
+    double             elapsed = 0;
+
+    CHECK_EQUAL(STATUS_SUCCESS, converter.allocate());
+
+    initFormat(&format, RATE, 2, 16);
+    RtlZeroMemory(render, sizeof(render));
+
+    TestHoldPerformanceCounter(1000 * MS);
+
+    for (ULONG n = 0; n < count; n++)
+    {
+        write(&converter, &format, &format, (PBYTE)render, sizeof(render));
+
+        const double start = TestSeconds();
+
+        read(&converter, &format, (PBYTE)capture, sizeof(capture));
+
+        elapsed += TestSeconds() - start;
+    }
+
+    TestReleasePerformanceCounter();
+
+    converter.getStats(&stats);
+    CHECK_EQUAL(0, stats.ulUnderflows);
+
+    printf("       %.2f us per 10 ms burst\n", elapsed * 1e6 / count);
+}
@@ -0,0 +1,364 @@
+/*
+Abstract:
+    Tests of the device clock error model, and of the frame counts the DMA
+    engine derives its position from.
+*/
+
+#include <msvad.h>
+#include "devclock.h"
+#include "test.h"
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+#define MS                          10000ULL        // 100 ns units.
+#define HOUR                        (3600 * 1000 * MS)
+
+//=============================================================================
+// Types
+//=============================================================================
+
+typedef struct _ENGINE_FORMAT
+{
+    ULONG       ulFrameRate;
+    ULONG       ulBlockAlign;
+    ULONG       ulBurstFrames;
+} ENGINE_FORMAT;
+
+// The position state of the DMA engine in basewave.cpp.
+typedef struct _ENGINE
+{
+    ULONGLONG   ullGridStart;
+    ULONGLONG   ullFrames;
+    ULONG       ulPendingBytes;
+    ULONG       ulPosition;
+    ULONG       ulBufferSize;
+    ULONGLONG   ullMovedBytes;
+} ENGINE;
+
+//=============================================================================
+// floor(time * frameRate / 10^7), in 128 bits.
+static ULONGLONG exactFrames(IN ULONGLONG time, IN ULONG frameRate)
+{
+    return (ULONGLONG)((unsigned __int128)time * frameRate / _100NS_UNITS_PER_SECOND);
+}
+
+//=============================================================================
+// One run of the engine at time, with the arithmetic of advanceDma.
+static void runEngine(IN OUT ENGINE* engine, IN const ENGINE_FORMAT* format, IN PCLOCK_ERROR_PARAMS clock, IN ULONGLONG time)
+{
+    const ULONGLONG frames     = DeviceFrames(clock, time, format->ulFrameRate) - engine->ullGridStart;
+    const ULONG     burstBytes = format->ulBurstFrames * format->ulBlockAlign;
+    const ULONGLONG pending    = engine->ulPendingBytes + (frames - engine->ullFrames) * format->ulBlockAlign;
+
+    engine->ullFrames      = frames;
+    engine->ulPendingBytes = (ULONG)(pending % burstBytes);
+
+    const ULONGLONG moved = pending - engine->ulPendingBytes;
+
+    engine->ullMovedBytes += moved;
+    engine->ulPosition     = (ULONG)((engine->ulPosition + moved) % engine->ulBufferSize);
+}
+
+//=============================================================================
+// Calls at random intervals for a day, on an adapter that has been up for
+// days, with now and then a gap of minutes that a 32-bit byte count would
+// not survive at the higher rates. The frame count and the position must
+// match the exact count of frames since the start after every call, so
+// nothing is lost or gained however the calls fall.
+TEST(DayOfRandomCallsHasNoCumulativeError)
+{
+    const ENGINE_FORMAT formats[] =
+    {
+        {   8000,  2,  1 },
+        {  11025,  1,  1 },
+        {  44100,  4,  1 },
+        {  44100,  6, 32 },
+        {  48000,  8, 48 },
+        {  96000, 24,  1 },
+        { 192000,  8, 16 },
+        { 384000, 32,  1 },
+    };
+
+    CLOCK_ERROR_PARAMS exact;
+
+    RtlZeroMemory(&exact, sizeof(exact));
+
+    for (ULONG f = 0; f < RTL_NUMBER_OF(formats); f++)
+    {
+        const ENGINE_FORMAT* format = &formats[f];
+        const ULONGLONG      start  = 3 * 24 * HOUR + TestRandom() % HOUR;
+        ENGINE               engine;
+        ULONG                errors = 0;
+        ULONG                calls  = 0;
+
+        RtlZeroMemory(&engine, sizeof(engine));
+
+        engine.ulBufferSize = format->ulFrameRate / 10 * format->ulBlockAlign;
+        engine.ullGridStart = DeviceFrames(&exact, start, format->ulFrameRate);
+
+        for (ULONGLONG time = start; time - start < 24 * HOUR; calls++)
+        {
+            const ULONGLONG random = TestRandom();
+
+            time += random % 100000 ? random % (30 * MS) : (random >> 32) % (20 * 60 * 1000 * MS);
+
+            runEngine(&engine, format, &exact, time);
+
+            const ULONGLONG frames = exactFrames(time, format->ulFrameRate) - exactFrames(start, format->ulFrameRate);
+
+            if (engine.ullFrames != frames ||
+                engine.ullMovedBytes + engine.ulPendingBytes != frames * format->ulBlockAlign ||
+                engine.ulPosition != engine.ullMovedBytes % engine.ulBufferSize)
+            {
+                errors++;
+            }
+        }
+
+        CHECK_EQUAL(0, errors);
+        CHECK(calls > 24 * 3600 * 1000 / 30);
+    }
+}
+
+//=============================================================================
+// With a clock error the count is exact in device time, and never goes
+// backwards, also over centuries of run time.
+TEST(DeviceFramesAreExactInDeviceTime)
+{
+    const ULONG rates[] = { 8000, 44100, 48000, 96000, 176400, 384000 };
+
+    CLOCK_ERROR_PARAMS clock;
+
+    RtlZeroMemory(&clock, sizeof(clock));
+
+    clock.lOffsetPpb       = -37000;
+    clock.ulWanderPpb      = 5000;
+    clock.ulWanderPeriodMs = 600000;
+    clock.ulJitterUs       = 20;
+    clock.ulSeed           = 7;
+
+    CHECK_EQUAL(STATUS_SUCCESS, ValidateClockError(&clock));
+
+    for (ULONG r = 0; r < RTL_NUMBER_OF(rates); r++)
+    {
+        ULONGLONG time     = 0;
+        ULONGLONG previous = 0;
+        ULONG     errors   = 0;
+
+        for (ULONG step = 0; step < 200000; step++)
+        {
+            const ULONGLONG random = TestRandom();
+
+            time += step < 100000 ? random % (50 * MS) : random % (100 * HOUR);
+
+            const ULONGLONG frames = DeviceFrames(&clock, time, rates[r]);
+
+            if (frames != exactFrames(DeviceTime(&clock, time), rates[r]) || frames < previous)
+            {
+                errors++;
+            }
+
+            previous = frames;
+        }
+
+        CHECK_EQUAL(0, errors);
+    }
+}
+
+//=============================================================================
+// The constant offset is exact to the 100 ns unit at any run time.
+TEST(OffsetIsExactInPpb)
+{
+    const LONG offsets[] = { 1, -1, 37000, -37000, CLOCK_MAX_OFFSET_PPB, -CLOCK_MAX_OFFSET_PPB };
+
+    CLOCK_ERROR_PARAMS clock;
+
+    RtlZeroMemory(&clock, sizeof(clock));
+
+    for (ULONG o = 0; o < RTL_NUMBER_OF(offsets); o++)
+    {
+        ULONG errors = 0;
+
+        clock.lOffsetPpb = offsets[o];
+        CHECK_EQUAL(STATUS_SUCCESS, ValidateClockError(&clock));
+
+        for (ULONG step = 0; step < 100000; step++)
+        {
+            const ULONGLONG time  = TestRandom() % (step & 1 ? 24 * HOUR : 100000 * 24 * HOUR);
+            const LONGLONG  exact = (LONGLONG)((__int128)time * offsets[o] / 1000000000);
+
+            errors += ClockError(&clock, time) != exact;
+        }
+
+        CHECK_EQUAL(0, errors);
+    }
+}
+
+//=============================================================================
+// The wander is back to zero at the end of every period, peaks at an
+// eighth of the period at the peak rate, and its rate never exceeds the
+// peak.
+TEST(WanderIsBoundedAndPeriodic)
+{
+    const ULONG periods[] = { CLOCK_MIN_WANDER_PERIOD_MS, 600000, CLOCK_MAX_WANDER_PERIOD_MS };
+
+    CLOCK_ERROR_PARAMS clock;
+
+    RtlZeroMemory(&clock, sizeof(clock));
+
+    clock.ulWanderPpb = 50000;
+
+    for (ULONG p = 0; p < RTL_NUMBER_OF(periods); p++)
+    {
+        const ULONGLONG period = periods[p] * MS;
+        const LONGLONG  bound  = (LONGLONG)clock.ulWanderPpb * periods[p] / 8 / 100000;
+        const ULONGLONG step   = period / 1000;
+        LONGLONG        peak   = 0;
+        LONGLONG        slope  = 0;
+        ULONG           errors = 0;
+
+        clock.ulWanderPeriodMs = periods[p];
+        CHECK_EQUAL(STATUS_SUCCESS, ValidateClockError(&clock));
+
+        for (ULONG n = 0; n < 10; n++)
+        {
+            errors += ClockError(&clock, (TestRandom() % 100000) * period) != 0;
+        }
+
+        LONGLONG previous = ClockError(&clock, 0);
+
+        for (ULONGLONG time = step; time <= 3 * period; time += step)
+        {
+            const LONGLONG error = ClockError(&clock, time);
+
+            peak     = max(peak, llabs(error));
+            slope    = max(slope, llabs(error - previous));
+            previous = error;
+        }
+
+        CHECK_EQUAL(0, errors);
+        CHECK(peak <= bound);
+        CHECK(peak >= bound - 1);
+
+        // At most the peak rate over a step, give or take a unit of rounding
+        // at either end.
+        //
+        CHECK(slope <= (LONGLONG)(step * clock.ulWanderPpb / 1000000000) + 2);
+    }
+}
+
+//=============================================================================
+// Jitter stays within its peak, starts at zero, is the same for the same
+// seed and different for another, and never turns the device time back.
+TEST(JitterIsBoundedAndSeeded)
+{
+    CLOCK_ERROR_PARAMS clock;
+    CLOCK_ERROR_PARAMS other;
+
+    RtlZeroMemory(&clock, sizeof(clock));
+
+    clock.ulJitterUs = CLOCK_MAX_JITTER_US;
+    clock.ulSeed     = 11;
+    other            = clock;
+    other.ulSeed     = 12;
+
+    CHECK_EQUAL(STATUS_SUCCESS, ValidateClockError(&clock));
+    CHECK_EQUAL(0, ClockError(&clock, 0));
+
+    const LONGLONG peak     = clock.ulJitterUs * 10;
+    LONGLONG       largest  = 0;
+    ULONG          outside  = 0;
+    ULONG          backward = 0;
+    ULONG          same     = 0;
+
+    for (ULONG step = 0; step < 100000; step++)
+    {
+        const ULONGLONG time  = TestRandom() % (1000 * 24 * HOUR);
+        const LONGLONG  error = ClockError(&clock, time);
+
+        outside  += llabs(error) > peak;
+        backward += DeviceTime(&clock, time + 1) < DeviceTime(&clock, time);
+        same     += ClockError(&other, time) == error;
+        largest   = max(largest, llabs(error));
+
+        CHECK_EQUAL(error, ClockError(&clock, time));
+    }
+
+    CHECK_EQUAL(0, outside);
+    CHECK_EQUAL(0, backward);
+    CHECK(largest > peak * 9 / 10);
+    CHECK(same < 1000);
+}
+
+//=============================================================================
+// The components add: the error of all three is the sum of each alone.
+TEST(ErrorsAdd)
+{
+    CLOCK_ERROR_PARAMS clock;
+
+    RtlZeroMemory(&clock, sizeof(clock));
+
+    clock.lOffsetPpb       = -20000;
+    clock.ulWanderPpb      = 3000;
+    clock.ulWanderPeriodMs = 90000;
+    clock.ulJitterUs       = 40;
+    clock.ulSeed           = 3;
+
+    CLOCK_ERROR_PARAMS offset = clock;
+    CLOCK_ERROR_PARAMS wander = clock;
+    CLOCK_ERROR_PARAMS jitter = clock;
+
+    offset.ulWanderPpb = offset.ulJitterUs = 0;
+    wander.lOffsetPpb  = 0;
+    wander.ulJitterUs  = 0;
+    jitter.lOffsetPpb  = 0;
+    jitter.ulWanderPpb = 0;
+
+    ULONG errors = 0;
+
+    for (ULONG step = 0; step < 100000; step++)
+    {
+        const ULONGLONG time = TestRandom() % (100 * 24 * HOUR);
+
+        errors += ClockError(&clock, time) !=
+                  ClockError(&offset, time) + ClockError(&wander, time) + ClockError(&jitter, time);
+    }
+
+    CHECK_EQUAL(0, errors);
+}
+
+//=============================================================================
+TEST(ClockErrorsOutOfRangeAreRejected)
+{
+    CLOCK_ERROR_PARAMS clock;
+
+    RtlZeroMemory(&clock, sizeof(clock));
+    CHECK_EQUAL(STATUS_SUCCESS, ValidateClockError(&clock));
+
+    clock.lOffsetPpb = -CLOCK_MAX_OFFSET_PPB - 1;
+    CHECK_EQUAL(STATUS_INVALID_PARAMETER, ValidateClockError(&clock));
+
+    clock.lOffsetPpb = CLOCK_MAX_OFFSET_PPB + 1;
+    CHECK_EQUAL(STATUS_INVALID_PARAMETER, ValidateClockError(&clock));
+
+    RtlZeroMemory(&clock, sizeof(clock));
+    clock.ulJitterUs = CLOCK_MAX_JITTER_US + 1;
+    CHECK_EQUAL(STATUS_INVALID_PARAMETER, ValidateClockError(&clock));
+
+    // The wander period only matters with a wander.
+    //
+    RtlZeroMemory(&clock, sizeof(clock));
+    clock.ulWanderPeriodMs = 1;
+    CHECK_EQUAL(STATUS_SUCCESS, ValidateClockError(&clock));
+
+    clock.ulWanderPpb = 1;
+    CHECK_EQUAL(STATUS_INVALID_PARAMETER, ValidateClockError(&clock));
+
+    clock.ulWanderPeriodMs = CLOCK_MAX_WANDER_PERIOD_MS + 1;
+    CHECK_EQUAL(STATUS_INVALID_PARAMETER, ValidateClockError(&clock));
+
+    clock.ulWanderPpb = CLOCK_MAX_WANDER_PPB + 1;
+    clock.ulWanderPeriodMs = CLOCK_MIN_WANDER_PERIOD_MS;
+    CHECK_EQUAL(STATUS_INVALID_PARAMETER, ValidateClockError(&clock));
+}
@@ -0,0 +1,343 @@
+/*
+Abstract:
+    Tests and benchmark of the pool of stream DMA buffers.
+*/
+
+#include <thread>
+
+#include <msvad.h>
+#include "dmapool.h"
+#include "kernel.h"
+#include "test.h"
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+#define THREADS                     8
+#define STRESS_SECONDS              0.5
+#define POOL_SIZES                  4
+
+//=============================================================================
+// Types
+//=============================================================================
+
+typedef struct _STRESS
+{
+    DmaBufferPool*      Pool;
+    BOOLEAN volatile    fStop;
+    ULONGLONG           ullAcquires[THREADS];
+    ULONGLONG           ullOverwritten[THREADS];    // Buffers another thread wrote to.
+    ULONGLONG           ullMisaligned[THREADS];
+} STRESS;
+
+static STRESS Stress;
+
+// A size within each class, and one beyond them.
+static const ULONG Sizes[POOL_SIZES + 1] =
+{
+    DMA_BUFFER_MIN_SIZE - 100,
+    6 * PAGE_SIZE,
+    DMA_BUFFER_SIZE,
+    DMA_BUFFER_POOLED_MAX_SIZE,
+    DMA_BUFFER_POOLED_MAX_SIZE + 1
+};
+
+//=============================================================================
+static BOOLEAN pageAligned(IN PVOID buffer)
+{
+    return !((ULONG_PTR)buffer & (PAGE_SIZE - 1));
+}
+
+//=============================================================================
+// The preallocated buffers are handed out first, and a released buffer is
+// the next one handed out of its class.
+TEST(ReleasedBuffersAreReused)
+{
+    DmaBufferPool  pool;
+    DMA_POOL_STATS stats;
+
+    CHECK_EQUAL(STATUS_SUCCESS, pool.init());
+
+    PVOID first  = pool.acquire(DMA_BUFFER_SIZE);
+    PVOID second = pool.acquire(DMA_BUFFER_SIZE);
+
+    CHECK(first && second && first != second);
+
+    pool.release(first, DMA_BUFFER_SIZE);
+    CHECK(pool.acquire(DMA_BUFFER_SIZE) == first);
+
+    pool.release(first, DMA_BUFFER_SIZE);
+    pool.release(second, DMA_BUFFER_SIZE);
+
+    pool.getStats(&stats);
+    CHECK_EQUAL(3, stats.ulHits);
+    CHECK_EQUAL(0, stats.ulMisses);
+    CHECK_EQUAL(3, stats.PoolLatency.ulCount);
+}
+
+//=============================================================================
+// Each size lands in the smallest class that fits it, empty classes
+// allocate, larger sizes bypass the pool, and every buffer is page aligned.
+TEST(SizesFallInTheirClass)
+{
+    DmaBufferPool  pool;
+    DMA_POOL_STATS stats;
+    PVOID          buffers[POOL_SIZES + 1][8];
+
+    CHECK_EQUAL(STATUS_SUCCESS, pool.init());
+
+    for (ULONG s = 0; s <= POOL_SIZES; s++)
+    {
+        for (ULONG i = 0; i < RTL_NUMBER_OF(buffers[s]); i++)
+        {
+            buffers[s][i] = pool.acquire(Sizes[s]);
+
+            CHECK(buffers[s][i] && pageAligned(buffers[s][i]));
+
+            RtlFillMemory(buffers[s][i], Sizes[s], (UCHAR)s);
+        }
+    }
+
+    // 2, 2, 4 and 0 buffers preallocated in the classes.
+    //
+    pool.getStats(&stats);
+    CHECK_EQUAL(8, stats.ulHits);
+    CHECK_EQUAL(4 * 8 - 8, stats.ulMisses);
+    CHECK_EQUAL(8, stats.ulOversize);
+    CHECK_EQUAL(stats.ulMisses + stats.ulOversize, stats.AllocLatency.ulCount - 8);
+
+    for (ULONG s = 0; s <= POOL_SIZES; s++)
+    {
+        for (ULONG i = 0; i < RTL_NUMBER_OF(buffers[s]); i++)
+        {
+            pool.release(buffers[s][i], Sizes[s]);
+        }
+    }
+
+    // A class is served by buffers released from the same class only.
+    //
+    for (ULONG s = 0; s < POOL_SIZES; s++)
+    {
+        PVOID   buffer = pool.acquire(Sizes[s]);
+        BOOLEAN own    = FALSE;
+
+        for (ULONG i = 0; i < RTL_NUMBER_OF(buffers[s]); i++)
+        {
+            own = own || buffer == buffers[s][i];
+        }
+
+        CHECK(own);
+        pool.release(buffer, Sizes[s]);
+    }
+}
+
+//=============================================================================
+// A class keeps at most its limit of free buffers; a burst of streams gives
+// the rest back to nonpaged pool.
+TEST(FreeListsAreBounded)
+{
+    DmaBufferPool  pool;
+    DMA_POOL_STATS stats;
+    PVOID          buffers[24];
+
+    CHECK_EQUAL(STATUS_SUCCESS, pool.init());
+
+    for (ULONG i = 0; i < RTL_NUMBER_OF(buffers); i++)
+    {
+        buffers[i] = pool.acquire(DMA_BUFFER_MIN_SIZE);
+    }
+
+    for (ULONG i = 0; i < RTL_NUMBER_OF(buffers); i++)
+    {
+        pool.release(buffers[i], DMA_BUFFER_MIN_SIZE);
+    }
+
+    pool.getStats(&stats);
+    const ULONG hits   = stats.ulHits;
+    const ULONG misses = stats.ulMisses;
+
+    for (ULONG i = 0; i < RTL_NUMBER_OF(buffers); i++)
+    {
+        buffers[i] = pool.acquire(DMA_BUFFER_MIN_SIZE);
+    }
+
+    pool.getStats(&stats);
+    CHECK_EQUAL(16, stats.ulHits - hits);
+    CHECK_EQUAL(RTL_NUMBER_OF(buffers) - 16, stats.ulMisses - misses);
+
+    for (ULONG i = 0; i < RTL_NUMBER_OF(buffers); i++)
+    {
+        pool.release(buffers[i], DMA_BUFFER_MIN_SIZE);
+    }
+}
+
+//=============================================================================
+// Latencies are kept in power-of-two buckets: with the counter held every
+// acquire takes 0 ns, which is the bucket of up to 1 ns.
+TEST(LatenciesFallInTheirBucket)
+{
+    DmaBufferPool  pool;
+    DMA_POOL_STATS stats;
+
+    TestHoldPerformanceCounter(1000);
+
+    CHECK_EQUAL(STATUS_SUCCESS, pool.init());
+
+    for (ULONG i = 0; i < 100; i++)
+    {
+        pool.release(pool.acquire(DMA_BUFFER_SIZE), DMA_BUFFER_SIZE);
+    }
+
+    TestReleasePerformanceCounter();
+
+    pool.getStats(&stats);
+    CHECK_EQUAL(100, stats.PoolLatency.ulCount);
+    CHECK_EQUAL(1, stats.PoolLatency.ulP50);
+    CHECK_EQUAL(1, stats.PoolLatency.ulP99);
+}
+
+//=============================================================================
+// Each thread stamps the buffers it holds with its own index and checks the
+// stamp before it gives them back, so a buffer handed to two threads at
+// once shows as overwritten. TestRandom is not shared between threads, so
+// each runs a generator of its own.
+static void worker(IN ULONG index)
+{
+    PVOID     held[4]  = { nullptr, nullptr, nullptr, nullptr };
+    ULONG     sizes[4] = { 0, 0, 0, 0 };
+    ULONGLONG state    = 0x9E3779B97F4A7C15ULL * (index + 1);
+
+    while (!Stress.fStop)
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+
+        const ULONGLONG random = state;
+        const ULONG     slot   = random % RTL_NUMBER_OF(held);
+
+        if (held[slot])
+        {
+            const PULONG words = (PULONG)held[slot];
+
+            for (ULONG i = 0; i < sizes[slot] / sizeof(ULONG); i += PAGE_SIZE / sizeof(ULONG))
+            {
+                if (words[i] != index)
+                {
+                    Stress.ullOverwritten[index]++;
+                    break;
+                }
+            }
+
+            Stress.Pool->release(held[slot], sizes[slot]);
+            held[slot] = nullptr;
+            continue;
+        }
+
+        sizes[slot] = Sizes[(random >> 8) % (random & 0x10000 ? POOL_SIZES + 1 : 3)];
+        held[slot]  = Stress.Pool->acquire(sizes[slot]);
+
+        if (!pageAligned(held[slot]))
+        {
+            Stress.ullMisaligned[index]++;
+        }
+
+        const PULONG words = (PULONG)held[slot];
+
+        for (ULONG i = 0; i < sizes[slot] / sizeof(ULONG); i += PAGE_SIZE / sizeof(ULONG))
+        {
+            words[i] = index;
+        }
+
+        Stress.ullAcquires[index]++;
+    }
+
+    for (ULONG slot = 0; slot < RTL_NUMBER_OF(held); slot++)
+    {
+        if (held[slot])
+        {
+            Stress.Pool->release(held[slot], sizes[slot]);
+        }
+    }
+}
+
+//=============================================================================
+TEST(ThreadsNeverShareABuffer)
+{
+    DmaBufferPool  pool;
+    DMA_POOL_STATS stats;
+    std::thread    threads[THREADS];
+
+    CHECK_EQUAL(STATUS_SUCCESS, pool.init());
+
+    RtlZeroMemory(&Stress, sizeof(Stress));
+    Stress.Pool = &pool;
+
+    for (ULONG i = 0; i < THREADS; i++)
+    {
+        threads[i] = std::thread(worker, i);
+    }
+
+    const double start = TestSeconds();
+
+    while (TestSeconds() - start < STRESS_SECONDS)
+    {
+        std::this_thread::yield();
+    }
+
+    Stress.fStop = TRUE;
+
+    for (ULONG i = 0; i < THREADS; i++)
+    {
+        threads[i].join();
+    }
+
+    ULONGLONG acquires = 0;
+
+    for (ULONG i = 0; i < THREADS; i++)
+    {
+        CHECK_EQUAL(0, Stress.ullOverwritten[i]);
+        CHECK_EQUAL(0, Stress.ullMisaligned[i]);
+
+        acquires += Stress.ullAcquires[i];
+    }
+
+    pool.getStats(&stats);
+    CHECK_EQUAL(acquires, (ULONGLONG)stats.ulHits + stats.ulMisses + stats.ulOversize);
+    CHECK(stats.ulHits > stats.ulMisses);
+
+    printf("       %llu acquires, %u hits, %u misses, %u oversize\n",
+           acquires, stats.ulHits, stats.ulMisses, stats.ulOversize);
+}
+
+//=============================================================================
+// Latency percentiles of stream buffer acquires from the pool against the
+// direct allocations the pool replaces. In user mode the direct path is
+// the C library allocator rather than nonpaged pool.
+TEST(BenchmarkAcquire)
+{
+    DmaBufferPool  pool;
+    DMA_POOL_STATS stats;
+
+    CHECK_EQUAL(STATUS_SUCCESS, pool.init());
+
+    for (ULONG i = 0; i < 100000; i++)
+    {
+        pool.release(pool.acquire(DMA_BUFFER_SIZE), DMA_BUFFER_SIZE);
+    }
+
+    // Oversize buffers are always allocated, and recorded as allocations.
+    //
+    for (ULONG i = 0; i < 100000; i++)
+    {
+        pool.release(pool.acquire(DMA_BUFFER_POOLED_MAX_SIZE + PAGE_SIZE), DMA_BUFFER_POOLED_MAX_SIZE + PAGE_SIZE);
+    }
+
+    pool.getStats(&stats);
+
+    printf("       pool       p50/p90/p99 %u/%u/%u ns of %u\n",
+           stats.PoolLatency.ulP50, stats.PoolLatency.ulP90, stats.PoolLatency.ulP99, stats.PoolLatency.ulCount);
+    printf("       allocation p50/p90/p99 %u/%u/%u ns of %u\n",
+           stats.AllocLatency.ulP50, stats.AllocLatency.ulP90, stats.AllocLatency.ulP99, stats.AllocLatency.ulCount);
+}
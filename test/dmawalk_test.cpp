@@ -0,0 +1,632 @@
+/*
+Abstract:
+    Tests and benchmark of the walk of the emulated DMA engine.
+*/
+
+#include <thread>
+#include <vector>
+
+#include <msvad.h>
+#include "dmawalk.h"
+#include "test.h"
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+#define STRESS_SECONDS              0.5
+#define FREQUENCY                   10000000LL      // Performance counter.
+#define BYTES_PER_SECOND            192000          // 48 kHz 16-bit stereo.
+#define PACKET_SIZE                 1920            // 10 ms.
+#define PACKET_TICKS                100000
+
+//=============================================================================
+// Types
+//=============================================================================
+
+// Stands in for the stream: checks every span against the position the
+// engine should be at, and counts the passes over each byte.
+typedef struct _CONSUMER
+{
+    PBYTE               Buffer;
+    ULONG               ulBufferSize;
+    ULONG               ulPosition;
+    ULONGLONG           ullBytes;
+    ULONG               ulSpans;
+    ULONG               ulErrors;
+    std::vector<ULONG>  Passes;
+} CONSUMER, *PCONSUMER;
+
+// A capture buffer shared with a client that maps it along with the
+// position register. The engine stamps each word it records with a running
+// count, and the client checks the count of every word up to the register.
+typedef struct _SHARED
+{
+    std::vector<ULONG>  Buffer;
+    ULONG               ulPositionRegister;
+    ULONG               ulStamp;
+    ULONGLONG volatile  ullClientBytes;     // Read by the client so far.
+    BOOLEAN volatile    fStop;
+    ULONGLONG           ullEngineBytes;
+    ULONGLONG           ullStale;
+} SHARED;
+
+static SHARED Shared;
+
+// Records each packet handed over and the time stamp of the one before.
+typedef struct _PACKET_LOG
+{
+    PDMA_PACKETS            Packets;
+    PBYTE                   Buffer;
+    std::vector<ULONG>      Offsets;
+    std::vector<ULONG>      Lengths;
+    std::vector<LONGLONG>   Qpcs;
+} PACKET_LOG, *PPACKET_LOG;
+
+//=============================================================================
+static void countSpan(IN PVOID context, IN PBYTE span, IN ULONG byteCount)
+{
+    const PCONSUMER consumer = (PCONSUMER)context;
+    const ULONG     offset   = (ULONG)(span - consumer->Buffer);
+
+    consumer->ulErrors += offset != consumer->ulPosition;
+    consumer->ulErrors += !byteCount || offset + byteCount > consumer->ulBufferSize;
+
+    if (!consumer->ulErrors)
+    {
+        for (ULONG i = 0; i < byteCount; i++)
+        {
+            consumer->Passes[offset + i]++;
+        }
+    }
+
+    consumer->ulPosition = (offset + byteCount) % consumer->ulBufferSize;
+    consumer->ullBytes  += byteCount;
+    consumer->ulSpans++;
+}
+
+//=============================================================================
+// Bytes short of a burst stay pending, however the elapsed bytes arrive.
+TEST(OnlyWholeBurstsMove)
+{
+    ULONG pending = 0;
+
+    CHECK_EQUAL(0, DmaWholeBursts(&pending, 100, 480));
+    CHECK_EQUAL(100, pending);
+    CHECK_EQUAL(480, DmaWholeBursts(&pending, 400, 480));
+    CHECK_EQUAL(20, pending);
+    CHECK_EQUAL(4800, DmaWholeBursts(&pending, 4800, 480));
+    CHECK_EQUAL(20, pending);
+    CHECK_EQUAL(1ULL << 40, DmaWholeBursts(&pending, (1ULL << 40) - 20, 1));
+    CHECK_EQUAL(0, pending);
+
+    for (ULONG trial = 0; trial < 1000; trial++)
+    {
+        const ULONG burst   = 1 + (ULONG)(TestRandom() % 10000);
+        ULONGLONG   elapsed = 0;
+        ULONGLONG   moved   = 0;
+
+        pending = 0;
+
+        for (ULONG n = 0; n < 100; n++)
+        {
+            const ULONGLONG bytes = TestRandom() % 20000;
+
+            elapsed += bytes;
+            moved   += DmaWholeBursts(&pending, bytes, burst);
+        }
+
+        CHECK(moved % burst == 0);
+        CHECK(pending < burst);
+        CHECK_EQUAL(elapsed, moved + pending);
+    }
+}
+
+//=============================================================================
+// Frames elapsing in uneven steps, as the timer runs, move the engine in
+// whole bursts through buffers of any size. Every span starts where the
+// last one ended and stops at the end of the buffer, and each pass over
+// the buffer touches every byte exactly once.
+TEST(SpansArriveOnceAndInOrder)
+{
+    const ULONG aligns[] = { 1, 2, 4, 6, 8, 24 };
+
+    for (ULONG trial = 0; trial < 200; trial++)
+    {
+        const ULONG         blockAlign = aligns[TestRandom() % RTL_NUMBER_OF(aligns)];
+        const ULONG         burstBytes = (1 + (ULONG)(TestRandom() % 1024)) * blockAlign;
+        std::vector<BYTE>   buffer((1 + TestRandom() % 4096) * blockAlign + TestRandom() % 2);
+        CONSUMER            consumer;
+        ULONG               position   = 0;
+        ULONG               pending    = 0;
+        ULONGLONG           frames     = 0;
+
+        consumer.Buffer       = buffer.data();
+        consumer.ulBufferSize = (ULONG)buffer.size();
+        consumer.ulPosition   = 0;
+        consumer.ullBytes     = 0;
+        consumer.ulSpans      = 0;
+        consumer.ulErrors     = 0;
+        consumer.Passes.assign(buffer.size(), 0);
+
+        for (ULONG n = 0; n < 1000; n++)
+        {
+            const ULONGLONG elapsed = TestRandom() % 3 ? TestRandom() % 2000 : 0;
+            const ULONGLONG bytes   = DmaWholeBursts(&pending, elapsed * blockAlign, burstBytes);
+
+            frames  += elapsed;
+            position = DmaWalk(buffer.data(), (ULONG)buffer.size(), position, bytes, countSpan, &consumer);
+
+            CHECK_EQUAL(consumer.ulPosition, position);
+        }
+
+        CHECK_EQUAL(0, consumer.ulErrors);
+        CHECK_EQUAL(frames * blockAlign, consumer.ullBytes + pending);
+        CHECK_EQUAL(consumer.ullBytes % buffer.size(), position);
+
+        // Whole passes, and the bytes before the position once more.
+        //
+        const ULONG passes = (ULONG)(consumer.ullBytes / buffer.size());
+        ULONG       wrong  = 0;
+
+        for (ULONG i = 0; i < buffer.size(); i++)
+        {
+            wrong += consumer.Passes[i] != passes + (i < position);
+        }
+
+        CHECK_EQUAL(0, wrong);
+    }
+}
+
+//=============================================================================
+// One call going round the buffer several times splits only at the end.
+TEST(LongWalksSplitAtTheEnd)
+{
+    BYTE     buffer[1000];
+    CONSUMER consumer;
+
+    consumer.Buffer       = buffer;
+    consumer.ulBufferSize = sizeof(buffer);
+    consumer.ulPosition   = 600;
+    consumer.ullBytes     = 0;
+    consumer.ulSpans      = 0;
+    consumer.ulErrors     = 0;
+    consumer.Passes.assign(sizeof(buffer), 0);
+
+    CHECK_EQUAL(100, DmaWalk(buffer, sizeof(buffer), 600, 2500, countSpan, &consumer));
+    CHECK_EQUAL(0, consumer.ulErrors);
+    CHECK_EQUAL(4, consumer.ulSpans);
+    CHECK_EQUAL(2500, consumer.ullBytes);
+
+    // Ending on the end of the buffer wraps the position to its start.
+    //
+    CHECK_EQUAL(0, DmaWalk(buffer, sizeof(buffer), 100, 900, countSpan, &consumer));
+    CHECK_EQUAL(5, consumer.ulSpans);
+
+    // Nothing to move, or nowhere to move it.
+    //
+    CHECK_EQUAL(0, DmaWalk(buffer, sizeof(buffer), 0, 0, countSpan, &consumer));
+    CHECK_EQUAL(0, DmaWalk(nullptr, 0, 0, 4800, countSpan, &consumer));
+    CHECK_EQUAL(5, consumer.ulSpans);
+}
+
+//=============================================================================
+// The register follows the position of the walk, and a stream without a
+// mapped register skips it.
+TEST(RegisterFollowsTheEngine)
+{
+    BYTE     buffer[4800];
+    ULONG    positionRegister = MAXULONG;
+    ULONG    position         = 0;
+    ULONG    pending          = 0;
+    CONSUMER consumer;
+
+    consumer.Buffer       = buffer;
+    consumer.ulBufferSize = sizeof(buffer);
+    consumer.ulPosition   = 0;
+    consumer.ullBytes     = 0;
+    consumer.ulSpans      = 0;
+    consumer.ulErrors     = 0;
+    consumer.Passes.assign(sizeof(buffer), 0);
+
+    for (ULONG n = 0; n < 1000; n++)
+    {
+        const ULONGLONG bytes = DmaWholeBursts(&pending, TestRandom() % 2000 * 4, 48 * 4);
+
+        position = DmaWalk(buffer, sizeof(buffer), position, bytes, countSpan, &consumer);
+
+        DmaSetPositionRegister(&positionRegister, position);
+        DmaSetPositionRegister(nullptr, position);
+
+        CHECK_EQUAL(position, positionRegister);
+    }
+
+    CHECK_EQUAL(0, consumer.ulErrors);
+}
+
+//=============================================================================
+static void stampSpan(IN PVOID context, IN PBYTE span, IN ULONG byteCount)
+{
+    const PULONG words = (PULONG)span;
+
+    UNREFERENCED_PARAMETER(context);
+
+    for (ULONG i = 0; i < byteCount / sizeof(ULONG); i++)
+    {
+        words[i] = Shared.ulStamp++;
+    }
+}
+
+//=============================================================================
+// Runs the engine in random bursts, never more than a buffer ahead of the
+// client, as a client that keeps up.
+static void engine()
+{
+    const ULONG bufferSize = (ULONG)(Shared.Buffer.size() * sizeof(ULONG));
+    ULONG       position   = 0;
+    ULONGLONG   state      = 0x9E3779B97F4A7C15ULL;
+
+    while (!Shared.fStop)
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+
+        const ULONG bytes = (1 + (ULONG)(state % 256)) * sizeof(ULONG);
+
+        if (Shared.ullEngineBytes + bytes >= Shared.ullClientBytes + bufferSize)
+        {
+            YieldProcessor();
+            continue;
+        }
+
+        KeMemoryBarrier();
+
+        position = DmaWalk((PBYTE)Shared.Buffer.data(), bufferSize, position, bytes, stampSpan, nullptr);
+
+        Shared.ullEngineBytes += bytes;
+
+        DmaSetPositionRegister(&Shared.ulPositionRegister, position);
+    }
+}
+
+//=============================================================================
+// Reads everything up to the register, as a capture client polling it.
+static void client()
+{
+    const ULONG words    = (ULONG)Shared.Buffer.size();
+    ULONG       position = 0;
+    ULONG       stamp    = 0;
+
+    while (!Shared.fStop)
+    {
+        const ULONG engine = *(ULONG volatile*)&Shared.ulPositionRegister / sizeof(ULONG);
+
+        KeMemoryBarrier();
+
+        const ULONG available = (engine + words - position) % words;
+
+        for (ULONG i = 0; i < available; i++)
+        {
+            Shared.ullStale += Shared.Buffer[(position + i) % words] != stamp++;
+        }
+
+        position = (position + available) % words;
+
+        KeMemoryBarrier();
+
+        Shared.ullClientBytes = Shared.ullClientBytes + available * sizeof(ULONG);
+    }
+}
+
+//=============================================================================
+// A client reading the shared buffer up to the register, while the engine
+// records into it, reads every word the engine wrote and none it had not.
+TEST(SharedBufferIsNeverStale)
+{
+    Shared.Buffer.assign(4096, MAXULONG);
+    Shared.ulPositionRegister = 0;
+    Shared.ulStamp            = 0;
+    Shared.ullClientBytes     = 0;
+    Shared.fStop              = FALSE;
+    Shared.ullEngineBytes     = 0;
+    Shared.ullStale           = 0;
+
+    std::thread engineThread(engine);
+    std::thread clientThread(client);
+
+    const double start = TestSeconds();
+
+    while (TestSeconds() - start < STRESS_SECONDS)
+    {
+        std::this_thread::yield();
+    }
+
+    Shared.fStop = TRUE;
+
+    engineThread.join();
+    clientThread.join();
+
+    printf("       %llu bytes recorded, %llu read\n", Shared.ullEngineBytes, Shared.ullClientBytes);
+
+    CHECK_EQUAL(0, Shared.ullStale);
+    CHECK(Shared.ullClientBytes > 10 * Shared.Buffer.size() * sizeof(ULONG));
+}
+
+//=============================================================================
+static void logPacket(IN PVOID context, IN PBYTE span, IN ULONG byteCount)
+{
+    const PPACKET_LOG log = (PPACKET_LOG)context;
+
+    log->Offsets.push_back((ULONG)(span - log->Buffer));
+    log->Lengths.push_back(byteCount);
+    log->Qpcs.push_back(log->Packets->llQpc);
+}
+
+//=============================================================================
+// Timer runs that come late by up to 5 ms move the engine whole packets
+// at a time. Every packet is handed over whole, in buffer order, and once,
+// and is stamped with the time the engine crossed its end to within the
+// time of a byte, however late the run that handed it over.
+TEST(PacketsAreWholeAndStampedOnTheBoundary)
+{
+    std::vector<BYTE> buffer(8 * PACKET_SIZE);
+    DMA_PACKETS       packets;
+    PACKET_LOG        log;
+    ULONG             position = 0;
+    ULONG             pending  = 0;
+    LONGLONG          time     = 0;
+    ULONGLONG         bytes    = 0;
+    ULONG             errors   = 0;
+
+    DmaResetPackets(&packets);
+
+    log.Packets = &packets;
+    log.Buffer  = buffer.data();
+
+    for (ULONG n = 0; n < 100000; n++)
+    {
+        time += PACKET_TICKS / 2 + TestRandom() % PACKET_TICKS;
+
+        const ULONGLONG elapsed = (ULONGLONG)time * BYTES_PER_SECOND / FREQUENCY;
+        const ULONGLONG whole   = DmaWholeBursts(&pending, elapsed - bytes, PACKET_SIZE);
+
+        bytes = elapsed;
+
+        CHECK(!DmaWalkPackets(&packets, buffer.data(), (ULONG)buffer.size(), &position, PACKET_SIZE, whole,
+                              pending, time, FREQUENCY, BYTES_PER_SECOND, logPacket, &log));
+    }
+
+    CHECK_EQUAL(bytes / PACKET_SIZE, packets.ullNumber);
+    CHECK_EQUAL(packets.ullNumber, log.Offsets.size());
+
+    // The stamp of packet k - 1 was current when packet k was handed over.
+    //
+    for (ULONG k = 0; k < log.Offsets.size(); k++)
+    {
+        const LONGLONG stamp = k + 1 < log.Qpcs.size() ? log.Qpcs[k + 1] : packets.llQpc;
+        const LONGLONG error = stamp - (LONGLONG)(k + 1) * PACKET_TICKS;
+
+        errors += log.Offsets[k] != k % 8 * PACKET_SIZE;
+        errors += log.Lengths[k] != PACKET_SIZE;
+        errors += error < 0 || error > FREQUENCY / BYTES_PER_SECOND + 1;
+    }
+
+    CHECK_EQUAL(0, errors);
+    CHECK(!packets.fEndOfStream);
+}
+
+//=============================================================================
+// Lateness is the time to move the bytes already past the end of each
+// packet: the later packets, and those pending.
+TEST(LatenessCountsTheBytesBehind)
+{
+    std::vector<BYTE> buffer(4 * PACKET_SIZE);
+    DMA_PACKETS       packets;
+    PACKET_LOG        log;
+    ULONG             position = 2 * PACKET_SIZE;
+
+    DmaResetPackets(&packets);
+
+    log.Packets = &packets;
+    log.Buffer  = buffer.data();
+
+    CHECK(!DmaWalkPackets(&packets, buffer.data(), (ULONG)buffer.size(), &position, PACKET_SIZE, 3 * PACKET_SIZE + 100,
+                          480, 1000000, FREQUENCY, BYTES_PER_SECOND, logPacket, &log));
+
+    CHECK_EQUAL(PACKET_SIZE, position);
+    CHECK_EQUAL(3, packets.ullNumber);
+    CHECK_EQUAL(1000000 - 480 * FREQUENCY / BYTES_PER_SECOND, packets.llQpc);
+    CHECK_EQUAL((3 * 480 + 3 * PACKET_SIZE) * FREQUENCY / BYTES_PER_SECOND, packets.ullLatenessTotal);
+    CHECK_EQUAL((480 + 2 * PACKET_SIZE) * FREQUENCY / BYTES_PER_SECOND, packets.ullLatenessMax);
+    CHECK_EQUAL(2 * PACKET_SIZE, log.Offsets[0]);
+    CHECK_EQUAL(3 * PACKET_SIZE, log.Offsets[1]);
+    CHECK_EQUAL(0, log.Offsets[2]);
+
+    // Less than a packet moves nothing.
+    //
+    CHECK(!DmaWalkPackets(&packets, buffer.data(), (ULONG)buffer.size(), &position, PACKET_SIZE, PACKET_SIZE - 1,
+                          0, 2000000, FREQUENCY, BYTES_PER_SECOND, logPacket, &log));
+    CHECK_EQUAL(3, packets.ullNumber);
+}
+
+//=============================================================================
+// The end-of-stream packet is handed over with its valid bytes only, and
+// the walk stops after it, however many bytes remain.
+TEST(EndOfStreamTruncatesAndStops)
+{
+    std::vector<BYTE> buffer(4 * PACKET_SIZE);
+    DMA_PACKETS       packets;
+    PACKET_LOG        log;
+    ULONG             position = 0;
+
+    DmaResetPackets(&packets);
+
+    log.Packets = &packets;
+    log.Buffer  = buffer.data();
+
+    packets.ullEosPacket = 5;
+    packets.ulEosLength  = 100;
+
+    CHECK(!DmaWalkPackets(&packets, buffer.data(), (ULONG)buffer.size(), &position, PACKET_SIZE, 2 * PACKET_SIZE,
+                          0, 0, FREQUENCY, BYTES_PER_SECOND, logPacket, &log));
+    CHECK(DmaWalkPackets(&packets, buffer.data(), (ULONG)buffer.size(), &position, PACKET_SIZE, 10 * PACKET_SIZE,
+                         0, 0, FREQUENCY, BYTES_PER_SECOND, logPacket, &log));
+
+    CHECK(packets.fEndOfStream);
+    CHECK_EQUAL(6, packets.ullNumber);
+    CHECK_EQUAL(6, log.Lengths.size());
+    CHECK_EQUAL(PACKET_SIZE, log.Lengths[4]);
+    CHECK_EQUAL(100, log.Lengths[5]);
+    CHECK_EQUAL(2 * PACKET_SIZE, position);
+}
+
+//=============================================================================
+static void copySpan(IN PVOID context, IN PBYTE span, IN ULONG byteCount)
+{
+    PBYTE* sink = (PBYTE*)context;
+
+    RtlCopyMemory(*sink, span, byteCount);
+    *sink += byteCount;
+}
+
+//=============================================================================
+// Cost of a timer run of the engine moving 10 ms of 48 kHz 16-bit stereo
+// in 1 ms bursts through a 100 ms buffer, copying out each span.
+TEST(BenchmarkDmaWalk)
+{
+    const ULONG         blockAlign = 4;
+    const ULONG         tickBytes  = 480 * blockAlign;
+    const ULONG         count      = 1000000;
+    std::vector<BYTE>   buffer(4800 * blockAlign, 1);
+    std::vector<BYTE>   sink(2 * tickBytes);
+    ULONG               position   = 0;
+    ULONG               pending    = 0;
+    ULONGLONG           sum        = 0;
+
+    const double start = TestSeconds();
+
+    for (ULONG n = 0; n < count; n++)
+    {
+        PBYTE           next  = sink.data();
+        const ULONGLONG bytes = DmaWholeBursts(&pending, tickBytes + (n & 1) * blockAlign * 7, 48 * blockAlign);
+
+        position = DmaWalk(buffer.data(), (ULONG)buffer.size(), position, bytes, copySpan, &next);
+        sum     += next - sink.data();
+    }
+
+    const double seconds = TestSeconds() - start;
+
+    printf("       %6.1f ns per run, %.1f GB/s\n", seconds * 1e9 / count, sum / seconds / 1e9);
+
+    CHECK(sum);
+}
+
+//=============================================================================
+static void sumSpan(IN PVOID context, IN PBYTE span, IN ULONG byteCount)
+{
+    const PULONG words = (PULONG)span;
+    PULONGLONG   sum   = (PULONGLONG)context;
+
+    for (ULONG i = 0; i < byteCount / sizeof(ULONG); i++)
+    {
+        *sum += words[i];
+    }
+}
+
+//=============================================================================
+// Work of the driver for 10 ms of 48 kHz 32-bit stereo through a 100 ms
+// buffer: the engine passing over the data a client rendered straight into
+// the mapped buffer, against the port copying it in from the buffer of the
+// client first, as CopyTo does. Rendering costs the client the same in both.
+TEST(BenchmarkSharedBuffer)
+{
+    const ULONG         periodWords = 960;
+    const ULONG         count       = 200000;
+    std::vector<ULONG>  buffer(10 * periodWords);
+    std::vector<ULONG>  client(periodWords, 1);
+    const ULONG         bufferSize  = (ULONG)(buffer.size() * sizeof(ULONG));
+    ULONGLONG           sum         = 0;
+    double              seconds[2];
+
+    // Alternately, twice each.
+    //
+    for (ULONG pass = 0; pass < 4; pass++)
+    {
+        const ULONG copy     = pass & 1;
+        ULONG       position = 0;
+
+        const double start = TestSeconds();
+
+        for (ULONG n = 0; n < count; n++)
+        {
+            if (copy)
+            {
+                RtlCopyMemory((PBYTE)buffer.data() + position, client.data(), periodWords * sizeof(ULONG));
+            }
+
+            position = DmaWalk((PBYTE)buffer.data(), bufferSize, position, periodWords * sizeof(ULONG), sumSpan, &sum);
+        }
+
+        seconds[copy] = TestSeconds() - start;
+    }
+
+    printf("       mapped %6.1f ns, copied %6.1f ns per 10 ms\n",
+           seconds[0] * 1e9 / count, seconds[1] * 1e9 / count);
+
+    CHECK(sum);
+}
+
+//=============================================================================
+static void touchPacket(IN PVOID context, IN PBYTE span, IN ULONG byteCount)
+{
+    *(PULONGLONG)context += span[0] + span[byteCount - 1];
+}
+
+//=============================================================================
+// Packet throughput of the engine, and the lateness of delivery when the
+// timer runs every 1 to 11 ms, against the 10 ms packets of a 16-bit stereo
+// 48 kHz stream. The stamps stay on the packet boundaries regardless, as
+// PacketsAreWholeAndStampedOnTheBoundary checks.
+TEST(BenchmarkPacketWalk)
+{
+    const ULONG         count  = 10000000;
+    std::vector<BYTE>   buffer(8 * PACKET_SIZE, 1);
+    DMA_PACKETS         packets;
+    ULONG               position = 0;
+    ULONGLONG           sum      = 0;
+
+    DmaResetPackets(&packets);
+
+    double start = TestSeconds();
+
+    DmaWalkPackets(&packets, buffer.data(), (ULONG)buffer.size(), &position, PACKET_SIZE, (ULONGLONG)count * PACKET_SIZE,
+                   0, 0, FREQUENCY, BYTES_PER_SECOND, touchPacket, &sum);
+
+    printf("       %5.2f ns per packet\n", (TestSeconds() - start) * 1e9 / count);
+
+    ULONG     pending = 0;
+    LONGLONG  time    = 0;
+    ULONGLONG bytes   = 0;
+
+    DmaResetPackets(&packets);
+
+    for (ULONG n = 0; n < 1000000; n++)
+    {
+        time += PACKET_TICKS / 10 + TestRandom() % PACKET_TICKS;
+
+        const ULONGLONG elapsed = (ULONGLONG)time * BYTES_PER_SECOND / FREQUENCY;
+        const ULONGLONG whole   = DmaWholeBursts(&pending, elapsed - bytes, PACKET_SIZE);
+
+        bytes = elapsed;
+
+        DmaWalkPackets(&packets, buffer.data(), (ULONG)buffer.size(), &position, PACKET_SIZE, whole,
+                       pending, time, FREQUENCY, BYTES_PER_SECOND, touchPacket, &sum);
+    }
+
+    printf("       lateness mean %.0f us, max %.0f us over %llu packets\n",
+           (double)packets.ullLatenessTotal / packets.ullNumber * 1e6 / FREQUENCY,
+           (double)packets.ullLatenessMax * 1e6 / FREQUENCY, packets.ullNumber);
+
+    CHECK(sum);
+}
@@ -0,0 +1,644 @@
+/*
+Abstract:
+    Tests and benchmarks of the sample-processing helpers.
+*/
+
+#include <math.h>
+
+#include <msvad.h>
+#include "dsp.h"
+#include "test.h"
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+// The PCM formats the samples accept: any rate in the range, up to 8
+// channels of up to 32 bits.
+#define FORMAT_MIN_RATE             4000
+#define FORMAT_MAX_RATE             64000
+#define FORMAT_MAX_BLOCK_ALIGN      (8 * 4)
+
+#define FILL_GUARD                  64
+
+#define VOICE_SAMPLE_COUNT          4800    // 100 ms at 48 kHz.
+
+//=============================================================================
+static void initFormat(OUT PWAVEFORMATEXTENSIBLE format, IN WORD tag, IN const GUID* subFormat, IN WORD channels, IN WORD bits)
+{
+    RtlZeroMemory(format, sizeof(*format));
+
+    format->Format.wFormatTag      = tag;
+    format->Format.nChannels       = channels;
+    format->Format.nSamplesPerSec  = 48000;
+    format->Format.wBitsPerSample  = bits;
+    format->Format.nBlockAlign     = channels * bits / 8;
+    format->Format.nAvgBytesPerSec = 48000 * format->Format.nBlockAlign;
+
+    if (WAVE_FORMAT_EXTENSIBLE == tag)
+    {
+        format->Format.cbSize                = sizeof(*format) - sizeof(format->Format);
+        format->Samples.wValidBitsPerSample  = bits;
+        format->SubFormat                    = *subFormat;
+    }
+}
+
+//=============================================================================
+// floor(value * scale / divisor), in 128 bits.
+static ULONGLONG exactScale(IN ULONGLONG value, IN ULONGLONG scale, IN ULONGLONG divisor)
+{
+    return (ULONGLONG)((unsigned __int128)value * scale / divisor);
+}
+
+//=============================================================================
+// Largest position whose time in 100 ns units fits in a LONGLONG.
+static ULONGLONG maxPosition(IN ULONG byteRate)
+{
+    return (ULONGLONG)min((unsigned __int128)MAXLONGLONG * byteRate / _100NS_UNITS_PER_SECOND,
+                          (unsigned __int128)MAXLONGLONG);
+}
+
+//=============================================================================
+TEST(ReciprocalDivideIsExact)
+{
+    const ULONG divisors[] = { 1, 2, 3, 6, 7, 12, 1000, 44100, 176400, 0x7FFFFFFF, 0x80000000, 0xFFFFFFFF };
+
+    for (ULONG d = 0; d < RTL_NUMBER_OF(divisors); d++)
+    {
+        DSP_RECIPROCAL reciprocal;
+        ULONG          errors = 0;
+
+        ReciprocalInit(&reciprocal, divisors[d]);
+
+        for (ULONG i = 0; i < 100000; i++)
+        {
+            // Small values, values around multiples of the divisor, and any.
+            //
+            const ULONGLONG random = TestRandom();
+            ULONGLONG       value  = random;
+
+            if (i < 1000)
+            {
+                value = i;
+            }
+            else if (i % 2)
+            {
+                value = (random >> 8) / divisors[d] * divisors[d] + (LONG)(random % 5) - 2;
+            }
+            else if (i == 1000)
+            {
+                value = MAXULONGLONG;
+            }
+
+            ULONGLONG       remainder;
+            const ULONGLONG quotient = ReciprocalDivide(&reciprocal, value, &remainder);
+
+            if (quotient != value / divisors[d] || remainder != value % divisors[d])
+            {
+                errors++;
+            }
+        }
+
+        CHECK_EQUAL(0, errors);
+    }
+}
+
+//=============================================================================
+// NormalizePhysicalPosition is ReciprocalScale by 10^7 with the reciprocal
+// of the byte rate. Every rate and block align of the supported formats,
+// at positions around whole seconds, anywhere, and the largest one whose
+// time fits.
+TEST(NormalizedPositionIsExactForEveryFormat)
+{
+    ULONGLONG checks = 0;
+    ULONGLONG errors = 0;
+
+    for (ULONG rate = FORMAT_MIN_RATE; rate <= FORMAT_MAX_RATE; rate++)
+    {
+        for (ULONG blockAlign = 1; blockAlign <= FORMAT_MAX_BLOCK_ALIGN; blockAlign++)
+        {
+            const ULONG     byteRate = rate * blockAlign;
+            const ULONGLONG maximum  = maxPosition(byteRate);
+            DSP_RECIPROCAL  reciprocal;
+
+            ReciprocalInit(&reciprocal, byteRate);
+
+            const ULONGLONG random      = TestRandom();
+            const ULONGLONG positions[] =
+            {
+                0,
+                blockAlign,
+                byteRate - 1,
+                byteRate,
+                (random % 100000 + 1) * byteRate - 1,
+                (random % 100000) * byteRate + blockAlign,
+                random % maximum,
+                (random >> 20) % maximum,
+                maximum,
+            };
+
+            for (ULONG i = 0; i < RTL_NUMBER_OF(positions); i++)
+            {
+                const ULONGLONG time = ReciprocalScale(&reciprocal, positions[i], _100NS_UNITS_PER_SECOND);
+
+                if (time != exactScale(positions[i], _100NS_UNITS_PER_SECOND, byteRate))
+                {
+                    errors++;
+                }
+
+                checks++;
+            }
+        }
+    }
+
+    CHECK_EQUAL(0, errors);
+    CHECK(checks > 15000000);
+}
+
+//=============================================================================
+// Every position of the first seconds of the formats whose block align does
+// not divide 10^7, where the division the reciprocals replaced truncated.
+TEST(NormalizedPositionIsExactForOddBlockAligns)
+{
+    const ULONG blockAligns[] = { 3, 6, 9, 12, 18, 24 };
+    const ULONG rates[]       = { 11025, 44100, 48000, 64000 };
+    ULONGLONG   errors        = 0;
+
+    for (ULONG b = 0; b < RTL_NUMBER_OF(blockAligns); b++)
+    {
+        for (ULONG r = 0; r < RTL_NUMBER_OF(rates); r++)
+        {
+            const ULONG    byteRate = rates[r] * blockAligns[b];
+            DSP_RECIPROCAL reciprocal;
+
+            ReciprocalInit(&reciprocal, byteRate);
+
+            for (ULONGLONG position = 0; position < 3ULL * byteRate; position++)
+            {
+                if (ReciprocalScale(&reciprocal, position, _100NS_UNITS_PER_SECOND) !=
+                    exactScale(position, _100NS_UNITS_PER_SECOND, byteRate))
+                {
+                    errors++;
+                }
+            }
+        }
+    }
+
+    CHECK_EQUAL(0, errors);
+}
+
+//=============================================================================
+// Time per conversion with the reciprocal, with the 64-bit divisions it
+// replaced, which truncate and overflow, and with a 128-bit division.
+TEST(BenchmarkNormalizePosition)
+{
+    const ULONG     count      = 20000000;
+    const ULONG     blockAlign = 12;
+    const ULONG     rate       = 44100;
+    ULONGLONG       sink       = 0;
+    DSP_RECIPROCAL  reciprocal;
+
+    ReciprocalInit(&reciprocal, rate * blockAlign);
+
+    // Positions of increasing size, as a stream plays.
+    //
+    double start = TestSeconds();
+
+    for (ULONG i = 0; i < count; i++)
+    {
+        sink += ReciprocalScale(&reciprocal, (ULONGLONG)i * 4099, _100NS_UNITS_PER_SECOND);
+    }
+
+    const double reciprocalTime = TestSeconds() - start;
+
+    start = TestSeconds();
+
+    for (ULONG i = 0; i < count; i++)
+    {
+        volatile ULONG align   = blockAlign;
+        volatile ULONG divisor = rate;
+
+        sink += (_100NS_UNITS_PER_SECOND / align * ((ULONGLONG)i * 4099)) / divisor;
+    }
+
+    const double divisionTime = TestSeconds() - start;
+
+    start = TestSeconds();
+
+    for (ULONG i = 0; i < count; i++)
+    {
+        volatile ULONG divisor = rate * blockAlign;
+
+        sink += exactScale((ULONGLONG)i * 4099, _100NS_UNITS_PER_SECOND, divisor);
+    }
+
+    const double wideTime = TestSeconds() - start;
+
+    printf("       reciprocal %.2f ns, two 64-bit divisions %.2f ns, 128-bit division %.2f ns (%llu)\n",
+           reciprocalTime * 1e9 / count, divisionTime * 1e9 / count, wideTime * 1e9 / count, sink & 1);
+}
+
+//=============================================================================
+// Silence reads back as a zero level in every PCM format, plain and
+// extensible, and is all-zero bits in float formats.
+TEST(SilenceByteForEveryFormat)
+{
+    const WORD bits[] = { 8, 16, 24, 32 };
+    BYTE       buffer[8 * 4 * 16];
+
+    for (ULONG b = 0; b < RTL_NUMBER_OF(bits); b++)
+    {
+        for (WORD channels = 1; channels <= 8; channels++)
+        {
+            WAVEFORMATEXTENSIBLE plain;
+            WAVEFORMATEXTENSIBLE extensible;
+
+            initFormat(&plain, WAVE_FORMAT_PCM, nullptr, channels, bits[b]);
+            initFormat(&extensible, WAVE_FORMAT_EXTENSIBLE, &KSDATAFORMAT_SUBTYPE_PCM, channels, bits[b]);
+
+            const UCHAR silence = SilenceByte(&plain.Format);
+
+            CHECK_EQUAL(8 == bits[b] ? 0x80 : 0, silence);
+            CHECK_EQUAL(silence, SilenceByte(&extensible.Format));
+
+            const ULONG byteCount = plain.Format.nBlockAlign * 16;
+
+            FillSilence(buffer, byteCount, silence);
+
+            CHECK_EQUAL(0, PeakLevel(buffer, byteCount, &plain.Format));
+        }
+    }
+
+    WAVEFORMATEXTENSIBLE format;
+
+    initFormat(&format, WAVE_FORMAT_IEEE_FLOAT, nullptr, 2, 32);
+    CHECK_EQUAL(0, SilenceByte(&format.Format));
+
+    initFormat(&format, WAVE_FORMAT_EXTENSIBLE, &KSDATAFORMAT_SUBTYPE_IEEE_FLOAT, 8, 32);
+    CHECK_EQUAL(0, SilenceByte(&format.Format));
+
+    // 8-bit float does not exist, so only PCM is unsigned.
+    //
+    initFormat(&format, WAVE_FORMAT_EXTENSIBLE, &KSDATAFORMAT_SUBTYPE_IEEE_FLOAT, 2, 8);
+    CHECK_EQUAL(0, SilenceByte(&format.Format));
+}
+
+//=============================================================================
+// Checks that a fill wrote silence to exactly its bytes, and left the
+// guards around it at 0x5A. Past the first and last pages only every 61st
+// byte is read, which still lands in every 64-byte streaming store.
+static BOOLEAN checkFill(IN PBYTE memory, IN PBYTE buffer, IN ULONG byteCount, IN UCHAR silence)
+{
+    const ULONG size = (ULONG)(buffer + byteCount - memory) + FILL_GUARD;
+
+    for (ULONG i = 0; i < size; i += (i < 2 * FILL_GUARD + PAGE_SIZE || i + 2 * FILL_GUARD + PAGE_SIZE > size) ? 1 : 61)
+    {
+        const BOOLEAN inside = memory + i >= buffer && memory + i < buffer + byteCount;
+
+        if (memory[i] != (inside ? silence : 0x5A))
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+//=============================================================================
+// Fills of every small size and of sizes around the streaming threshold, at
+// every alignment, write exactly their bytes. Consecutive fills alternate
+// the silence byte, so a byte a fill missed keeps the wrong one.
+TEST(FillSilenceWritesExactlyTheBuffer)
+{
+    const ULONG size   = DSP_STREAMING_FILL_SIZE + 256 + 2 * FILL_GUARD;
+    PBYTE       memory = (PBYTE)ExAllocatePoolWithTag(NonPagedPool, size, MSVAD_POOLTAG);
+    ULONG       errors = 0;
+    ULONG       fills  = 0;
+    PBYTE       dirty  = memory;
+
+    CHECK(memory);
+
+    ULONG byteCounts[300];
+    ULONG counts = 0;
+
+    for (ULONG i = 0; i <= 200; i++)
+    {
+        byteCounts[counts++] = i;
+    }
+
+    for (ULONG i = 0; i < 16; i++)
+    {
+        byteCounts[counts++] = DSP_STREAMING_FILL_SIZE - 8 + i;
+    }
+
+    RtlFillMemory(memory, size, 0x5A);
+
+    for (ULONG c = 0; c < counts; c++)
+    {
+        for (ULONG offset = 0; offset < 16; offset++)
+        {
+            const UCHAR silence = fills++ % 2 ? 0x80 : 0;
+            const PBYTE buffer  = memory + FILL_GUARD + offset;
+
+            // Only the guards need restoring, up to the end of the last fill.
+            //
+            RtlFillMemory(memory, FILL_GUARD + 16, 0x5A);
+
+            if (dirty > buffer + byteCounts[c])
+            {
+                RtlFillMemory(buffer + byteCounts[c], (ULONG)(dirty - buffer - byteCounts[c]), 0x5A);
+            }
+
+            FillSilence(buffer, byteCounts[c], silence);
+
+            dirty   = buffer + byteCounts[c];
+            errors += !checkFill(memory, buffer, byteCounts[c], silence);
+        }
+    }
+
+    CHECK_EQUAL(0, errors);
+
+    ExFreePoolWithTag(memory, MSVAD_POOLTAG);
+}
+
+//=============================================================================
+// Fill rate across buffer sizes, against RtlFillMemory. Below
+// DSP_STREAMING_FILL_SIZE the two are the same fill; from there on
+// FillSilence bypasses the caches, which pays once the buffer is larger
+// than the last level cache.
+TEST(BenchmarkFillSilence)
+{
+    const ULONG sizes[] = { 64, 1024, 4096, 0x10000, 0x16000, 0x100000, 0x400000, 0x1000000, 0x2000000, 0x4000000 };
+    PBYTE       buffer  = (PBYTE)ExAllocatePoolWithTag(NonPagedPool, sizes[RTL_NUMBER_OF(sizes) - 1], MSVAD_POOLTAG);
+
+    CHECK(buffer);
+
+    // Fault the pages in first, or the first loop to reach them pays for it.
+    //
+    RtlFillMemory(buffer, sizes[RTL_NUMBER_OF(sizes) - 1], 0);
+
+    for (ULONG s = 0; s < RTL_NUMBER_OF(sizes); s++)
+    {
+        const ULONG repeat = max(0x10000000 / sizes[s], 64);
+
+        double start = TestSeconds();
+
+        for (ULONG i = 0; i < repeat; i++)
+        {
+            FillSilence(buffer, sizes[s], (UCHAR)(i & 0x80));
+        }
+
+        const double fillTime = TestSeconds() - start;
+
+        start = TestSeconds();
+
+        for (ULONG i = 0; i < repeat; i++)
+        {
+            RtlFillMemory(buffer, sizes[s], (UCHAR)(i & 0x80));
+            __asm__ __volatile__("" : : "r"(buffer) : "memory");
+        }
+
+        const double memsetTime = TestSeconds() - start;
+
+        printf("       %8u bytes: FillSilence %6.2f GB/s, RtlFillMemory %6.2f GB/s\n", sizes[s],
+               (double)sizes[s] * repeat / fillTime / 1e9, (double)sizes[s] * repeat / memsetTime / 1e9);
+    }
+
+    ExFreePoolWithTag(buffer, MSVAD_POOLTAG);
+}
+
+//=============================================================================
+// Stores a 16-bit sample value at an index of a buffer of another width.
+static void putSample16(OUT PBYTE buffer, IN ULONG index, IN WORD bits, IN LONG value)
+{
+    switch (bits)
+    {
+        case 8:
+            buffer[index] = (BYTE)((value >> 8) + 0x80);
+            break;
+
+        case 16:
+            ((SHORT*)buffer)[index] = (SHORT)value;
+            break;
+
+        case 24:
+            buffer[3 * index]     = 0;
+            buffer[3 * index + 1] = (BYTE)value;
+            buffer[3 * index + 2] = (BYTE)(value >> 8);
+            break;
+
+        default:
+            ((LONG*)buffer)[index] = value * 65536;
+            break;
+    }
+}
+
+//=============================================================================
+// Fills a buffer of frameCount frames with a tone of a level and frequency
+// at 48 kHz in the left channel, and with level in the others.
+static void putTone(OUT PBYTE buffer, IN ULONG frameCount, IN PWAVEFORMATEX format, IN LONG level, IN double hz)
+{
+    for (ULONG i = 0; i < frameCount; i++)
+    {
+        putSample16(buffer, i * format->nChannels, format->wBitsPerSample,
+                    (LONG)lround(level * sin(2 * M_PI * hz * i / 48000 + 0.5)));
+
+        for (ULONG c = 1; c < format->nChannels; c++)
+        {
+            putSample16(buffer, i * format->nChannels + c, format->wBitsPerSample, level);
+        }
+    }
+}
+
+//=============================================================================
+// Silence and buffers of no more than two frames have no energy, no
+// crossings and full flatness, in every format.
+TEST(VoiceFeaturesOfSilenceAndShortBuffers)
+{
+    const WORD bits[] = { 8, 16, 24, 32 };
+    BYTE       buffer[VOICE_SAMPLE_COUNT * 2 * 4];
+
+    for (ULONG b = 0; b < RTL_NUMBER_OF(bits); b++)
+    {
+        for (WORD channels = 1; channels <= 2; channels++)
+        {
+            WAVEFORMATEXTENSIBLE format;
+            DSP_VOICE_FEATURES   features;
+
+            initFormat(&format, WAVE_FORMAT_PCM, nullptr, channels, bits[b]);
+
+            FillSilence(buffer, sizeof(buffer), SilenceByte(&format.Format));
+            VoiceFeatures(buffer, sizeof(buffer), &format.Format, &features);
+
+            CHECK_EQUAL(0, features.ulEnergy);
+            CHECK_EQUAL(0, features.ulZeroCrossings);
+            CHECK_EQUAL(DSP_LEVEL_FULL_SCALE, features.ulFlatness);
+
+            putTone(buffer, 2, &format.Format, 16384, 1000);
+            VoiceFeatures(buffer, 2 * format.Format.nBlockAlign, &format.Format, &features);
+
+            CHECK_EQUAL(0, features.ulEnergy);
+            CHECK_EQUAL(0, features.ulZeroCrossings);
+            CHECK_EQUAL(DSP_LEVEL_FULL_SCALE, features.ulFlatness);
+        }
+    }
+}
+
+//=============================================================================
+// The energy is the RMS level: the level of a square wave, and the level of
+// a sine wave over the square root of two, in every sample width. Levels
+// are multiples of 256 so that 8-bit samples hold the square wave exactly.
+TEST(VoiceFeaturesEnergyIsTheRmsLevel)
+{
+    const WORD bits[]   = { 8, 16, 24, 32 };
+    const LONG levels[] = { 512, 4096, 16384, 32512 };
+
+    for (ULONG b = 0; b < RTL_NUMBER_OF(bits); b++)
+    {
+        for (ULONG l = 0; l < RTL_NUMBER_OF(levels); l++)
+        {
+            WAVEFORMATEXTENSIBLE format;
+            DSP_VOICE_FEATURES   features;
+            BYTE                 buffer[VOICE_SAMPLE_COUNT * 4];
+
+            initFormat(&format, WAVE_FORMAT_PCM, nullptr, 1, bits[b]);
+
+            for (ULONG i = 0; i < VOICE_SAMPLE_COUNT; i++)
+            {
+                putSample16(buffer, i, bits[b], (i / 24) % 2 ? levels[l] : -levels[l]);
+            }
+
+            VoiceFeatures(buffer, VOICE_SAMPLE_COUNT * bits[b] / 8, &format.Format, &features);
+            CHECK_EQUAL(levels[l], features.ulEnergy);
+
+            putTone(buffer, VOICE_SAMPLE_COUNT, &format.Format, levels[l], 1000);
+
+            VoiceFeatures(buffer, VOICE_SAMPLE_COUNT * bits[b] / 8, &format.Format, &features);
+            // Within the rounding of the sine, or a step of 8-bit samples.
+            const double step = (8 == bits[b]) ? 256 : 1;
+
+            CHECK(fabs(features.ulEnergy - levels[l] / sqrt(2.0)) <= levels[l] / 200.0 + step);
+        }
+    }
+}
+
+//=============================================================================
+// A tone crosses zero twice a period, so the crossings per sample are twice
+// its frequency over the sample rate. A DC channel adds none, and a signal
+// that alternates sign crosses at every sample.
+TEST(VoiceFeaturesCountsZeroCrossings)
+{
+    const WORD   bits[]  = { 8, 16, 24, 32 };
+    const double tones[] = { 100, 440, 1000, 3000, 8000 };
+
+    for (ULONG b = 0; b < RTL_NUMBER_OF(bits); b++)
+    {
+        for (WORD channels = 1; channels <= 2; channels++)
+        {
+            WAVEFORMATEXTENSIBLE format;
+            DSP_VOICE_FEATURES   features;
+            BYTE                 buffer[VOICE_SAMPLE_COUNT * 2 * 4];
+
+            initFormat(&format, WAVE_FORMAT_PCM, nullptr, channels, bits[b]);
+
+            const ULONG byteCount = VOICE_SAMPLE_COUNT * format.Format.nBlockAlign;
+
+            for (ULONG t = 0; t < RTL_NUMBER_OF(tones); t++)
+            {
+                putTone(buffer, VOICE_SAMPLE_COUNT, &format.Format, 16384, tones[t]);
+                VoiceFeatures(buffer, byteCount, &format.Format, &features);
+
+                const double expected = 2 * tones[t] / 48000 / channels * 32768;
+
+                CHECK(fabs(features.ulZeroCrossings - expected) <= expected / 50 + 8);
+            }
+
+            for (ULONG i = 0; i < VOICE_SAMPLE_COUNT * channels; i++)
+            {
+                putSample16(buffer, i, bits[b], (i / channels) % 2 ? 8192 : -8192);
+            }
+
+            VoiceFeatures(buffer, byteCount, &format.Format, &features);
+            CHECK_EQUAL(DSP_LEVEL_FULL_SCALE, features.ulZeroCrossings);
+        }
+    }
+}
+
+//=============================================================================
+// A second order predictor follows a pure tone exactly, so its flatness is
+// close to 0; white noise cannot be predicted, and is close to full scale.
+TEST(VoiceFeaturesFlatnessSeparatesTonesFromNoise)
+{
+    const WORD   bits[]  = { 16, 24, 32 };
+    const double tones[] = { 100, 1000, 3000, 8000 };
+
+    TestSeed(29);
+
+    for (ULONG b = 0; b < RTL_NUMBER_OF(bits); b++)
+    {
+        WAVEFORMATEXTENSIBLE format;
+        DSP_VOICE_FEATURES   features;
+        BYTE                 buffer[VOICE_SAMPLE_COUNT * 4];
+
+        initFormat(&format, WAVE_FORMAT_PCM, nullptr, 1, bits[b]);
+
+        const ULONG byteCount = VOICE_SAMPLE_COUNT * format.Format.nBlockAlign;
+
+        for (ULONG t = 0; t < RTL_NUMBER_OF(tones); t++)
+        {
+            putTone(buffer, VOICE_SAMPLE_COUNT, &format.Format, 16384, tones[t]);
+            VoiceFeatures(buffer, byteCount, &format.Format, &features);
+
+            CHECK(features.ulFlatness < DSP_LEVEL_FULL_SCALE / 100);
+        }
+
+        for (ULONG i = 0; i < VOICE_SAMPLE_COUNT; i++)
+        {
+            putSample16(buffer, i, bits[b], (LONG)(TestRandom() % 32768) - 16384);
+        }
+
+        VoiceFeatures(buffer, byteCount, &format.Format, &features);
+        CHECK(features.ulFlatness > DSP_LEVEL_FULL_SCALE * 9 / 10);
+    }
+}
+
+//=============================================================================
+// The vector path of 16-bit samples gives exactly the features of the same
+// samples in 32 bits, which take the scalar path, for every length and
+// channel count.
+TEST(VoiceFeaturesVectorPathMatchesScalar)
+{
+    SHORT samples[8 * 64];
+    LONG  wide[8 * 64];
+
+    TestSeed(29);
+
+    for (ULONG i = 0; i < RTL_NUMBER_OF(samples); i++)
+    {
+        // Loud enough to reach the limits of the 16-bit products.
+        samples[i] = (SHORT)(TestRandom() % 4 ? TestRandom() : (TestRandom() % 2 ? 0x7FFF : 0x8000));
+        wide[i]    = samples[i] * 65536;
+    }
+
+    for (WORD channels = 1; channels <= 8; channels++)
+    {
+        WAVEFORMATEXTENSIBLE narrowFormat;
+        WAVEFORMATEXTENSIBLE wideFormat;
+
+        initFormat(&narrowFormat, WAVE_FORMAT_PCM, nullptr, channels, 16);
+        initFormat(&wideFormat, WAVE_FORMAT_PCM, nullptr, channels, 32);
+
+        for (ULONG count = 0; count <= RTL_NUMBER_OF(samples); count++)
+        {
+            DSP_VOICE_FEATURES narrow;
+            DSP_VOICE_FEATURES expected;
+
+            VoiceFeatures((PBYTE)samples, count * sizeof(SHORT), &narrowFormat.Format, &narrow);
+            VoiceFeatures((PBYTE)wide, count * sizeof(LONG), &wideFormat.Format, &expected);
+
+            CHECK_EQUAL(expected.ulEnergy, narrow.ulEnergy);
+            CHECK_EQUAL(expected.ulZeroCrossings, narrow.ulZeroCrossings);
+            CHECK_EQUAL(expected.ulFlatness, narrow.ulFlatness);
+        }
+    }
+}
@@ -0,0 +1,391 @@
+/*
+Abstract:
+    User-mode implementation of the kernel routines of km/portcls.h.
+
+    Spin locks are real spin locks and the interlocked operations real
+    atomics, so the tests can run driver code on several threads. The IRQL
+    is kept per thread, only to check that it is raised and lowered in
+    pairs.
+*/
+
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+
+#include <msvad.h>
+#include "kernel.h"
+
+//=============================================================================
+// Types
+//=============================================================================
+
+typedef struct _TEST_KERNEL
+{
+    LONGLONG volatile   llHeldCounter;      // -1 while the counter runs.
+    LIST_ENTRY          Timers;             // Inserted kernel timers.
+    KSPIN_LOCK          TimerLock;
+} TEST_KERNEL;
+
+static TEST_KERNEL TestKernel = { -1, { &TestKernel.Timers, &TestKernel.Timers }, 0 };
+
+static thread_local KIRQL CurrentIrql = PASSIVE_LEVEL;
+
+//=============================================================================
+// Memory
+//=============================================================================
+
+PVOID ExAllocatePoolWithTag(IN POOL_TYPE poolType, IN SIZE_T size, IN ULONG tag)
+{
+    UNREFERENCED_PARAMETER(poolType);
+    UNREFERENCED_PARAMETER(tag);
+
+    PVOID p = nullptr;
+
+    if (posix_memalign(&p, size >= PAGE_SIZE ? PAGE_SIZE : MEMORY_ALLOCATION_ALIGNMENT, max(size, 1)))
+    {
+        return nullptr;
+    }
+
+    return p;
+}
+
+void ExFreePoolWithTag(IN PVOID p, IN ULONG tag)
+{
+    UNREFERENCED_PARAMETER(tag);
+
+    free(p);
+}
+
+//=============================================================================
+// IRQL and spin locks
+//=============================================================================
+
+KIRQL KeGetCurrentIrql()
+{
+    return CurrentIrql;
+}
+
+void KeRaiseIrql(IN KIRQL newIrql, OUT PKIRQL oldIrql)
+{
+    ASSERT(newIrql >= CurrentIrql);
+
+    *oldIrql    = CurrentIrql;
+    CurrentIrql = newIrql;
+}
+
+void KeLowerIrql(IN KIRQL newIrql)
+{
+    ASSERT(newIrql <= CurrentIrql);
+
+    CurrentIrql = newIrql;
+}
+
+void KeInitializeSpinLock(OUT PKSPIN_LOCK spinLock)
+{
+    *spinLock = 0;
+}
+
+void KeAcquireSpinLockAtDpcLevel(IN PKSPIN_LOCK spinLock)
+{
+    ASSERT(CurrentIrql >= DISPATCH_LEVEL);
+
+    while (__atomic_exchange_n(spinLock, 1, __ATOMIC_ACQUIRE))
+    {
+        while (__atomic_load_n(spinLock, __ATOMIC_RELAXED))
+        {
+            YieldProcessor();
+        }
+    }
+}
+
+void KeReleaseSpinLockFromDpcLevel(IN PKSPIN_LOCK spinLock)
+{
+    ASSERT(*spinLock);
+
+    __atomic_store_n(spinLock, 0, __ATOMIC_RELEASE);
+}
+
+void KeAcquireSpinLock(IN PKSPIN_LOCK spinLock, OUT PKIRQL oldIrql)
+{
+    KeRaiseIrql(DISPATCH_LEVEL, oldIrql);
+    KeAcquireSpinLockAtDpcLevel(spinLock);
+}
+
+void KeReleaseSpinLock(IN PKSPIN_LOCK spinLock, IN KIRQL newIrql)
+{
+    KeReleaseSpinLockFromDpcLevel(spinLock);
+    KeLowerIrql(newIrql);
+}
+
+//=============================================================================
+// Lock-free lists, here behind a spin lock
+//=============================================================================
+
+void InitializeSListHead(PSLIST_HEADER head)
+{
+    RtlZeroMemory(head, sizeof(*head));
+}
+
+PSLIST_ENTRY InterlockedPushEntrySList(PSLIST_HEADER head, PSLIST_ENTRY entry)
+{
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&head->Lock, &oldIrql);
+
+    const PSLIST_ENTRY first = head->First;
+
+    entry->Next = first;
+    head->First = entry;
+    head->Depth++;
+
+    KeReleaseSpinLock(&head->Lock, oldIrql);
+
+    return first;
+}
+
+PSLIST_ENTRY InterlockedPopEntrySList(PSLIST_HEADER head)
+{
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&head->Lock, &oldIrql);
+
+    const PSLIST_ENTRY first = head->First;
+
+    if (first)
+    {
+        head->First = first->Next;
+        head->Depth--;
+    }
+
+    KeReleaseSpinLock(&head->Lock, oldIrql);
+
+    return first;
+}
+
+PSLIST_ENTRY InterlockedFlushSList(PSLIST_HEADER head)
+{
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&head->Lock, &oldIrql);
+
+    const PSLIST_ENTRY first = head->First;
+
+    head->First = nullptr;
+    head->Depth = 0;
+
+    KeReleaseSpinLock(&head->Lock, oldIrql);
+
+    return first;
+}
+
+USHORT QueryDepthSList(PSLIST_HEADER head)
+{
+    return __atomic_load_n(&head->Depth, __ATOMIC_RELAXED);
+}
+
+//=============================================================================
+// Performance counter
+//=============================================================================
+
+LARGE_INTEGER KeQueryPerformanceCounter(OUT PLARGE_INTEGER frequency)
+{
+    LARGE_INTEGER counter;
+
+    if (frequency)
+    {
+        frequency->QuadPart = TEST_PERFORMANCE_FREQUENCY;
+    }
+
+    counter.QuadPart = __atomic_load_n(&TestKernel.llHeldCounter, __ATOMIC_SEQ_CST);
+
+    if (counter.QuadPart < 0)
+    {
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        counter.QuadPart = (LONGLONG)now.tv_sec * TEST_PERFORMANCE_FREQUENCY + now.tv_nsec / 100;
+    }
+
+    return counter;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Holds the performance counter at counter, until it is released.
+*/
+void TestHoldPerformanceCounter(IN LONGLONG counter)
+{
+    ASSERT(counter >= 0);
+
+    __atomic_store_n(&TestKernel.llHeldCounter, counter, __ATOMIC_SEQ_CST);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Moves the held performance counter forward. Timers that fall due do not
+  fire until TestRunTimers runs them.
+*/
+void TestAdvancePerformanceCounter(IN LONGLONG ticks)
+{
+    ASSERT(TestKernel.llHeldCounter >= 0);
+
+    __atomic_add_fetch(&TestKernel.llHeldCounter, ticks, __ATOMIC_SEQ_CST);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Lets the performance counter run with the host clock again.
+*/
+void TestReleasePerformanceCounter()
+{
+    __atomic_store_n(&TestKernel.llHeldCounter, -1, __ATOMIC_SEQ_CST);
+}
+
+//=============================================================================
+// DPCs and timers
+//=============================================================================
+
+void KeInitializeDpc(OUT PRKDPC dpc, IN PKDEFERRED_ROUTINE routine, IN PVOID context)
+{
+    dpc->DeferredRoutine = routine;
+    dpc->DeferredContext = context;
+}
+
+void KeFlushQueuedDpcs()
+{
+    ASSERT(CurrentIrql == PASSIVE_LEVEL);
+}
+
+void KeInitializeTimerEx(OUT PKTIMER timer, IN TIMER_TYPE type)
+{
+    UNREFERENCED_PARAMETER(type);
+
+    RtlZeroMemory(timer, sizeof(*timer));
+}
+
+BOOLEAN KeCancelTimer(IN PKTIMER timer)
+{
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&TestKernel.TimerLock, &oldIrql);
+
+    const BOOLEAN inserted = timer->Inserted;
+
+    if (inserted)
+    {
+        RemoveEntryList(&timer->TimerListEntry);
+        timer->Inserted = FALSE;
+    }
+
+    KeReleaseSpinLock(&TestKernel.TimerLock, oldIrql);
+
+    return inserted;
+}
+
+BOOLEAN KeSetTimerEx(IN PKTIMER timer, IN LARGE_INTEGER dueTime, IN LONG periodMs, IN PKDPC dpc)
+{
+    ASSERT(dueTime.QuadPart <= 0);
+
+    const BOOLEAN inserted = KeCancelTimer(timer);
+    KIRQL         oldIrql;
+
+    KeAcquireSpinLock(&TestKernel.TimerLock, &oldIrql);
+
+    timer->DueTime  = KeQueryPerformanceCounter(nullptr).QuadPart - dueTime.QuadPart;
+    timer->Period   = periodMs;
+    timer->Dpc      = dpc;
+    timer->Inserted = TRUE;
+    InsertTailList(&TestKernel.Timers, &timer->TimerListEntry);
+
+    KeReleaseSpinLock(&TestKernel.TimerLock, oldIrql);
+
+    return inserted;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Runs the DPC of every kernel timer due at the current performance
+  counter, once, as the DPC of a late timer runs once however late it is.
+  Periodic timers are due again one period after they were due.
+
+Return Value:
+  The number of DPCs run.
+*/
+ULONG TestRunTimers()
+{
+    const LONGLONG now = KeQueryPerformanceCounter(nullptr).QuadPart;
+    ULONG          ran = 0;
+
+    for (;;)
+    {
+        KIRQL  oldIrql;
+        PKTIMER due = nullptr;
+
+        KeAcquireSpinLock(&TestKernel.TimerLock, &oldIrql);
+
+        for (PLIST_ENTRY entry = TestKernel.Timers.Flink; entry != &TestKernel.Timers; entry = entry->Flink)
+        {
+            const PKTIMER timer = CONTAINING_RECORD(entry, KTIMER, TimerListEntry);
+
+            if (timer->DueTime <= now)
+            {
+                due = timer;
+                break;
+            }
+        }
+
+        if (!due)
+        {
+            KeReleaseSpinLock(&TestKernel.TimerLock, oldIrql);
+            break;
+        }
+
+        RemoveEntryList(&due->TimerListEntry);
+
+        if (due->Period)
+        {
+            due->DueTime = max(due->DueTime + (LONGLONG)due->Period * 10000, now + 1);
+            InsertTailList(&TestKernel.Timers, &due->TimerListEntry);
+        }
+        else
+        {
+            due->Inserted = FALSE;
+        }
+
+        const PKDPC dpc = due->Dpc;
+
+        KeReleaseSpinLockFromDpcLevel(&TestKernel.TimerLock);
+        dpc->DeferredRoutine(dpc, dpc->DeferredContext, nullptr, nullptr);
+        KeLowerIrql(oldIrql);
+
+        ran++;
+    }
+
+    return ran;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Returns the number of kernel timers inserted.
+*/
+ULONG TestArmedTimers()
+{
+    KIRQL oldIrql;
+    ULONG count = 0;
+
+    KeAcquireSpinLock(&TestKernel.TimerLock, &oldIrql);
+
+    for (PLIST_ENTRY entry = TestKernel.Timers.Flink; entry != &TestKernel.Timers; entry = entry->Flink)
+    {
+        count++;
+    }
+
+    KeReleaseSpinLock(&TestKernel.TimerLock, oldIrql);
+
+    return count;
+}
@@ -0,0 +1,34 @@
+/*
+Abstract:
+    Controls of the user-mode kernel the tests run the driver code on.
+
+    The performance counter runs at 10 MHz, off the monotonic clock of the
+    host, unless a test holds it at a value. Kernel timers do not fire by
+    themselves: TestRunTimers runs the DPCs of those due, so a test decides
+    when, and how late, a timer DPC runs.
+*/
+
+#ifndef _MSVAD_TEST_KERNEL_H_
+#define _MSVAD_TEST_KERNEL_H_
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+#define TEST_PERFORMANCE_FREQUENCY  _100NS_UNITS_PER_SECOND
+
+//=============================================================================
+// Function Prototypes
+//=============================================================================
+
+void     TestHoldPerformanceCounter(IN LONGLONG counter);
+
+void     TestAdvancePerformanceCounter(IN LONGLONG ticks);
+
+void     TestReleasePerformanceCounter();
+
+ULONG    TestRunTimers();
+
+ULONG    TestArmedTimers();
+
+#endif
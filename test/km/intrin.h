@@ -0,0 +1,19 @@
+/*
+Abstract:
+    User-mode stand-in for intrin.h, for the tests.
+*/
+
+#ifndef _MSVAD_TEST_INTRIN_H_
+#define _MSVAD_TEST_INTRIN_H_
+
+#include <cpuid.h>
+
+// The one of cpuid.h takes the registers apart.
+#undef __cpuid
+
+inline void __cpuid(int cpuInfo[4], int function)
+{
+    __cpuid_count(function, 0, cpuInfo[0], cpuInfo[1], cpuInfo[2], cpuInfo[3]);
+}
+
+#endif
@@ -0,0 +1,17 @@
+/*
+Abstract:
+    User-mode stand-in for ksdebug.h, for the tests. Debug output is
+    compiled but not printed; its formats are those of DbgPrint.
+*/
+
+#ifndef _MSVAD_TEST_KSDEBUG_H_
+#define _MSVAD_TEST_KSDEBUG_H_
+
+#define DEBUGLVL_ERROR              0
+#define DEBUGLVL_TERSE              1
+#define DEBUGLVL_VERBOSE            2
+#define DEBUGLVL_BLAB               3
+
+#define _DbgPrintF(lvl, strings)    do { if (0) { printf strings; } } while (0)
+
+#endif
@@ -0,0 +1,6 @@
+/*
+Abstract:
+    User-mode stand-in for poppack.h, for the tests.
+*/
+
+#pragma pack(pop)
@@ -0,0 +1,442 @@
+/*
+Abstract:
+    User-mode stand-in for the WDK headers, for the tests.
+
+    Declares the part of the kernel, KS and PortCls interfaces the modules
+    under test use, with the layouts and semantics of the real ones where
+    the modules depend on them. The routines are implemented in kernel.cpp.
+*/
+
+#ifndef _MSVAD_TEST_PORTCLS_H_
+#define _MSVAD_TEST_PORTCLS_H_
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+//=============================================================================
+// Annotations and language
+//=============================================================================
+
+#define IN
+#define OUT
+#define OPTIONAL
+#define _In_
+#define _In_opt_
+#define _Out_
+#define _Out_opt_
+#define _Inout_
+#define _In_reads_(x)
+#define _In_reads_bytes_(x)
+#define _Out_writes_(x)
+#define _Out_writes_bytes_(x)
+#define _Inout_updates_(x)
+#define _Inout_updates_bytes_(x)
+
+#define FORCEINLINE                 inline __attribute__((always_inline))
+#define DECLSPEC_ALIGN(x)           __attribute__((aligned(x)))
+#define UNREFERENCED_PARAMETER(p)   ((void)(p))
+#define C_ASSERT(e)                 static_assert(e, #e)
+#define PAGED_CODE()
+
+#define ASSERT(e)                   assert(e)
+#define NT_ASSERT(e)                assert(e)
+
+#define min(a, b)                   (((a) < (b)) ? (a) : (b))
+#define max(a, b)                   (((a) > (b)) ? (a) : (b))
+
+#define RTL_NUMBER_OF(a)            (sizeof(a) / sizeof((a)[0]))
+#define ARRAYSIZE(a)                RTL_NUMBER_OF(a)
+#define FIELD_OFFSET(t, f)          offsetof(t, f)
+#define CONTAINING_RECORD(a, t, f)  ((t*)((char*)(a) - offsetof(t, f)))
+#define ALIGN_UP_BY(l, a)           (((ULONG_PTR)(l) + (a) - 1) & ~((ULONG_PTR)(a) - 1))
+#define ALIGN_DOWN_BY(l, a)         ((ULONG_PTR)(l) & ~((ULONG_PTR)(a) - 1))
+
+//=============================================================================
+// Basic types
+//=============================================================================
+
+typedef void                VOID, *PVOID;
+typedef char                CHAR, *PCHAR;
+typedef unsigned char       UCHAR, *PUCHAR, BYTE, *PBYTE, BOOLEAN, *PBOOLEAN;
+typedef int16_t             SHORT, *PSHORT;
+typedef uint16_t            USHORT, *PUSHORT, WORD;
+typedef int32_t             LONG, *PLONG, INT, BOOL;
+typedef uint32_t            ULONG, *PULONG, DWORD, *PDWORD, UINT;
+typedef int64_t             LONGLONG, *PLONGLONG, LONG64;
+typedef uint64_t            ULONGLONG, *PULONGLONG, ULONG64;
+typedef intptr_t            LONG_PTR;
+typedef uintptr_t           ULONG_PTR;
+typedef size_t              SIZE_T;
+typedef wchar_t             WCHAR, *PWSTR;
+typedef const WCHAR*        PCWSTR;
+typedef LONG                NTSTATUS;
+
+#define TRUE                1
+#define FALSE               0
+
+#define MAXUSHORT           0xFFFF
+#define MAXLONG             0x7FFFFFFF
+#define MINLONG             ((LONG)0x80000000)
+#define MAXULONG            0xFFFFFFFFUL
+#define MAXLONGLONG         0x7FFFFFFFFFFFFFFFLL
+#define MAXULONGLONG        0xFFFFFFFFFFFFFFFFULL
+
+typedef union _LARGE_INTEGER
+{
+    struct
+    {
+        ULONG   LowPart;
+        LONG    HighPart;
+    };
+    LONGLONG    QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER, PHYSICAL_ADDRESS, *PPHYSICAL_ADDRESS;
+
+typedef struct _GUID
+{
+    ULONG   Data1;
+    USHORT  Data2;
+    USHORT  Data3;
+    UCHAR   Data4[8];
+} GUID;
+
+#define IsEqualGUIDAligned(a, b)    (!memcmp(&(a), &(b), sizeof(GUID)))
+#define DEFINE_GUIDSTRUCT(g, n)     struct n
+#define DEFINE_GUIDNAMED(n)         n
+
+//=============================================================================
+// Status values
+//=============================================================================
+
+#define NT_SUCCESS(s)                   (((NTSTATUS)(s)) >= 0)
+
+#define STATUS_SUCCESS                  ((NTSTATUS)0x00000000L)
+#define STATUS_UNSUCCESSFUL             ((NTSTATUS)0xC0000001L)
+#define STATUS_NOT_IMPLEMENTED          ((NTSTATUS)0xC0000002L)
+#define STATUS_INVALID_PARAMETER        ((NTSTATUS)0xC000000DL)
+#define STATUS_INVALID_DEVICE_REQUEST   ((NTSTATUS)0xC0000010L)
+#define STATUS_BUFFER_TOO_SMALL         ((NTSTATUS)0xC0000023L)
+#define STATUS_INSUFFICIENT_RESOURCES   ((NTSTATUS)0xC000009AL)
+#define STATUS_DEVICE_NOT_READY         ((NTSTATUS)0xC00000A3L)
+#define STATUS_NOT_SUPPORTED            ((NTSTATUS)0xC00000BBL)
+#define STATUS_INVALID_DEVICE_STATE     ((NTSTATUS)0xC0000184L)
+
+//=============================================================================
+// Memory
+//=============================================================================
+
+#define PAGE_SIZE                   4096
+#define PAGE_SHIFT                  12
+#define MEMORY_ALLOCATION_ALIGNMENT 16
+
+#define ROUND_TO_PAGES(size)        (((ULONG_PTR)(size) + PAGE_SIZE - 1) & ~((ULONG_PTR)PAGE_SIZE - 1))
+
+typedef enum _POOL_TYPE
+{
+    NonPagedPool,
+    PagedPool
+} POOL_TYPE;
+
+// Allocations of a page or more are page aligned, as in the kernel.
+PVOID ExAllocatePoolWithTag(IN POOL_TYPE poolType, IN SIZE_T size, IN ULONG tag);
+void  ExFreePoolWithTag(IN PVOID p, IN ULONG tag);
+
+inline void* operator new(size_t size, POOL_TYPE poolType, ULONG tag)
+{
+    return ExAllocatePoolWithTag(poolType, size, tag);
+}
+
+#define RtlZeroMemory(d, l)         memset((d), 0, (l))
+#define RtlFillMemory(d, l, f)      memset((d), (f), (l))
+#define RtlCopyMemory(d, s, l)      memcpy((d), (s), (l))
+#define RtlMoveMemory(d, s, l)      memmove((d), (s), (l))
+
+inline PVOID RtlSecureZeroMemory(PVOID d, SIZE_T l)
+{
+    volatile UCHAR* p = (volatile UCHAR*)d;
+
+    while (l--)
+    {
+        *p++ = 0;
+    }
+
+    return d;
+}
+
+#define RtlUlonglongByteSwap(x)     __builtin_bswap64(x)
+
+//=============================================================================
+// Lists
+//=============================================================================
+
+typedef struct _LIST_ENTRY
+{
+    struct _LIST_ENTRY* Flink;
+    struct _LIST_ENTRY* Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+inline void InitializeListHead(PLIST_ENTRY head)
+{
+    head->Flink = head->Blink = head;
+}
+
+inline BOOLEAN IsListEmpty(PLIST_ENTRY head)
+{
+    return head->Flink == head;
+}
+
+inline BOOLEAN RemoveEntryList(PLIST_ENTRY entry)
+{
+    const PLIST_ENTRY flink = entry->Flink;
+    const PLIST_ENTRY blink = entry->Blink;
+
+    // The kernel fails fast on a corrupted list, and so do the tests.
+    //
+    assert(flink->Blink == entry && blink->Flink == entry);
+
+    blink->Flink = flink;
+    flink->Blink = blink;
+
+    return flink == blink;
+}
+
+inline PLIST_ENTRY RemoveHeadList(PLIST_ENTRY head)
+{
+    const PLIST_ENTRY entry = head->Flink;
+
+    RemoveEntryList(entry);
+
+    return entry;
+}
+
+inline void InsertTailList(PLIST_ENTRY head, PLIST_ENTRY entry)
+{
+    const PLIST_ENTRY blink = head->Blink;
+
+    assert(blink->Flink == head);
+
+    entry->Flink = head;
+    entry->Blink = blink;
+    blink->Flink = entry;
+    head->Blink  = entry;
+}
+
+inline void InsertHeadList(PLIST_ENTRY head, PLIST_ENTRY entry)
+{
+    const PLIST_ENTRY flink = head->Flink;
+
+    assert(flink->Blink == head);
+
+    entry->Flink = flink;
+    entry->Blink = head;
+    flink->Blink = entry;
+    head->Flink  = entry;
+}
+
+typedef struct _SLIST_ENTRY
+{
+    struct _SLIST_ENTRY* Next;
+} SLIST_ENTRY, *PSLIST_ENTRY;
+
+typedef struct DECLSPEC_ALIGN(16) _SLIST_HEADER
+{
+    PSLIST_ENTRY    First;
+    ULONG_PTR       Lock;
+    USHORT          Depth;
+} SLIST_HEADER, *PSLIST_HEADER;
+
+void         InitializeSListHead(PSLIST_HEADER head);
+PSLIST_ENTRY InterlockedPushEntrySList(PSLIST_HEADER head, PSLIST_ENTRY entry);
+PSLIST_ENTRY InterlockedPopEntrySList(PSLIST_HEADER head);
+PSLIST_ENTRY InterlockedFlushSList(PSLIST_HEADER head);
+USHORT       QueryDepthSList(PSLIST_HEADER head);
+
+//=============================================================================
+// Interlocked operations and intrinsics
+//=============================================================================
+
+inline LONG InterlockedIncrement(LONG volatile* p)              { return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST); }
+inline LONG InterlockedDecrement(LONG volatile* p)              { return __atomic_sub_fetch(p, 1, __ATOMIC_SEQ_CST); }
+inline LONG InterlockedExchange(LONG volatile* p, LONG v)       { return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST); }
+inline LONG InterlockedExchangeAdd(LONG volatile* p, LONG v)    { return __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST); }
+
+inline LONG InterlockedCompareExchange(LONG volatile* p, LONG v, LONG comparand)
+{
+    __atomic_compare_exchange_n(p, &comparand, v, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return comparand;
+}
+
+inline LONGLONG InterlockedExchange64(LONGLONG volatile* p, LONGLONG v)
+{
+    return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+inline LONGLONG InterlockedCompareExchange64(LONGLONG volatile* p, LONGLONG v, LONGLONG comparand)
+{
+    __atomic_compare_exchange_n(p, &comparand, v, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return comparand;
+}
+
+inline void KeMemoryBarrier()
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+inline void YieldProcessor()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#endif
+}
+
+inline BOOLEAN _BitScanForward(PULONG index, ULONG mask)
+{
+    if (!mask)
+    {
+        return FALSE;
+    }
+
+    *index = (ULONG)__builtin_ctz(mask);
+    return TRUE;
+}
+
+inline BOOLEAN _BitScanReverse(PULONG index, ULONG mask)
+{
+    if (!mask)
+    {
+        return FALSE;
+    }
+
+    *index = 31 - (ULONG)__builtin_clz(mask);
+    return TRUE;
+}
+
+inline ULONGLONG UnsignedMultiplyHigh(ULONGLONG a, ULONGLONG b)
+{
+    return (ULONGLONG)(((unsigned __int128)a * b) >> 64);
+}
+
+//=============================================================================
+// IRQL, spin locks, DPCs and timers
+//=============================================================================
+
+typedef UCHAR       KIRQL, *PKIRQL;
+typedef ULONG_PTR   KSPIN_LOCK, *PKSPIN_LOCK;
+
+#define PASSIVE_LEVEL               0
+#define APC_LEVEL                   1
+#define DISPATCH_LEVEL              2
+
+#define _100NS_UNITS_PER_SECOND     10000000L
+
+typedef struct _KDPC* PKDPC;
+typedef PKDPC PRKDPC;
+
+typedef void KDEFERRED_ROUTINE(IN PKDPC Dpc, IN PVOID DeferredContext, IN PVOID SystemArgument1, IN PVOID SystemArgument2);
+typedef KDEFERRED_ROUTINE* PKDEFERRED_ROUTINE;
+
+typedef struct _KDPC
+{
+    PKDEFERRED_ROUTINE  DeferredRoutine;
+    PVOID               DeferredContext;
+} KDPC;
+
+typedef enum _TIMER_TYPE
+{
+    NotificationTimer,
+    SynchronizationTimer
+} TIMER_TYPE;
+
+// Due times are performance counter values; see TestRunTimers.
+typedef struct _KTIMER
+{
+    LIST_ENTRY  TimerListEntry;
+    LONGLONG    DueTime;
+    LONG        Period;
+    PKDPC       Dpc;
+    BOOLEAN     Inserted;
+} KTIMER, *PKTIMER;
+
+KIRQL         KeGetCurrentIrql();
+void          KeRaiseIrql(IN KIRQL newIrql, OUT PKIRQL oldIrql);
+void          KeLowerIrql(IN KIRQL newIrql);
+
+void          KeInitializeSpinLock(OUT PKSPIN_LOCK spinLock);
+void          KeAcquireSpinLock(IN PKSPIN_LOCK spinLock, OUT PKIRQL oldIrql);
+void          KeReleaseSpinLock(IN PKSPIN_LOCK spinLock, IN KIRQL newIrql);
+void          KeAcquireSpinLockAtDpcLevel(IN PKSPIN_LOCK spinLock);
+void          KeReleaseSpinLockFromDpcLevel(IN PKSPIN_LOCK spinLock);
+
+void          KeInitializeDpc(OUT PRKDPC dpc, IN PKDEFERRED_ROUTINE routine, IN PVOID context);
+void          KeFlushQueuedDpcs();
+
+void          KeInitializeTimerEx(OUT PKTIMER timer, IN TIMER_TYPE type);
+BOOLEAN       KeSetTimerEx(IN PKTIMER timer, IN LARGE_INTEGER dueTime, IN LONG periodMs, IN PKDPC dpc);
+BOOLEAN       KeCancelTimer(IN PKTIMER timer);
+
+LARGE_INTEGER KeQueryPerformanceCounter(OUT PLARGE_INTEGER frequency);
+
+//=============================================================================
+// Audio formats
+//=============================================================================
+
+#define WAVE_FORMAT_PCM             0x0001
+#define WAVE_FORMAT_IEEE_FLOAT      0x0003
+#define WAVE_FORMAT_EXTENSIBLE      0xFFFE
+
+typedef struct tWAVEFORMATEX
+{
+    WORD    wFormatTag;
+    WORD    nChannels;
+    DWORD   nSamplesPerSec;
+    DWORD   nAvgBytesPerSec;
+    WORD    nBlockAlign;
+    WORD    wBitsPerSample;
+    WORD    cbSize;
+} __attribute__((packed)) WAVEFORMATEX, *PWAVEFORMATEX;
+
+typedef struct
+{
+    WAVEFORMATEX    Format;
+    union
+    {
+        WORD        wValidBitsPerSample;
+        WORD        wSamplesPerBlock;
+    } Samples;
+    DWORD           dwChannelMask;
+    GUID            SubFormat;
+} __attribute__((packed)) WAVEFORMATEXTENSIBLE, *PWAVEFORMATEXTENSIBLE;
+
+static const GUID KSDATAFORMAT_SUBTYPE_PCM        = { 0x00000001, 0x0000, 0x0010, { 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71 } };
+static const GUID KSDATAFORMAT_SUBTYPE_IEEE_FLOAT = { 0x00000003, 0x0000, 0x0010, { 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71 } };
+
+//=============================================================================
+// KS and PortCls
+//=============================================================================
+
+#define KSPROPERTY_TYPE_GET             0x00000001
+#define KSPROPERTY_TYPE_SET             0x00000002
+#define KSPROPERTY_TYPE_BASICSUPPORT    0x00000200
+
+typedef struct _DEVICE_OBJECT* PDEVICE_OBJECT;
+
+typedef struct
+{
+    ULONG   FormatSize;
+    ULONG   Flags;
+    ULONG   SampleSize;
+    ULONG   Reserved;
+    GUID    MajorFormat;
+    GUID    SubFormat;
+    GUID    Specifier;
+} KSDATAFORMAT, *PKSDATAFORMAT;
+
+typedef struct _PCPROPERTY_REQUEST* PPCPROPERTY_REQUEST;
+
+#endif
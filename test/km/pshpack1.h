@@ -0,0 +1,6 @@
+/*
+Abstract:
+    User-mode stand-in for pshpack1.h, for the tests.
+*/
+
+#pragma pack(push, 1)
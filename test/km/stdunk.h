@@ -0,0 +1,10 @@
+/*
+Abstract:
+    User-mode stand-in for stdunk.h, for the tests. The modules under test
+    implement no COM interfaces.
+*/
+
+#ifndef _MSVAD_TEST_STDUNK_H_
+#define _MSVAD_TEST_STDUNK_H_
+
+#endif
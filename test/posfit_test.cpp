@@ -0,0 +1,324 @@
+/*
+Abstract:
+    Tests and benchmark of the position estimator.
+*/
+
+#include <math.h>
+
+#include <msvad.h>
+#include "posfit.h"
+#include "test.h"
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+#define MS                          10000ULL        // 100 ns units.
+#define DAY                         (24 * 3600 * 1000 * MS)
+
+//=============================================================================
+// floor(time * frameRate / 10^7), in 128 bits.
+static ULONGLONG exactFrames(IN ULONGLONG time, IN ULONG frameRate)
+{
+    return (ULONGLONG)((unsigned __int128)time * frameRate / _100NS_UNITS_PER_SECOND);
+}
+
+//=============================================================================
+// Roughly normal noise of standard deviation sigma, from the sum of four
+// uniform values.
+static double noise(IN double sigma)
+{
+    double sum = 0;
+
+    for (ULONG i = 0; i < 4; i++)
+    {
+        sum += (double)(TestRandom() >> 11) / (1ULL << 53) - 0.5;
+    }
+
+    return sum * sigma * sqrt(3.0);
+}
+
+//=============================================================================
+// Positions of a clock running exactly, sampled every 10 ms on an adapter
+// that has been up for days, are predicted to the frame around the window
+// and for a second beyond it, with the rate exact to its Q16 rounding.
+TEST(ExactClockIsPredictedToTheFrame)
+{
+    const ULONG rates[] = { 8000, 44100, 48000, 192000, 384000 };
+
+    for (ULONG r = 0; r < RTL_NUMBER_OF(rates); r++)
+    {
+        const ULONGLONG start  = 5 * DAY + TestRandom() % DAY;
+        PositionFit     fit;
+        ULONG           errors = 0;
+
+        for (ULONGLONG time = start; time < start + 10 * 1000 * MS; time += 10 * MS)
+        {
+            fit.add(time, exactFrames(time, rates[r]) - exactFrames(start, rates[r]));
+        }
+
+        const PPOSITION_ESTIMATE estimate = fit.estimate();
+
+        CHECK_EQUAL(POSITION_FIT_SAMPLES, estimate->ulCount);
+        CHECK(llabs((LONGLONG)estimate->ullRateQ16 - ((LONGLONG)rates[r] << 16)) <= 2);
+
+        for (ULONG n = 0; n < 1000; n++)
+        {
+            const ULONGLONG time = estimate->ullTime - 200 * MS + TestRandom() % (1200 * MS);
+            ULONGLONG       frames;
+            ULONG           bound;
+
+            CHECK_EQUAL(STATUS_SUCCESS, PositionPredict(estimate, time, &frames, &bound));
+
+            errors += llabs((LONGLONG)(frames - (exactFrames(time, rates[r]) - exactFrames(start, rates[r])))) > 1;
+            errors += bound > 2;
+        }
+
+        CHECK_EQUAL(0, errors);
+    }
+}
+
+//=============================================================================
+// With noisy positions the prediction stays within its bound about as
+// often as the confidence says, up to a second beyond the samples. Below a
+// frame of noise the rounding to whole frames dominates, and the bound
+// holds nearly always.
+TEST(BoundCoversTheError)
+{
+    const double sigmas[] = { 0.5, 4, 40 };
+
+    for (ULONG s = 0; s < RTL_NUMBER_OF(sigmas); s++)
+    {
+        const ULONG     rate    = 48000;
+        ULONGLONG       time    = DAY;
+        ULONG           inside  = 0;
+        ULONG           count   = 0;
+        PositionFit     fit;
+
+        for (ULONG n = 0; n < 20000; n++)
+        {
+            time += 10 * MS;
+
+            const LONGLONG frames = (LONGLONG)exactFrames(time - DAY, rate) + llround(noise(sigmas[s]));
+
+            fit.add(time, (ULONGLONG)max(frames, 0));
+
+            if (n % 10 || n < 100)
+            {
+                continue;
+            }
+
+            // A copy, as the readers of the position snapshot use.
+            //
+            POSITION_ESTIMATE estimate = *fit.estimate();
+            const ULONGLONG   ahead    = TestRandom() % (1000 * MS);
+            ULONGLONG         predicted;
+            ULONG             bound;
+
+            CHECK_EQUAL(STATUS_SUCCESS, PositionPredict(&estimate, time + ahead, &predicted, &bound));
+
+            const double truth = (double)(time + ahead - DAY) * rate / _100NS_UNITS_PER_SECOND + noise(sigmas[s]);
+
+            inside += fabs((double)predicted - truth) <= bound + 0.5;
+            count++;
+        }
+
+        printf("       noise %4.1f frames: %.1f%% within the bound\n", sigmas[s], 100.0 * inside / count);
+
+        CHECK(inside >= count * 90 / 100);
+
+        // Too narrow a bound is no use, so it must not be far above the 95%.
+        //
+        CHECK(inside <= count * 999 / 1000 || sigmas[s] < 1);
+    }
+}
+
+//=============================================================================
+// The fixed-point fit matches a least-squares fit in double precision of
+// the same samples, and follows a device clock off its nominal rate. The
+// window spans only a third of a second, over which whole frames resolve
+// the rate to a few frames per second; over many phases of the samples
+// against the frames the rate comes out unbiased.
+TEST(FitMatchesLeastSquaresAndFollowsTheClock)
+{
+    const ULONG rate   = 48000;
+    ULONG       errors = 0;
+    double      bias   = 0;
+    ULONG       count  = 0;
+
+    for (ULONG trial = 0; trial < 1000; trial++)
+    {
+        const LONG      ppm   = (LONG)(TestRandom() % 4001) - 2000;
+        const ULONGLONG start = 2 * DAY + TestRandom() % DAY;
+        const ULONGLONG phase = TestRandom() % (10 * MS);
+        ULONGLONG       times[POSITION_FIT_SAMPLES];
+        ULONGLONG       frames[POSITION_FIT_SAMPLES];
+        PositionFit     fit;
+        ULONG           n = 0;
+
+        for (ULONGLONG time = phase; time < phase + 1000 * MS; time += 10 * MS + TestRandom() % MS, n++)
+        {
+            const ULONGLONG deviceTime = time + (ULONGLONG)((LONGLONG)time * ppm / 1000000);
+
+            times[n % POSITION_FIT_SAMPLES]  = start + time;
+            frames[n % POSITION_FIT_SAMPLES] = exactFrames(deviceTime, rate);
+
+            fit.add(times[n % POSITION_FIT_SAMPLES], frames[n % POSITION_FIT_SAMPLES]);
+        }
+
+        double meanTime   = 0;
+        double meanFrames = 0;
+        double sxx        = 0;
+        double sxy        = 0;
+        double squares    = 0;
+
+        for (ULONG i = 0; i < POSITION_FIT_SAMPLES; i++)
+        {
+            meanTime   += (double)(times[i] - start) / POSITION_FIT_SAMPLES;
+            meanFrames += (double)frames[i] / POSITION_FIT_SAMPLES;
+        }
+
+        for (ULONG i = 0; i < POSITION_FIT_SAMPLES; i++)
+        {
+            const double dx = (double)(times[i] - start) - meanTime;
+
+            sxx += dx * dx;
+            sxy += dx * ((double)frames[i] - meanFrames);
+        }
+
+        const double slope = sxy / sxx;
+
+        for (ULONG i = 0; i < POSITION_FIT_SAMPLES; i++)
+        {
+            const double residual = (double)frames[i] - meanFrames - slope * ((double)(times[i] - start) - meanTime);
+
+            squares += residual * residual;
+        }
+
+        const PPOSITION_ESTIMATE estimate = fit.estimate();
+        const double             fitted   = (double)estimate->ullRateQ16 / 65536;
+        const double             centre   = meanFrames + slope * ((double)(estimate->ullTime - start) - meanTime);
+
+        errors += fabs(fitted - slope * _100NS_UNITS_PER_SECOND) > 2.0 / 65536;
+        errors += fabs((double)estimate->ullFramesQ16 / 65536 - centre) > 2.0 / 65536;
+        errors += fabs((double)estimate->ulErrorQ16 / 65536 - sqrt(squares / (POSITION_FIT_SAMPLES - 2))) > 2.0 / 65536;
+
+        bias += fitted - rate * (1 + ppm * 1e-6);
+        count++;
+    }
+
+    CHECK_EQUAL(0, errors);
+    CHECK(fabs(bias / count) < 0.1);
+}
+
+//=============================================================================
+// The window holds POSITION_FIT_SAMPLES within POSITION_FIT_MAX_SPAN, a
+// sample that goes back starts over, and a stalled position is level.
+TEST(WindowAndRestarts)
+{
+    PositionFit fit;
+    ULONGLONG   frames;
+    ULONG       bound;
+
+    CHECK_EQUAL(STATUS_DEVICE_NOT_READY, PositionPredict(fit.estimate(), DAY, &frames, &bound));
+
+    fit.add(DAY, 1000);
+    fit.add(DAY + 10 * MS, 1480);
+    CHECK_EQUAL(STATUS_DEVICE_NOT_READY, PositionPredict(fit.estimate(), DAY, &frames, &bound));
+
+    fit.add(DAY + 20 * MS, 1960);
+    CHECK_EQUAL(STATUS_SUCCESS, PositionPredict(fit.estimate(), DAY + 30 * MS, &frames, &bound));
+    CHECK_EQUAL(2440, frames);
+
+    // Too far from the samples.
+    //
+    CHECK_EQUAL(STATUS_INVALID_PARAMETER,
+                PositionPredict(fit.estimate(), DAY + 20 * MS + POSITION_FIT_MAX_EXTRAPOLATION + MS, &frames, &bound));
+    CHECK_EQUAL(STATUS_INVALID_PARAMETER,
+                PositionPredict(fit.estimate(), DAY - POSITION_FIT_MAX_EXTRAPOLATION - MS, &frames, &bound));
+
+    // Back in frames, as after a stop.
+    //
+    fit.add(DAY + 30 * MS, 0);
+    CHECK_EQUAL(STATUS_DEVICE_NOT_READY, PositionPredict(fit.estimate(), DAY, &frames, &bound));
+
+    // Back in time.
+    //
+    fit.add(DAY + 40 * MS, 480);
+    fit.add(DAY + 50 * MS, 960);
+    fit.add(DAY + 45 * MS, 960);
+    CHECK_EQUAL(STATUS_DEVICE_NOT_READY, PositionPredict(fit.estimate(), DAY, &frames, &bound));
+
+    // The window is full at POSITION_FIT_SAMPLES.
+    //
+    fit.reset();
+
+    for (ULONG n = 0; n < 100; n++)
+    {
+        fit.add(DAY + n * 10 * MS, n * 480);
+    }
+
+    CHECK_EQUAL(POSITION_FIT_SAMPLES, fit.estimate()->ulCount);
+
+    // Samples further apart than the span leave only the latest ones.
+    //
+    fit.reset();
+
+    for (ULONG n = 0; n < 5; n++)
+    {
+        fit.add(DAY + n * POSITION_FIT_MAX_SPAN / 2, n * 480);
+    }
+
+    CHECK_EQUAL(POSITION_FIT_MIN_SAMPLES, fit.estimate()->ulCount);
+
+    // A stalled position, as in a pause.
+    //
+    fit.reset();
+    fit.add(DAY,           1000);
+    fit.add(DAY + 10 * MS, 1000);
+    fit.add(DAY + 20 * MS, 1000);
+    CHECK_EQUAL(0, fit.estimate()->ullRateQ16);
+    CHECK_EQUAL(0, fit.estimate()->ulErrorQ16);
+}
+
+//=============================================================================
+// Cost of adding a sample to a full window, as every DMA engine run does,
+// and of a prediction, as every position query does.
+TEST(BenchmarkPositionFit)
+{
+    const ULONG count = 1000000;
+    PositionFit fit;
+    ULONGLONG   time  = DAY;
+    ULONGLONG   sum   = 0;
+
+    for (ULONG n = 0; n < POSITION_FIT_SAMPLES; n++, time += 10 * MS)
+    {
+        fit.add(time, exactFrames(time - DAY, 48000));
+    }
+
+    double start = TestSeconds();
+
+    for (ULONG n = 0; n < count; n++, time += 10 * MS)
+    {
+        fit.add(time, exactFrames(time - DAY, 48000));
+    }
+
+    printf("       add     %6.1f ns\n", (TestSeconds() - start) * 1e9 / count);
+
+    POSITION_ESTIMATE estimate = *fit.estimate();
+
+    start = TestSeconds();
+
+    for (ULONG n = 0; n < count; n++)
+    {
+        ULONGLONG frames;
+        ULONG     bound;
+
+        PositionPredict(&estimate, estimate.ullTime + n % 100000, &frames, &bound);
+        sum += frames + bound;
+    }
+
+    printf("       predict %6.1f ns\n", (TestSeconds() - start) * 1e9 / count);
+
+    CHECK(sum);
+}
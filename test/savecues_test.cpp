@@ -0,0 +1,145 @@
+/*
+Abstract:
+    Tests of the segment cue points of gated files.
+*/
+
+#include <string.h>
+#include <vector>
+
+#include <msvad.h>
+#include "savecues.h"
+#include "test.h"
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+#define DATA_START                  0x2C    // After a plain PCM header.
+
+//=============================================================================
+// Little-endian DWORD at an offset of the chunks, as a reader sees it.
+static DWORD readDword(IN const std::vector<BYTE>& chunks, IN ULONG offset)
+{
+    return chunks[offset] | (chunks[offset + 1] << 8) | (chunks[offset + 2] << 16) | ((DWORD)chunks[offset + 3] << 24);
+}
+
+//=============================================================================
+static BOOL isFourCc(IN const std::vector<BYTE>& chunks, IN ULONG offset, IN const char* fourCc)
+{
+    return offset + 4 <= chunks.size() && !memcmp(&chunks[offset], fourCc, 4);
+}
+
+//=============================================================================
+// Builds the chunks of the segments and reads them back the way a RIFF
+// reader does, from the identifiers and lengths alone.
+static void checkCues(IN std::vector<SAVE_SEGMENT>& segments, IN ULONG blockAlign)
+{
+    const ULONG       segmentCount = (ULONG)segments.size();
+    std::vector<BYTE> chunks(SaveCuesSize(segmentCount) + 4, 0);
+
+    SaveCuesBuild(chunks.data(), segments.data(), segmentCount, DATA_START, blockAlign, 0x61746164);
+
+    // Nothing past the chunks is touched.
+    CHECK_EQUAL(0, readDword(chunks, (ULONG)chunks.size() - 4));
+    chunks.resize(chunks.size() - 4);
+
+    // 'cue ': the count, then one 24-byte cue point per segment.
+    ULONG offset = 0;
+
+    CHECK(isFourCc(chunks, offset, "cue "));
+
+    const ULONG cueLength = readDword(chunks, offset + 4);
+
+    CHECK_EQUAL(4 + 24 * segmentCount, cueLength);
+    CHECK_EQUAL(segmentCount, readDword(chunks, offset + 8));
+
+    for (ULONG i = 0; i < segmentCount; i++)
+    {
+        const ULONG point    = offset + 12 + 24 * i;
+        const DWORD position = (DWORD)((segments[i].llStart - DATA_START) / blockAlign);
+
+        CHECK_EQUAL(i + 1, readDword(chunks, point));
+        CHECK_EQUAL(position, readDword(chunks, point + 4));
+        CHECK(isFourCc(chunks, point + 8, "data"));
+        CHECK_EQUAL(0, readDword(chunks, point + 12));
+        CHECK_EQUAL(0, readDword(chunks, point + 16));
+        CHECK_EQUAL(position, readDword(chunks, point + 20));
+    }
+
+    // Chunks start at even offsets.
+    offset += 8 + cueLength + (cueLength & 1);
+
+    // 'LIST' 'adtl': one 'ltxt' of 20 bytes per segment.
+    CHECK(isFourCc(chunks, offset, "LIST"));
+
+    const ULONG listLength = readDword(chunks, offset + 4);
+    const ULONG listEnd    = offset + 8 + listLength;
+
+    CHECK_EQUAL(chunks.size(), listEnd);
+    CHECK(isFourCc(chunks, offset + 8, "adtl"));
+
+    ULONG sub   = offset + 12;
+    ULONG count = 0;
+
+    while (sub < listEnd)
+    {
+        CHECK(isFourCc(chunks, sub, "ltxt"));
+
+        const ULONG length = readDword(chunks, sub + 4);
+
+        CHECK_EQUAL(20, length);
+        CHECK_EQUAL(count + 1, readDword(chunks, sub + 8));
+        CHECK_EQUAL((segments[count].llEnd - segments[count].llStart) / blockAlign, readDword(chunks, sub + 12));
+        CHECK(isFourCc(chunks, sub + 16, "rgn "));
+
+        // Country, language, dialect and code page are left at 0.
+        CHECK_EQUAL(0, readDword(chunks, sub + 20));
+        CHECK_EQUAL(0, readDword(chunks, sub + 24));
+
+        sub += 8 + length + (length & 1);
+        count++;
+    }
+
+    CHECK_EQUAL(listEnd, sub);
+    CHECK_EQUAL(segmentCount, count);
+}
+
+//=============================================================================
+TEST(OneSegmentGetsOneCueAndOneRegion)
+{
+    std::vector<SAVE_SEGMENT> segments = { { DATA_START, DATA_START + 4 * 48000 } };
+
+    checkCues(segments, 4);
+}
+
+//=============================================================================
+// Segments of random lengths with random gaps, in the block aligns of odd
+// formats, and with a gap of 2^31 sample frames, which takes all but the
+// 8-bit mono files past 4 GB.
+TEST(CuesCountSampleFramesFromTheDataChunk)
+{
+    const ULONG blockAligns[] = { 1, 2, 3, 4, 6, 8, 12, 32 };
+
+    TestSeed(29);
+
+    for (ULONG b = 0; b < RTL_NUMBER_OF(blockAligns); b++)
+    {
+        std::vector<SAVE_SEGMENT> segments;
+        LONGLONG                  start = DATA_START;
+
+        for (ULONG i = 0; i < 100; i++)
+        {
+            const LONGLONG length = (LONGLONG)(1 + TestRandom() % 100000) * blockAligns[b];
+            const LONGLONG gap    = (LONGLONG)(i == 50 ? 0x80000000ULL : TestRandom() % 100000) * blockAligns[b];
+
+            segments.push_back({ start + gap, start + gap + length });
+            start += gap + length;
+        }
+
+        // Sample frames still fit the 32-bit cue points.
+        CHECK(segments.back().llEnd - DATA_START >= 0x80000000LL * blockAligns[b]);
+        CHECK(segments.back().llEnd - DATA_START < 0xFFFFFFFFLL * blockAligns[b]);
+
+        checkCues(segments, blockAligns[b]);
+    }
+}
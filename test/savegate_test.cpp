@@ -0,0 +1,424 @@
+/*
+Abstract:
+    Tests of the activity gate and pre-roll of the save path.
+*/
+
+#include <vector>
+
+#include <msvad.h>
+#include "savegate.h"
+#include "test.h"
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+#define TRIGGER_LEVEL               1000
+#define LOUD                        0x40000000      // Level 16384 in 32-bit samples.
+#define INDEX_MASK                  (LOUD - 1)
+
+//=============================================================================
+// Types
+//=============================================================================
+
+// Stands in for the file. The stream is 32-bit mono, and each sample holds
+// its index in the stream, so the file shows what was written in what
+// order. Loud samples also have the LOUD bit set.
+typedef struct _DISK
+{
+    std::vector<ULONG>  Samples;            // Indexes, in the order written.
+    std::vector<ULONG>  Opens;              // Samples written before each opening.
+    std::vector<ULONG>  Closes;             // Samples written before each closing.
+    ULONG               ulFlushes;
+    ULONG               ulFlushedSamples;   // Since the last opening.
+    BOOL                fFlushFails;
+    ULONG               ulErrors;
+} DISK, *PDISK;
+
+// A stream running through the gate into a disk.
+typedef struct _STREAM
+{
+    SAVE_GATE           Gate;
+    std::vector<BYTE>   PreRoll;
+    WAVEFORMATEX        Format;
+    DISK                Disk;
+    ULONG               ulNext;             // Index of the next sample.
+    BOOL                fRingBusy;
+} STREAM, *PSTREAM;
+
+//=============================================================================
+static void appendSamples(IN OUT PDISK disk, IN PBYTE span, IN ULONG byteCount)
+{
+    const ULONG* samples = (const ULONG*)span;
+
+    for (ULONG i = 0; i < byteCount / sizeof(ULONG); i++)
+    {
+        disk->Samples.push_back(samples[i] & INDEX_MASK);
+    }
+}
+
+//=============================================================================
+static BOOL flushed(IN PVOID context, IN PBYTE span, IN ULONG byteCount)
+{
+    const PDISK disk = (PDISK)context;
+
+    // Only ever right after an opening, with nothing written in between.
+    disk->ulErrors += disk->Opens.empty() || disk->Opens.back() + disk->ulFlushedSamples != disk->Samples.size();
+
+    if (disk->fFlushFails)
+    {
+        return FALSE;
+    }
+
+    appendSamples(disk, span, byteCount);
+
+    disk->ulFlushes++;
+    disk->ulFlushedSamples += byteCount / sizeof(ULONG);
+
+    return TRUE;
+}
+
+//=============================================================================
+static void edged(IN PVOID context, IN BOOL open)
+{
+    const PDISK disk = (PDISK)context;
+
+    if (open)
+    {
+        disk->ulErrors += disk->Opens.size() != disk->Closes.size();
+        disk->Opens.push_back((ULONG)disk->Samples.size());
+        disk->ulFlushedSamples = 0;
+    }
+    else
+    {
+        disk->ulErrors += disk->Opens.size() != disk->Closes.size() + 1;
+        disk->Closes.push_back((ULONG)disk->Samples.size());
+    }
+}
+
+//=============================================================================
+static void initStream(OUT PSTREAM stream, IN ULONG preRollSamples, IN ULONG hangOverSamples)
+{
+    stream->PreRoll.assign(preRollSamples * sizeof(ULONG), 0);
+    stream->Disk      = DISK();
+    stream->ulNext    = 0;
+    stream->fRingBusy = FALSE;
+
+    RtlZeroMemory(&stream->Gate, sizeof(stream->Gate));
+    stream->Gate.pPreRoll        = preRollSamples ? stream->PreRoll.data() : nullptr;
+    stream->Gate.ulPreRollSize   = preRollSamples * sizeof(ULONG);
+    stream->Gate.ulTriggerLevel  = TRIGGER_LEVEL;
+    stream->Gate.ulHangOverBytes = hangOverSamples * sizeof(ULONG);
+
+    RtlZeroMemory(&stream->Format, sizeof(stream->Format));
+    stream->Format.wFormatTag      = WAVE_FORMAT_PCM;
+    stream->Format.nChannels       = 1;
+    stream->Format.nSamplesPerSec  = 48000;
+    stream->Format.wBitsPerSample  = 32;
+    stream->Format.nBlockAlign     = sizeof(ULONG);
+    stream->Format.nAvgBytesPerSec = 48000 * sizeof(ULONG);
+}
+
+//=============================================================================
+// Runs a buffer of sampleCount samples through the gate, loud or quiet, and
+// writes it to the disk if the gate says so. Returns what the gate said.
+static BOOL run(IN OUT PSTREAM stream, IN ULONG sampleCount, IN BOOL loud)
+{
+    std::vector<ULONG> buffer(sampleCount);
+
+    for (ULONG i = 0; i < sampleCount; i++)
+    {
+        buffer[i] = (stream->ulNext++) | (loud ? LOUD : 0);
+    }
+
+    const BOOL write = SaveGateRun(&stream->Gate,
+                                   (PBYTE)buffer.data(),
+                                   sampleCount * sizeof(ULONG),
+                                   &stream->Format,
+                                   stream->fRingBusy,
+                                   edged,
+                                   flushed,
+                                   &stream->Disk);
+    if (write)
+    {
+        appendSamples(&stream->Disk, (PBYTE)buffer.data(), sampleCount * sizeof(ULONG));
+    }
+
+    return write;
+}
+
+//=============================================================================
+// Quiet buffers never open the gate, and go nowhere but the pre-roll. The
+// first loud buffer opens it, and is written after the pre-roll.
+TEST(LoudBufferOpensTheGate)
+{
+    STREAM stream;
+
+    initStream(&stream, 480, 4800);
+
+    for (ULONG n = 0; n < 100; n++)
+    {
+        CHECK(!run(&stream, 100 + n, FALSE));
+    }
+
+    CHECK(stream.Disk.Samples.empty());
+    CHECK(stream.Disk.Opens.empty());
+
+    const ULONG loudStart = stream.ulNext;
+
+    CHECK(run(&stream, 100, TRUE));
+    CHECK(stream.Gate.fOpen);
+    CHECK_EQUAL(1, stream.Disk.Opens.size());
+    CHECK_EQUAL(0, stream.Disk.Opens[0]);
+    CHECK_EQUAL(580, stream.Disk.Samples.size());
+    CHECK_EQUAL(loudStart - 480, stream.Disk.Samples[0]);
+    CHECK_EQUAL(loudStart, stream.Disk.Samples[480]);
+    CHECK_EQUAL(0, stream.Gate.ulPreRollFill);
+    CHECK_EQUAL(0, stream.Disk.ulErrors);
+
+    // A buffer just below the trigger level does not open the gate.
+    initStream(&stream, 0, 0);
+
+    std::vector<LONG> buffer(64, (TRIGGER_LEVEL - 1) << 16);
+
+    buffer[17] = -(TRIGGER_LEVEL - 1) << 16;
+
+    CHECK(!SaveGateRun(&stream.Gate, (PBYTE)buffer.data(), 256, &stream.Format, FALSE, edged, flushed, &stream.Disk));
+
+    buffer[40] = TRIGGER_LEVEL << 16;
+
+    CHECK(SaveGateRun(&stream.Gate, (PBYTE)buffer.data(), 256, &stream.Format, FALSE, edged, flushed, &stream.Disk));
+}
+
+//=============================================================================
+// Once loud audio stops, the gate stays open for the hang-over: the idle
+// buffers that end within it are written, and the one that uses it up
+// closes the gate and goes to the pre-roll. Loud audio during the hang-over
+// starts it again.
+TEST(HangOverExpiresAfterItsBytes)
+{
+    const ULONG hangOvers[] = { 0, 1, 99, 100, 101, 1000, 4801 };
+    const ULONG sizes[]     = { 1, 7, 100, 480 };
+
+    for (ULONG h = 0; h < RTL_NUMBER_OF(hangOvers); h++)
+    {
+        for (ULONG s = 0; s < RTL_NUMBER_OF(sizes); s++)
+        {
+            STREAM stream;
+            ULONG  written = 0;
+
+            initStream(&stream, 256, hangOvers[h]);
+
+            CHECK(run(&stream, sizes[s], TRUE));
+
+            // Half way through, loud audio restarts the hang-over.
+            for (ULONG n = 0; n < hangOvers[h] / sizes[s] / 2; n++)
+            {
+                CHECK(run(&stream, sizes[s], FALSE));
+            }
+
+            CHECK(run(&stream, sizes[s], TRUE));
+
+            while (run(&stream, sizes[s], FALSE))
+            {
+                written++;
+            }
+
+            // Written while more than one buffer of the hang-over was left.
+            CHECK_EQUAL((hangOvers[h] + sizes[s] - 1) / sizes[s] - (hangOvers[h] ? 1 : 0), written);
+            CHECK(!stream.Gate.fOpen);
+            CHECK_EQUAL(1, stream.Disk.Closes.size());
+            CHECK_EQUAL(stream.Disk.Samples.size(), stream.Disk.Closes[0]);
+            CHECK_EQUAL(min(sizes[s], 256) * sizeof(ULONG), stream.Gate.ulPreRollFill);
+            CHECK_EQUAL(0, stream.Disk.ulErrors);
+        }
+    }
+}
+
+//=============================================================================
+// However often the ring wraps, and whatever the buffer sizes, including
+// buffers larger than the ring, the pre-roll holds the most recent audio,
+// which is flushed oldest first and followed without a gap by the buffer
+// that opened the gate. A ring being flushed is left alone.
+TEST(PreRollRingWrapKeepsTheMostRecentAudio)
+{
+    for (ULONG n = 0; n < 2000; n++)
+    {
+        const ULONG ringSamples = 1 + (ULONG)(TestRandom() % 300);
+        const ULONG maxBuffer   = 1 + (ULONG)(TestRandom() % 500);
+        ULONG       quiet       = 0;
+        STREAM      stream;
+
+        initStream(&stream, ringSamples, 0);
+
+        for (ULONG b = (ULONG)(TestRandom() % 20); b > 0; b--)
+        {
+            const ULONG size = 1 + (ULONG)(TestRandom() % maxBuffer);
+
+            CHECK(!run(&stream, size, FALSE));
+            quiet += size;
+        }
+
+        const ULONG held = min(quiet, ringSamples);
+
+        if (n % 10 == 0)
+        {
+            stream.fRingBusy = TRUE;
+            CHECK(!run(&stream, 1 + (ULONG)(TestRandom() % maxBuffer), FALSE));
+            stream.fRingBusy = FALSE;
+        }
+
+        const ULONG skipped = stream.ulNext - quiet;
+        const BOOL  split   = held == ringSamples && stream.Gate.ulPreRollPtr;
+
+        CHECK(run(&stream, 10, TRUE));
+        CHECK_EQUAL(held + 10, stream.Disk.Samples.size());
+
+        // In two spans where the ring wrapped, unless it wrapped at its end.
+        CHECK_EQUAL(!held ? 0 : split ? 2 : 1, stream.Disk.ulFlushes);
+
+        for (ULONG i = 0; i < stream.Disk.Samples.size(); i++)
+        {
+            const ULONG expected = (i < held) ? quiet - held + i : quiet + skipped + i - held;
+
+            if (stream.Disk.Samples[i] != expected)
+            {
+                stream.Disk.ulErrors++;
+            }
+        }
+
+        CHECK_EQUAL(0, stream.Disk.ulErrors);
+    }
+}
+
+//=============================================================================
+// Over a long stream of loud passages and pauses of random lengths, each
+// opening writes the pre-roll and then the live audio, and the file holds
+// the stream in order without repeats. Each segment starts at the oldest
+// audio the ring can hold, or right after the previous segment if that is
+// later, and ends at the buffer that used up the hang-over.
+TEST(PreRollIsFlushedAheadOfTheLiveAudio)
+{
+    const ULONG ringSamples     = 960;
+    const ULONG hangOverSamples = 2400;
+    STREAM      stream;
+    ULONG       segments        = 0;
+
+    initStream(&stream, ringSamples, hangOverSamples);
+
+    for (ULONG n = 0; n < 20000; n++)
+    {
+        const ULONG size     = 1 + (ULONG)(TestRandom() % 480);
+        const ULONG start    = stream.ulNext;
+        const ULONG previous = stream.Disk.Samples.empty() ? 0 : stream.Disk.Samples.back() + 1;
+        const BOOL  wasOpen  = stream.Gate.fOpen;
+        const BOOL  loud     = TestRandom() % 8 == 0;
+        const ULONG before   = (ULONG)stream.Disk.Samples.size();
+
+        if (run(&stream, size, loud) && !wasOpen)
+        {
+            // Opened here: the pre-roll, then this buffer.
+            const ULONG first = max(start - min(start, ringSamples), previous);
+
+            CHECK_EQUAL(before + start - first + size, stream.Disk.Samples.size());
+
+            for (ULONG i = before; i < stream.Disk.Samples.size(); i++)
+            {
+                stream.Disk.ulErrors += stream.Disk.Samples[i] != first + i - before;
+            }
+
+            segments++;
+        }
+    }
+
+    for (ULONG i = 1; i < stream.Disk.Samples.size(); i++)
+    {
+        stream.Disk.ulErrors += stream.Disk.Samples[i] <= stream.Disk.Samples[i - 1];
+    }
+
+    CHECK(segments > 100);
+    CHECK_EQUAL(segments, stream.Disk.Opens.size());
+    CHECK(stream.Disk.Closes.size() + 1 >= segments);
+    CHECK_EQUAL(0, stream.Disk.ulErrors);
+}
+
+//=============================================================================
+// A pre-roll that cannot be queued is dropped, not kept for later, and the
+// live audio is still written.
+TEST(PreRollThatCannotBeQueuedIsDropped)
+{
+    STREAM stream;
+
+    initStream(&stream, 100, 0);
+
+    CHECK(!run(&stream, 150, FALSE));
+
+    stream.Disk.fFlushFails = TRUE;
+
+    CHECK(run(&stream, 10, TRUE));
+    CHECK_EQUAL(10, stream.Disk.Samples.size());
+    CHECK_EQUAL(150, stream.Disk.Samples[0]);
+    CHECK_EQUAL(0, stream.Gate.ulPreRollFill);
+    CHECK_EQUAL(0, stream.Disk.ulErrors);
+}
+
+//=============================================================================
+// With 16-bit audio the peak comes from the vector path in blocks of eight
+// samples and the scalar path for the rest. One sample at the trigger level
+// opens the gate wherever it is in a buffer of any length and alignment,
+// and one just below does not. Full scale negative samples count as full
+// scale.
+TEST(PeakLevelTriggerFindsASingleSample)
+{
+    const SHORT  levels[] = { TRIGGER_LEVEL, -TRIGGER_LEVEL, -32768, 32767 };
+    WAVEFORMATEX format;
+    SHORT        memory[80];
+    ULONG        errors   = 0;
+
+    RtlZeroMemory(&format, sizeof(format));
+    format.wFormatTag      = WAVE_FORMAT_PCM;
+    format.nChannels       = 2;
+    format.nSamplesPerSec  = 48000;
+    format.wBitsPerSample  = 16;
+    format.nBlockAlign     = 4;
+    format.nAvgBytesPerSec = 48000 * 4;
+
+    for (ULONG offset = 0; offset < 8; offset++)
+    {
+        PSHORT buffer = memory + offset;
+
+        for (ULONG count = 2; count <= 64; count += 2)
+        {
+            for (ULONG position = 0; position < count; position++)
+            {
+                for (ULONG l = 0; l < RTL_NUMBER_OF(levels) + 1; l++)
+                {
+                    const BOOL below = (l == RTL_NUMBER_OF(levels));
+                    SAVE_GATE  gate;
+                    DISK       disk;
+
+                    RtlZeroMemory(&gate, sizeof(gate));
+                    gate.ulTriggerLevel = TRIGGER_LEVEL;
+
+                    for (ULONG i = 0; i < RTL_NUMBER_OF(memory); i++)
+                    {
+                        memory[i] = (i % 2) ? TRIGGER_LEVEL - 1 : 1 - TRIGGER_LEVEL;
+                    }
+
+                    // Loud samples just outside the buffer must not count.
+                    memory[offset + count] = 32767;
+                    if (offset)
+                    {
+                        memory[offset - 1] = -32768;
+                    }
+
+                    buffer[position] = below ? (SHORT)(TRIGGER_LEVEL - 1) : levels[l];
+
+                    errors += below == SaveGateRun(&gate, (PBYTE)buffer, count * sizeof(SHORT), &format, FALSE, edged, flushed, &disk);
+                }
+            }
+        }
+    }
+
+    CHECK_EQUAL(0, errors);
+}
@@ -0,0 +1,287 @@
+/*
+Abstract:
+    Tests of the write tracking of retention rings.
+*/
+
+#include <vector>
+
+#include <msvad.h>
+#include "savering.h"
+#include "test.h"
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+#define IN_FLIGHT                   15      // Work items of the save class.
+
+//=============================================================================
+// Types
+//=============================================================================
+
+// A frame queued for the ring, as by the save class.
+typedef struct _FRAME
+{
+    ULONGLONG   ullStart;
+    ULONG       ulSize;
+} FRAME;
+
+// Stands in for a retention file: its data region and the head recorded in
+// its ring header.
+typedef struct _RING_FILE
+{
+    std::vector<BYTE>       Data;
+    std::vector<ULONGLONG>  Written;    // Stream offset + 1 of each byte, or 0.
+    SAVE_RING_HEAD          Head;
+    ULONGLONG               ullBytesWritten;
+} RING_FILE, *PRING_FILE;
+
+//=============================================================================
+// Byte at a stream offset, without a period that could line up with a ring.
+static BYTE streamByte(IN ULONGLONG offset)
+{
+    return (BYTE)((offset * 2654435761u) >> 13);
+}
+
+//=============================================================================
+// Writes a frame through the ring the way CSaveData::fileWrite does.
+static void writeFrame(IN OUT PRING_FILE file, IN const FRAME& frame)
+{
+    const ULONG ringSize = (ULONG)file->Data.size();
+    ULONG       written  = 0;
+
+    while (written < frame.ulSize)
+    {
+        ULONG       ringPos;
+        const ULONG span = SaveRingSpan(ringSize, frame.ullStart + written, frame.ulSize - written, &ringPos);
+
+        CHECK(span > 0);
+        CHECK(ringPos + span <= ringSize);
+
+        for (ULONG i = 0; i < span; i++)
+        {
+            file->Data[ringPos + i]    = streamByte(frame.ullStart + written + i);
+            file->Written[ringPos + i] = frame.ullStart + written + i + 1;
+        }
+
+        written += span;
+    }
+}
+
+//=============================================================================
+static void completeFrame(IN OUT PRING_FILE file, IN const FRAME& frame)
+{
+    if (SaveRingComplete(&file->Head, frame.ullStart, frame.ulSize))
+    {
+        file->ullBytesWritten = file->Head.ullHead;
+    }
+}
+
+//=============================================================================
+static void initFile(OUT PRING_FILE file, IN ULONG ringSize)
+{
+    file->Data.assign(ringSize, 0);
+    file->Written.assign(ringSize, 0);
+    file->ullBytesWritten = 0;
+    SaveRingReset(&file->Head);
+}
+
+//=============================================================================
+// Reads a retention file back in stream order, as described with
+// OUTPUT_RING_HEADER.
+static std::vector<BYTE> linearize(IN const RING_FILE& file)
+{
+    const ULONGLONG ringSize = file.Data.size();
+
+    if (file.ullBytesWritten < ringSize)
+    {
+        return std::vector<BYTE>(file.Data.begin(), file.Data.begin() + file.ullBytesWritten);
+    }
+
+    const ULONG oldest = (ULONG)(file.ullBytesWritten % ringSize);
+
+    std::vector<BYTE> linear(file.Data.begin() + oldest, file.Data.end());
+    linear.insert(linear.end(), file.Data.begin(), file.Data.begin() + oldest);
+
+    return linear;
+}
+
+//=============================================================================
+// Queues frames of random sizes and completes them in random order, with up
+// to IN_FLIGHT outstanding, all within a ring of the oldest, as the save
+// class sizes the ring. A frame larger than the ring is only queued alone.
+// After each completion the file must read back as
+// the stream up to its head. Only a frame that completed ahead of the head
+// may have overwritten some of the oldest data with newer; no byte may be
+// older than it should be, or never written.
+static void runRing(IN ULONG ringSize, IN ULONG maxFrameSize, IN ULONGLONG streamSize)
+{
+    RING_FILE file;
+
+    initFile(&file, ringSize);
+
+    std::vector<FRAME> inFlight;
+    ULONGLONG          queued = 0;
+
+    while (queued < streamSize || !inFlight.empty())
+    {
+        while (queued < streamSize && inFlight.size() < IN_FLIGHT && (inFlight.empty() || TestRandom() % 2))
+        {
+            const ULONGLONG draw = 1 + TestRandom() % maxFrameSize;
+            const ULONG     size = (ULONG)min(draw, streamSize - queued);
+
+            if (!inFlight.empty() && queued + size > file.ullBytesWritten + ringSize)
+            {
+                break;
+            }
+
+            inFlight.push_back({ queued, size });
+            queued += size;
+        }
+
+        const size_t next  = TestRandom() % inFlight.size();
+        const FRAME  frame = inFlight[next];
+
+        inFlight.erase(inFlight.begin() + next);
+
+        writeFrame(&file, frame);
+        completeFrame(&file, frame);
+
+        // The head is where the oldest frame still in flight starts.
+        ULONGLONG expectedHead = queued;
+
+        for (const FRAME& f : inFlight)
+        {
+            expectedHead = min(expectedHead, f.ullStart);
+        }
+
+        CHECK_EQUAL(expectedHead, file.ullBytesWritten);
+        CHECK(file.Head.ulPendingCount <= IN_FLIGHT);
+
+        const std::vector<BYTE> linear = linearize(file);
+        const ULONGLONG         first  = file.ullBytesWritten - linear.size();
+        ULONG                   errors = 0;
+
+        CHECK_EQUAL(min(file.ullBytesWritten, (ULONGLONG)ringSize), linear.size());
+
+        for (ULONGLONG i = 0; i < linear.size(); i++)
+        {
+            const ULONGLONG offset  = first + i;
+            const ULONGLONG written = file.Written[offset % ringSize];
+
+            errors += !written ||
+                      (written - 1 != offset && written - 1 < file.ullBytesWritten) ||
+                      linear[i] != streamByte(written - 1);
+        }
+
+        CHECK_EQUAL(0, errors);
+    }
+
+    // With nothing in flight, the file holds the end of the stream.
+    CHECK_EQUAL(streamSize, file.ullBytesWritten);
+    CHECK_EQUAL(0, file.Head.ulPendingCount);
+
+    const std::vector<BYTE> linear = linearize(file);
+    ULONG                   errors = 0;
+
+    for (ULONGLONG i = 0; i < linear.size(); i++)
+    {
+        errors += linear[i] != streamByte(streamSize - linear.size() + i);
+    }
+
+    CHECK_EQUAL(0, errors);
+}
+
+//=============================================================================
+TEST(SpanStopsAtTheEndOfTheRing)
+{
+    ULONG ringPos;
+
+    CHECK_EQUAL(100, SaveRingSpan(1000, 0, 100, &ringPos));
+    CHECK_EQUAL(0, ringPos);
+
+    CHECK_EQUAL(100, SaveRingSpan(1000, 900, 500, &ringPos));
+    CHECK_EQUAL(900, ringPos);
+
+    CHECK_EQUAL(1000, SaveRingSpan(1000, 3000, 4000, &ringPos));
+    CHECK_EQUAL(0, ringPos);
+
+    CHECK_EQUAL(1, SaveRingSpan(1000, 0x100000000ULL * 1000 + 999, 2, &ringPos));
+    CHECK_EQUAL(999, ringPos);
+}
+
+//=============================================================================
+TEST(HeadWaitsForTheOldestWrite)
+{
+    SAVE_RING_HEAD head;
+
+    SaveRingReset(&head);
+
+    // Three frames of 100 bytes, completing last to first.
+    CHECK(!SaveRingComplete(&head, 200, 100));
+    CHECK(!SaveRingComplete(&head, 100, 100));
+    CHECK_EQUAL(0, head.ullHead);
+
+    CHECK(SaveRingComplete(&head, 0, 100));
+    CHECK_EQUAL(300, head.ullHead);
+    CHECK_EQUAL(0, head.ulPendingCount);
+
+    // The middle one of the next three last.
+    CHECK(SaveRingComplete(&head, 300, 50));
+    CHECK_EQUAL(350, head.ullHead);
+
+    CHECK(!SaveRingComplete(&head, 400, 70));
+    CHECK_EQUAL(350, head.ullHead);
+
+    CHECK(SaveRingComplete(&head, 350, 50));
+    CHECK_EQUAL(470, head.ullHead);
+}
+
+//=============================================================================
+TEST(WrappedRingLinearizesInStreamOrder)
+{
+    TestSeed(27);
+
+    // Frames smaller and larger than the ring, and rings of odd sizes.
+    runRing(4096, 1024, 64 * 1024);
+    runRing(4099, 4096, 256 * 1024);
+    runRing(1000, 3000, 64 * 1024);
+    runRing(16384, 16, 40 * 1024);
+}
+
+//=============================================================================
+TEST(LostFramesDoNotStopTheHead)
+{
+    RING_FILE file;
+
+    initFile(&file, 1000);
+
+    // The fourth frame could not be written, but is completed all the same.
+    const FRAME frames[] = { { 0, 400 }, { 400, 400 }, { 800, 400 }, { 1200, 400 }, { 1600, 400 } };
+
+    for (ULONG i = 0; i < 3; i++)
+    {
+        writeFrame(&file, frames[i]);
+        completeFrame(&file, frames[i]);
+    }
+
+    writeFrame(&file, frames[4]);
+    completeFrame(&file, frames[4]);
+    CHECK_EQUAL(1200, file.ullBytesWritten);
+
+    completeFrame(&file, frames[3]);
+    CHECK_EQUAL(2000, file.ullBytesWritten);
+
+    // Where the lost frame would have gone, 200 to 600 in the ring, the
+    // file still holds the first lap.
+    const std::vector<BYTE> linear = linearize(file);
+
+    CHECK_EQUAL(1000, linear.size());
+
+    for (ULONG i = 0; i < 1000; i++)
+    {
+        const ULONGLONG offset = (i >= 200 && i < 600) ? i : 1000 + i;
+
+        CHECK_EQUAL(streamByte(offset), linear[i]);
+    }
+}
@@ -0,0 +1,359 @@
+/*
+Abstract:
+    Tests of the disk bandwidth throttle, in virtual time.
+*/
+
+#include <vector>
+
+#include <msvad.h>
+#include "savethrottle.h"
+#include "vtime.h"
+#include "kernel.h"
+#include "test.h"
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+#define MS                          10000ULL        // 100 ns units.
+#define FRAME_SIZE                  (PAGE_SIZE * 4)
+
+//=============================================================================
+// Types
+//=============================================================================
+
+// A stream writing through its own bucket and the shared adapter bucket.
+typedef struct _STREAM
+{
+    SAVE_TOKEN_BUCKET   Bucket;
+    SAVE_THROTTLE_STATS Stats;
+    ULONGLONG           ullAdmitted;
+} STREAM, *PSTREAM;
+
+//=============================================================================
+// Statics
+//=============================================================================
+
+static SAVE_TOKEN_BUCKET    AdapterBucket;
+static KSPIN_LOCK           AdapterLock;
+static WAVEFORMATEX         Format;
+static std::vector<BYTE>    Loud(FRAME_SIZE * 4);
+static std::vector<BYTE>    Silent(FRAME_SIZE * 4);
+
+//=============================================================================
+static void startVirtualTime()
+{
+    TestHoldPerformanceCounter(1000 * MS);
+    CHECK_EQUAL(STATUS_SUCCESS, VirtualTimeEnable(TRUE));
+    TestReleasePerformanceCounter();
+
+    KeInitializeSpinLock(&AdapterLock);
+
+    // 48 kHz 16-bit stereo, a full scale square wave and silence.
+    Format.wFormatTag      = WAVE_FORMAT_PCM;
+    Format.nChannels       = 2;
+    Format.nSamplesPerSec  = 48000;
+    Format.wBitsPerSample  = 16;
+    Format.nBlockAlign     = 4;
+    Format.nAvgBytesPerSec = 48000 * 4;
+
+    for (ULONG i = 0; i < Loud.size() / 2; i++)
+    {
+        ((PSHORT)Loud.data())[i] = (i / 64 % 2) ? 32767 : -32767;
+    }
+}
+
+//=============================================================================
+static void stopVirtualTime()
+{
+    CHECK_EQUAL(STATUS_SUCCESS, VirtualTimeEnable(FALSE));
+}
+
+//=============================================================================
+static void resetStream(OUT PSTREAM stream, IN ULONG bytesPerSec, IN ULONG burstBytes)
+{
+    RtlZeroMemory(stream, sizeof(*stream));
+
+    SaveBucketReset(&stream->Bucket, bytesPerSec, burstBytes, TimeNow(nullptr));
+}
+
+//=============================================================================
+static BOOL admit(IN OUT PSTREAM stream, IN SAVE_THROTTLE_POLICY policy, IN BOOL loud, IN ULONG dataSize)
+{
+    const BOOL admitted = SaveThrottleAdmit(&stream->Bucket,
+                                            &AdapterBucket,
+                                            &AdapterLock,
+                                            policy,
+                                            loud ? Loud.data() : Silent.data(),
+                                            dataSize,
+                                            &Format,
+                                            TimeNow(nullptr),
+                                            &stream->Stats);
+    if (admitted)
+    {
+        stream->ullAdmitted += dataSize;
+    }
+
+    return admitted;
+}
+
+//=============================================================================
+// Over a long run a bucket admits its rate plus the burst, whatever the
+// write sizes and intervals, also when each interval earns a fraction of
+// a byte or less: the fraction is carried to the next refill. The refill
+// time is kept in whole 100 ns units, so each refill may credit up to one
+// unit early.
+TEST(BucketAdmitsItsRateOverTime)
+{
+    typedef struct _CASE
+    {
+        ULONG       ulRate;
+        ULONG       ulWriteSize;
+        ULONGLONG   ullInterval;    // 100 ns units.
+    } CASE;
+
+    const CASE cases[] =
+    {
+        { 123457,     1000, 1 * MS },      // 123.457 bytes an interval.
+        { 192000,     3840, 10 * MS },     // Whole bytes an interval.
+        { 1000,       100,  7 },           // 0.0007 bytes an interval.
+        { 44100 * 4,  1,    3 },           // 0.05292 bytes an interval.
+        { 9999999,    4096, MS / 10 },    // 999.9999 bytes an interval.
+    };
+
+    startVirtualTime();
+
+    for (ULONG c = 0; c < RTL_NUMBER_OF(cases); c++)
+    {
+        const ULONGLONG duration = (cases[c].ullInterval < MS / 10) ? 2 * _100NS_UNITS_PER_SECOND : 100 * _100NS_UNITS_PER_SECOND;
+        STREAM          stream;
+
+        resetStream(&stream, cases[c].ulRate, FRAME_SIZE);
+        SaveBucketReset(&AdapterBucket, 0, 0, TimeNow(nullptr));
+
+        for (ULONGLONG time = 0; time < duration; time += cases[c].ullInterval)
+        {
+            admit(&stream, SaveThrottleDrop, TRUE, cases[c].ulWriteSize);
+            CHECK_EQUAL(STATUS_SUCCESS, VirtualTimeAdvance(cases[c].ullInterval));
+        }
+
+        const ULONGLONG writes = (duration + cases[c].ullInterval - 1) / cases[c].ullInterval;
+        const ULONGLONG last   = (writes - 1) * cases[c].ullInterval;
+        const ULONGLONG budget = (ULONGLONG)cases[c].ulRate * last / _100NS_UNITS_PER_SECOND + FRAME_SIZE;
+        const ULONGLONG early  = writes * cases[c].ulRate / _100NS_UNITS_PER_SECOND + 1;
+
+        CHECK(stream.ullAdmitted <= budget + early);
+        CHECK(stream.ullAdmitted + cases[c].ulWriteSize >= budget);
+        CHECK_EQUAL(writes * cases[c].ulWriteSize, stream.Stats.ullBytesDropped + stream.ullAdmitted);
+    }
+
+    stopVirtualTime();
+}
+
+//=============================================================================
+// A write larger than the burst fits only into a full bucket and leaves it
+// in debt, which is paid off before anything else fits.
+TEST(OversizedWriteTakesAFullBucket)
+{
+    const ULONG rate = 100000;
+    STREAM      stream;
+
+    startVirtualTime();
+
+    resetStream(&stream, rate, FRAME_SIZE);
+    SaveBucketReset(&AdapterBucket, 0, 0, TimeNow(nullptr));
+
+    CHECK(admit(&stream, SaveThrottleDrop, TRUE, 3 * FRAME_SIZE));
+    CHECK_EQUAL(-2 * FRAME_SIZE, stream.Bucket.llTokens);
+
+    // The debt and one byte take this long to earn.
+    const ULONGLONG debt = (2ULL * FRAME_SIZE + 1) * _100NS_UNITS_PER_SECOND / rate;
+
+    CHECK_EQUAL(STATUS_SUCCESS, VirtualTimeAdvance(debt - MS));
+    CHECK(!admit(&stream, SaveThrottleDrop, TRUE, 1));
+    CHECK_EQUAL(STATUS_SUCCESS, VirtualTimeAdvance(MS));
+    CHECK(admit(&stream, SaveThrottleDrop, TRUE, 1));
+
+    // Once full it takes another oversized write.
+    CHECK_EQUAL(STATUS_SUCCESS, VirtualTimeAdvance(_100NS_UNITS_PER_SECOND));
+    CHECK(admit(&stream, SaveThrottleDrop, TRUE, 3 * FRAME_SIZE));
+
+    stopVirtualTime();
+}
+
+//=============================================================================
+// The drop policy drops loud and silent data alike once over budget, and
+// counts the frames and bytes. The throttle engages once per time the
+// bucket runs dry, and only lets go once it has filled up again.
+TEST(DropPolicyCountsWhatItDrops)
+{
+    const ULONG rate = 96000;       // Half of the data rate of the stream.
+    STREAM      stream;
+    ULONGLONG   engaged = 0;
+
+    startVirtualTime();
+
+    resetStream(&stream, rate, FRAME_SIZE);
+    SaveBucketReset(&AdapterBucket, 0, 0, TimeNow(nullptr));
+
+    // 1920-byte writes every 10 ms, for 10 s.
+    for (ULONG n = 0; n < 1000; n++)
+    {
+        const ULONG     engageCount = stream.Bucket.ulEngageCount;
+        const ULONGLONG dropped     = stream.Stats.ulFramesDropped;
+        const BOOL      admitted    = admit(&stream, SaveThrottleDrop, n % 2, 1920);
+
+        CHECK_EQUAL(!admitted, stream.Stats.ulFramesDropped - dropped);
+
+        if (engageCount != stream.Bucket.ulEngageCount)
+        {
+            CHECK(!engageCount);
+            CHECK(!admitted);
+            engaged = TimeNow(nullptr);
+        }
+
+        CHECK_EQUAL(STATUS_SUCCESS, VirtualTimeAdvance(10 * MS));
+    }
+
+    // Never refilled to the burst, so engaged once, at the first drop.
+    CHECK_EQUAL(1, stream.Bucket.ulEngageCount);
+    CHECK(stream.Bucket.fEngaged);
+    CHECK_EQUAL(engaged, stream.Bucket.ullLastEngaged);
+    CHECK_EQUAL(0, stream.Stats.ulFramesSkipped);
+    CHECK_EQUAL(1920ULL * stream.Stats.ulFramesDropped, stream.Stats.ullBytesDropped);
+    CHECK_EQUAL(1000 * 1920ULL, stream.ullAdmitted + stream.Stats.ullBytesDropped);
+    CHECK(llabs((LONGLONG)stream.ullAdmitted - (LONGLONG)(rate * 10 + FRAME_SIZE)) <= 1920);
+
+    // Quiet long enough to fill up, then over budget again: a second
+    // engagement.
+    CHECK_EQUAL(STATUS_SUCCESS, VirtualTimeAdvance(_100NS_UNITS_PER_SECOND));
+    CHECK(admit(&stream, SaveThrottleDrop, TRUE, 1920));
+    CHECK(!stream.Bucket.fEngaged);
+
+    while (admit(&stream, SaveThrottleDrop, TRUE, 1920))
+    {
+    }
+
+    CHECK_EQUAL(2, stream.Bucket.ulEngageCount);
+    CHECK_EQUAL(TimeNow(nullptr), stream.Bucket.ullLastEngaged);
+
+    stopVirtualTime();
+}
+
+//=============================================================================
+// With SaveThrottleSkipSilence, silent data is skipped while the stream or
+// the adapter throttles, without taking tokens, and is written normally
+// otherwise. Loud data is throttled as with the drop policy.
+TEST(SkipSilencePolicySkipsOnlyWhileThrottled)
+{
+    STREAM stream;
+
+    startVirtualTime();
+
+    resetStream(&stream, 50000, FRAME_SIZE);
+    SaveBucketReset(&AdapterBucket, 0, 0, TimeNow(nullptr));
+
+    // Not throttling yet: silence takes tokens like anything else.
+    CHECK(admit(&stream, SaveThrottleSkipSilence, FALSE, 1920));
+    CHECK_EQUAL(FRAME_SIZE - 1920, stream.Bucket.llTokens);
+
+    while (admit(&stream, SaveThrottleSkipSilence, TRUE, 1920))
+    {
+    }
+
+    CHECK(stream.Bucket.fEngaged);
+    CHECK_EQUAL(1, stream.Stats.ulFramesDropped);
+
+    // Enough time for a loud write: the silent one before it is skipped
+    // and leaves the tokens for it.
+    const LONGLONG tokens = stream.Bucket.llTokens;
+
+    CHECK_EQUAL(STATUS_SUCCESS, VirtualTimeAdvance(100 * MS));
+    CHECK(!admit(&stream, SaveThrottleSkipSilence, FALSE, 1920));
+    CHECK_EQUAL(1, stream.Stats.ulFramesSkipped);
+    CHECK_EQUAL(1920, stream.Stats.ullBytesSkipped);
+    CHECK_EQUAL(tokens + 5000, stream.Bucket.llTokens);
+    CHECK(admit(&stream, SaveThrottleSkipSilence, TRUE, 1920));
+    CHECK_EQUAL(1, stream.Stats.ulFramesDropped);
+
+    // Filled up, the stream lets go, and silence is written again.
+    CHECK_EQUAL(STATUS_SUCCESS, VirtualTimeAdvance(_100NS_UNITS_PER_SECOND));
+    CHECK(admit(&stream, SaveThrottleSkipSilence, FALSE, 1920));
+    CHECK(!stream.Bucket.fEngaged);
+
+    // An adapter that throttles makes an unthrottled stream skip silence.
+    STREAM other;
+
+    resetStream(&stream, 0, 0);
+    resetStream(&other, 0, 0);
+    SaveBucketReset(&AdapterBucket, 50000, FRAME_SIZE, TimeNow(nullptr));
+
+    while (admit(&other, SaveThrottleDrop, TRUE, 1920))
+    {
+    }
+
+    CHECK(AdapterBucket.fEngaged);
+    CHECK(!admit(&stream, SaveThrottleSkipSilence, FALSE, 1920));
+    CHECK_EQUAL(1, stream.Stats.ulFramesSkipped);
+    CHECK_EQUAL(0, stream.Stats.ulFramesDropped);
+
+    stopVirtualTime();
+}
+
+//=============================================================================
+// Streams under their own budgets share the adapter budget. A write the
+// adapter refuses gives the stream its tokens back, and is counted as
+// dropped by the stream that wrote it. The adapter engagement shows in the
+// adapter bucket, not in the stream.
+TEST(AdapterBucketIsSharedByTheStreams)
+{
+    const ULONG adapterRate = 300000;
+    STREAM      streams[3];
+
+    startVirtualTime();
+
+    for (ULONG s = 0; s < RTL_NUMBER_OF(streams); s++)
+    {
+        resetStream(&streams[s], 192000, FRAME_SIZE);
+    }
+
+    SaveBucketReset(&AdapterBucket, adapterRate, FRAME_SIZE, TimeNow(nullptr));
+
+    for (ULONG n = 0; n < 1000; n++)
+    {
+        for (ULONG s = 0; s < RTL_NUMBER_OF(streams); s++)
+        {
+            const LONGLONG tokens   = streams[s].Bucket.llTokens;
+            const BOOL     admitted = admit(&streams[s], SaveThrottleDrop, TRUE, 1920);
+
+            // The stream earns at its own rate, so its tokens only go down
+            // when the write is admitted.
+            if (!admitted)
+            {
+                CHECK(streams[s].Bucket.llTokens >= tokens);
+            }
+        }
+
+        CHECK_EQUAL(STATUS_SUCCESS, VirtualTimeAdvance(10 * MS));
+    }
+
+    const ULONGLONG budget   = adapterRate * 999ULL / 100 + FRAME_SIZE;     // At the last write.
+    ULONGLONG       admitted = 0;
+    ULONG           dropped  = 0;
+
+    for (ULONG s = 0; s < RTL_NUMBER_OF(streams); s++)
+    {
+        admitted += streams[s].ullAdmitted;
+        dropped  += streams[s].Stats.ulFramesDropped;
+
+        CHECK_EQUAL(0, streams[s].Bucket.ulEngageCount);
+        CHECK_EQUAL(1000 * 1920ULL, streams[s].ullAdmitted + streams[s].Stats.ullBytesDropped);
+    }
+
+    CHECK(dropped);
+    CHECK(admitted <= budget);
+    CHECK(admitted + 1920 >= budget);
+    CHECK_EQUAL(1, AdapterBucket.ulEngageCount);
+
+    stopVirtualTime();
+}
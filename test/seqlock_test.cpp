@@ -0,0 +1,182 @@
+/*
+Abstract:
+    Stress test of the sequence lock that publishes the DMA position.
+*/
+
+#include <thread>
+
+#include <msvad.h>
+#include "seqlock.h"
+#include "test.h"
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+#define WRITERS                     2
+#define READERS                     4
+#define STRESS_SECONDS              0.5
+
+//=============================================================================
+// Types
+//=============================================================================
+
+// As large as the position snapshot. Every write sets all words to the
+// same generation, so a torn copy shows as words that differ.
+typedef struct _PUBLISHED
+{
+    ULONGLONG   ullWords[24];
+} PUBLISHED;
+
+typedef struct _STRESS
+{
+    KSPIN_LOCK      WriterLock;         // As dmaLock_.
+    SEQUENCE_LOCK   Sequence;
+    PUBLISHED       Data;
+    ULONGLONG       ullGeneration;
+    BOOLEAN volatile fStop;
+    ULONGLONG       ullWrites[WRITERS];
+    ULONGLONG       ullReads[READERS];
+    ULONGLONG       ullTorn[READERS];
+    ULONGLONG       ullBackwards[READERS];  // Older than a copy before.
+} STRESS;
+
+static STRESS Stress;
+
+//=============================================================================
+static void writer(IN ULONG index)
+{
+    while (!Stress.fStop)
+    {
+        KIRQL oldIrql;
+
+        KeAcquireSpinLock(&Stress.WriterLock, &oldIrql);
+
+        const ULONGLONG generation = ++Stress.ullGeneration;
+
+        SequenceWriteBegin(&Stress.Sequence);
+
+        for (ULONG i = 0; i < RTL_NUMBER_OF(Stress.Data.ullWords); i++)
+        {
+            Stress.Data.ullWords[i] = generation;
+        }
+
+        SequenceWriteEnd(&Stress.Sequence);
+
+        KeReleaseSpinLock(&Stress.WriterLock, oldIrql);
+
+        Stress.ullWrites[index]++;
+    }
+}
+
+//=============================================================================
+static void reader(IN ULONG index)
+{
+    ULONGLONG latest = 0;
+
+    while (!Stress.fStop)
+    {
+        PUBLISHED copy;
+
+        SequenceRead(&Stress.Sequence, &Stress.Data, &copy, sizeof(copy));
+
+        for (ULONG i = 1; i < RTL_NUMBER_OF(copy.ullWords); i++)
+        {
+            if (copy.ullWords[i] != copy.ullWords[0])
+            {
+                Stress.ullTorn[index]++;
+                break;
+            }
+        }
+
+        if (copy.ullWords[0] < latest)
+        {
+            Stress.ullBackwards[index]++;
+        }
+
+        latest = max(latest, copy.ullWords[0]);
+        Stress.ullReads[index]++;
+    }
+}
+
+//=============================================================================
+TEST(ReadersNeverSeeTornWrites)
+{
+    RtlZeroMemory(&Stress, sizeof(Stress));
+    KeInitializeSpinLock(&Stress.WriterLock);
+
+    std::thread writers[WRITERS];
+    std::thread readers[READERS];
+
+    for (ULONG i = 0; i < READERS; i++)
+    {
+        readers[i] = std::thread(reader, i);
+    }
+
+    for (ULONG i = 0; i < WRITERS; i++)
+    {
+        writers[i] = std::thread(writer, i);
+    }
+
+    const double start = TestSeconds();
+
+    while (TestSeconds() - start < STRESS_SECONDS)
+    {
+        std::this_thread::yield();
+    }
+
+    Stress.fStop = TRUE;
+
+    for (ULONG i = 0; i < WRITERS; i++)
+    {
+        writers[i].join();
+    }
+
+    for (ULONG i = 0; i < READERS; i++)
+    {
+        readers[i].join();
+    }
+
+    ULONGLONG writes = 0;
+    ULONGLONG reads  = 0;
+
+    for (ULONG i = 0; i < WRITERS; i++)
+    {
+        writes += Stress.ullWrites[i];
+    }
+
+    for (ULONG i = 0; i < READERS; i++)
+    {
+        CHECK_EQUAL(0, Stress.ullTorn[i]);
+        CHECK_EQUAL(0, Stress.ullBackwards[i]);
+        CHECK(Stress.ullReads[i] > 0);
+
+        reads += Stress.ullReads[i];
+    }
+
+    CHECK_EQUAL(Stress.ullGeneration, writes);
+    CHECK_EQUAL(2 * writes, Stress.Sequence.lSequence);
+
+    printf("       %llu writes, %llu reads\n", writes, reads);
+}
+
+//=============================================================================
+TEST(ReadAfterWriteSeesIt)
+{
+    SEQUENCE_LOCK lock;
+    ULONGLONG     data = 1;
+    ULONGLONG     copy = 0;
+
+    RtlZeroMemory(&lock, sizeof(lock));
+
+    SequenceRead(&lock, &data, &copy, sizeof(copy));
+    CHECK_EQUAL(1, copy);
+
+    SequenceWriteBegin(&lock);
+    data = 2;
+    SequenceWriteEnd(&lock);
+
+    SequenceRead(&lock, &data, &copy, sizeof(copy));
+    CHECK_EQUAL(2, copy);
+    CHECK_EQUAL(2, lock.lSequence);
+}
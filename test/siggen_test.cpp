@@ -0,0 +1,371 @@
+/*
+Abstract:
+    Tests and benchmarks of the signal generator.
+*/
+
+#include <math.h>
+
+#include <msvad.h>
+#include "siggen.h"
+#include "test.h"
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+#define TEST_FRAMES                 48000
+#define TEST_LEVEL                  20000
+
+//=============================================================================
+static void initFormat(OUT PWAVEFORMATEX format, IN ULONG rate, IN WORD channels, IN WORD bits)
+{
+    RtlZeroMemory(format, sizeof(*format));
+
+    format->wFormatTag      = WAVE_FORMAT_PCM;
+    format->nChannels       = channels;
+    format->nSamplesPerSec  = rate;
+    format->wBitsPerSample  = bits;
+    format->nBlockAlign     = channels * bits / 8;
+    format->nAvgBytesPerSec = rate * format->nBlockAlign;
+}
+
+//=============================================================================
+static void initSignal(OUT PSIGGEN_PARAMS params, IN SIGGEN_SIGNAL signal)
+{
+    RtlZeroMemory(params, sizeof(*params));
+
+    params->Signal         = signal;
+    params->ulToneCount    = 3;
+    params->ulFrequency[0] = 997;
+    params->ulFrequency[1] = 3001;
+    params->ulFrequency[2] = 11025;
+    params->ulSweepEnd     = 20000;
+    params->ulSweepMs      = 250;
+    params->ulLevel        = TEST_LEVEL;
+    params->ulSeed         = 12345;
+}
+
+//=============================================================================
+// Sample of channel of frame in a buffer, as 16 bits.
+static LONG sampleAt(IN PBYTE buffer, IN PWAVEFORMATEX format, IN ULONG frame, IN ULONG channel)
+{
+    const PBYTE sample = buffer + frame * format->nBlockAlign + channel * format->wBitsPerSample / 8;
+
+    switch (format->wBitsPerSample)
+    {
+        case 8:  return ((LONG)sample[0] - 0x80) << 8;
+        case 16: return *(SHORT*)sample;
+        case 24: return (SHORT)(sample[1] | (sample[2] << 8));
+        default: return *(LONG*)sample >> 16;
+    }
+}
+
+//=============================================================================
+static PBYTE allocate(IN ULONG size)
+{
+    return (PBYTE)ExAllocatePoolWithTag(NonPagedPool, size, MSVAD_POOLTAG);
+}
+
+//=============================================================================
+// Signals come out the same however the stream is cut into spans, as the
+// DMA engine cuts it at the buffer end and its bursts. A tone restarts its
+// phase from the frame count at every span, which can differ from the phase
+// stepped to within a block in the last bit, so tones may differ by a step
+// per oscillator. Noise steps all its lanes at a time, so it is the same for
+// spans of whole groups of lanes.
+TEST(SignalsDoNotDependOnTheSpans)
+{
+    const SIGGEN_SIGNAL signals[] = { SigGenSine, SigGenMultitone, SigGenSweep, SigGenImpulse,
+                                      SigGenWhiteNoise, SigGenPinkNoise };
+    WAVEFORMATEX        format;
+
+    initFormat(&format, 44100, 2, 16);
+
+    const ULONG size  = TEST_FRAMES * format.nBlockAlign;
+    PBYTE       whole = allocate(size);
+    PBYTE       spans = allocate(size);
+
+    for (ULONG s = 0; s < RTL_NUMBER_OF(signals); s++)
+    {
+        const ULONG     grain = signals[s] >= SigGenWhiteNoise ? SIGGEN_NOISE_LANES : 1;
+        SignalGenerator generator;
+        SIGGEN_PARAMS   params;
+
+        initSignal(&params, signals[s]);
+        CHECK_EQUAL(STATUS_SUCCESS, generator.setSignal(&params));
+        generator.setFormat(&format);
+        generator.fill(whole, size);
+
+        generator.reset();
+
+        for (ULONG frame = 0; frame < TEST_FRAMES; )
+        {
+            const ULONG frames = min((ULONG)(TestRandom() % 700 + 1) * grain, TEST_FRAMES - frame);
+
+            generator.fill(spans + frame * format.nBlockAlign, frames * format.nBlockAlign);
+            frame += frames;
+        }
+
+        if (SigGenSine == signals[s] || SigGenMultitone == signals[s])
+        {
+            LONG error = 0;
+
+            for (ULONG i = 0; i < size / sizeof(SHORT); i++)
+            {
+                error = max(error, labs(((PSHORT)whole)[i] - ((PSHORT)spans)[i]));
+            }
+
+            CHECK(error <= (LONG)params.ulToneCount);
+        }
+        else
+        {
+            CHECK(!memcmp(whole, spans, size));
+        }
+    }
+
+    ExFreePoolWithTag(whole, MSVAD_POOLTAG);
+    ExFreePoolWithTag(spans, MSVAD_POOLTAG);
+}
+
+//=============================================================================
+// A sine follows the exact one within a few steps of the level, also an
+// hour into the stream, where an accumulated phase would have drifted.
+TEST(SineIsPhaseAccurate)
+{
+    const ULONG     rate      = 48000;
+    const ULONG     frequency = 997;
+    SignalGenerator generator;
+    SIGGEN_PARAMS   params;
+    WAVEFORMATEX    format;
+
+    initFormat(&format, rate, 1, 16);
+    initSignal(&params, SigGenSine);
+    params.ulFrequency[0] = frequency;
+
+    CHECK_EQUAL(STATUS_SUCCESS, generator.setSignal(&params));
+    generator.setFormat(&format);
+
+    const ULONG size   = 0x10000;
+    PBYTE       buffer = allocate(size);
+    ULONGLONG   frame  = 0;
+    LONG        error  = 0;
+
+    for (ULONG minute = 0; minute <= 60; minute++)
+    {
+        generator.fill(buffer, size);
+
+        for (ULONG i = 0; i < size / sizeof(SHORT); i++)
+        {
+            const double phase = 2 * M_PI * (double)((frame + i) * frequency % rate) / rate;
+            const LONG   exact = (LONG)lround(TEST_LEVEL * sin(phase));
+
+            error = max(error, labs(sampleAt(buffer, &format, i, 0) - exact));
+        }
+
+        frame += size / sizeof(SHORT);
+
+        // Skip ahead a minute at a time.
+        //
+        while (frame < (ULONGLONG)(minute + 1) * 60 * rate - size / sizeof(SHORT))
+        {
+            const ULONG bytes = (ULONG)min(((ULONGLONG)(minute + 1) * 60 * rate - size / sizeof(SHORT) - frame) * sizeof(SHORT), size);
+
+            generator.fill(buffer, bytes);
+            frame += bytes / sizeof(SHORT);
+        }
+    }
+
+    printf("       sine error %d of %d\n", error, TEST_LEVEL);
+    CHECK(error <= TEST_LEVEL / 200);
+
+    ExFreePoolWithTag(buffer, MSVAD_POOLTAG);
+}
+
+//=============================================================================
+// Every supported sample width and channel count: the same sample on every
+// channel, the level as set, and silence in a trailing partial frame.
+TEST(EveryFormatCarriesTheSignal)
+{
+    const WORD bits[] = { 8, 16, 24, 32 };
+
+    for (ULONG b = 0; b < RTL_NUMBER_OF(bits); b++)
+    {
+        for (WORD channels = 1; channels <= 8; channels++)
+        {
+            SignalGenerator generator;
+            SIGGEN_PARAMS   params;
+            WAVEFORMATEX    format;
+
+            initFormat(&format, 48000, channels, bits[b]);
+            initSignal(&params, SigGenSine);
+            params.ulFrequency[0] = 1000;
+
+            CHECK_EQUAL(STATUS_SUCCESS, generator.setSignal(&params));
+            generator.setFormat(&format);
+
+            const ULONG frames = 480;
+            const ULONG size   = frames * format.nBlockAlign + format.nBlockAlign - 1;
+            PBYTE       buffer = allocate(size);
+            ULONG       errors = 0;
+
+            generator.fill(buffer, size);
+
+            for (ULONG i = 0; i < frames; i++)
+            {
+                for (ULONG channel = 1; channel < channels; channel++)
+                {
+                    errors += sampleAt(buffer, &format, i, channel) != sampleAt(buffer, &format, i, 0);
+                }
+            }
+
+            for (ULONG i = frames * format.nBlockAlign; i < size; i++)
+            {
+                errors += buffer[i] != (8 == bits[b] ? 0x80 : 0);
+            }
+
+            CHECK_EQUAL(0, errors);
+
+            const LONG peak = (LONG)PeakLevel(buffer, frames * format.nBlockAlign, &format);
+
+            CHECK(labs(peak - TEST_LEVEL) <= TEST_LEVEL / 100 + (8 == bits[b] ? 256 : 0));
+
+            ExFreePoolWithTag(buffer, MSVAD_POOLTAG);
+        }
+    }
+}
+
+//=============================================================================
+TEST(ImpulsesFallOnTheirPeriod)
+{
+    SignalGenerator generator;
+    SIGGEN_PARAMS   params;
+    WAVEFORMATEX    format;
+    SHORT           samples[TEST_FRAMES];
+
+    initFormat(&format, 48000, 1, 16);
+    initSignal(&params, SigGenImpulse);
+    params.ulFrequency[0] = 100;
+
+    CHECK_EQUAL(STATUS_SUCCESS, generator.setSignal(&params));
+    generator.setFormat(&format);
+    generator.fill((PBYTE)samples, sizeof(samples));
+
+    ULONG errors = 0;
+
+    for (ULONG i = 0; i < TEST_FRAMES; i++)
+    {
+        errors += samples[i] != (i % 480 ? 0 : TEST_LEVEL);
+    }
+
+    CHECK_EQUAL(0, errors);
+}
+
+//=============================================================================
+// Noise stays within its level, is centered, is the same for the same seed
+// and different for another. The slowest rows of pink noise are drawn only
+// a few dozen times a second, so its mean wanders further.
+TEST(NoiseIsBoundedAndSeeded)
+{
+    const SIGGEN_SIGNAL signals[] = { SigGenWhiteNoise, SigGenPinkNoise };
+    WAVEFORMATEX        format;
+    SHORT               first[TEST_FRAMES];
+    SHORT               again[TEST_FRAMES];
+
+    initFormat(&format, 48000, 1, 16);
+
+    for (ULONG s = 0; s < RTL_NUMBER_OF(signals); s++)
+    {
+        SignalGenerator generator;
+        SIGGEN_PARAMS   params;
+
+        initSignal(&params, signals[s]);
+        CHECK_EQUAL(STATUS_SUCCESS, generator.setSignal(&params));
+        generator.setFormat(&format);
+
+        generator.fill((PBYTE)first, sizeof(first));
+        generator.reset();
+        generator.fill((PBYTE)again, sizeof(again));
+
+        CHECK(!memcmp(first, again, sizeof(first)));
+
+        LONGLONG sum  = 0;
+        LONG     peak = 0;
+
+        for (ULONG i = 0; i < TEST_FRAMES; i++)
+        {
+            sum += first[i];
+            peak = max(peak, labs(first[i]));
+        }
+
+        CHECK(peak <= TEST_LEVEL);
+        CHECK(peak >= TEST_LEVEL / 4);
+        CHECK(llabs(sum / TEST_FRAMES) < TEST_LEVEL / (SigGenWhiteNoise == signals[s] ? 50 : 10));
+
+        params.ulSeed++;
+        CHECK_EQUAL(STATUS_SUCCESS, generator.setSignal(&params));
+        generator.fill((PBYTE)again, sizeof(again));
+
+        CHECK(memcmp(first, again, sizeof(first)));
+    }
+}
+
+//=============================================================================
+TEST(InvalidSignalsAreRejected)
+{
+    SignalGenerator generator;
+    SIGGEN_PARAMS   params;
+
+    initSignal(&params, SigGenSine);
+    params.ulLevel = DSP_LEVEL_FULL_SCALE + 1;
+    CHECK_EQUAL(STATUS_INVALID_PARAMETER, generator.setSignal(&params));
+
+    initSignal(&params, SigGenMultitone);
+    params.ulToneCount = SIGGEN_MAX_TONES + 1;
+    CHECK_EQUAL(STATUS_INVALID_PARAMETER, generator.setSignal(&params));
+
+    initSignal(&params, SigGenSweep);
+    params.ulSweepMs = 0;
+    CHECK_EQUAL(STATUS_INVALID_PARAMETER, generator.setSignal(&params));
+
+    initSignal(&params, SigGenWhiteNoise);
+    params.ulSeed = 0;
+    CHECK_EQUAL(STATUS_INVALID_PARAMETER, generator.setSignal(&params));
+
+    initSignal(&params, (SIGGEN_SIGNAL)100);
+    CHECK_EQUAL(STATUS_INVALID_PARAMETER, generator.setSignal(&params));
+}
+
+//=============================================================================
+// Cost of 10 ms of 48 kHz stereo 16-bit capture, a notification interval,
+// for each signal.
+TEST(BenchmarkSignalGenerator)
+{
+    const SIGGEN_SIGNAL signals[] = { SigGenSilence, SigGenSine, SigGenMultitone, SigGenSweep,
+                                      SigGenWhiteNoise, SigGenPinkNoise, SigGenImpulse };
+    const char*         names[]   = { "silence", "sine", "multitone", "sweep", "white noise",
+                                      "pink noise", "impulse" };
+    WAVEFORMATEX        format;
+    BYTE                buffer[480 * 4];
+
+    initFormat(&format, 48000, 2, 16);
+
+    for (ULONG s = 0; s < RTL_NUMBER_OF(signals); s++)
+    {
+        const ULONG     count = 20000;
+        SignalGenerator generator;
+        SIGGEN_PARAMS   params;
+
+        initSignal(&params, signals[s]);
+        CHECK_EQUAL(STATUS_SUCCESS, generator.setSignal(&params));
+        generator.setFormat(&format);
+
+        const double start = TestSeconds();
+
+        for (ULONG i = 0; i < count; i++)
+        {
+            generator.fill(buffer, sizeof(buffer));
+        }
+
+        printf("       %-12s %6.2f us per 10 ms\n", names[s], (TestSeconds() - start) * 1e6 / count);
+    }
+}
@@ -0,0 +1,74 @@
+/*
+Abstract:
+    The test framework of the user-mode tests.
+
+    Each test program is a set of TEST functions, run in order of
+    definition by testmain.cpp. A failed CHECK reports and the test goes on;
+    the program fails if any check did. Arguments on the command line select
+    the tests whose name contains one of them, and tests named Benchmark*
+    only run when selected that way, so a plain run stays fast.
+*/
+
+#ifndef _MSVAD_TEST_TEST_H_
+#define _MSVAD_TEST_TEST_H_
+
+//=============================================================================
+// Types
+//=============================================================================
+
+typedef void TEST_ROUTINE();
+
+typedef struct _TEST_CASE
+{
+    const char*         pszName;
+    TEST_ROUTINE*       Routine;
+    struct _TEST_CASE*  pNext;
+} TEST_CASE;
+
+//=============================================================================
+// Function Prototypes
+//=============================================================================
+
+int         TestRegister(TEST_CASE* test);
+
+void        TestFail(const char* file, int line, const char* format, ...);
+
+void        TestSeed(ULONGLONG seed);
+
+ULONGLONG   TestRandom();
+
+double      TestSeconds();
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+#define TEST(name)                                                          \
+    static TEST_ROUTINE name;                                               \
+    static TEST_CASE    name##Case = { #name, name, nullptr };              \
+    static int          name##Registered = TestRegister(&name##Case);       \
+    static void         name()
+
+#define CHECK(condition)                                                    \
+    do                                                                      \
+    {                                                                       \
+        if (!(condition))                                                   \
+        {                                                                   \
+            TestFail(__FILE__, __LINE__, "%s", #condition);                 \
+        }                                                                   \
+    } while (0)
+
+#define CHECK_EQUAL(expected, actual)                                       \
+    do                                                                      \
+    {                                                                       \
+        const unsigned long long e_ = (unsigned long long)(expected);       \
+        const unsigned long long a_ = (unsigned long long)(actual);         \
+                                                                            \
+        if (e_ != a_)                                                       \
+        {                                                                   \
+            TestFail(__FILE__, __LINE__, "%s == %s: expected %llu, got %llu", \
+                     #expected, #actual, e_, a_);                           \
+        }                                                                   \
+    } while (0)
+
+#endif
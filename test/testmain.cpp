@@ -0,0 +1,136 @@
+/*
+Abstract:
+    Runs the tests of a test program. See test.h.
+*/
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <msvad.h>
+#include "vtime.h"
+#include "test.h"
+
+//=============================================================================
+// Types
+//=============================================================================
+
+typedef struct _TEST_RUN
+{
+    TEST_CASE*          pFirst;
+    TEST_CASE**         ppLast;
+    const TEST_CASE*    pCurrent;
+    ULONG               ulFailures;     // Of the current test.
+    ULONGLONG           ullRandom;      // xorshift64 state.
+} TEST_RUN;
+
+static TEST_RUN TestRun = { nullptr, &TestRun.pFirst, nullptr, 0, 0x9E3779B97F4A7C15ULL };
+
+//=============================================================================
+int TestRegister(TEST_CASE* test)
+{
+    *TestRun.ppLast = test;
+    TestRun.ppLast  = &test->pNext;
+
+    return 0;
+}
+
+//=============================================================================
+void TestFail(const char* file, int line, const char* format, ...)
+{
+    va_list arguments;
+
+    // A loop that fails on every pass reports the first few.
+    //
+    if (TestRun.ulFailures++ < 10)
+    {
+        printf("%s:%d: %s: ", file, line, TestRun.pCurrent->pszName);
+
+        va_start(arguments, format);
+        vprintf(format, arguments);
+        va_end(arguments);
+
+        printf("\n");
+    }
+}
+
+//=============================================================================
+// Pseudo-random numbers, the same sequence on every run of a test, or after
+// every TestSeed with the same seed, which must not be 0.
+void TestSeed(ULONGLONG seed)
+{
+    ASSERT(seed);
+
+    TestRun.ullRandom = seed;
+}
+
+//=============================================================================
+ULONGLONG TestRandom()
+{
+    TestRun.ullRandom ^= TestRun.ullRandom << 13;
+    TestRun.ullRandom ^= TestRun.ullRandom >> 7;
+    TestRun.ullRandom ^= TestRun.ullRandom << 17;
+
+    return TestRun.ullRandom;
+}
+
+//=============================================================================
+// Host time, for benchmarks.
+double TestSeconds()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+//=============================================================================
+static bool selected(const TEST_CASE* test, int argc, char** argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strstr(test->pszName, argv[i]))
+        {
+            return true;
+        }
+    }
+
+    return argc < 2 && strncmp(test->pszName, "Benchmark", 9);
+}
+
+//=============================================================================
+int main(int argc, char** argv)
+{
+    ULONG run    = 0;
+    ULONG failed = 0;
+
+    setvbuf(stdout, nullptr, _IONBF, 0);
+
+    TimeSourceInitialize();
+
+    for (const TEST_CASE* test = TestRun.pFirst; test; test = test->pNext)
+    {
+        if (!selected(test, argc, argv))
+        {
+            continue;
+        }
+
+        TestRun.pCurrent   = test;
+        TestRun.ulFailures = 0;
+        TestRun.ullRandom  = 0x9E3779B97F4A7C15ULL;
+
+        const double start = TestSeconds();
+
+        test->Routine();
+
+        printf("%-6s %s (%.2f s)\n", TestRun.ulFailures ? "FAIL" : "ok", test->pszName, TestSeconds() - start);
+
+        run++;
+        failed += TestRun.ulFailures ? 1 : 0;
+    }
+
+    printf("%u of %u tests passed\n", run - failed, run);
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,308 @@
+/*
+Abstract:
+    Tests of the timer wheel, in virtual time and with late kernel timers.
+*/
+
+#include <msvad.h>
+#include "timewheel.h"
+#include "kernel.h"
+#include "test.h"
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+#define MS                          10000ULL        // 100 ns units.
+#define TIMERS                      12
+
+//=============================================================================
+// Types
+//=============================================================================
+
+typedef struct _TIMER_RECORD
+{
+    WHEEL_TIMER Timer;
+    ULONG       ulPeriod;           // Milliseconds.
+    ULONGLONG   ullSet;             // Millisecond it was set at.
+    ULONGLONG   ullNext;            // Millisecond of the next expiry.
+    ULONG       ulExpiries;
+    ULONG       ulEarly;            // Expiries before ullNext,
+    ULONG       ulLate;             // and after it.
+    BOOLEAN     fCancelSelf;        // Cancel the timer when it expires.
+} TIMER_RECORD;
+
+static PTimerWheel  Wheel;
+static TIMER_RECORD Records[TIMERS];
+
+//=============================================================================
+static ULONGLONG nowMs()
+{
+    return TimeNow(nullptr) / MS;
+}
+
+//=============================================================================
+// Checks an expiry against the phase the timer was set with. Expiries a late
+// tick missed are dropped, so the next one is the first of the phase after
+// now. In virtual time the ticks are never late.
+static void expired(IN PKDPC dpc, IN PVOID context, IN PVOID SA1, IN PVOID SA2)
+{
+    UNREFERENCED_PARAMETER(dpc);
+    UNREFERENCED_PARAMETER(SA1);
+    UNREFERENCED_PARAMETER(SA2);
+
+    TIMER_RECORD*   record = (TIMER_RECORD*)context;
+    const ULONGLONG now    = nowMs();
+
+    if (now < record->ullNext)
+    {
+        record->ulEarly++;
+    }
+    else if (now > record->ullNext)
+    {
+        record->ulLate++;
+    }
+
+    record->ulExpiries++;
+    record->ullNext += ((now - min(record->ullNext, now)) / record->ulPeriod + 1) * record->ulPeriod;
+
+    if (record->fCancelSelf)
+    {
+        Wheel->cancelTimer(&record->Timer);
+    }
+}
+
+//=============================================================================
+static void setTimer(IN ULONG index, IN ULONG periodMs)
+{
+    TIMER_RECORD* record = &Records[index];
+
+    record->ulPeriod = periodMs;
+    record->ullSet   = nowMs();
+    record->ullNext  = record->ullSet + periodMs;
+
+    Wheel->setTimer(&record->Timer, periodMs);
+}
+
+//=============================================================================
+static void createWheel()
+{
+    RtlZeroMemory(Records, sizeof(Records));
+
+    Wheel = new (NonPagedPool, MSVAD_POOLTAG) TimerWheel();
+
+    for (ULONG i = 0; i < TIMERS; i++)
+    {
+        Wheel->initializeTimer(&Records[i].Timer, expired, &Records[i]);
+    }
+}
+
+//=============================================================================
+static void deleteWheel()
+{
+    for (ULONG i = 0; i < TIMERS; i++)
+    {
+        Wheel->cancelTimer(&Records[i].Timer);
+    }
+
+    delete Wheel;
+    Wheel = nullptr;
+}
+
+//=============================================================================
+TEST(ExpiriesKeepTheirPhaseInVirtualTime)
+{
+    const ULONG periods[TIMERS] = { 1, 3, 10, 10, 10, 17, 64, 65, 100, 4096, 5000, 70000 };
+
+    TestHoldPerformanceCounter(12345 * MS);
+    CHECK_EQUAL(STATUS_SUCCESS, VirtualTimeEnable(TRUE));
+    TestReleasePerformanceCounter();
+
+    createWheel();
+
+    for (ULONG i = 0; i < TIMERS; i++)
+    {
+        VirtualTimeAdvance((TestRandom() % 7) * MS);
+        setTimer(i, periods[i]);
+    }
+
+    for (ULONG step = 0; step < 500; step++)
+    {
+        VirtualTimeAdvance((TestRandom() % 2000) * MS / 3);
+    }
+
+    for (ULONG i = 0; i < TIMERS; i++)
+    {
+        CHECK_EQUAL((nowMs() - Records[i].ullSet) / periods[i], Records[i].ulExpiries);
+        CHECK_EQUAL(0, Records[i].ulEarly);
+        CHECK_EQUAL(0, Records[i].ulLate);
+    }
+
+    TIMER_WHEEL_STATS stats;
+
+    Wheel->getStats(&stats);
+
+    CHECK_EQUAL(TIMERS, stats.ulTimers);
+    CHECK_EQUAL(1, stats.ulKernelTimers);
+    CHECK(stats.ullDpcs < stats.ullExpiries);
+
+    deleteWheel();
+
+    CHECK_EQUAL(STATUS_SUCCESS, VirtualTimeEnable(FALSE));
+}
+
+//=============================================================================
+TEST(TimersBeyondTheSpanOfTheWheel)
+{
+    const ULONG period = 5 * 3600 * 1000;    // Further than the 4.6 hours of the levels.
+
+    CHECK_EQUAL(STATUS_SUCCESS, VirtualTimeEnable(TRUE));
+
+    createWheel();
+    setTimer(0, period);
+    setTimer(1, 1000);
+
+    VirtualTimeAdvance(11ULL * 3600 * 1000 * MS);
+
+    CHECK_EQUAL(2, Records[0].ulExpiries);
+    CHECK_EQUAL(11 * 3600, Records[1].ulExpiries);
+
+    for (ULONG i = 0; i < 2; i++)
+    {
+        CHECK_EQUAL(0, Records[i].ulEarly);
+        CHECK_EQUAL(0, Records[i].ulLate);
+    }
+
+    deleteWheel();
+
+    CHECK_EQUAL(STATUS_SUCCESS, VirtualTimeEnable(FALSE));
+}
+
+//=============================================================================
+// Kernel timers expire on the clock interval, so the DPC of the wheel runs
+// several ticks late, by more than a period of its shorter timers. Each
+// timer then expires once, and its later expiries keep their phase.
+TEST(LateTickExpiresEachTimerOnce)
+{
+    TestHoldPerformanceCounter(1000 * MS);
+
+    createWheel();
+    setTimer(0, 10);
+    setTimer(1, 3);
+    setTimer(2, 1);
+    setTimer(3, 100);
+
+    for (ULONG round = 0; round < 200; round++)
+    {
+        const ULONG before[4] = { Records[0].ulExpiries, Records[1].ulExpiries,
+                                  Records[2].ulExpiries, Records[3].ulExpiries };
+
+        // 15.6 ms, the default clock interval, and sometimes much later.
+        //
+        TestAdvancePerformanceCounter(round % 10 ? 156000 : 1000 * MS);
+        CHECK_EQUAL(1, TestRunTimers());
+
+        for (ULONG i = 0; i < 3; i++)
+        {
+            CHECK_EQUAL(before[i] + 1, Records[i].ulExpiries);
+        }
+
+        CHECK(Records[3].ulExpiries - before[3] <= 1);
+    }
+
+    for (ULONG i = 0; i < 4; i++)
+    {
+        CHECK_EQUAL(0, Records[i].ulEarly);
+    }
+
+    // The wheel keeps one kernel timer armed for the next tick due.
+    //
+    CHECK_EQUAL(1, TestArmedTimers());
+
+    deleteWheel();
+
+    CHECK_EQUAL(0, TestArmedTimers());
+
+    TestReleasePerformanceCounter();
+}
+
+//=============================================================================
+// The last timer cancelled from its own routine, while the tick runs, must
+// not leave the kernel timer of the wheel counted as armed, or the time
+// source can never switch again.
+TEST(WheelEmptiedDuringTickReleasesKernelTimer)
+{
+    TestHoldPerformanceCounter(1000 * MS);
+
+    createWheel();
+    Records[0].fCancelSelf = TRUE;
+    setTimer(0, 10);
+
+    TestAdvancePerformanceCounter(10 * MS);
+    CHECK_EQUAL(1, TestRunTimers());
+    CHECK_EQUAL(1, Records[0].ulExpiries);
+    CHECK_EQUAL(0, TestArmedTimers());
+
+    TestReleasePerformanceCounter();
+
+    CHECK_EQUAL(STATUS_SUCCESS, VirtualTimeEnable(TRUE));
+
+    // The same in virtual time, and with a timer cancelled from the routine
+    // of another.
+    //
+    Records[0].fCancelSelf = FALSE;
+    Records[1].fCancelSelf = TRUE;
+    setTimer(0, 10);
+    setTimer(1, 10);
+    Wheel->cancelTimer(&Records[0].Timer);
+
+    VirtualTimeAdvance(20 * MS);
+
+    CHECK_EQUAL(1, Records[1].ulExpiries);
+    CHECK_EQUAL(STATUS_SUCCESS, VirtualTimeEnable(FALSE));
+
+    deleteWheel();
+}
+
+//=============================================================================
+// Routines that set and cancel timers, their own and others, as streams do
+// when they start and stop in their notifications.
+TEST(TimersSetAndCancelledFromRoutines)
+{
+    CHECK_EQUAL(STATUS_SUCCESS, VirtualTimeEnable(TRUE));
+
+    createWheel();
+
+    for (ULONG i = 0; i < TIMERS; i++)
+    {
+        setTimer(i, 1 + (ULONG)(TestRandom() % 50));
+    }
+
+    for (ULONG step = 0; step < 2000; step++)
+    {
+        VirtualTimeAdvance((TestRandom() % 30) * MS);
+
+        const ULONGLONG random = TestRandom();
+        const ULONG     index  = (ULONG)(random % TIMERS);
+
+        if (random & 0x100)
+        {
+            setTimer(index, 1 + (ULONG)((random >> 16) % 200));
+        }
+        else
+        {
+            Wheel->cancelTimer(&Records[index].Timer);
+        }
+
+        Records[(random >> 32) % TIMERS].fCancelSelf = (random >> 40) % 4 == 0;
+    }
+
+    for (ULONG i = 0; i < TIMERS; i++)
+    {
+        CHECK_EQUAL(0, Records[i].ulEarly);
+        CHECK_EQUAL(0, Records[i].ulLate);
+    }
+
+    deleteWheel();
+
+    CHECK_EQUAL(STATUS_SUCCESS, VirtualTimeEnable(FALSE));
+}
@@ -0,0 +1,257 @@
+/*
+Abstract:
+    Tests of the time source in virtual time.
+*/
+
+#include <msvad.h>
+#include "vtime.h"
+#include "kernel.h"
+#include "test.h"
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+#define MS                          10000ULL        // 100 ns units.
+#define TRACE_SIZE                  64
+
+//=============================================================================
+// Types
+//=============================================================================
+
+// What the timer routines saw, in order.
+typedef struct _TRACE
+{
+    ULONG       ulCount;
+    ULONG       ulTimer[TRACE_SIZE];
+    ULONGLONG   ullTime[TRACE_SIZE];
+    ULONGLONG   ullHash;            // Of every firing, also past TRACE_SIZE.
+} TRACE;
+
+static TRACE       Trace;
+static TIME_TIMER  Timers[8];
+
+//=============================================================================
+static void traced(IN PKDPC dpc, IN PVOID context, IN PVOID SA1, IN PVOID SA2)
+{
+    UNREFERENCED_PARAMETER(dpc);
+    UNREFERENCED_PARAMETER(SA1);
+    UNREFERENCED_PARAMETER(SA2);
+
+    const ULONG     timer = (ULONG)(ULONG_PTR)context;
+    const ULONGLONG time  = TimeNow(nullptr);
+
+    if (Trace.ulCount < TRACE_SIZE)
+    {
+        Trace.ulTimer[Trace.ulCount] = timer;
+        Trace.ullTime[Trace.ulCount] = time;
+    }
+
+    Trace.ulCount++;
+    Trace.ullHash = (Trace.ullHash ^ (time * 8 + timer)) * 0x100000001B3ULL;
+}
+
+//=============================================================================
+// Sets or cancels another timer from a timer routine, as stream DPCs do.
+static void churning(IN PKDPC dpc, IN PVOID context, IN PVOID SA1, IN PVOID SA2)
+{
+    traced(dpc, context, SA1, SA2);
+
+    const ULONGLONG random = TestRandom();
+    const ULONG     other  = (ULONG)(random % RTL_NUMBER_OF(Timers));
+
+    if (random & 0x100)
+    {
+        LARGE_INTEGER dueTime;
+
+        dueTime.QuadPart = -(LONGLONG)((random >> 16) % (50 * MS));
+        TimerSet(&Timers[other], dueTime, (LONG)((random >> 32) % 20));
+    }
+    else
+    {
+        TimerCancel(&Timers[other]);
+    }
+}
+
+//=============================================================================
+static void startVirtualTime(IN PKDEFERRED_ROUTINE routine)
+{
+    RtlZeroMemory(&Trace, sizeof(Trace));
+
+    TestHoldPerformanceCounter(1000 * MS);
+    CHECK_EQUAL(STATUS_SUCCESS, VirtualTimeEnable(TRUE));
+    TestReleasePerformanceCounter();
+
+    for (ULONG i = 0; i < RTL_NUMBER_OF(Timers); i++)
+    {
+        TimerInitialize(&Timers[i], routine, (PVOID)(ULONG_PTR)i);
+    }
+}
+
+//=============================================================================
+static void stopVirtualTime()
+{
+    for (ULONG i = 0; i < RTL_NUMBER_OF(Timers); i++)
+    {
+        TimerCancel(&Timers[i]);
+    }
+
+    CHECK_EQUAL(STATUS_SUCCESS, VirtualTimeEnable(FALSE));
+}
+
+//=============================================================================
+static void setTimer(IN ULONG timer, IN ULONGLONG delay, IN LONG periodMs)
+{
+    LARGE_INTEGER dueTime;
+
+    dueTime.QuadPart = -(LONGLONG)delay;
+    TimerSet(&Timers[timer], dueTime, periodMs);
+}
+
+//=============================================================================
+TEST(VirtualTimeStartsAtRealTime)
+{
+    startVirtualTime(traced);
+
+    // The clock stands still between advances, however long they take.
+    //
+    CHECK_EQUAL(1000 * MS, TimeNow(nullptr));
+    CHECK_EQUAL(STATUS_SUCCESS, VirtualTimeAdvance(5 * MS));
+    CHECK_EQUAL(1005 * MS, TimeNow(nullptr));
+
+    LARGE_INTEGER   frequency;
+    const ULONGLONG counter = (ULONGLONG)TimeQueryPerformanceCounter(&frequency).QuadPart;
+
+    CHECK_EQUAL(VIRTUAL_TIME_FREQUENCY, frequency.QuadPart);
+    CHECK_EQUAL(1005 * MS, counter);
+    CHECK_EQUAL(1005 * MS, TimeForPerformanceCounter((LONGLONG)counter));
+
+    stopVirtualTime();
+
+    CHECK_EQUAL(STATUS_INVALID_DEVICE_STATE, VirtualTimeAdvance(MS));
+}
+
+//=============================================================================
+TEST(TimersFireAtTheirExpiryInOrder)
+{
+    startVirtualTime(traced);
+
+    setTimer(0, 10 * MS, 10);       // 10, 20, 30 ms
+    setTimer(1, 15 * MS, 0);        // 15 ms, once
+    setTimer(2, 20 * MS, 0);        // 20 ms, before timer 0, which is queued
+                                    // again only when it fires at 10 ms
+
+    CHECK_EQUAL(STATUS_SUCCESS, VirtualTimeAdvance(30 * MS));
+
+    const ULONG     timers[] = { 0, 1, 2, 0, 0 };
+    const ULONGLONG times[]  = { 10, 15, 20, 20, 30 };
+
+    CHECK_EQUAL(RTL_NUMBER_OF(timers), Trace.ulCount);
+
+    for (ULONG i = 0; i < min(Trace.ulCount, RTL_NUMBER_OF(timers)); i++)
+    {
+        CHECK_EQUAL(timers[i], Trace.ulTimer[i]);
+        CHECK_EQUAL(1000 * MS + times[i] * MS, Trace.ullTime[i]);
+    }
+
+    CHECK_EQUAL(1030 * MS, TimeNow(nullptr));
+
+    stopVirtualTime();
+}
+
+//=============================================================================
+TEST(CancelledTimersDoNotFire)
+{
+    startVirtualTime(traced);
+
+    setTimer(0, 10 * MS, 5);
+    setTimer(1, 10 * MS, 0);
+    TimerCancel(&Timers[1]);
+
+    CHECK_EQUAL(STATUS_SUCCESS, VirtualTimeAdvance(20 * MS));
+    CHECK_EQUAL(3, Trace.ulCount);
+
+    TimerCancel(&Timers[0]);
+
+    CHECK_EQUAL(STATUS_SUCCESS, VirtualTimeAdvance(20 * MS));
+    CHECK_EQUAL(3, Trace.ulCount);
+
+    stopVirtualTime();
+}
+
+//=============================================================================
+TEST(SwitchRefusedWhileTimersAreArmed)
+{
+    startVirtualTime(traced);
+
+    // A one-shot timer counts as armed after it fired, as with TimerSet on
+    // a kernel timer, until it is cancelled.
+    //
+    setTimer(0, MS, 0);
+    CHECK_EQUAL(STATUS_SUCCESS, VirtualTimeAdvance(2 * MS));
+    CHECK_EQUAL(1, Trace.ulCount);
+    CHECK_EQUAL(STATUS_INVALID_DEVICE_STATE, VirtualTimeEnable(FALSE));
+
+    TimerCancel(&Timers[0]);
+    CHECK_EQUAL(STATUS_SUCCESS, VirtualTimeEnable(FALSE));
+
+    // Real time timers are kernel timers.
+    //
+    setTimer(0, MS, 0);
+    CHECK_EQUAL(1, TestArmedTimers());
+    CHECK_EQUAL(STATUS_INVALID_DEVICE_STATE, VirtualTimeEnable(TRUE));
+
+    TimerCancel(&Timers[0]);
+    CHECK_EQUAL(0, TestArmedTimers());
+}
+
+//=============================================================================
+TEST(RunsAreReproducible)
+{
+    ULONGLONG hash[2];
+
+    for (ULONG run = 0; run < 2; run++)
+    {
+        TestSeed(1);
+        startVirtualTime(churning);
+
+        for (ULONG i = 0; i < RTL_NUMBER_OF(Timers); i++)
+        {
+            setTimer(i, (i + 1) * MS, (LONG)(i + 1));
+        }
+
+        for (ULONG step = 0; step < 1000; step++)
+        {
+            VirtualTimeAdvance(TestRandom() % (100 * MS));
+        }
+
+        hash[run] = Trace.ullHash;
+        CHECK(Trace.ulCount > 1000);
+
+        stopVirtualTime();
+    }
+
+    CHECK_EQUAL(hash[0], hash[1]);
+}
+
+//=============================================================================
+TEST(HourOfNotificationsInVirtualTime)
+{
+    startVirtualTime(traced);
+
+    for (ULONG i = 0; i < RTL_NUMBER_OF(Timers); i++)
+    {
+        setTimer(i, 10 * MS, 10);
+    }
+
+    const double start = TestSeconds();
+
+    CHECK_EQUAL(STATUS_SUCCESS, VirtualTimeAdvance(3600ULL * 1000 * MS));
+
+    const double elapsed = TestSeconds() - start;
+
+    CHECK_EQUAL(RTL_NUMBER_OF(Timers) * 360000, Trace.ulCount);
+    printf("       one hour of %u 10 ms timers in %.3f s\n", (ULONG)RTL_NUMBER_OF(Timers), elapsed);
+
+    stopVirtualTime();
+}
@@ -0,0 +1,50 @@
+/*
+Abstract:
+    Implementation of the adapter-wide device timebase.
+*/
+
+#include <msvad.h>
+#include "timebase.h"
+#include "vtime.h"
+
+//=============================================================================
+#pragma code_seg("PAGE")
+DeviceTimebase::DeviceTimebase()
+{
+    PAGED_CODE();
+
+    origin_ = TimeNow(nullptr);
+
+    DPF(D_VERBOSE, ("[DeviceTimebase::DeviceTimebase : origin %I64u]", origin_));
+}
+
+#pragma code_seg()
+
+//=============================================================================
+/*
+Routine Description:
+  Converts a TimeNow value to timebase time. Time before the origin, which
+  only a switch back from virtual time can produce, reads as the origin.
+  Callers of timeAt can run at any IRQL.
+
+Arguments:
+  time - TimeNow value.
+*/
+ULONGLONG DeviceTimebase::timeAt(IN ULONGLONG time)
+{
+    return time > origin_ ? time - origin_ : 0;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Returns the timebase time. Callers of now can run at any IRQL.
+
+Arguments:
+  performanceCounter - Receives the performance counter value the time was
+                       read at, if not nullptr.
+*/
+ULONGLONG DeviceTimebase::now(_Out_opt_ PLONGLONG performanceCounter)
+{
+    return timeAt(TimeNow(performanceCounter));
+}
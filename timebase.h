@@ -0,0 +1,40 @@
+/*
+Abstract:
+    Declaration of the adapter-wide device timebase.
+
+    A real device runs all of its streams from one sample clock, so streams
+    started at different times still sample on the same instants. The
+    timebase is that clock for the streams of an adapter. Each stream counts
+    its frames on the grid the timebase lays down for its rate, and keeps
+    the grid frame its own frame zero falls on. Two streams of one rate
+    that are started apart are then a whole number of frames apart, and that
+    number is the difference of their offsets.
+*/
+
+#ifndef _MSVAD_TIMEBASE_H_
+#define _MSVAD_TIMEBASE_H_
+
+//=============================================================================
+// Classes
+//=============================================================================
+
+///////////////////////////////////////////////////////////////////////////////
+// DeviceTimebase
+//   Time since the adapter started, in 100 ns units of the time source. The
+//   constructor must be called at PASSIVE_LEVEL, the other methods at any
+//   IRQL.
+
+class DeviceTimebase
+{
+public:
+    DeviceTimebase();
+
+    ULONGLONG   timeAt(IN ULONGLONG time);
+    ULONGLONG   now(_Out_opt_ PLONGLONG performanceCounter);
+
+private:
+    ULONGLONG   origin_;        // TimeNow when the adapter started.
+};
+using PDeviceTimebase = DeviceTimebase*;
+
+#endif
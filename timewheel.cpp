@@ -0,0 +1,501 @@
+/*
+Abstract:
+    Implementation of the adapter-wide timer wheel.
+*/
+
+#pragma warning (disable : 4127)
+
+#include <msvad.h>
+#include "timewheel.h"
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+#define SLOT_MASK                   (TIMER_WHEEL_SLOTS - 1)
+
+// Timers further out than the wheel spans wait in its last slot and are
+// placed again when they come down.
+#define WHEEL_SPAN                  (1ULL << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOT_BITS))
+
+#pragma code_seg()
+//=============================================================================
+// Index of the lowest set bit of bits, which must not be 0. Two 32-bit scans,
+// because there is no 64-bit scan on x86.
+static FORCEINLINE ULONG lowestBit(IN ULONGLONG bits)
+{
+    ULONG index;
+
+    if (_BitScanForward(&index, (ULONG)bits))
+    {
+        return index;
+    }
+
+    _BitScanForward(&index, (ULONG)(bits >> 32));
+
+    return index + 32;
+}
+
+#pragma code_seg("PAGE")
+//=============================================================================
+TimerWheel::TimerWheel()
+{
+    PAGED_CODE();
+
+    KeInitializeSpinLock(&lock_);
+    TimerInitialize(&tickTimer_, timerWheelTick, this);
+
+    for (ULONG level = 0; level < TIMER_WHEEL_LEVELS; level++)
+    {
+        for (ULONG slot = 0; slot < TIMER_WHEEL_SLOTS; slot++)
+        {
+            InitializeListHead(&slots_[level][slot]);
+        }
+
+        occupied_[level] = 0;
+    }
+
+    now_           = 0;
+    timers_        = 0;
+    ticking_       = FALSE;
+    scheduled_     = FALSE;
+    scheduledTick_ = 0;
+    expiries_      = 0;
+    dpcs_          = 0;
+    statsTime_     = TimeNow(nullptr);
+    statsExpiries_ = 0;
+    statsDpcs_     = 0;
+}
+
+//=============================================================================
+TimerWheel::~TimerWheel()
+{
+    PAGED_CODE();
+
+    ASSERT(!timers_);
+
+    TimerCancel(&tickTimer_);
+
+    // Wait for a tick that is still running before the wheel goes away.
+    //
+    KeFlushQueuedDpcs();
+
+    DPF(D_TERSE, ("[TimerWheel::~TimerWheel : %I64u expiries in %I64u DPCs]", expiries_, dpcs_));
+}
+
+#pragma code_seg()
+
+//=============================================================================
+/*
+Routine Description:
+  Initializes a wheel timer that runs routine with context at
+  DISPATCH_LEVEL, like the DPC routine of a kernel timer. The dpc argument
+  is the DPC of the wheel.
+
+Arguments:
+  timer   - The timer.
+  routine - The routine.
+  context - Its context.
+*/
+void TimerWheel::initializeTimer(OUT PWHEEL_TIMER timer, IN PKDEFERRED_ROUTINE routine, IN PVOID context)
+{
+    ASSERT(timer);
+    ASSERT(routine);
+
+    RtlZeroMemory(timer, sizeof(*timer));
+
+    timer->Routine  = routine;
+    timer->pContext = context;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Arms a timer to expire every periodMs milliseconds, the first time one
+  period from now. The phase is kept from there: a late tick does not
+  shift the later expiries, and expiries it missed are dropped, as for a
+  late periodic kernel timer. Setting an armed timer starts it anew.
+
+Arguments:
+  timer    - The timer.
+  periodMs - Period in milliseconds, not 0.
+*/
+void TimerWheel::setTimer(IN PWHEEL_TIMER timer, IN ULONG periodMs)
+{
+    ASSERT(timer);
+    ASSERT(periodMs);
+
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&lock_, &oldIrql);
+
+    const ULONGLONG current = TimeNow(nullptr) / TIMER_WHEEL_TICK;
+
+    if (timer->fArmed)
+    {
+        remove(timer);
+    }
+
+    // An empty wheel has nothing to catch up with.
+    //
+    if (!timers_ && !ticking_)
+    {
+        now_ = current;
+    }
+
+    timer->ulPeriod = max(periodMs, 1);
+    timer->ullDue   = current + timer->ulPeriod;
+    timer->fArmed   = TRUE;
+    timers_++;
+
+    insert(timer);
+    schedule();
+
+    KeReleaseSpinLock(&lock_, oldIrql);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Disarms a timer. As with a kernel timer, a routine the wheel is already
+  running, or about to, still completes; wait with KeFlushQueuedDpcs before
+  the timer goes away.
+
+Arguments:
+  timer - The timer.
+*/
+void TimerWheel::cancelTimer(IN PWHEEL_TIMER timer)
+{
+    ASSERT(timer);
+
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&lock_, &oldIrql);
+
+    if (timer->fArmed)
+    {
+        remove(timer);
+
+        // Without timers the wheel gives up its kernel timer, so that the
+        // time source can switch between real and virtual time. That holds
+        // while a tick runs as well: its kernel timer has expired, but still
+        // counts as armed until it is cancelled.
+        //
+        if (!timers_)
+        {
+            TimerCancel(&tickTimer_);
+            scheduled_ = FALSE;
+        }
+    }
+
+    KeReleaseSpinLock(&lock_, oldIrql);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Returns the number of timers and the DPC rates of the wheel, and of the
+  kernel timers it replaces, and starts the next period of the rates.
+
+Arguments:
+  stats - Receives the statistics.
+*/
+void TimerWheel::getStats(OUT PTIMER_WHEEL_STATS stats)
+{
+    ASSERT(stats);
+
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&lock_, &oldIrql);
+
+    const ULONGLONG time    = TimeNow(nullptr);
+    const ULONGLONG elapsed = max(time - statsTime_, 1);
+
+    stats->ulTimers            = timers_;
+    stats->ulKernelTimers      = scheduled_ ? 1 : 0;
+    stats->ulExpiriesPerSecond = (ULONG)min((expiries_ - statsExpiries_) * _100NS_UNITS_PER_SECOND / elapsed, MAXULONG);
+    stats->ulDpcsPerSecond     = (ULONG)min((dpcs_ - statsDpcs_) * _100NS_UNITS_PER_SECOND / elapsed, MAXULONG);
+    stats->ullExpiries         = expiries_;
+    stats->ullDpcs             = dpcs_;
+
+    statsTime_     = time;
+    statsExpiries_ = expiries_;
+    statsDpcs_     = dpcs_;
+
+    KeReleaseSpinLock(&lock_, oldIrql);
+
+    DPF(D_VERBOSE, ("[TimerWheel::getStats : %d timers at %d expiries/s on %d kernel timer, %d DPCs/s]",
+                    stats->ulTimers, stats->ulExpiriesPerSecond, stats->ulKernelTimers, stats->ulDpcsPerSecond));
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Puts an armed timer in the slot of its due tick: on the first level if it
+  is due within TIMER_WHEEL_SLOTS ticks, else on the lowest level whose
+  span covers it. The caller holds lock_.
+*/
+void TimerWheel::insert(IN PWHEEL_TIMER timer)
+{
+    const ULONGLONG due   = min(max(timer->ullDue, now_), now_ + WHEEL_SPAN - 1);
+    const ULONGLONG delta = due - now_;
+    ULONG           level = 0;
+
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >> ((level + 1) * TIMER_WHEEL_SLOT_BITS))
+    {
+        level++;
+    }
+
+    const ULONG slot = (ULONG)(due >> (level * TIMER_WHEEL_SLOT_BITS)) & SLOT_MASK;
+
+    timer->ucLevel = (UCHAR)level;
+    timer->ucSlot  = (UCHAR)slot;
+
+    InsertTailList(&slots_[level][slot], &timer->ListEntry);
+    occupied_[level] |= 1ULL << slot;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Takes an armed timer off the wheel. The caller holds lock_.
+*/
+void TimerWheel::remove(IN PWHEEL_TIMER timer)
+{
+    RemoveEntryList(&timer->ListEntry);
+
+    if (IsListEmpty(&slots_[timer->ucLevel][timer->ucSlot]))
+    {
+        occupied_[timer->ucLevel] &= ~(1ULL << timer->ucSlot);
+    }
+
+    timer->fArmed = FALSE;
+    timers_--;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  At the start of a round of the first level, refills it from the slot of
+  the second level that covers the round, and so on up while a level
+  starts a round as well. Each timer moves to the level its remaining time
+  fits. The caller holds lock_.
+*/
+void TimerWheel::cascade()
+{
+    for (ULONG level = 1; level < TIMER_WHEEL_LEVELS; level++)
+    {
+        const ULONG       slot = (ULONG)(now_ >> (level * TIMER_WHEEL_SLOT_BITS)) & SLOT_MASK;
+        const PLIST_ENTRY head = &slots_[level][slot];
+        LIST_ENTRY        list;
+
+        // Take the whole slot first: a timer can come back to it when it is
+        // beyond the span of the wheel.
+        //
+        InitializeListHead(&list);
+
+        while (!IsListEmpty(head))
+        {
+            InsertTailList(&list, RemoveHeadList(head));
+        }
+
+        occupied_[level] &= ~(1ULL << slot);
+
+        while (!IsListEmpty(&list))
+        {
+            insert(CONTAINING_RECORD(RemoveHeadList(&list), WHEEL_TIMER, ListEntry));
+        }
+
+        if (slot)
+        {
+            break;
+        }
+    }
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Arms the kernel timer for the next tick with a timer due on it, or the
+  start of the next round when only the higher levels hold timers. The
+  next tick to run has not cascaded yet, so when it starts a round, the
+  first level may still lack timers due in that round, and it is that
+  tick. An earlier arming stands. The running tick schedules when its
+  routines are done. The caller holds lock_.
+*/
+void TimerWheel::schedule()
+{
+    if (ticking_ || !timers_)
+    {
+        return;
+    }
+
+    const ULONG     slot  = (ULONG)(now_ & SLOT_MASK);
+    const ULONGLONG ahead = occupied_[0] >> slot;
+    ULONGLONG       next  = now_;
+
+    if (slot)
+    {
+        next = ahead ? now_ + lowestBit(ahead) : (now_ | SLOT_MASK) + 1;
+    }
+
+    if (scheduled_ && scheduledTick_ <= next)
+    {
+        return;
+    }
+
+    const ULONGLONG time = TimeNow(nullptr);
+    const ULONGLONG due  = next * TIMER_WHEEL_TICK;
+
+    LARGE_INTEGER dueTime;
+
+    dueTime.QuadPart = -(LONGLONG)(due > time ? due - time : 0);
+
+    scheduled_     = TRUE;
+    scheduledTick_ = next;
+
+    TimerSet(&tickTimer_, dueTime, 0);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Runs the wheel up to the current tick. The routines of the expired timers
+  run in order of expiry with lock_ released, so they can set and cancel
+  timers, and the kernel timer is armed again once they are done, so only
+  one tick runs at a time.
+
+Arguments:
+  dpc - The DPC of the wheel, passed on to the routines.
+*/
+void TimerWheel::tick(IN PKDPC dpc)
+{
+    LIST_ENTRY expired;
+    ULONGLONG  count = 0;
+
+    InitializeListHead(&expired);
+
+    KeAcquireSpinLockAtDpcLevel(&lock_);
+
+    if (ticking_)
+    {
+        KeReleaseSpinLockFromDpcLevel(&lock_);
+        return;
+    }
+
+    ticking_   = TRUE;
+    scheduled_ = FALSE;
+    dpcs_++;
+
+    const ULONGLONG current = TimeNow(nullptr) / TIMER_WHEEL_TICK;
+
+    while (timers_ && now_ <= current)
+    {
+        const ULONG slot = (ULONG)(now_ & SLOT_MASK);
+
+        if (!slot)
+        {
+            cascade();
+        }
+
+        if (occupied_[0] & (1ULL << slot))
+        {
+            const PLIST_ENTRY head = &slots_[0][slot];
+            LIST_ENTRY        due;
+
+            InitializeListHead(&due);
+
+            while (!IsListEmpty(head))
+            {
+                InsertTailList(&due, RemoveHeadList(head));
+            }
+
+            occupied_[0] &= ~(1ULL << slot);
+
+            // Every timer here is periodic, so it goes straight back on the
+            // wheel, at its first expiry after the current tick. The ticks
+            // this run catches up on would expire it again, when it is due
+            // more than once per kernel timer interval, and those expiries
+            // are dropped instead.
+            //
+            while (!IsListEmpty(&due))
+            {
+                const PWHEEL_TIMER timer = CONTAINING_RECORD(RemoveHeadList(&due), WHEEL_TIMER, ListEntry);
+
+                if (timer->ullDue <= current)
+                {
+                    timer->ullDue += ((current - timer->ullDue) / timer->ulPeriod + 1) * timer->ulPeriod;
+                }
+
+                insert(timer);
+
+                ASSERT(!timer->ExpiredEntry.Flink);
+                InsertTailList(&expired, &timer->ExpiredEntry);
+            }
+        }
+
+        now_++;
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&lock_);
+
+    while (!IsListEmpty(&expired))
+    {
+        const PWHEEL_TIMER timer = CONTAINING_RECORD(RemoveHeadList(&expired), WHEEL_TIMER, ExpiredEntry);
+
+        timer->ExpiredEntry.Flink = nullptr;
+        timer->ExpiredEntry.Blink = nullptr;
+
+        timer->Routine(dpc, timer->pContext, nullptr, nullptr);
+        count++;
+    }
+
+    KeAcquireSpinLockAtDpcLevel(&lock_);
+
+    expiries_ += count;
+    ticking_   = FALSE;
+
+    // The routines may have left the wheel empty, and the next arming
+    // starts it at the time of then. The expired kernel timer is cancelled
+    // then, or it would keep counting as armed.
+    //
+    if (timers_)
+    {
+        schedule();
+    }
+    else
+    {
+        TimerCancel(&tickTimer_);
+        scheduled_ = FALSE;
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&lock_);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  DPC routine of the kernel timer of the wheel.
+
+Arguments:
+  dpc             - The DPC.
+  deferredContext - The wheel.
+*/
+void timerWheelTick
+(
+    IN  PKDPC dpc,
+    IN  PVOID deferredContext,
+    IN  PVOID SA1,
+    IN  PVOID SA2
+)
+{
+    UNREFERENCED_PARAMETER(SA1);
+    UNREFERENCED_PARAMETER(SA2);
+
+    PTimerWheel wheel = (PTimerWheel)deferredContext;
+
+    if (wheel)
+    {
+        wheel->tick(dpc);
+    }
+}
@@ -0,0 +1,121 @@
+/*
+Abstract:
+    Declaration of the adapter-wide timer wheel.
+
+    Every running stream needs a periodic notification. Instead of a kernel
+    timer and DPC of its own, each stream arms a wheel timer, and the wheel
+    runs all of them from one kernel timer. The wheel is hierarchical: the
+    first level holds the timers due within 64 ticks of a millisecond, and
+    each further level 64 times the span of the one below, whose slots its
+    own slots refill as time reaches them. The kernel timer is armed only
+    for the next tick that has a timer due, or that refills a slot, so an
+    idle wheel costs nothing, and timers due on the same tick share a DPC.
+
+    The tick is the granularity of the periods and phases, not of the
+    expiries: the kernel timer expires on the system clock interval, 15.6 ms
+    unless a client raised the timer resolution, and a late DPC runs all the
+    ticks it missed at once.
+*/
+
+#ifndef _MSVAD_TIMEWHEEL_H_
+#define _MSVAD_TIMEWHEEL_H_
+
+#include "vtime.h"
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+#define TIMER_WHEEL_TICK            (_100NS_UNITS_PER_SECOND / 1000)    // 1 ms.
+#define TIMER_WHEEL_SLOT_BITS       6
+#define TIMER_WHEEL_SLOTS           (1 << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_LEVELS          4       // 64 ms, 4 s, 4 min, 4.6 hours.
+
+//=============================================================================
+// Referenced Forward
+//=============================================================================
+KDEFERRED_ROUTINE timerWheelTick;
+
+//=============================================================================
+// Types
+//=============================================================================
+
+// A periodic timer of the wheel. The members are private to timewheel.cpp.
+typedef struct _WHEEL_TIMER
+{
+    LIST_ENTRY          ListEntry;      // In its slot while armed.
+    LIST_ENTRY          ExpiredEntry;   // On the list of the running tick, else nullptr links.
+    PKDEFERRED_ROUTINE  Routine;
+    PVOID               pContext;
+    ULONGLONG           ullDue;         // Tick of the next expiry.
+    ULONG               ulPeriod;       // Ticks.
+    UCHAR               ucLevel;        // Slot while armed.
+    UCHAR               ucSlot;
+    BOOLEAN             fArmed;
+} WHEEL_TIMER;
+
+using PWHEEL_TIMER = WHEEL_TIMER*;
+
+// Cost of the stream notifications. The expiries are the DPCs one kernel
+// timer per stream would run, the wheel DPCs those it runs instead. Rates
+// are per second since the previous call of getStats.
+typedef struct _TIMER_WHEEL_STATS
+{
+    ULONG       ulTimers;               // Armed wheel timers.
+    ULONG       ulKernelTimers;         // Armed kernel timers behind them, 0 or 1.
+    ULONG       ulExpiriesPerSecond;
+    ULONG       ulDpcsPerSecond;
+    ULONGLONG   ullExpiries;            // Since the wheel started.
+    ULONGLONG   ullDpcs;
+} TIMER_WHEEL_STATS;
+
+using PTIMER_WHEEL_STATS = TIMER_WHEEL_STATS*;
+
+//=============================================================================
+// Classes
+//=============================================================================
+
+///////////////////////////////////////////////////////////////////////////////
+// TimerWheel
+//   Periodic timers of the streams of an adapter on one kernel timer. The
+//   constructor and destructor must be called at PASSIVE_LEVEL, the other
+//   methods at IRQL <= DISPATCH_LEVEL.
+
+class TimerWheel
+{
+public:
+     TimerWheel();
+    ~TimerWheel();
+
+    void    initializeTimer(OUT PWHEEL_TIMER timer, IN PKDEFERRED_ROUTINE routine, IN PVOID context);
+    void    setTimer(IN PWHEEL_TIMER timer, IN ULONG periodMs);
+    void    cancelTimer(IN PWHEEL_TIMER timer);
+    void    getStats(OUT PTIMER_WHEEL_STATS stats);
+
+    friend void  timerWheelTick(IN PKDPC Dpc, IN PVOID DeferredContext, IN PVOID SA1, IN PVOID SA2);
+
+private:
+    void    insert(IN PWHEEL_TIMER timer);
+    void    remove(IN PWHEEL_TIMER timer);
+    void    cascade();
+    void    schedule();
+    void    tick(IN PKDPC dpc);
+
+    TIME_TIMER  tickTimer_;                                         // The one kernel timer.
+    KSPIN_LOCK  lock_;
+    LIST_ENTRY  slots_[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    ULONGLONG   occupied_[TIMER_WHEEL_LEVELS];                      // Bit per non-empty slot.
+    ULONGLONG   now_;                                               // Next tick to run.
+    ULONG       timers_;                                            // Armed.
+    BOOLEAN     ticking_;                                           // A tick runs its routines.
+    BOOLEAN     scheduled_;                                         // tickTimer_ is armed,
+    ULONGLONG   scheduledTick_;                                     // for this tick.
+    ULONGLONG   expiries_;
+    ULONGLONG   dpcs_;
+    ULONGLONG   statsTime_;                                         // TimeNow of the previous getStats,
+    ULONGLONG   statsExpiries_;                                     // and the counts then.
+    ULONGLONG   statsDpcs_;
+};
+using PTimerWheel = TimerWheel*;
+
+#endif
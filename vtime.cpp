@@ -0,0 +1,339 @@
+/*
+Abstract:
+    Implementation of the MSVAD time source.
+*/
+
+#pragma warning (disable : 4127)
+
+#include <msvad.h>
+#include "vtime.h"
+
+//=============================================================================
+// Types
+//=============================================================================
+
+typedef struct _VIRTUAL_TIME
+{
+    BOOLEAN volatile    fEnabled;
+    LONGLONG volatile   llNow;          // 100 ns units.
+    ULONGLONG           ullSequence;
+    LIST_ENTRY          Events;         // Queued timers by due time and sequence.
+    ULONG               ulArmed;        // Timers armed in either time.
+    KSPIN_LOCK          Lock;           // Protects all but fEnabled and llNow.
+} VIRTUAL_TIME;
+
+static VIRTUAL_TIME VirtualTime;
+
+#pragma code_seg()
+//=============================================================================
+// Current virtual time. Reads of 64 bits are not atomic on every target.
+static FORCEINLINE ULONGLONG virtualNow()
+{
+    return (ULONGLONG)InterlockedCompareExchange64(&VirtualTime.llNow, 0, 0);
+}
+
+//=============================================================================
+// Queues a timer behind every timer due no later than it. The caller holds
+// VirtualTime.Lock.
+static void queueTimer(IN PTIME_TIMER timer)
+{
+    PLIST_ENTRY entry = VirtualTime.Events.Blink;
+
+    while (entry != &VirtualTime.Events &&
+           CONTAINING_RECORD(entry, TIME_TIMER, ListEntry)->ullDue > timer->ullDue)
+    {
+        entry = entry->Blink;
+    }
+
+    timer->ullSequence = VirtualTime.ullSequence++;
+    timer->fQueued     = TRUE;
+    InsertHeadList(entry, &timer->ListEntry);
+}
+
+#pragma code_seg("INIT")
+//=============================================================================
+/*
+Routine Description:
+  Sets up the time source, in real time. Called once from DriverEntry.
+*/
+void TimeSourceInitialize()
+{
+    RtlZeroMemory(&VirtualTime, sizeof(VirtualTime));
+    InitializeListHead(&VirtualTime.Events);
+    KeInitializeSpinLock(&VirtualTime.Lock);
+}
+#pragma code_seg()
+
+//=============================================================================
+// counter of a performance counter running at rate, in 100 ns units.
+// Splitting off whole seconds keeps the products within 64 bits.
+static FORCEINLINE ULONGLONG counterTime(IN ULONGLONG counter, IN ULONGLONG rate)
+{
+    return counter / rate * _100NS_UNITS_PER_SECOND + counter % rate * _100NS_UNITS_PER_SECOND / rate;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Returns the time in 100 ns units: the performance counter converted, or
+  the virtual time. Callers of TimeNow can run at any IRQL.
+
+Arguments:
+  performanceCounter - Receives the performance counter value the time was
+                       read from, if not nullptr.
+*/
+ULONGLONG TimeNow(_Out_opt_ PLONGLONG performanceCounter)
+{
+    LARGE_INTEGER   frequency;
+    const ULONGLONG counter = (ULONGLONG)TimeQueryPerformanceCounter(&frequency).QuadPart;
+
+    if (performanceCounter)
+    {
+        *performanceCounter = (LONGLONG)counter;
+    }
+
+    return counterTime(counter, (ULONGLONG)frequency.QuadPart);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Converts a performance counter value of the time source to the time
+  TimeNow returns with it. Callers can run at any IRQL.
+
+Arguments:
+  performanceCounter - The counter value.
+*/
+ULONGLONG TimeForPerformanceCounter(IN LONGLONG performanceCounter)
+{
+    LARGE_INTEGER frequency;
+
+    TimeQueryPerformanceCounter(&frequency);
+
+    return counterTime((ULONGLONG)max(performanceCounter, 0), (ULONGLONG)frequency.QuadPart);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  KeQueryPerformanceCounter of the time source. In virtual time the counter
+  runs at VIRTUAL_TIME_FREQUENCY. Callers can run at any IRQL.
+
+Arguments:
+  frequency - Receives the counter frequency, if not nullptr.
+*/
+LARGE_INTEGER TimeQueryPerformanceCounter(_Out_opt_ PLARGE_INTEGER frequency)
+{
+    if (!VirtualTime.fEnabled)
+    {
+        return KeQueryPerformanceCounter(frequency);
+    }
+
+    LARGE_INTEGER counter;
+
+    if (frequency)
+    {
+        frequency->QuadPart = VIRTUAL_TIME_FREQUENCY;
+    }
+
+    counter.QuadPart = (LONGLONG)virtualNow();
+
+    return counter;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Initializes a timer that runs routine with context at DISPATCH_LEVEL.
+  Callers of TimerInitialize can run at IRQL <= DISPATCH_LEVEL.
+*/
+void TimerInitialize(OUT PTIME_TIMER timer, IN PKDEFERRED_ROUTINE routine, IN PVOID context)
+{
+    ASSERT(timer);
+    ASSERT(routine);
+
+    RtlZeroMemory(timer, sizeof(*timer));
+
+    KeInitializeDpc(&timer->Dpc, routine, context);
+    KeInitializeTimerEx(&timer->Timer, NotificationTimer);
+
+    timer->Routine  = routine;
+    timer->pContext = context;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  KeSetTimerEx of the time source. The timer stays armed, and counts as
+  such for VirtualTimeEnable, until it is cancelled.
+  Callers of TimerSet can run at IRQL <= DISPATCH_LEVEL.
+
+Arguments:
+  timer    - The timer.
+  dueTime  - First expiry: negative relative to now, else absolute, in
+             100 ns units.
+  periodMs - Period in milliseconds, or 0 to expire once.
+*/
+void TimerSet(IN PTIME_TIMER timer, IN LARGE_INTEGER dueTime, IN LONG periodMs)
+{
+    ASSERT(timer);
+
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&VirtualTime.Lock, &oldIrql);
+
+    VirtualTime.ulArmed += !timer->fArmed;
+    timer->fArmed        = TRUE;
+
+    if (VirtualTime.fEnabled)
+    {
+        const ULONGLONG now = virtualNow();
+
+        if (timer->fQueued)
+        {
+            RemoveEntryList(&timer->ListEntry);
+        }
+
+        timer->ullDue    = dueTime.QuadPart < 0 ? now - dueTime.QuadPart : max((ULONGLONG)dueTime.QuadPart, now);
+        timer->ullPeriod = (ULONGLONG)max(periodMs, 0) * 10000;
+        queueTimer(timer);
+    }
+    else
+    {
+        KeSetTimerEx(&timer->Timer, dueTime, periodMs, &timer->Dpc);
+    }
+
+    KeReleaseSpinLock(&VirtualTime.Lock, oldIrql);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  KeCancelTimer of the time source. As with KeCancelTimer, a DPC already
+  running completes. Callers of TimerCancel can run at IRQL <= DISPATCH_LEVEL.
+*/
+void TimerCancel(IN PTIME_TIMER timer)
+{
+    ASSERT(timer);
+
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&VirtualTime.Lock, &oldIrql);
+
+    if (timer->fQueued)
+    {
+        RemoveEntryList(&timer->ListEntry);
+        timer->fQueued = FALSE;
+    }
+
+    VirtualTime.ulArmed -= timer->fArmed;
+    timer->fArmed        = FALSE;
+
+    KeReleaseSpinLock(&VirtualTime.Lock, oldIrql);
+
+    KeCancelTimer(&timer->Timer);
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Switches between real and virtual time. Virtual time starts at the real
+  time of the switch, so the clock does not jump. Timers of one time cannot
+  move to the other, so the switch fails while any timer is armed.
+  Callers of VirtualTimeEnable can run at IRQL <= DISPATCH_LEVEL.
+
+Arguments:
+  enable - TRUE for virtual time.
+*/
+NTSTATUS VirtualTimeEnable(IN BOOLEAN enable)
+{
+    NTSTATUS ntStatus = STATUS_SUCCESS;
+    KIRQL    oldIrql;
+
+    KeAcquireSpinLock(&VirtualTime.Lock, &oldIrql);
+
+    if (VirtualTime.ulArmed)
+    {
+        ntStatus = STATUS_INVALID_DEVICE_STATE;
+    }
+    else if (enable && !VirtualTime.fEnabled)
+    {
+        InterlockedExchange64(&VirtualTime.llNow, (LONGLONG)TimeNow(nullptr));
+        VirtualTime.fEnabled = TRUE;
+    }
+    else if (!enable)
+    {
+        VirtualTime.fEnabled = FALSE;
+    }
+
+    KeReleaseSpinLock(&VirtualTime.Lock, oldIrql);
+
+    DPF(D_TERSE, ("[VirtualTimeEnable : %s, 0x%X]", enable ? "virtual" : "real", ntStatus));
+
+    return ntStatus;
+}
+
+//=============================================================================
+/*
+Routine Description:
+  Moves virtual time forward by duration. Each timer that expires on the
+  way runs at its expiry time, in order of expiry and, for the same expiry,
+  in the order the timers were set, and a periodic timer as often as it
+  expires. The routines run without the queue lock held, so they can set
+  and cancel timers. Callers of VirtualTimeAdvance must run at
+  IRQL <= DISPATCH_LEVEL, and advance time from one thread at a time.
+
+Arguments:
+  duration - 100 ns units.
+*/
+NTSTATUS VirtualTimeAdvance(IN ULONGLONG duration)
+{
+    if (!VirtualTime.fEnabled)
+    {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    const ULONGLONG end   = virtualNow() + duration;
+    ULONGLONG       fired = 0;
+    KIRQL           oldIrql;
+
+    for (;;)
+    {
+        KeAcquireSpinLock(&VirtualTime.Lock, &oldIrql);
+
+        if (IsListEmpty(&VirtualTime.Events) ||
+            CONTAINING_RECORD(VirtualTime.Events.Flink, TIME_TIMER, ListEntry)->ullDue > end)
+        {
+            KeReleaseSpinLock(&VirtualTime.Lock, oldIrql);
+            break;
+        }
+
+        const PTIME_TIMER timer = CONTAINING_RECORD(VirtualTime.Events.Flink, TIME_TIMER, ListEntry);
+
+        RemoveEntryList(&timer->ListEntry);
+        timer->fQueued = FALSE;
+
+        InterlockedExchange64(&VirtualTime.llNow, (LONGLONG)timer->ullDue);
+
+        if (timer->ullPeriod)
+        {
+            timer->ullDue += timer->ullPeriod;
+            queueTimer(timer);
+        }
+
+        // The spin lock leaves the routine at DISPATCH_LEVEL, where a DPC
+        // runs.
+        //
+        KeReleaseSpinLockFromDpcLevel(&VirtualTime.Lock);
+        timer->Routine(&timer->Dpc, timer->pContext, nullptr, nullptr);
+        KeLowerIrql(oldIrql);
+
+        fired++;
+    }
+
+    InterlockedExchange64(&VirtualTime.llNow, (LONGLONG)end);
+
+    DPF(D_VERBOSE, ("[VirtualTimeAdvance : %I64u timers fired]", fired));
+
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,69 @@
+/*
+Abstract:
+    Declaration of the MSVAD time source.
+
+    Every timing path of the streams reads the time and arms its timers
+    through here. Normally that is the performance counter and kernel
+    timers. In virtual time, the clock is a counter that only moves when
+    the test driving the driver advances it. Armed timers are then events
+    in a queue, and they fire in time order with the clock set to their
+    expiry. A stream runs through an hour of virtual time in the time its
+    DPCs take to run, and because nothing depends on wall-clock time, two
+    runs with the same inputs produce the same results.
+*/
+
+#ifndef _MSVAD_VTIME_H_
+#define _MSVAD_VTIME_H_
+
+//=============================================================================
+// Defines
+//=============================================================================
+
+// Performance counter frequency in virtual time. The counter is the time.
+#define VIRTUAL_TIME_FREQUENCY      _100NS_UNITS_PER_SECOND
+
+//=============================================================================
+// Types
+//=============================================================================
+
+// A timer that runs a DPC routine in the time of the time source. The
+// members are private to vtime.cpp.
+typedef struct _TIME_TIMER
+{
+    KTIMER              Timer;          // Real time.
+    KDPC                Dpc;
+    LIST_ENTRY          ListEntry;      // Virtual time, on the event queue.
+    PKDEFERRED_ROUTINE  Routine;
+    PVOID               pContext;
+    ULONGLONG           ullDue;         // Virtual time of the next expiry.
+    ULONGLONG           ullPeriod;      // 100 ns units, 0 for a one-shot timer.
+    ULONGLONG           ullSequence;    // Orders timers due at the same time.
+    BOOLEAN             fArmed;
+    BOOLEAN             fQueued;        // On the event queue.
+} TIME_TIMER;
+
+using PTIME_TIMER = TIME_TIMER*;
+
+//=============================================================================
+// Function Prototypes
+//=============================================================================
+
+void          TimeSourceInitialize();
+
+ULONGLONG     TimeNow(_Out_opt_ PLONGLONG performanceCounter);
+
+ULONGLONG     TimeForPerformanceCounter(IN LONGLONG performanceCounter);
+
+LARGE_INTEGER TimeQueryPerformanceCounter(_Out_opt_ PLARGE_INTEGER frequency);
+
+void          TimerInitialize(OUT PTIME_TIMER timer, IN PKDEFERRED_ROUTINE routine, IN PVOID context);
+
+void          TimerSet(IN PTIME_TIMER timer, IN LARGE_INTEGER dueTime, IN LONG periodMs);
+
+void          TimerCancel(IN PTIME_TIMER timer);
+
+NTSTATUS      VirtualTimeEnable(IN BOOLEAN enable);
+
+NTSTATUS      VirtualTimeAdvance(IN ULONGLONG duration);
+
+#endif